@@ -19,6 +19,12 @@ void on_command(const char *cmd) {
   link_send_status_msg();
 }
 
+// Handler for "SET_BRIGHTNESS=%u", receives the already parsed value
+void on_set_brightness(const char *cmd, const link_arg_t *args, int argc) {
+  ESP_LOGI(TAG, "Set brightness to %lu", args[0].u);
+  link_send_status_msg();
+}
+
 // Callback function to generate the status message
 char *on_status_message(void) {
   char *status;
@@ -63,7 +69,8 @@ int app_main() {
       .data_fmt = "D:{\"T\":%.2f, \"H\":%.2f}", // Data format to be sent
                                                 // (Temperature, Humidity)
       .commands = {"ON", "OFF",
-                   "SET_BRIGHTNESS=*"}, // Commands the device can respond to
+                   "SET_BRIGHTNESS=%u"}, // Commands the device can respond to
+      .command_handlers = {[2] = on_set_brightness}, // Per-command handlers
       .status_fmt =
           "S:{\"state\":%s,\"brightness\":%u}", // Status format (e.g., ON/OFF
                                                 // state, brightness level)
@@ -86,5 +93,11 @@ int app_main() {
     vTaskDelay(pdMS_TO_TICKS(5000));
     // Example: uncomment to send data messages periodically
     // link_send_data_msg();
+
+    // Example: the same message formatted straight into a send buffer,
+    // without any heap allocation
+    // link_msg_t *msg = link_msg_reserve_data();
+    // link_msg_printf(msg, NULL, 21.2, 55.1);
+    // link_msg_send(msg);
   }
 }
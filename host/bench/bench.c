@@ -0,0 +1,371 @@
+// Benchmarks of the send, receive and command paths on simulated nodes.
+//
+// Prints one JSON document whose results are keyed by benchmark name, so the
+// output of two versions can be diffed. The send and receive benchmarks run on
+// an ideal medium without latency or airtime and measure the component and
+// its tasks; pairing runs on the default medium.
+//
+// Usage: link_bench [--quick] [--out FILE]
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+#define TYPE 3
+#define STATION_CHANNEL 6
+#define MAX_SAMPLES 20000
+#define RX_PIPELINE 4
+
+static unsigned samples_count;
+static FILE *out;
+static bool first_result = true;
+
+static double samples[MAX_SAMPLES];
+static double started_us[MAX_SAMPLES];
+static double handled_us[MAX_SAMPLES];
+
+static void fail(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "link_bench: ");
+  vfprintf(stderr, fmt, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  exit(1);
+}
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned n, unsigned p) {
+  if (n == 0)
+    return 0;
+  unsigned i = (n * p + 99) / 100;
+  return sorted[i > 0 ? i - 1 : 0];
+}
+
+// Writes "name": {...} with the latency distribution of the samples and the
+// rate of count operations in elapsed_us, null if the rate is not measured
+static void result_latency(const char *name, const char *medium,
+                           unsigned count, double elapsed_us) {
+  char rate[32] = "null";
+  if (elapsed_us > 0)
+    snprintf(rate, sizeof(rate), "%.1f", count * 1e6 / elapsed_us);
+  qsort(samples, samples_count, sizeof(samples[0]), compare_double);
+  fprintf(out,
+          "%s\n    \"%s\": {\"medium\": \"%s\", \"count\": %u, "
+          "\"msgs_per_s\": %s, \"p50_us\": %.1f, \"p99_us\": %.1f}",
+          first_result ? "" : ",", name, medium, count, rate,
+          percentile(samples, samples_count, 50),
+          percentile(samples, samples_count, 99));
+  first_result = false;
+  fflush(out);
+}
+
+static void result_cost(const char *name, unsigned count, uint64_t ns) {
+  fprintf(out, "%s\n    \"%s\": {\"count\": %u, \"ns_per_call\": %.1f}",
+          first_result ? "" : ",", name, count, (double)ns / count);
+  first_result = false;
+  fflush(out);
+}
+
+static void sample(double us) {
+  if (samples_count < MAX_SAMPLES)
+    samples[samples_count++] = us;
+}
+
+static void medium_ideal(void) {
+  sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+  medium.latency_us = 0;
+  medium.rate_bps = 0;
+  sim_medium_set(&medium);
+}
+
+static void medium_default(void) {
+  sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+  sim_medium_set(&medium);
+}
+
+// Scripted gateway: accepts every pairing request and counts the benchmark
+// frames it hears, so the device side is measured alone
+static volatile unsigned station_unicast;
+static volatile unsigned station_broadcast;
+
+static void station_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (frame->len > 5 && memcmp(frame->data, "SHPR:{", 6) == 0) {
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+    return;
+  }
+  if (frame->len < 6 || memcmp(frame->data, "bench:", 6) != 0)
+    return;
+  if (memcmp(frame->dst, "\xff\xff\xff\xff\xff\xff", 6) == 0)
+    __atomic_add_fetch(&station_broadcast, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&station_unicast, 1, __ATOMIC_RELAXED);
+}
+
+static volatile unsigned handled;
+
+static void on_set(const char *cmd, const link_arg_t *args, int argc) {
+  unsigned i = args[0].u;
+  if (i < MAX_SAMPLES)
+    handled_us[i] = sim_now_us();
+  __atomic_add_fetch(&handled, 1, __ATOMIC_RELEASE);
+}
+
+static void on_other(const char *cmd, const link_arg_t *args, int argc) {}
+
+static void on_message(const link_node_t *node, link_node_msg_kind_e kind,
+                       const link_field_t *schema, const char *payload,
+                       size_t len) {}
+
+static void config_commands(link_config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->type = TYPE;
+  strcpy(config->config, "{}");
+  strcpy(config->commands[0], "SET=%u");
+  strcpy(config->commands[1], "MODE=*");
+  strcpy(config->commands[2], "LED_ON");
+  config->command_handlers[0] = on_set;
+  config->command_handlers[1] = on_other;
+  config->command_handlers[2] = on_other;
+}
+
+// Polls more often than sim_wait_for, which would bound the measured rates
+static bool wait_count(volatile unsigned *counter, unsigned count,
+                       uint32_t timeout_ms) {
+  const struct timespec poll = {.tv_nsec = 10000};
+  uint64_t until = sim_now_us() + (uint64_t)timeout_ms * 1000;
+  while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) < count) {
+    if (sim_now_us() > until)
+      return false;
+    nanosleep(&poll, NULL);
+  }
+  return true;
+}
+
+static void bench_send_with_result(sim_node_t *device, unsigned n) {
+  const sim_api_t *api = sim_on(device);
+  char msg[32];
+  samples_count = 0;
+  uint64_t start = sim_now_us();
+  for (unsigned i = 0; i < n; i++) {
+    snprintf(msg, sizeof(msg), "bench:%u", i);
+    uint64_t t = sim_now_us();
+    if (!api->enc_send_with_result(msg))
+      fail("enc_send_with_result failed");
+    sample(sim_now_us() - t);
+  }
+  result_latency("enc_send_with_result", "ideal", n, sim_now_us() - start);
+}
+
+// Latency is the time a call blocks, the rate counts frames heard
+static void bench_send_queued(sim_node_t *device, unsigned n, bool broadcast) {
+  const sim_api_t *api = sim_on(device);
+  volatile unsigned *heard = broadcast ? &station_broadcast : &station_unicast;
+  unsigned base = *heard;
+  char msg[32];
+  samples_count = 0;
+  uint64_t start = sim_now_us();
+  for (unsigned i = 0; i < n; i++) {
+    snprintf(msg, sizeof(msg), "bench:%u", i);
+    uint64_t t = sim_now_us();
+    if (broadcast)
+      api->enc_send_to_broadcast(msg);
+    else
+      api->enc_send_no_result(msg);
+    sample(sim_now_us() - t);
+  }
+  if (!wait_count(heard, base + n, 10000))
+    fail("station heard %u of %u frames", *heard - base, n);
+  result_latency(broadcast ? "enc_send_to_broadcast" : "enc_send_no_result",
+                 "ideal", n, sim_now_us() - start);
+}
+
+// Command frames from the gateway through on_esp_now_data_receive,
+// esp_now_receive_task and link_message_parse to a command worker. Latency
+// is measured with one frame in flight, the rate with RX_PIPELINE frames.
+static void bench_receive(sim_node_t *station, sim_node_t *device, unsigned n) {
+  char msg[32];
+  samples_count = 0;
+  handled = 0;
+  for (unsigned i = 0; i < n; i++) {
+    int len = snprintf(msg, sizeof(msg), "SET=%u", i);
+    started_us[i] = sim_now_us();
+    sim_station_send(station, sim_node_mac(device), msg, len);
+    if (!wait_count(&handled, i + 1, 1000))
+      fail("command %u was not handled", i);
+    sample(handled_us[i] - started_us[i]);
+  }
+  result_latency("receive_command", "ideal", n, 0);
+
+  samples_count = 0;
+  handled = 0;
+  uint64_t start = sim_now_us();
+  for (unsigned i = 0; i < n; i++) {
+    if (i >= RX_PIPELINE && !wait_count(&handled, i + 1 - RX_PIPELINE, 1000))
+      fail("command %u was not handled", i - RX_PIPELINE);
+    int len = snprintf(msg, sizeof(msg), "SET=%u", i);
+    started_us[i] = sim_now_us();
+    sim_station_send(station, sim_node_mac(device), msg, len);
+  }
+  if (!wait_count(&handled, n, 1000))
+    fail("%u of %u commands handled", handled, n);
+  for (unsigned i = 0; i < n; i++)
+    sample(handled_us[i] - started_us[i]);
+  result_latency("receive_command_pipelined", "ideal", n,
+                 sim_now_us() - start);
+}
+
+// Matching and running a handler inline, on a node without command workers
+static void bench_dispatch(unsigned n) {
+  static link_config_t config;
+  config_commands(&config);
+  sim_node_t *node = sim_node_create("device_inline");
+  const sim_api_t *api = sim_on(node);
+  api->link_register(&config);
+
+  static const struct {
+    const char *name;
+    const char *msg;
+  } cases[] = {
+      {"link_message_parse/number", "SET=42"},
+      {"link_message_parse/wildcard", "MODE=night"},
+      {"link_message_parse/plain", "LED_ON"},
+      {"link_message_parse/unknown", "REBOOT_NOW"},
+  };
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    uint64_t start = cpu_ns();
+    for (unsigned i = 0; i < n; i++)
+      api->link_message_parse(cases[c].msg);
+    result_cost(cases[c].name, n, cpu_ns() - start);
+  }
+}
+
+static void bench_generate(sim_node_t *device, unsigned n) {
+  const sim_api_t *api = sim_on(device);
+  static char long_value[241];
+  memset(long_value, 'x', sizeof(long_value) - 1);
+
+  uint64_t start = cpu_ns();
+  for (unsigned i = 0; i < n; i++)
+    free(api->link_generate_status_message("{\"on\":%s,\"level\":%u}",
+                                           i & 1 ? "true" : "false", i & 255));
+  result_cost("link_generate_status_message/small", n, cpu_ns() - start);
+
+  start = cpu_ns();
+  for (unsigned i = 0; i < n; i++)
+    free(api->link_generate_data_message(
+        "{\"t\":%.2f,\"h\":%.1f,\"p\":%u,\"v\":[%d,%d,%d,%d]}", 21.5 + i % 7,
+        40.0 + i % 13, 101325 + i % 100, i, -(int)i, i * 3, i * 7));
+  result_cost("link_generate_data_message/sensor", n, cpu_ns() - start);
+
+  // Longer than a frame, formatted a second time into a heap buffer
+  start = cpu_ns();
+  for (unsigned i = 0; i < n; i++)
+    free(api->link_generate_data_message("{\"id\":%u,\"log\":\"%s\"}", i,
+                                         long_value));
+  result_cost("link_generate_data_message/long", n, cpu_ns() - start);
+}
+
+static void bench_pairing(unsigned devices) {
+  static link_config_t configs[64];
+  static sim_node_t *nodes[64];
+  static bool paired[64];
+  if (devices > 64)
+    devices = 64;
+
+  medium_default();
+  sim_node_t *gateway = sim_node_create("gateway");
+  const sim_api_t *gw = sim_on(gateway);
+  gw->link_start(true);
+  gw->link_gateway_register_handler(TYPE, on_message);
+
+  samples_count = 0;
+  uint64_t start = sim_now_us();
+  for (unsigned i = 0; i < devices; i++) {
+    config_commands(&configs[i]);
+    nodes[i] = sim_node_create("device");
+    const sim_api_t *api = sim_on(nodes[i]);
+    api->link_register(&configs[i]);
+    api->link_start(true);
+  }
+  unsigned done = 0;
+  while (done < devices) {
+    if (sim_now_us() - start > 30000000)
+      fail("%u of %u devices paired", done, devices);
+    for (unsigned i = 0; i < devices; i++) {
+      if (!paired[i] && sim_on(nodes[i])->enp_get_gateway_mac(NULL)) {
+        paired[i] = true;
+        sample(sim_now_us() - start);
+        done++;
+      }
+    }
+    sim_sleep_ms(1);
+  }
+  result_latency("pairing", "default", devices, sim_now_us() - start);
+  sim_node_stop(gateway);
+  for (unsigned i = 0; i < devices; i++)
+    sim_node_stop(nodes[i]);
+}
+
+int main(int argc, char **argv) {
+  bool quick = false;
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0)
+      quick = true;
+    else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+      path = argv[++i];
+    else
+      fail("usage: link_bench [--quick] [--out FILE]");
+  }
+  out = path != NULL ? fopen(path, "w") : stdout;
+  if (out == NULL)
+    fail("cannot write %s", path);
+
+  unsigned frames = quick ? 200 : 5000;
+  unsigned calls = quick ? 2000 : 200000;
+
+  sim_init(NULL);
+  fprintf(out, "{\n  \"quick\": %s,\n  \"results\": {", quick ? "true" : "false");
+
+  medium_ideal();
+  static link_config_t config;
+  config_commands(&config);
+  sim_node_t *station =
+      sim_station_create("bench_gateway", STATION_CHANNEL, station_rx, NULL);
+  sim_node_t *device = sim_node_create("device");
+  const sim_api_t *api = sim_on(device);
+  api->link_register(&config);
+  api->link_start(true);
+  if (!api->link_wait_for_pair(10000))
+    fail("device did not pair with the scripted gateway");
+
+  bench_send_with_result(device, frames);
+  bench_send_queued(device, frames, false);
+  bench_send_queued(device, frames, true);
+  bench_receive(station, device, frames);
+  bench_dispatch(calls);
+  bench_generate(device, calls);
+  sim_node_stop(device);
+
+  bench_pairing(quick ? 4 : 32);
+
+  fprintf(out, "\n  }\n}\n");
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
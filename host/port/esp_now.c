@@ -0,0 +1,266 @@
+#include <string.h>
+
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+#include "port.h"
+
+esp_err_t esp_netif_init(void) { return ESP_OK; }
+
+esp_err_t esp_event_loop_create_default(void) { return ESP_OK; }
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+  (void)config;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage) {
+  (void)storage;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+  (void)mode;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  node->wifi_started = true;
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_stop(void) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  node->wifi_started = false;
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second) {
+  (void)second;
+  if (primary < 1 || primary > 14)
+    return ESP_ERR_INVALID_ARG;
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  if (!node->wifi_started) {
+    pthread_mutex_unlock(&node->lock);
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (node->channel != primary)
+    node->counters.channel_switches++;
+  node->channel = primary;
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  *primary = node->channel;
+  pthread_mutex_unlock(&node->lock);
+  if (second != NULL)
+    *second = WIFI_SECOND_CHAN_NONE;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6]) {
+  (void)ifx;
+  memcpy(mac, sim_self()->mac, ESP_NOW_ETH_ALEN);
+  return ESP_OK;
+}
+
+void sim_inbox_post(sim_node_t *node, const sim_inbox_t *item) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  // Room for the send results is reserved, esp_now_send limits them
+  unsigned limit = item->kind == SIM_INBOX_SENT ? SIM_INBOX_SIZE
+                                                : SIM_INBOX_SIZE - SIM_TX_QUEUE;
+  if (node->inbox_count >= limit) {
+    node->counters.rx_dropped++;
+  } else {
+    unsigned index = (node->inbox_head + node->inbox_count) % SIM_INBOX_SIZE;
+    node->inbox[index] = *item;
+    node->inbox_count++;
+    pthread_cond_broadcast(&node->inbox_cond);
+  }
+  pthread_mutex_unlock(&sim_kernel_lock);
+}
+
+// Runs the callbacks of the node like the Wi-Fi task of ESP-IDF does
+static void wifi_task(void *arg) {
+  sim_node_t *node = arg;
+  sim_inbox_t item;
+  while (1) {
+    pthread_mutex_lock(&sim_kernel_lock);
+    while (node->inbox_count == 0)
+      sim_kernel_block(&node->inbox_cond, UINT64_MAX);
+    item = node->inbox[node->inbox_head];
+    node->inbox_head = (node->inbox_head + 1) % SIM_INBOX_SIZE;
+    node->inbox_count--;
+    pthread_mutex_unlock(&sim_kernel_lock);
+
+    pthread_mutex_lock(&node->lock);
+    esp_now_send_cb_t send_cb = node->send_cb;
+    esp_now_recv_cb_t recv_cb = node->recv_cb;
+    if (item.kind == SIM_INBOX_SENT)
+      node->tx_pending--;
+    pthread_mutex_unlock(&node->lock);
+
+    if (item.kind == SIM_INBOX_SENT) {
+      if (send_cb != NULL)
+        send_cb(item.mac, item.status);
+    } else if (recv_cb != NULL) {
+      wifi_pkt_rx_ctrl_t rx_ctrl = {.rssi = item.rssi,
+                                    .channel = node->channel};
+      esp_now_recv_info_t info = {
+          .src_addr = item.mac, .des_addr = item.dst, .rx_ctrl = &rx_ctrl};
+      recv_cb(&info, item.data, item.len);
+    }
+  }
+}
+
+void sim_wifi_task_start(sim_node_t *node) {
+  sim_task_create(node, wifi_task, "wifi", node);
+}
+
+esp_err_t esp_now_init(void) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  if (!node->wifi_started) {
+    pthread_mutex_unlock(&node->lock);
+    return ESP_ERR_ESPNOW_NOT_INIT;
+  }
+  bool start = !node->now_ready;
+  node->now_ready = true;
+  pthread_mutex_unlock(&node->lock);
+  if (start)
+    sim_wifi_task_start(node);
+  return ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  node->send_cb = NULL;
+  node->recv_cb = NULL;
+  memset(node->peers, 0, sizeof(node->peers));
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  node->send_cb = cb;
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  node->recv_cb = cb;
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+static sim_peer_t *peer_find(sim_node_t *node, const uint8_t *mac) {
+  for (int i = 0; i < SIM_MAX_PEERS; i++) {
+    if (node->peers[i].used &&
+        memcmp(node->peers[i].mac, mac, ESP_NOW_ETH_ALEN) == 0)
+      return &node->peers[i];
+  }
+  return NULL;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+  if (peer == NULL || peer->channel > 14)
+    return ESP_ERR_ESPNOW_ARG;
+  sim_node_t *node = sim_self();
+  esp_err_t ret = ESP_ERR_ESPNOW_FULL;
+  pthread_mutex_lock(&node->lock);
+  if (!node->now_ready) {
+    ret = ESP_ERR_ESPNOW_NOT_INIT;
+  } else if (peer_find(node, peer->peer_addr) != NULL) {
+    ret = ESP_ERR_ESPNOW_EXIST;
+  } else {
+    for (int i = 0; i < SIM_MAX_PEERS; i++) {
+      if (!node->peers[i].used) {
+        memcpy(node->peers[i].mac, peer->peer_addr, ESP_NOW_ETH_ALEN);
+        node->peers[i].channel = peer->channel;
+        node->peers[i].used = true;
+        node->counters.peer_adds++;
+        ret = ESP_OK;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ret;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr) {
+  sim_node_t *node = sim_self();
+  esp_err_t ret = ESP_ERR_ESPNOW_NOT_FOUND;
+  pthread_mutex_lock(&node->lock);
+  sim_peer_t *peer = peer_find(node, peer_addr);
+  if (peer != NULL) {
+    peer->used = false;
+    node->counters.peer_dels++;
+    ret = ESP_OK;
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ret;
+}
+
+esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer) {
+  sim_node_t *node = sim_self();
+  esp_err_t ret = ESP_ERR_ESPNOW_NOT_FOUND;
+  pthread_mutex_lock(&node->lock);
+  sim_peer_t *found = peer_find(node, peer->peer_addr);
+  if (found != NULL) {
+    found->channel = peer->channel;
+    ret = ESP_OK;
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ret;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  bool exists = peer_find(node, peer_addr) != NULL;
+  pthread_mutex_unlock(&node->lock);
+  return exists;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data,
+                       size_t len) {
+  if (peer_addr == NULL || data == NULL || len == 0 ||
+      len > ESP_NOW_MAX_DATA_LEN)
+    return ESP_ERR_ESPNOW_ARG;
+  sim_node_t *node = sim_self();
+  esp_err_t ret = ESP_OK;
+  pthread_mutex_lock(&node->lock);
+  sim_peer_t *peer = peer_find(node, peer_addr);
+  if (!node->now_ready)
+    ret = ESP_ERR_ESPNOW_NOT_INIT;
+  else if (peer == NULL)
+    ret = ESP_ERR_ESPNOW_NOT_FOUND;
+  else if (peer->channel != 0 && peer->channel != node->channel)
+    ret = ESP_ERR_ESPNOW_CHAN;
+  else if (node->tx_pending >= SIM_TX_QUEUE)
+    ret = ESP_ERR_ESPNOW_NO_MEM;
+  if (ret == ESP_OK)
+    node->tx_pending++;
+  else
+    node->counters.tx_rejected++;
+  pthread_mutex_unlock(&node->lock);
+  if (ret == ESP_OK)
+    sim_radio_transmit(node, peer_addr, data, len);
+  return ret;
+}
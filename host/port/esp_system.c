@@ -0,0 +1,118 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "port.h"
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static esp_log_level_t log_level = ESP_LOG_NONE;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// SIM_LOG selects the most verbose level printed: E, W, I, D or V
+static void log_init(void) {
+  const char *level = getenv("SIM_LOG");
+  if (level == NULL)
+    return;
+  const char *levels = "EWIDV";
+  const char *found = strchr(levels, level[0]);
+  if (found != NULL && level[0] != '\0')
+    log_level = (esp_log_level_t)(found - levels + 1);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+  pthread_once(&log_once, log_init);
+  if (level > log_level)
+    return;
+  sim_node_t *node = sim_self();
+  va_list args;
+  pthread_mutex_lock(&log_lock);
+  fprintf(stderr, "%8.3f %-8s %c %s: ", sim_now_us() / 1000.0,
+          node != NULL ? node->name : "-", " EWIDV"[level], tag);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  pthread_mutex_unlock(&log_lock);
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  (void)tag;
+  (void)level;
+}
+
+// Per node xorshift64*, seeded from the MAC address so runs repeat
+uint32_t esp_random(void) {
+  sim_node_t *node = sim_self();
+  if (node == NULL)
+    return (uint32_t)random();
+  uint64_t old = __atomic_load_n(&node->rng, __ATOMIC_RELAXED);
+  uint64_t next;
+  do {
+    next = old;
+    next ^= next >> 12;
+    next ^= next << 25;
+    next ^= next >> 27;
+  } while (!__atomic_compare_exchange_n(&node->rng, &old, next, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return (uint32_t)((next * 2685821657736338717ULL) >> 32);
+}
+
+void esp_fill_random(void *buf, size_t len) {
+  uint8_t *out = buf;
+  for (size_t i = 0; i < len; i++)
+    out[i] = (uint8_t)esp_random();
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_NVS_NOT_FOUND:
+    return "ESP_ERR_NVS_NOT_FOUND";
+  case ESP_ERR_NVS_INVALID_LENGTH:
+    return "ESP_ERR_NVS_INVALID_LENGTH";
+  case ESP_ERR_NVS_KEY_TOO_LONG:
+    return "ESP_ERR_NVS_KEY_TOO_LONG";
+  case ESP_ERR_ESPNOW_NOT_INIT:
+    return "ESP_ERR_ESPNOW_NOT_INIT";
+  case ESP_ERR_ESPNOW_ARG:
+    return "ESP_ERR_ESPNOW_ARG";
+  case ESP_ERR_ESPNOW_NO_MEM:
+    return "ESP_ERR_ESPNOW_NO_MEM";
+  case ESP_ERR_ESPNOW_FULL:
+    return "ESP_ERR_ESPNOW_FULL";
+  case ESP_ERR_ESPNOW_NOT_FOUND:
+    return "ESP_ERR_ESPNOW_NOT_FOUND";
+  case ESP_ERR_ESPNOW_EXIST:
+    return "ESP_ERR_ESPNOW_EXIST";
+  case ESP_ERR_ESPNOW_CHAN:
+    return "ESP_ERR_ESPNOW_CHAN";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+void sim_esp_error_check_failed(esp_err_t rc, const char *file, int line,
+                                const char *expression) {
+  sim_fatal("ESP_ERROR_CHECK failed: %s (0x%x) at %s:%d: %s",
+            esp_err_to_name(rc), rc, file, line, expression);
+}
@@ -0,0 +1,554 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "port.h"
+
+// Upper bound of one wait, so tasks of a stopped node notice it in time
+#define SIM_WAIT_SLICE_US 20000
+
+#define NOTIFY_NONE 0
+#define NOTIFY_WAITING 1
+#define NOTIFY_PENDING 2
+
+struct sim_task {
+  char name[16];
+  sim_node_t *node;
+  TaskFunction_t fn;
+  void *arg;
+  bool adopted; // thread not created by xTaskCreate
+  bool deleted;
+  pthread_cond_t cond;
+  uint32_t notify_value[configTASK_NOTIFICATION_ARRAY_ENTRIES];
+  uint8_t notify_state[configTASK_NOTIFICATION_ARRAY_ENTRIES];
+};
+
+struct sim_queue {
+  size_t item_size;
+  size_t length;
+  size_t count;
+  size_t head;
+  uint8_t *items;
+  pthread_cond_t cond;
+};
+
+struct sim_event_group {
+  EventBits_t bits;
+  pthread_cond_t cond;
+};
+
+pthread_mutex_t sim_kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static uint64_t epoch_us;
+static __thread struct sim_task *current;
+static __thread sim_node_t *thread_node;
+
+uint64_t sim_mono_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sim_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void kernel_init(void) {
+  epoch_us = sim_mono_us();
+  sim_cond_init(&stop_cond);
+}
+
+void sim_fatal(const char *fmt, ...) {
+  va_list args;
+  fprintf(stderr, "sim: fatal: ");
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  fflush(stderr);
+  abort();
+}
+
+static struct sim_task *task_alloc(const char *name, sim_node_t *node) {
+  struct sim_task *task = calloc(1, sizeof(*task));
+  if (task == NULL)
+    sim_fatal("out of memory");
+  snprintf(task->name, sizeof(task->name), "%s", name);
+  task->node = node;
+  sim_cond_init(&task->cond);
+  return task;
+}
+
+static struct sim_task *task_self(void) {
+  pthread_once(&kernel_once, kernel_init);
+  if (current == NULL) {
+    current = task_alloc("main", thread_node);
+    current->adopted = true;
+  }
+  return current;
+}
+
+void sim_thread_set_node(sim_node_t *node) {
+  thread_node = node;
+  if (current != NULL && current->adopted)
+    current->node = node;
+}
+
+sim_node_t *sim_self(void) { return task_self()->node; }
+
+const char *sim_task_name(void) { return task_self()->name; }
+
+// Ends the calling task, the kernel lock must be held
+static void __attribute__((noreturn)) task_exit_locked(struct sim_task *task) {
+  task->deleted = true;
+  if (task->node != NULL) {
+    task->node->live_tasks--;
+    pthread_cond_broadcast(&stop_cond);
+  }
+  pthread_mutex_unlock(&sim_kernel_lock);
+  current = NULL;
+  pthread_exit(NULL);
+}
+
+uint64_t sim_deadline(TickType_t ticks) {
+  if (ticks == portMAX_DELAY)
+    return UINT64_MAX;
+  return sim_mono_us() + (uint64_t)ticks * (1000000 / configTICK_RATE_HZ);
+}
+
+bool sim_kernel_block(pthread_cond_t *cond, uint64_t deadline_us) {
+  struct sim_task *self = task_self();
+  uint64_t now = sim_mono_us();
+  if (now >= deadline_us)
+    return false;
+  uint64_t until = deadline_us;
+  if (until - now > SIM_WAIT_SLICE_US)
+    until = now + SIM_WAIT_SLICE_US;
+  struct timespec ts = {.tv_sec = until / 1000000,
+                        .tv_nsec = (until % 1000000) * 1000};
+  pthread_cond_timedwait(cond, &sim_kernel_lock, &ts);
+  if (!self->adopted && self->node != NULL && self->node->stopping)
+    task_exit_locked(self);
+  return true;
+}
+
+static void *task_entry(void *arg) {
+  current = arg;
+  thread_node = current->node;
+  current->fn(current->arg);
+  // Returning from a task is not allowed by FreeRTOS, treat it as a delete
+  pthread_mutex_lock(&sim_kernel_lock);
+  task_exit_locked(current);
+}
+
+TaskHandle_t sim_task_create(sim_node_t *node, TaskFunction_t fn,
+                             const char *name, void *arg) {
+  pthread_once(&kernel_once, kernel_init);
+  struct sim_task *task = task_alloc(name, node);
+  task->fn = fn;
+  task->arg = arg;
+
+  pthread_mutex_lock(&sim_kernel_lock);
+  if (node != NULL)
+    node->live_tasks++;
+  pthread_mutex_unlock(&sim_kernel_lock);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 256 * 1024);
+  pthread_t thread;
+  if (pthread_create(&thread, &attr, task_entry, task) != 0)
+    sim_fatal("cannot create task %s", name);
+  pthread_attr_destroy(&attr);
+  return task;
+}
+
+void sim_node_stop_tasks(sim_node_t *node) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  node->stopping = true;
+  uint64_t deadline = sim_mono_us() + 5000000;
+  while (node->live_tasks > 0) {
+    uint64_t now = sim_mono_us();
+    if (now >= deadline)
+      sim_fatal("%d tasks of %s do not stop", node->live_tasks, node->name);
+    uint64_t until = now + SIM_WAIT_SLICE_US;
+    struct timespec ts = {.tv_sec = until / 1000000,
+                          .tv_nsec = (until % 1000000) * 1000};
+    pthread_cond_timedwait(&stop_cond, &sim_kernel_lock, &ts);
+  }
+  node->stopping = false;
+  pthread_mutex_unlock(&sim_kernel_lock);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *handle) {
+  (void)stack;
+  (void)priority;
+  TaskHandle_t task = sim_task_create(sim_self(), fn, name, arg);
+  if (handle != NULL)
+    *handle = task;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core) {
+  (void)core;
+  return xTaskCreate(fn, name, stack, arg, priority, handle);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  struct sim_task *self = task_self();
+  if (task != NULL && task != self)
+    sim_fatal("deleting another task is not supported");
+  if (self->adopted)
+    sim_fatal("vTaskDelete from a thread that is not a task");
+  pthread_mutex_lock(&sim_kernel_lock);
+  task_exit_locked(self);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  struct sim_task *self = task_self();
+  uint64_t deadline = sim_deadline(ticks);
+  pthread_mutex_lock(&sim_kernel_lock);
+  while (sim_kernel_block(&self->cond, deadline))
+    ;
+  pthread_mutex_unlock(&sim_kernel_lock);
+}
+
+TickType_t xTaskGetTickCount(void) {
+  pthread_once(&kernel_once, kernel_init);
+  return (TickType_t)((sim_mono_us() - epoch_us) /
+                      (1000000 / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return task_self(); }
+
+const char *pcTaskGetName(TaskHandle_t task) {
+  return task != NULL ? task->name : task_self()->name;
+}
+
+static void check_index(UBaseType_t index) {
+  if (index >= configTASK_NOTIFICATION_ARRAY_ENTRIES)
+    sim_fatal("notification index %u out of range", index);
+}
+
+BaseType_t xTaskGenericNotify(TaskHandle_t task, UBaseType_t index,
+                              uint32_t value, eNotifyAction action,
+                              uint32_t *previous) {
+  check_index(index);
+  BaseType_t ret = pdPASS;
+  pthread_mutex_lock(&sim_kernel_lock);
+  if (task->deleted)
+    sim_fatal("notification to deleted task %s", task->name);
+  if (previous != NULL)
+    *previous = task->notify_value[index];
+  switch (action) {
+  case eNoAction:
+    break;
+  case eSetBits:
+    task->notify_value[index] |= value;
+    break;
+  case eIncrement:
+    task->notify_value[index]++;
+    break;
+  case eSetValueWithOverwrite:
+    task->notify_value[index] = value;
+    break;
+  case eSetValueWithoutOverwrite:
+    if (task->notify_state[index] == NOTIFY_PENDING)
+      ret = pdFAIL;
+    else
+      task->notify_value[index] = value;
+    break;
+  }
+  if (ret == pdPASS) {
+    task->notify_state[index] = NOTIFY_PENDING;
+    pthread_cond_broadcast(&task->cond);
+  }
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return ret;
+}
+
+BaseType_t xTaskGenericNotifyWait(UBaseType_t index, uint32_t clear_on_entry,
+                                  uint32_t clear_on_exit, uint32_t *value,
+                                  TickType_t ticks) {
+  check_index(index);
+  struct sim_task *self = task_self();
+  uint64_t deadline = sim_deadline(ticks);
+  pthread_mutex_lock(&sim_kernel_lock);
+  if (self->notify_state[index] != NOTIFY_PENDING) {
+    self->notify_value[index] &= ~clear_on_entry;
+    self->notify_state[index] = NOTIFY_WAITING;
+    while (self->notify_state[index] != NOTIFY_PENDING &&
+           sim_kernel_block(&self->cond, deadline))
+      ;
+  }
+  if (value != NULL)
+    *value = self->notify_value[index];
+  BaseType_t ret = pdFALSE;
+  if (self->notify_state[index] == NOTIFY_PENDING) {
+    self->notify_value[index] &= ~clear_on_exit;
+    ret = pdTRUE;
+  }
+  self->notify_state[index] = NOTIFY_NONE;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return ret;
+}
+
+uint32_t ulTaskGenericNotifyTake(UBaseType_t index, BaseType_t clear,
+                                 TickType_t ticks) {
+  check_index(index);
+  struct sim_task *self = task_self();
+  uint64_t deadline = sim_deadline(ticks);
+  pthread_mutex_lock(&sim_kernel_lock);
+  if (self->notify_value[index] == 0) {
+    self->notify_state[index] = NOTIFY_WAITING;
+    while (self->notify_value[index] == 0 &&
+           sim_kernel_block(&self->cond, deadline))
+      ;
+  }
+  uint32_t value = self->notify_value[index];
+  if (value != 0)
+    self->notify_value[index] = clear ? 0 : value - 1;
+  self->notify_state[index] = NOTIFY_NONE;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return value;
+}
+
+BaseType_t xTaskGenericNotifyStateClear(TaskHandle_t task, UBaseType_t index) {
+  check_index(index);
+  if (task == NULL)
+    task = task_self();
+  pthread_mutex_lock(&sim_kernel_lock);
+  BaseType_t was_pending = task->notify_state[index] == NOTIFY_PENDING;
+  if (was_pending)
+    task->notify_state[index] = NOTIFY_NONE;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return was_pending;
+}
+
+uint32_t ulTaskGenericNotifyValueClear(TaskHandle_t task, UBaseType_t index,
+                                       uint32_t bits) {
+  check_index(index);
+  if (task == NULL)
+    task = task_self();
+  pthread_mutex_lock(&sim_kernel_lock);
+  uint32_t value = task->notify_value[index];
+  task->notify_value[index] &= ~bits;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return value;
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux) { pthread_mutex_lock(&mux->lock); }
+
+void vPortExitCritical(portMUX_TYPE *mux) { pthread_mutex_unlock(&mux->lock); }
+
+static struct sim_queue *queue_create(size_t length, size_t item_size,
+                                      size_t count) {
+  pthread_once(&kernel_once, kernel_init);
+  struct sim_queue *queue = calloc(1, sizeof(*queue));
+  if (queue == NULL)
+    return NULL;
+  queue->item_size = item_size;
+  queue->length = length;
+  queue->count = count;
+  if (item_size > 0) {
+    queue->items = calloc(length, item_size);
+    if (queue->items == NULL) {
+      free(queue);
+      return NULL;
+    }
+  }
+  sim_cond_init(&queue->cond);
+  return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  if (length == 0)
+    return NULL;
+  return queue_create(length, item_size, 0);
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  if (queue == NULL)
+    return;
+  pthread_cond_destroy(&queue->cond);
+  free(queue->items);
+  free(queue);
+}
+
+BaseType_t xQueueGenericSend(QueueHandle_t queue, const void *item,
+                             TickType_t ticks, BaseType_t front) {
+  uint64_t deadline = sim_deadline(ticks);
+  pthread_mutex_lock(&sim_kernel_lock);
+  while (queue->count == queue->length) {
+    if (!sim_kernel_block(&queue->cond, deadline)) {
+      pthread_mutex_unlock(&sim_kernel_lock);
+      return pdFAIL;
+    }
+  }
+  size_t index;
+  if (front) {
+    queue->head = (queue->head + queue->length - 1) % queue->length;
+    index = queue->head;
+  } else {
+    index = (queue->head + queue->count) % queue->length;
+  }
+  if (queue->item_size > 0)
+    memcpy(queue->items + index * queue->item_size, item, queue->item_size);
+  queue->count++;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return pdPASS;
+}
+
+static BaseType_t queue_take(QueueHandle_t queue, void *item, TickType_t ticks,
+                             bool remove) {
+  uint64_t deadline = sim_deadline(ticks);
+  pthread_mutex_lock(&sim_kernel_lock);
+  while (queue->count == 0) {
+    if (!sim_kernel_block(&queue->cond, deadline)) {
+      pthread_mutex_unlock(&sim_kernel_lock);
+      return pdFAIL;
+    }
+  }
+  if (queue->item_size > 0 && item != NULL)
+    memcpy(item, queue->items + queue->head * queue->item_size,
+           queue->item_size);
+  if (remove) {
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->cond);
+  }
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  return queue_take(queue, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks) {
+  return queue_take(queue, item, ticks, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  UBaseType_t count = queue->count;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  UBaseType_t spaces = queue->length - queue->count;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return spaces;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  queue->count = 0;
+  queue->head = 0;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return queue_create(1, 0, 1); }
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer) {
+  buffer->handle = queue_create(1, 0, 1);
+  return buffer->handle;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+  return queue_create(1, 0, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+                                           UBaseType_t initial) {
+  return queue_create(max, 0, initial);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+  return queue_take(sem, NULL, ticks, true);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  return xQueueGenericSend(sem, NULL, 0, pdFALSE);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) { vQueueDelete(sem); }
+
+EventGroupHandle_t xEventGroupCreate(void) {
+  pthread_once(&kernel_once, kernel_init);
+  struct sim_event_group *group = calloc(1, sizeof(*group));
+  if (group != NULL)
+    sim_cond_init(&group->cond);
+  return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+  pthread_cond_destroy(&group->cond);
+  free(group);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  group->bits |= bits;
+  EventBits_t value = group->bits;
+  pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return value;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  EventBits_t value = group->bits;
+  group->bits &= ~bits;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return value;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  EventBits_t value = group->bits;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return value;
+}
+
+static bool bits_ready(EventBits_t value, EventBits_t bits, bool wait_all) {
+  return wait_all ? (value & bits) == bits : (value & bits) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+                                BaseType_t clear_on_exit, BaseType_t wait_all,
+                                TickType_t ticks) {
+  uint64_t deadline = sim_deadline(ticks);
+  pthread_mutex_lock(&sim_kernel_lock);
+  while (!bits_ready(group->bits, bits, wait_all) &&
+         sim_kernel_block(&group->cond, deadline))
+    ;
+  EventBits_t value = group->bits;
+  if (clear_on_exit && bits_ready(value, bits, wait_all))
+    group->bits &= ~bits;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return value;
+}
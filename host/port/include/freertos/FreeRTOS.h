@@ -0,0 +1,70 @@
+// FreeRTOS API of the host port. Tasks are threads, every kernel object is
+// guarded by one kernel lock and the tick counts milliseconds of real time.
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define configSUPPORT_STATIC_ALLOCATION 1
+#ifndef configTASK_NOTIFICATION_ARRAY_ENTRIES
+#define configTASK_NOTIFICATION_ARRAY_ENTRIES 1
+#endif
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)                                                      \
+  ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define pdTICKS_TO_MS(ticks)                                                   \
+  ((uint32_t)(((uint64_t)(ticks) * 1000) / configTICK_RATE_HZ))
+
+typedef struct {
+  pthread_mutex_t lock;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED                                           \
+  { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define taskENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define taskEXIT_CRITICAL(mux) vPortExitCritical(mux)
+
+typedef struct sim_task *TaskHandle_t;
+typedef struct sim_queue *QueueHandle_t;
+typedef struct sim_queue *SemaphoreHandle_t;
+typedef struct sim_event_group *EventGroupHandle_t;
+typedef uint32_t EventBits_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef struct {
+  SemaphoreHandle_t handle;
+} StaticSemaphore_t;
+
+typedef enum {
+  eNoAction = 0,
+  eSetBits,
+  eIncrement,
+  eSetValueWithOverwrite,
+  eSetValueWithoutOverwrite,
+} eNotifyAction;
+
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
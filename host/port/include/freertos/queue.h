@@ -0,0 +1,20 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueGenericSend(QueueHandle_t queue, const void *item,
+                             TickType_t ticks, BaseType_t front);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+BaseType_t xQueueReset(QueueHandle_t queue);
+
+#define xQueueSend(queue, item, ticks)                                         \
+  xQueueGenericSend((queue), (item), (ticks), pdFALSE)
+#define xQueueSendToBack(queue, item, ticks)                                   \
+  xQueueGenericSend((queue), (item), (ticks), pdFALSE)
+#define xQueueSendToFront(queue, item, ticks)                                  \
+  xQueueGenericSend((queue), (item), (ticks), pdTRUE)
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+                                   uint32_t stack, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+const char *pcTaskGetName(TaskHandle_t task);
+
+BaseType_t xTaskGenericNotify(TaskHandle_t task, UBaseType_t index,
+                              uint32_t value, eNotifyAction action,
+                              uint32_t *previous);
+BaseType_t xTaskGenericNotifyWait(UBaseType_t index, uint32_t clear_on_entry,
+                                  uint32_t clear_on_exit, uint32_t *value,
+                                  TickType_t ticks);
+uint32_t ulTaskGenericNotifyTake(UBaseType_t index, BaseType_t clear,
+                                 TickType_t ticks);
+BaseType_t xTaskGenericNotifyStateClear(TaskHandle_t task, UBaseType_t index);
+uint32_t ulTaskGenericNotifyValueClear(TaskHandle_t task, UBaseType_t index,
+                                       uint32_t bits);
+
+#define xTaskNotifyIndexed(task, index, value, action)                         \
+  xTaskGenericNotify((task), (index), (value), (action), NULL)
+#define xTaskNotify(task, value, action)                                       \
+  xTaskNotifyIndexed((task), 0, (value), (action))
+#define xTaskNotifyGiveIndexed(task, index)                                    \
+  xTaskGenericNotify((task), (index), 0, eIncrement, NULL)
+#define xTaskNotifyGive(task) xTaskNotifyGiveIndexed((task), 0)
+#define xTaskNotifyWaitIndexed(index, entry, exit, value, ticks)               \
+  xTaskGenericNotifyWait((index), (entry), (exit), (value), (ticks))
+#define xTaskNotifyWait(entry, exit, value, ticks)                             \
+  xTaskNotifyWaitIndexed(0, (entry), (exit), (value), (ticks))
+#define ulTaskNotifyTakeIndexed(index, clear, ticks)                           \
+  ulTaskGenericNotifyTake((index), (clear), (ticks))
+#define ulTaskNotifyTake(clear, ticks) ulTaskNotifyTakeIndexed(0, (clear), (ticks))
+#define xTaskNotifyStateClearIndexed(task, index)                              \
+  xTaskGenericNotifyStateClear((task), (index))
+#define xTaskNotifyStateClear(task) xTaskNotifyStateClearIndexed((task), 0)
+#define ulTaskNotifyValueClearIndexed(task, index, bits)                       \
+  ulTaskGenericNotifyValueClear((task), (index), (bits))
+#define ulTaskNotifyValueClear(task, bits)                                     \
+  ulTaskNotifyValueClearIndexed((task), 0, (bits))
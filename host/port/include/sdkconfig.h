@@ -0,0 +1,170 @@
+// Host build configuration. Mirrors the defaults of Kconfig.projbuild; every
+// value can be overridden with -DCONFIG_...=... when a node variant is built.
+// Options that default to "n" stay undefined, like in a generated sdkconfig.h.
+#pragma once
+
+#ifndef CONFIG_LINK_CONFIG_SIZE
+#define CONFIG_LINK_CONFIG_SIZE 32
+#endif
+#ifndef CONFIG_LINK_STATUS_FMT_SIZE
+#define CONFIG_LINK_STATUS_FMT_SIZE 32
+#endif
+#ifndef CONFIG_LINK_DATA_FMT_SIZE
+#define CONFIG_LINK_DATA_FMT_SIZE 32
+#endif
+#ifndef CONFIG_LINK_MAX_FIELDS
+#define CONFIG_LINK_MAX_FIELDS 8
+#endif
+#ifndef CONFIG_LINK_FIELD_KEY_SIZE
+#define CONFIG_LINK_FIELD_KEY_SIZE 8
+#endif
+#ifndef CONFIG_LINK_MAX_COMMANDS
+#define CONFIG_LINK_MAX_COMMANDS 10
+#endif
+#ifndef CONFIG_LINK_COMMAND_MAX_SIZE
+#define CONFIG_LINK_COMMAND_MAX_SIZE 32
+#endif
+#ifndef CONFIG_LINK_MAX_COMMAND_ARGS
+#define CONFIG_LINK_MAX_COMMAND_ARGS 4
+#endif
+#ifndef CONFIG_LINK_COMMAND_WORKERS
+#define CONFIG_LINK_COMMAND_WORKERS 1
+#endif
+#ifndef CONFIG_LINK_COMMAND_QUEUE_SIZE
+#define CONFIG_LINK_COMMAND_QUEUE_SIZE 4
+#endif
+#ifndef CONFIG_LINK_USE_PREFIX
+#define CONFIG_LINK_USE_PREFIX 1
+#endif
+#ifndef CONFIG_LINK_SEND_STATUS_DATE_AFTER_INIT
+#define CONFIG_LINK_SEND_STATUS_DATE_AFTER_INIT 1
+#endif
+#if defined(CONFIG_LINK_DELTA) && !defined(CONFIG_LINK_DELTA_KEYFRAME_INTERVAL)
+#define CONFIG_LINK_DELTA_KEYFRAME_INTERVAL 10
+#endif
+#ifndef CONFIG_LINK_STARTUP_SPREAD_MS
+#define CONFIG_LINK_STARTUP_SPREAD_MS 2000
+#endif
+#ifndef CONFIG_LINK_PAIR_CHANNEL_SWEEP
+#define CONFIG_LINK_PAIR_CHANNEL_SWEEP 1
+#endif
+#if defined(CONFIG_LINK_PAIR_CHANNEL_SWEEP) && !defined(CONFIG_LINK_PAIR_SWEEPS)
+#define CONFIG_LINK_PAIR_SWEEPS 3
+#endif
+#ifndef CONFIG_LINK_PAIR_RETRY_MIN_MS
+#define CONFIG_LINK_PAIR_RETRY_MIN_MS 500
+#endif
+#ifndef CONFIG_LINK_PAIR_RETRY_MAX_MS
+#define CONFIG_LINK_PAIR_RETRY_MAX_MS 6000
+#endif
+#ifndef CONFIG_LINK_REPAIR_AFTER_FAILURES
+#define CONFIG_LINK_REPAIR_AFTER_FAILURES 20
+#endif
+#ifndef CONFIG_LINK_GATEWAY_LIST_SIZE
+#define CONFIG_LINK_GATEWAY_LIST_SIZE 3
+#endif
+#ifndef CONFIG_LINK_GATEWAY_FAILOVER_AFTER_FAILURES
+#define CONFIG_LINK_GATEWAY_FAILOVER_AFTER_FAILURES 5
+#endif
+#ifndef CONFIG_LINK_TELEMETRY_INTERVAL
+#define CONFIG_LINK_TELEMETRY_INTERVAL 0
+#endif
+#ifndef CONFIG_LINK_ROLE_GATEWAY
+#ifndef CONFIG_LINK_ROLE_DEVICE
+#define CONFIG_LINK_ROLE_DEVICE 1
+#endif
+#else
+#ifndef CONFIG_LINK_GATEWAY_MAX_NODES
+#define CONFIG_LINK_GATEWAY_MAX_NODES 64
+#endif
+#ifndef CONFIG_LINK_GATEWAY_MAX_TYPES
+#define CONFIG_LINK_GATEWAY_MAX_TYPES 8
+#endif
+#if defined(CONFIG_LINK_DELTA) && !defined(CONFIG_LINK_GATEWAY_DELTA_NODES)
+#define CONFIG_LINK_GATEWAY_DELTA_NODES 16
+#endif
+#endif
+
+#ifndef CONFIG_ENC_CHANNEL
+#define CONFIG_ENC_CHANNEL 1
+#endif
+#ifndef CONFIG_ENC_MAX_CHANNEL
+#define CONFIG_ENC_MAX_CHANNEL 13
+#endif
+#ifndef CONFIG_ENC_SEND_QUEUE_SIZE
+#define CONFIG_ENC_SEND_QUEUE_SIZE 5
+#endif
+#ifndef CONFIG_ENC_STATUS_QUEUE_SIZE
+#define CONFIG_ENC_STATUS_QUEUE_SIZE 5
+#endif
+#ifndef CONFIG_ENC_DATA_QUEUE_SIZE
+#define CONFIG_ENC_DATA_QUEUE_SIZE 5
+#endif
+#ifndef CONFIG_ENC_SEND_STARVATION_LIMIT
+#define CONFIG_ENC_SEND_STARVATION_LIMIT 8
+#endif
+#ifndef CONFIG_ENC_WATERMARK_HIGH_PERCENT
+#define CONFIG_ENC_WATERMARK_HIGH_PERCENT 80
+#endif
+#ifndef CONFIG_ENC_WATERMARK_LOW_PERCENT
+#define CONFIG_ENC_WATERMARK_LOW_PERCENT 40
+#endif
+#ifndef CONFIG_ENC_SEND_POOL_SIZE
+#define CONFIG_ENC_SEND_POOL_SIZE 8
+#endif
+#ifndef CONFIG_ENC_RECIEVE_QUEUE_SIZE
+#define CONFIG_ENC_RECIEVE_QUEUE_SIZE 5
+#endif
+#ifndef CONFIG_ENC_RECEIVE_POOL_SIZE
+#define CONFIG_ENC_RECEIVE_POOL_SIZE 5
+#endif
+#ifndef CONFIG_ENC_RESULT_QUEUE_SIZE
+#define CONFIG_ENC_RESULT_QUEUE_SIZE 2
+#endif
+#ifndef CONFIG_ENC_PEER_CACHE_SIZE
+#define CONFIG_ENC_PEER_CACHE_SIZE 4
+#endif
+#ifndef CONFIG_ENC_SEND_WINDOW
+#define CONFIG_ENC_SEND_WINDOW 1
+#endif
+#ifndef CONFIG_ENC_AIRTIME_PERMILLE
+#define CONFIG_ENC_AIRTIME_PERMILLE 0
+#endif
+#ifndef CONFIG_ENC_AIRTIME_BURST_MS
+#define CONFIG_ENC_AIRTIME_BURST_MS 20
+#endif
+#ifndef CONFIG_ENC_BACKOFF_BASE_MS
+#define CONFIG_ENC_BACKOFF_BASE_MS 10
+#endif
+#ifndef CONFIG_ENC_BACKOFF_MAX_MS
+#define CONFIG_ENC_BACKOFF_MAX_MS 500
+#endif
+#ifndef CONFIG_ENC_MAX_MESSAGE_SIZE
+#define CONFIG_ENC_MAX_MESSAGE_SIZE 1024
+#endif
+#ifndef CONFIG_ENC_REASSEMBLY_BUFFERS
+#define CONFIG_ENC_REASSEMBLY_BUFFERS 2
+#endif
+#ifndef CONFIG_ENC_REASSEMBLY_TIMEOUT_MS
+#define CONFIG_ENC_REASSEMBLY_TIMEOUT_MS 1000
+#endif
+#ifdef CONFIG_ENC_RELIABLE
+#ifndef CONFIG_ENC_RELIABLE_MAX_RETRIES
+#define CONFIG_ENC_RELIABLE_MAX_RETRIES 5
+#endif
+#ifndef CONFIG_ENC_RELIABLE_INITIAL_RTO_MS
+#define CONFIG_ENC_RELIABLE_INITIAL_RTO_MS 200
+#endif
+#ifndef CONFIG_ENC_RELIABLE_MIN_RTO_MS
+#define CONFIG_ENC_RELIABLE_MIN_RTO_MS 30
+#endif
+#ifndef CONFIG_ENC_RELIABLE_MAX_RTO_MS
+#define CONFIG_ENC_RELIABLE_MAX_RTO_MS 2000
+#endif
+#endif
+#ifndef CONFIG_ENC_COALESCE
+#define CONFIG_ENC_COALESCE 1
+#endif
+#if defined(CONFIG_ENC_AGGREGATION) && !defined(CONFIG_ENC_AGGREGATION_FLUSH_MS)
+#define CONFIG_ENC_AGGREGATION_FLUSH_MS 20
+#endif
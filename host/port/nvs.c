@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "port.h"
+
+#define SIM_NVS_HANDLES 4096
+
+enum {
+  NVS_TYPE_U8,
+  NVS_TYPE_I8,
+  NVS_TYPE_U16,
+  NVS_TYPE_I16,
+  NVS_TYPE_U32,
+  NVS_TYPE_I32,
+  NVS_TYPE_U64,
+  NVS_TYPE_I64,
+  NVS_TYPE_STR,
+  NVS_TYPE_BLOB,
+};
+
+typedef struct {
+  sim_node_t *node;
+  char ns[NVS_KEY_NAME_MAX_SIZE];
+  bool writable;
+} nvs_open_t;
+
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static nvs_open_t handles[SIM_NVS_HANDLES];
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+
+esp_err_t nvs_flash_erase(void) {
+  sim_node_t *node = sim_self();
+  pthread_mutex_lock(&node->lock);
+  while (node->nvs != NULL) {
+    sim_nvs_entry_t *entry = node->nvs;
+    node->nvs = entry->next;
+    free(entry->data);
+    free(entry);
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+static bool name_valid(const char *name) {
+  return name != NULL && name[0] != '\0' &&
+         strlen(name) < NVS_KEY_NAME_MAX_SIZE;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode,
+                   nvs_handle_t *handle) {
+  if (!name_valid(name))
+    return ESP_ERR_NVS_INVALID_NAME;
+  esp_err_t ret = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+  pthread_mutex_lock(&handles_lock);
+  for (int i = 0; i < SIM_NVS_HANDLES; i++) {
+    if (handles[i].node == NULL) {
+      handles[i].node = sim_self();
+      strcpy(handles[i].ns, name);
+      handles[i].writable = mode == NVS_READWRITE;
+      *handle = i + 1;
+      ret = ESP_OK;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&handles_lock);
+  return ret;
+}
+
+static nvs_open_t *handle_get(nvs_handle_t handle) {
+  if (handle == 0 || handle > SIM_NVS_HANDLES ||
+      handles[handle - 1].node == NULL)
+    return NULL;
+  return &handles[handle - 1];
+}
+
+void nvs_close(nvs_handle_t handle) {
+  pthread_mutex_lock(&handles_lock);
+  nvs_open_t *open = handle_get(handle);
+  if (open != NULL)
+    open->node = NULL;
+  pthread_mutex_unlock(&handles_lock);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  nvs_open_t *open = handle_get(handle);
+  if (open == NULL)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  sim_node_t *node = open->node;
+  const char *task = sim_task_name();
+  pthread_mutex_lock(&node->lock);
+  node->counters.nvs_commits++;
+  for (int i = 0; i < SIM_COMMIT_TASKS; i++) {
+    if (node->commits[i].count == 0 || strcmp(node->commits[i].task, task) == 0) {
+      strncpy(node->commits[i].task, task, sizeof(node->commits[i].task) - 1);
+      node->commits[i].count++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+static sim_nvs_entry_t **entry_find(sim_node_t *node, const char *ns,
+                                    const char *key) {
+  sim_nvs_entry_t **link = &node->nvs;
+  while (*link != NULL) {
+    if (strcmp((*link)->ns, ns) == 0 && strcmp((*link)->key, key) == 0)
+      break;
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static esp_err_t entry_set(nvs_handle_t handle, const char *key, int type,
+                           const void *value, size_t len) {
+  nvs_open_t *open = handle_get(handle);
+  if (open == NULL)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  if (!open->writable)
+    return ESP_ERR_NVS_READ_ONLY;
+  if (!name_valid(key))
+    return strlen(key) >= NVS_KEY_NAME_MAX_SIZE ? ESP_ERR_NVS_KEY_TOO_LONG
+                                                : ESP_ERR_NVS_INVALID_NAME;
+  uint8_t *data = malloc(len > 0 ? len : 1);
+  if (data == NULL)
+    return ESP_ERR_NO_MEM;
+  memcpy(data, value, len);
+
+  sim_node_t *node = open->node;
+  pthread_mutex_lock(&node->lock);
+  sim_nvs_entry_t **link = entry_find(node, open->ns, key);
+  sim_nvs_entry_t *entry = *link;
+  if (entry == NULL) {
+    entry = calloc(1, sizeof(*entry));
+    strcpy(entry->ns, open->ns);
+    strcpy(entry->key, key);
+    *link = entry;
+  }
+  free(entry->data);
+  entry->type = type;
+  entry->data = data;
+  entry->len = len;
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+static esp_err_t entry_get(nvs_handle_t handle, const char *key, int type,
+                           void *out, size_t *len, bool exact) {
+  nvs_open_t *open = handle_get(handle);
+  if (open == NULL)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  if (!name_valid(key))
+    return ESP_ERR_NVS_INVALID_NAME;
+  sim_node_t *node = open->node;
+  esp_err_t ret = ESP_OK;
+  pthread_mutex_lock(&node->lock);
+  sim_nvs_entry_t *entry = *entry_find(node, open->ns, key);
+  if (entry == NULL) {
+    ret = ESP_ERR_NVS_NOT_FOUND;
+  } else if (entry->type != type) {
+    ret = ESP_ERR_NVS_TYPE_MISMATCH;
+  } else if (exact) {
+    memcpy(out, entry->data, entry->len);
+  } else if (out == NULL) {
+    *len = entry->len;
+  } else if (*len < entry->len) {
+    ret = ESP_ERR_NVS_INVALID_LENGTH;
+  } else {
+    memcpy(out, entry->data, entry->len);
+    *len = entry->len;
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ret;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  nvs_open_t *open = handle_get(handle);
+  if (open == NULL)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  sim_node_t *node = open->node;
+  esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+  pthread_mutex_lock(&node->lock);
+  sim_nvs_entry_t **link = entry_find(node, open->ns, key);
+  sim_nvs_entry_t *entry = *link;
+  if (entry != NULL) {
+    *link = entry->next;
+    free(entry->data);
+    free(entry);
+    ret = ESP_OK;
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ret;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+  nvs_open_t *open = handle_get(handle);
+  if (open == NULL)
+    return ESP_ERR_NVS_INVALID_HANDLE;
+  sim_node_t *node = open->node;
+  pthread_mutex_lock(&node->lock);
+  sim_nvs_entry_t **link = &node->nvs;
+  while (*link != NULL) {
+    sim_nvs_entry_t *entry = *link;
+    if (strcmp(entry->ns, open->ns) == 0) {
+      *link = entry->next;
+      free(entry->data);
+      free(entry);
+    } else {
+      link = &entry->next;
+    }
+  }
+  pthread_mutex_unlock(&node->lock);
+  return ESP_OK;
+}
+
+#define NVS_INTEGER(name, type, id)                                            \
+  esp_err_t nvs_set_##name(nvs_handle_t handle, const char *key,               \
+                           type value) {                                       \
+    return entry_set(handle, key, id, &value, sizeof(value));                  \
+  }                                                                            \
+  esp_err_t nvs_get_##name(nvs_handle_t handle, const char *key, type *out) {  \
+    return entry_get(handle, key, id, out, NULL, true);                        \
+  }
+
+NVS_INTEGER(u8, uint8_t, NVS_TYPE_U8)
+NVS_INTEGER(i8, int8_t, NVS_TYPE_I8)
+NVS_INTEGER(u16, uint16_t, NVS_TYPE_U16)
+NVS_INTEGER(i16, int16_t, NVS_TYPE_I16)
+NVS_INTEGER(u32, uint32_t, NVS_TYPE_U32)
+NVS_INTEGER(i32, int32_t, NVS_TYPE_I32)
+NVS_INTEGER(u64, uint64_t, NVS_TYPE_U64)
+NVS_INTEGER(i64, int64_t, NVS_TYPE_I64)
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value) {
+  return entry_set(handle, key, NVS_TYPE_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *out,
+                      size_t *length) {
+  return entry_get(handle, key, NVS_TYPE_STR, out, length, false);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value,
+                       size_t length) {
+  return entry_set(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out,
+                       size_t *length) {
+  return entry_get(handle, key, NVS_TYPE_BLOB, out, length, false);
+}
@@ -0,0 +1,123 @@
+// Internal interface between the host port of the ESP-IDF APIs and the
+// simulation that drives it. Not visible to the component sources.
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_now.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs.h"
+#include "sim.h"
+
+#define SIM_MAX_PEERS ESP_NOW_MAX_TOTAL_PEER_NUM
+#define SIM_TX_QUEUE 32
+#define SIM_INBOX_SIZE 256
+#define SIM_COMMIT_TASKS 8
+
+typedef struct {
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  uint8_t channel;
+  bool used;
+} sim_peer_t;
+
+typedef enum {
+  SIM_INBOX_RECV,
+  SIM_INBOX_SENT,
+} sim_inbox_kind_e;
+
+typedef struct {
+  sim_inbox_kind_e kind;
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  uint8_t dst[ESP_NOW_ETH_ALEN];
+  int8_t rssi;
+  esp_now_send_status_t status;
+  uint8_t len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} sim_inbox_t;
+
+typedef struct sim_nvs_entry {
+  struct sim_nvs_entry *next;
+  char ns[NVS_KEY_NAME_MAX_SIZE];
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  int type;
+  size_t len;
+  uint8_t *data;
+} sim_nvs_entry_t;
+
+struct sim_node {
+  int id;
+  char name[24];
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  char variant[32];
+  void *lib;
+  sim_api_t api;
+  int boots;
+
+  // Lifecycle, guarded by the kernel lock
+  bool stopping;
+  int live_tasks;
+
+  // Radio, guarded by the node lock
+  pthread_mutex_t lock;
+  bool radio_on;
+  bool wifi_started;
+  uint8_t channel;
+  bool now_ready;
+  esp_now_send_cb_t send_cb;
+  esp_now_recv_cb_t recv_cb;
+  sim_peer_t peers[SIM_MAX_PEERS];
+  int tx_pending;
+
+  // Scripted stations have no firmware, frames go to a callback or the inbox
+  bool scripted;
+  sim_rx_cb_t rx_cb;
+  void *rx_ctx;
+
+  // Inbox of the wifi task, guarded by the kernel lock
+  pthread_cond_t inbox_cond;
+  sim_inbox_t inbox[SIM_INBOX_SIZE];
+  unsigned inbox_head;
+  unsigned inbox_count;
+
+  // Storage survives restarts, guarded by the node lock
+  sim_nvs_entry_t *nvs;
+  struct {
+    char task[16];
+    unsigned count;
+  } commits[SIM_COMMIT_TASKS];
+
+  uint64_t rng;
+  sim_counters_t counters;
+};
+
+// Kernel lock shared by all kernel objects of all nodes
+extern pthread_mutex_t sim_kernel_lock;
+
+uint64_t sim_mono_us(void);
+void sim_cond_init(pthread_cond_t *cond);
+void sim_fatal(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+// Node of the calling task or thread
+sim_node_t *sim_self(void);
+const char *sim_task_name(void);
+
+// Blocks on cond with the kernel lock held until woken or deadline_us passes.
+// Returns false on timeout. Tasks of a stopping node exit from here.
+bool sim_kernel_block(pthread_cond_t *cond, uint64_t deadline_us);
+uint64_t sim_deadline(TickType_t ticks);
+
+// Creates a task owned by node, used for the tasks of the port itself
+TaskHandle_t sim_task_create(sim_node_t *node, TaskFunction_t fn,
+                             const char *name, void *arg);
+void sim_node_stop_tasks(sim_node_t *node);
+void sim_thread_set_node(sim_node_t *node);
+
+// Medium
+void sim_radio_init(void);
+void sim_radio_transmit(sim_node_t *from, const uint8_t *dst,
+                        const uint8_t *data, size_t len);
+void sim_inbox_post(sim_node_t *node, const sim_inbox_t *item);
+void sim_wifi_task_start(sim_node_t *node);
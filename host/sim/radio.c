@@ -0,0 +1,361 @@
+// Simulated medium: frames occupy their channel for their airtime, arrive
+// after a latency with optional jitter and reordering, and may be lost on the
+// way or in the acknowledgement.
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "port.h"
+#include "sim.h"
+#include "sim_internal.h"
+
+#define RADIO_EVENTS 65536
+#define RADIO_CHANNELS 15
+#define RADIO_LINKS 256
+#define RADIO_OVERHEAD_BYTES 43 // MAC header, vendor action frame and FCS
+#define RADIO_PREAMBLE_US 192
+
+typedef enum {
+  EVENT_DELIVER,
+  EVENT_SENT,
+} event_kind_e;
+
+typedef struct {
+  uint64_t t;
+  uint64_t order;
+  event_kind_e kind;
+  sim_node_t *from;
+  sim_node_t *to; // NULL for every station on the channel
+  int boot;       // of the sender, stale results are dropped
+  uint8_t channel;
+  esp_now_send_status_t status;
+  uint8_t dst[6];
+  uint8_t len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} event_t;
+
+typedef struct {
+  sim_node_t *from;
+  sim_node_t *to;
+  uint16_t loss_permille;
+  int8_t rssi;
+} link_t;
+
+static pthread_mutex_t radio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t radio_cond;
+static sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+static uint64_t rng = 1;
+static event_t *events;
+static int event_count;
+static uint64_t event_order;
+static uint64_t busy_until[RADIO_CHANNELS];
+static link_t links[RADIO_LINKS];
+static int link_count;
+static uint64_t start_us;
+
+static const uint8_t broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static uint32_t rand_below(uint32_t limit) {
+  if (limit == 0)
+    return 0;
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (uint32_t)(((rng * 2685821657736338717ULL) >> 32) % limit);
+}
+
+uint64_t sim_radio_seed(void) { return medium.seed; }
+
+uint64_t sim_now_us(void) { return sim_mono_us() - start_us; }
+
+static bool event_before(const event_t *a, const event_t *b) {
+  return a->t < b->t || (a->t == b->t && a->order < b->order);
+}
+
+static void event_push(const event_t *event) {
+  if (event_count == RADIO_EVENTS)
+    sim_fatal("medium overloaded");
+  int i = event_count++;
+  events[i] = *event;
+  events[i].order = event_order++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!event_before(&events[i], &events[parent]))
+      break;
+    event_t tmp = events[i];
+    events[i] = events[parent];
+    events[parent] = tmp;
+    i = parent;
+  }
+  pthread_cond_signal(&radio_cond);
+}
+
+static void event_pop(event_t *out) {
+  *out = events[0];
+  events[0] = events[--event_count];
+  int i = 0;
+  while (1) {
+    int left = 2 * i + 1, right = left + 1, min = i;
+    if (left < event_count && event_before(&events[left], &events[min]))
+      min = left;
+    if (right < event_count && event_before(&events[right], &events[min]))
+      min = right;
+    if (min == i)
+      break;
+    event_t tmp = events[i];
+    events[i] = events[min];
+    events[min] = tmp;
+    i = min;
+  }
+}
+
+static link_t *link_find(sim_node_t *from, sim_node_t *to) {
+  for (int i = 0; i < link_count; i++) {
+    if (links[i].from == from && links[i].to == to)
+      return &links[i];
+  }
+  return NULL;
+}
+
+static bool link_lost(sim_node_t *from, sim_node_t *to) {
+  link_t *link = link_find(from, to);
+  uint16_t loss = link != NULL ? link->loss_permille : medium.loss_permille;
+  return rand_below(1000) < loss;
+}
+
+static int8_t link_rssi(sim_node_t *from, sim_node_t *to) {
+  link_t *link = link_find(from, to);
+  return link != NULL ? link->rssi : medium.rssi;
+}
+
+static sim_node_t *station_find(const uint8_t *mac) {
+  int count = __atomic_load_n(&sim_node_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    if (memcmp(sim_nodes[i]->mac, mac, 6) == 0)
+      return sim_nodes[i];
+  }
+  return NULL;
+}
+
+static bool station_listening(sim_node_t *node, uint8_t channel) {
+  pthread_mutex_lock(&node->lock);
+  bool listening = node->radio_on && node->channel == channel &&
+                   (node->scripted || node->now_ready);
+  pthread_mutex_unlock(&node->lock);
+  return listening;
+}
+
+static uint64_t latency(void) {
+  uint64_t us = medium.latency_us;
+  if (medium.jitter_us > 0)
+    us += rand_below(medium.jitter_us);
+  if (rand_below(1000) < medium.reorder_permille)
+    us += medium.reorder_us;
+  return us;
+}
+
+// Returns whether a unicast frame reached its destination
+static bool transmit(sim_node_t *from, const uint8_t *dst, const void *data,
+                     size_t len, bool report) {
+  pthread_mutex_lock(&from->lock);
+  uint8_t channel = from->channel;
+  bool radio_on = from->radio_on;
+  int boot = from->boots;
+  from->counters.frames_tx++;
+  from->counters.bytes_tx += len;
+  pthread_mutex_unlock(&from->lock);
+
+  bool is_broadcast = memcmp(dst, broadcast, 6) == 0;
+  sim_node_t *to = is_broadcast ? NULL : station_find(dst);
+
+  pthread_mutex_lock(&radio_lock);
+  uint64_t now = sim_mono_us();
+  uint64_t tx_start = busy_until[channel] > now ? busy_until[channel] : now;
+  uint64_t airtime = 0;
+  if (medium.rate_bps > 0)
+    airtime = RADIO_PREAMBLE_US + (uint64_t)(len + RADIO_OVERHEAD_BYTES) * 8 *
+                                      1000000 / medium.rate_bps;
+  uint64_t tx_end = tx_start + airtime;
+  if (radio_on)
+    busy_until[channel] = tx_end;
+
+  event_t event = {.kind = EVENT_DELIVER,
+                   .from = from,
+                   .to = to,
+                   .boot = boot,
+                   .channel = channel,
+                   .len = len};
+  memcpy(event.dst, dst, 6);
+  memcpy(event.data, data, len);
+
+  bool delivered = is_broadcast;
+  uint64_t arrival = tx_end + latency();
+  if (radio_on && (is_broadcast || to != NULL)) {
+    if (!is_broadcast) {
+      delivered = station_listening(to, channel) && !link_lost(from, to);
+      if (!delivered) {
+        pthread_mutex_lock(&from->lock);
+        from->counters.frames_lost++;
+        pthread_mutex_unlock(&from->lock);
+      }
+    }
+    if (is_broadcast || delivered) {
+      event.t = arrival;
+      event_push(&event);
+    }
+  } else if (!is_broadcast) {
+    delivered = false;
+  }
+
+  if (report) {
+    event_t sent = {.kind = EVENT_SENT, .from = from, .boot = boot};
+    memcpy(sent.dst, dst, 6);
+    bool acked = delivered && (is_broadcast ||
+                               rand_below(1000) >= medium.ack_loss_permille);
+    sent.status = acked ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL;
+    sent.t = delivered ? arrival : tx_end + medium.latency_us;
+    event_push(&sent);
+  }
+  pthread_mutex_unlock(&radio_lock);
+  return delivered;
+}
+
+void sim_radio_transmit(sim_node_t *from, const uint8_t *dst,
+                        const uint8_t *data, size_t len) {
+  transmit(from, dst, data, len, true);
+}
+
+bool sim_station_send(sim_node_t *station, const uint8_t *dst,
+                      const void *data, size_t len) {
+  if (len == 0 || len > ESP_NOW_MAX_DATA_LEN)
+    sim_fatal("station frame of %zu bytes", len);
+  return transmit(station, dst, data, len, false);
+}
+
+static void deliver_to(const event_t *event, sim_node_t *to) {
+  if (to == event->from || !station_listening(to, event->channel))
+    return;
+  int8_t rssi;
+  if (event->to == NULL) {
+    pthread_mutex_lock(&radio_lock);
+    bool lost = link_lost(event->from, to);
+    rssi = link_rssi(event->from, to);
+    pthread_mutex_unlock(&radio_lock);
+    if (lost)
+      return;
+  } else {
+    pthread_mutex_lock(&radio_lock);
+    rssi = link_rssi(event->from, to);
+    pthread_mutex_unlock(&radio_lock);
+  }
+  pthread_mutex_lock(&to->lock);
+  to->counters.frames_rx++;
+  pthread_mutex_unlock(&to->lock);
+
+  if (to->scripted && to->rx_cb != NULL) {
+    sim_frame_t frame = {.rssi = rssi, .channel = event->channel,
+                         .len = event->len};
+    memcpy(frame.src, event->from->mac, 6);
+    memcpy(frame.dst, event->dst, 6);
+    memcpy(frame.data, event->data, event->len);
+    to->rx_cb(to, &frame, to->rx_ctx);
+    return;
+  }
+  sim_inbox_t item = {.kind = SIM_INBOX_RECV, .rssi = rssi, .len = event->len};
+  memcpy(item.mac, event->from->mac, 6);
+  memcpy(item.dst, event->dst, 6);
+  memcpy(item.data, event->data, event->len);
+  sim_inbox_post(to, &item);
+}
+
+static void dispatch(const event_t *event) {
+  if (event->kind == EVENT_SENT) {
+    sim_node_t *from = event->from;
+    pthread_mutex_lock(&from->lock);
+    bool current = from->boots == event->boot;
+    pthread_mutex_unlock(&from->lock);
+    if (!current)
+      return;
+    sim_inbox_t item = {.kind = SIM_INBOX_SENT, .status = event->status};
+    memcpy(item.mac, event->dst, 6);
+    sim_inbox_post(from, &item);
+  } else if (event->to != NULL) {
+    deliver_to(event, event->to);
+  } else {
+    int count = __atomic_load_n(&sim_node_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+      deliver_to(event, sim_nodes[i]);
+  }
+}
+
+static void *radio_thread(void *arg) {
+  (void)arg;
+  event_t event;
+  pthread_mutex_lock(&radio_lock);
+  while (1) {
+    if (event_count == 0) {
+      pthread_cond_wait(&radio_cond, &radio_lock);
+      continue;
+    }
+    uint64_t now = sim_mono_us();
+    if (events[0].t > now) {
+      uint64_t t = events[0].t;
+      struct timespec ts = {.tv_sec = t / 1000000,
+                            .tv_nsec = (t % 1000000) * 1000};
+      pthread_cond_timedwait(&radio_cond, &radio_lock, &ts);
+      continue;
+    }
+    event_pop(&event);
+    pthread_mutex_unlock(&radio_lock);
+    dispatch(&event);
+    pthread_mutex_lock(&radio_lock);
+  }
+  return NULL;
+}
+
+void sim_init(const sim_medium_t *config) {
+  static bool started;
+  if (started)
+    sim_fatal("sim_init called twice");
+  started = true;
+  start_us = sim_mono_us();
+  sim_medium_t defaults = SIM_MEDIUM_DEFAULT;
+  medium = config != NULL ? *config : defaults;
+  rng = medium.seed != 0 ? medium.seed : 1;
+  events = calloc(RADIO_EVENTS, sizeof(event_t));
+  if (events == NULL)
+    sim_fatal("out of memory");
+  sim_cond_init(&radio_cond);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, radio_thread, NULL) != 0)
+    sim_fatal("cannot start the medium");
+  pthread_detach(thread);
+}
+
+void sim_medium_set(const sim_medium_t *config) {
+  pthread_mutex_lock(&radio_lock);
+  medium = *config;
+  pthread_mutex_unlock(&radio_lock);
+}
+
+void sim_medium_get(sim_medium_t *config) {
+  pthread_mutex_lock(&radio_lock);
+  *config = medium;
+  pthread_mutex_unlock(&radio_lock);
+}
+
+void sim_link_set(sim_node_t *from, sim_node_t *to, uint16_t loss_permille,
+                  int8_t rssi) {
+  pthread_mutex_lock(&radio_lock);
+  link_t *link = link_find(from, to);
+  if (link == NULL) {
+    if (link_count == RADIO_LINKS)
+      sim_fatal("more than %d link overrides", RADIO_LINKS);
+    link = &links[link_count++];
+    link->from = from;
+    link->to = to;
+  }
+  link->loss_permille = loss_permille;
+  link->rssi = rssi;
+  pthread_mutex_unlock(&radio_lock);
+}
@@ -0,0 +1,257 @@
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "port.h"
+#include "sim.h"
+#include "sim_internal.h"
+
+#ifndef SIM_NODE_DIR
+#define SIM_NODE_DIR "."
+#endif
+
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+sim_node_t *sim_nodes[SIM_MAX_NODES];
+int sim_node_count;
+
+// Every node gets a private copy of its library so that the static state of
+// the component exists once per node. The copy lives in anonymous memory and
+// stays mapped for the lifetime of the process.
+static void *library_load(const char *variant) {
+  const char *dir = getenv("SIM_NODE_DIR");
+  char path[512];
+  snprintf(path, sizeof(path), "%s/liblink_%s.so", dir ? dir : SIM_NODE_DIR,
+           variant);
+  int in = open(path, O_RDONLY);
+  if (in < 0)
+    sim_fatal("no node variant %s at %s", variant, path);
+  struct stat st;
+  fstat(in, &st);
+  int copy = memfd_create(variant, 0);
+  if (copy < 0)
+    sim_fatal("memfd_create failed");
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(copy, buf, n) != n)
+      sim_fatal("cannot copy %s", path);
+  }
+  close(in);
+
+  // The descriptor stays open, the loader would otherwise match a reused
+  // /proc path with the copy loaded before
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", copy);
+  void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL)
+    sim_fatal("cannot load variant %s: %s", variant, dlerror());
+  return lib;
+}
+
+static void node_load(sim_node_t *node) {
+  node->lib = library_load(node->variant);
+#define SIM_API_LOAD(name) node->api.name = dlsym(node->lib, #name);
+  SIM_API(SIM_API_LOAD)
+#undef SIM_API_LOAD
+}
+
+static sim_node_t *node_alloc(const char *name, const char *variant) {
+  sim_node_t *node = calloc(1, sizeof(*node));
+  if (node == NULL)
+    sim_fatal("out of memory");
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&node->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  sim_cond_init(&node->inbox_cond);
+
+  pthread_mutex_lock(&nodes_lock);
+  if (sim_node_count == SIM_MAX_NODES)
+    sim_fatal("more than %d nodes", SIM_MAX_NODES);
+  node->id = sim_node_count + 1;
+
+  if (name != NULL)
+    snprintf(node->name, sizeof(node->name), "%s", name);
+  else
+    snprintf(node->name, sizeof(node->name), "%s%d", variant, node->id);
+  if (variant != NULL)
+    snprintf(node->variant, sizeof(node->variant), "%s", variant);
+  uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, node->id >> 8, node->id & 0xff};
+  memcpy(node->mac, mac, sizeof(mac));
+  node->rng = sim_radio_seed() ^ ((uint64_t)node->id * 0x9e3779b97f4a7c15ULL);
+  if (node->rng == 0)
+    node->rng = 1;
+  node->channel = 1;
+  node->radio_on = true;
+
+  // The medium reads the list without the lock
+  sim_nodes[sim_node_count] = node;
+  __atomic_store_n(&sim_node_count, sim_node_count + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&nodes_lock);
+  return node;
+}
+
+sim_node_t *sim_node_create(const char *variant) {
+  sim_node_t *node = node_alloc(NULL, variant);
+  node_load(node);
+  return node;
+}
+
+const sim_api_t *sim_on(sim_node_t *node) {
+  sim_thread_set_node(node);
+  return &node->api;
+}
+
+sim_node_t *sim_current(void) { return sim_self(); }
+
+void sim_node_stop(sim_node_t *node) {
+  pthread_mutex_lock(&node->lock);
+  node->radio_on = false;
+  node->boots++;
+  pthread_mutex_unlock(&node->lock);
+
+  sim_node_stop_tasks(node);
+
+  pthread_mutex_lock(&node->lock);
+  node->wifi_started = false;
+  node->now_ready = false;
+  node->send_cb = NULL;
+  node->recv_cb = NULL;
+  memset(node->peers, 0, sizeof(node->peers));
+  node->tx_pending = 0;
+  node->channel = 1;
+  pthread_mutex_unlock(&node->lock);
+
+  pthread_mutex_lock(&sim_kernel_lock);
+  node->inbox_count = 0;
+  pthread_mutex_unlock(&sim_kernel_lock);
+}
+
+void sim_node_reboot(sim_node_t *node) {
+  sim_node_stop(node);
+  node_load(node);
+  pthread_mutex_lock(&node->lock);
+  node->radio_on = true;
+  pthread_mutex_unlock(&node->lock);
+}
+
+void sim_node_set_radio(sim_node_t *node, bool on) {
+  pthread_mutex_lock(&node->lock);
+  node->radio_on = on;
+  pthread_mutex_unlock(&node->lock);
+}
+
+const uint8_t *sim_node_mac(sim_node_t *node) { return node->mac; }
+
+void sim_node_enc_mac(sim_node_t *node, enc_mac_t *mac) {
+  mac->value = 0;
+  memcpy(mac->bytes, node->mac, sizeof(node->mac));
+}
+
+uint8_t sim_node_channel(sim_node_t *node) {
+  pthread_mutex_lock(&node->lock);
+  uint8_t channel = node->channel;
+  pthread_mutex_unlock(&node->lock);
+  return channel;
+}
+
+int sim_node_peer_count(sim_node_t *node) {
+  int count = 0;
+  pthread_mutex_lock(&node->lock);
+  for (int i = 0; i < SIM_MAX_PEERS; i++)
+    count += node->peers[i].used;
+  pthread_mutex_unlock(&node->lock);
+  return count;
+}
+
+int sim_node_task_count(sim_node_t *node) {
+  pthread_mutex_lock(&sim_kernel_lock);
+  int count = node->live_tasks;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return count;
+}
+
+void sim_node_counters(sim_node_t *node, sim_counters_t *counters) {
+  pthread_mutex_lock(&node->lock);
+  *counters = node->counters;
+  pthread_mutex_unlock(&node->lock);
+  pthread_mutex_lock(&sim_kernel_lock);
+  counters->rx_dropped = node->counters.rx_dropped;
+  pthread_mutex_unlock(&sim_kernel_lock);
+}
+
+unsigned sim_node_nvs_commits(sim_node_t *node, const char *task_name) {
+  unsigned count = 0;
+  pthread_mutex_lock(&node->lock);
+  for (int i = 0; i < SIM_COMMIT_TASKS; i++) {
+    if (task_name == NULL || strcmp(node->commits[i].task, task_name) == 0)
+      count += node->commits[i].count;
+  }
+  pthread_mutex_unlock(&node->lock);
+  return count;
+}
+
+void *sim_node_symbol(sim_node_t *node, const char *name) {
+  return dlsym(node->lib, name);
+}
+
+sim_node_t *sim_station_create(const char *name, uint8_t channel,
+                               sim_rx_cb_t cb, void *ctx) {
+  sim_node_t *node = node_alloc(name, NULL);
+  node->scripted = true;
+  node->channel = channel;
+  node->rx_cb = cb;
+  node->rx_ctx = ctx;
+  return node;
+}
+
+void sim_station_set_channel(sim_node_t *station, uint8_t channel) {
+  pthread_mutex_lock(&station->lock);
+  station->channel = channel;
+  pthread_mutex_unlock(&station->lock);
+}
+
+bool sim_station_recv(sim_node_t *station, sim_frame_t *frame,
+                      uint32_t timeout_ms) {
+  uint64_t deadline = sim_mono_us() + (uint64_t)timeout_ms * 1000;
+  pthread_mutex_lock(&sim_kernel_lock);
+  while (station->inbox_count == 0) {
+    if (!sim_kernel_block(&station->inbox_cond, deadline)) {
+      pthread_mutex_unlock(&sim_kernel_lock);
+      return false;
+    }
+  }
+  sim_inbox_t *item = &station->inbox[station->inbox_head];
+  memcpy(frame->src, item->mac, 6);
+  memcpy(frame->dst, item->dst, 6);
+  frame->rssi = item->rssi;
+  frame->channel = station->channel;
+  frame->len = item->len;
+  memcpy(frame->data, item->data, item->len);
+  station->inbox_head = (station->inbox_head + 1) % SIM_INBOX_SIZE;
+  station->inbox_count--;
+  pthread_mutex_unlock(&sim_kernel_lock);
+  return true;
+}
+
+void sim_sleep_ms(uint32_t ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+  while (nanosleep(&ts, &ts) != 0)
+    ;
+}
+
+bool sim_wait_for(bool (*cond)(void *ctx), void *ctx, uint32_t timeout_ms) {
+  uint64_t deadline = sim_mono_us() + (uint64_t)timeout_ms * 1000;
+  while (!cond(ctx)) {
+    if (sim_mono_us() >= deadline)
+      return false;
+    sim_sleep_ms(1);
+  }
+  return true;
+}
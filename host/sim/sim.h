@@ -0,0 +1,202 @@
+// Simulation of ESP-NOW nodes on the host.
+//
+// Every node is a private copy of the component built for one configuration
+// variant, loaded into the process with its own static state. Its tasks run
+// as threads on the port layer in host/port, its frames travel through a
+// simulated medium with latency, loss, reordering and limited bandwidth.
+// Scripted stations are radios without firmware, driven by the test itself.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Declare the entry points of every optional feature, whichever variant a
+// node runs
+#ifndef CONFIG_LINK_DELTA
+#define CONFIG_LINK_DELTA 1
+#endif
+#ifndef CONFIG_ENC_COMPRESSION
+#define CONFIG_ENC_COMPRESSION 1
+#endif
+
+#include "esp_now_communication.h"
+#include "esp_now_compress.h"
+#include "esp_now_gateway.h"
+#include "esp_now_pair.h"
+#include "link.h"
+#include "link_command.h"
+#include "link_delta.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Entry points of a node, NULL if the variant does not build them
+#define SIM_API(X)                                                             \
+  X(link_register)                                                             \
+  X(link_start)                                                                \
+  X(link_generate_status_message)                                              \
+  X(link_generate_data_message)                                                \
+  X(link_send_status_msg)                                                      \
+  X(link_send_data_msg)                                                        \
+  X(link_try_send_status_msg)                                                  \
+  X(link_try_send_data_msg)                                                    \
+  X(link_set_send_watermark_cb)                                                \
+  X(link_msg_reserve_status)                                                   \
+  X(link_msg_reserve_data)                                                     \
+  X(link_msg_printf)                                                           \
+  X(link_msg_reserve_binary_status)                                            \
+  X(link_msg_reserve_binary_data)                                              \
+  X(link_msg_encode)                                                           \
+  X(link_msg_decode_field)                                                     \
+  X(link_msg_send)                                                             \
+  X(link_msg_discard)                                                          \
+  X(link_get_stats)                                                            \
+  X(link_get_peer_stats)                                                       \
+  X(link_get_pair_msg)                                                         \
+  X(link_block_until_find_pair)                                                \
+  X(link_wait_for_pair)                                                        \
+  X(link_gateway_register_handler)                                             \
+  X(link_gateway_send_command)                                                 \
+  X(link_gateway_get_node)                                                     \
+  X(link_gateway_remove_node)                                                  \
+  X(link_gateway_get_node_count)                                               \
+  X(link_command_compile)                                                      \
+  X(link_command_match)                                                        \
+  X(link_message_parse)                                                        \
+  X(link_delta_encode)                                                         \
+  X(link_delta_acked)                                                          \
+  X(link_delta_expand)                                                         \
+  X(enc_init)                                                                  \
+  X(enc_set_channel)                                                           \
+  X(enc_get_channel)                                                           \
+  X(enc_send_async)                                                            \
+  X(enc_send_with_result)                                                      \
+  X(enc_send_kind_with_result)                                                 \
+  X(enc_send_no_result)                                                        \
+  X(enc_send_to_broadcast)                                                     \
+  X(enc_send_to_async)                                                         \
+  X(enc_send_to_with_result)                                                   \
+  X(enc_try_send_async)                                                        \
+  X(enc_try_send_with_result)                                                  \
+  X(enc_send_queue_congested)                                                  \
+  X(enc_slot_reserve)                                                          \
+  X(enc_slot_data)                                                             \
+  X(enc_slot_release)                                                          \
+  X(enc_slot_send_async)                                                       \
+  X(enc_slot_send_with_result)                                                 \
+  X(enc_get_stats)                                                             \
+  X(enc_get_peer_stats)                                                        \
+  X(enc_compress)                                                              \
+  X(enc_decompress)                                                            \
+  X(enp_get_gateway_mac)                                                       \
+  X(enp_is_gateway)                                                            \
+  X(enp_report_send_result)                                                    \
+  X(enp_gateway_compresses)                                                    \
+  X(enp_gateway_deltas)                                                        \
+  X(eng_get_node)                                                              \
+  X(eng_node_compresses)
+
+typedef struct {
+#define SIM_API_MEMBER(name) __typeof__(&name) name;
+  SIM_API(SIM_API_MEMBER)
+#undef SIM_API_MEMBER
+} sim_api_t;
+
+typedef struct sim_node sim_node_t;
+
+// Medium shared by all nodes; a node hears the frames sent on its channel
+typedef struct {
+  uint32_t latency_us;         // from the end of a frame to its reception
+  uint32_t jitter_us;          // random extra latency up to this
+  uint16_t loss_permille;      // frames lost on the air
+  uint16_t ack_loss_permille;  // received frames reported as failed
+  uint16_t reorder_permille;   // frames held back by reorder_us
+  uint32_t reorder_us;
+  uint32_t rate_bps;           // bit rate of a channel, 0 for no airtime
+  int8_t rssi;                 // signal of links without an override
+  uint64_t seed;
+} sim_medium_t;
+
+typedef struct {
+  uint32_t frames_tx;
+  uint32_t frames_rx;
+  uint32_t frames_lost;
+  uint32_t bytes_tx;
+  uint32_t rx_dropped;    // inbox of the wifi task full
+  uint32_t tx_rejected;   // esp_now_send refused the frame
+  uint32_t peer_adds;
+  uint32_t peer_dels;
+  uint32_t channel_switches;
+  uint32_t nvs_commits;
+} sim_counters_t;
+
+// Frame heard by a scripted station
+typedef struct {
+  uint8_t src[6];
+  uint8_t dst[6];
+  int8_t rssi;
+  uint8_t channel;
+  size_t len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} sim_frame_t;
+
+// Called from the medium thread, may send but must not block for long
+typedef void (*sim_rx_cb_t)(sim_node_t *station, const sim_frame_t *frame,
+                            void *ctx);
+
+#define SIM_MEDIUM_DEFAULT                                                     \
+  { .latency_us = 300, .rate_bps = 1000000, .rssi = -50, .seed = 1 }
+
+// Starts the medium, NULL selects SIM_MEDIUM_DEFAULT. Once per process.
+void sim_init(const sim_medium_t *medium);
+void sim_medium_set(const sim_medium_t *medium);
+void sim_medium_get(sim_medium_t *medium);
+
+// Overrides loss and signal of the direction from -> to
+void sim_link_set(sim_node_t *from, sim_node_t *to, uint16_t loss_permille,
+                  int8_t rssi);
+
+// Loads a fresh copy of the component built as variant. The node does
+// nothing until the test calls into it.
+sim_node_t *sim_node_create(const char *variant);
+// Makes the calling thread act as a task of node and returns its entry points
+const sim_api_t *sim_on(sim_node_t *node);
+// Node of the calling task, NULL outside of nodes
+sim_node_t *sim_current(void);
+// Powers the node off: its tasks exit and its radio goes silent
+void sim_node_stop(sim_node_t *node);
+// Powers the node off and on again with fresh firmware state; storage and
+// MAC address are kept
+void sim_node_reboot(sim_node_t *node);
+void sim_node_set_radio(sim_node_t *node, bool on);
+const uint8_t *sim_node_mac(sim_node_t *node);
+void sim_node_enc_mac(sim_node_t *node, enc_mac_t *mac);
+uint8_t sim_node_channel(sim_node_t *node);
+int sim_node_peer_count(sim_node_t *node);
+int sim_node_task_count(sim_node_t *node);
+void sim_node_counters(sim_node_t *node, sim_counters_t *counters);
+// Commits to storage made by the task called task_name, all tasks if NULL
+unsigned sim_node_nvs_commits(sim_node_t *node, const char *task_name);
+void *sim_node_symbol(sim_node_t *node, const char *name);
+
+// Radio without firmware. Frames go to cb, or to an inbox read with
+// sim_station_recv when cb is NULL.
+sim_node_t *sim_station_create(const char *name, uint8_t channel,
+                               sim_rx_cb_t cb, void *ctx);
+void sim_station_set_channel(sim_node_t *station, uint8_t channel);
+// Returns whether the frame reached dst, always true for broadcasts
+bool sim_station_send(sim_node_t *station, const uint8_t *dst,
+                      const void *data, size_t len);
+bool sim_station_recv(sim_node_t *station, sim_frame_t *frame,
+                      uint32_t timeout_ms);
+
+uint64_t sim_now_us(void);
+void sim_sleep_ms(uint32_t ms);
+// Polls cond every millisecond, returns false if it is still false at timeout
+bool sim_wait_for(bool (*cond)(void *ctx), void *ctx, uint32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,11 @@
+// State shared between the node registry and the medium
+#pragma once
+
+#include "port.h"
+
+#define SIM_MAX_NODES 2048
+
+extern sim_node_t *sim_nodes[SIM_MAX_NODES];
+extern int sim_node_count;
+
+uint64_t sim_radio_seed(void);
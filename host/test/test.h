@@ -0,0 +1,69 @@
+// Assertions and scenario helpers of the host tests
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+#define TEST_ASSERT(cond)                                                      \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__,     \
+              #cond);                                                          \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+#define TEST_ASSERT_EQ(actual, expected)                                       \
+  do {                                                                         \
+    long long actual_ = (long long)(actual);                                   \
+    long long expected_ = (long long)(expected);                               \
+    if (actual_ != expected_) {                                                \
+      fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__,          \
+              __LINE__, #actual, actual_, expected_);                          \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+#define TEST_RUN(fn)                                                           \
+  do {                                                                         \
+    fprintf(stderr, "%s\n", #fn);                                              \
+    fn();                                                                      \
+  } while (0)
+
+// Waits up to timeout_ms for an expression to become true
+#define TEST_WAIT(cond, timeout_ms)                                            \
+  ({                                                                           \
+    uint64_t until_ = sim_now_us() + (uint64_t)(timeout_ms) * 1000;            \
+    while (!(cond) && sim_now_us() < until_)                                   \
+      sim_sleep_ms(1);                                                         \
+    (cond);                                                                    \
+  })
+
+// Prints one measurement as a JSON line on stdout
+void test_measure(const char *name, const char *unit, double value);
+
+// Messages a gateway handler received, for every device type. Only the
+// start of longer messages is kept, last_len is their full length.
+typedef struct {
+  unsigned count[LINK_NODE_MSG_OTHER + 1];
+  char last[LINK_NODE_MSG_OTHER + 1][ESP_NOW_MAX_DATA_LEN + 1];
+  size_t last_len[LINK_NODE_MSG_OTHER + 1];
+  enc_mac_t last_mac;
+} test_inbox_t;
+
+extern test_inbox_t test_gateway_inbox;
+unsigned test_received(link_node_msg_kind_e kind);
+
+// Starts a gateway without paired nodes whose handler for type fills
+// test_gateway_inbox
+sim_node_t *test_gateway(const char *variant, int type);
+
+// Starts a device of config->type, forgetting an earlier pairing
+sim_node_t *test_device(const char *variant, link_config_t *config);
+
+// Device configuration whose status and data callbacks report a counter
+void test_device_config(link_config_t *config, int type);
+
+bool test_paired(sim_node_t *device, uint32_t timeout_ms);
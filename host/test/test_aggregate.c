@@ -0,0 +1,88 @@
+// Aggregation: small data messages to the gateway share frames, each one
+// still reaches the handler on its own, and a lone message waits no longer
+// than the flush deadline. A burst is not held back by the deadline once the
+// send pool is empty.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 12
+#define MESSAGES 200
+#define FLUSH_MS 20 // default of CONFIG_ENC_AGGREGATION_FLUSH_MS
+
+static link_config_t config;
+
+// Queues MESSAGES data messages as fast as there is room and returns the
+// frames they took
+static unsigned burst(const char *variant, const char *name, double *rate) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device(variant, &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(500);
+
+  sim_counters_t before, after;
+  sim_node_counters(device, &before);
+  unsigned received = test_received(LINK_NODE_MSG_DATA);
+  uint64_t start = sim_now_us();
+  for (int i = 0; i < MESSAGES; i++) {
+    char msg[32];
+    int len = snprintf(msg, sizeof(msg), LINK_DATA_PREFIX "{\"i\":%d}", i);
+    TEST_ASSERT_EQ(api->enc_try_send_async(msg, len, ENC_MSG_DATA,
+                                           portMAX_DELAY, NULL, NULL),
+                   ESP_OK);
+  }
+  TEST_ASSERT(
+      TEST_WAIT(test_received(LINK_NODE_MSG_DATA) == received + MESSAGES, 5000));
+  double seconds = (sim_now_us() - start) / 1e6;
+  sim_node_counters(device, &after);
+
+  char measure[48];
+  snprintf(measure, sizeof(measure), "%s_messages_per_s", name);
+  *rate = MESSAGES / seconds;
+  test_measure(measure, "messages/s", *rate);
+  unsigned frames = after.frames_tx - before.frames_tx;
+  snprintf(measure, sizeof(measure), "%s_frames", name);
+  test_measure(measure, "frames", frames);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  return frames;
+}
+
+static void test_burst_shares_frames(void) {
+  double single_rate, aggregated_rate;
+  unsigned single = burst("device_fifo", "single", &single_rate);
+  unsigned aggregated = burst("device_aggregate", "aggregated",
+                              &aggregated_rate);
+  TEST_ASSERT_EQ(single, MESSAGES);
+  TEST_ASSERT(aggregated < MESSAGES / 2);
+  TEST_ASSERT(aggregated_rate > single_rate);
+}
+
+static void test_lone_message_flushed(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device_aggregate", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(500);
+
+  unsigned received = test_received(LINK_NODE_MSG_DATA);
+  uint64_t start = sim_now_us();
+  TEST_ASSERT(sim_on(device)->link_send_data_msg());
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_DATA) > received, 1000));
+  double ms = (sim_now_us() - start) / 1000.0;
+  test_measure("aggregation_lone_message", "ms", ms);
+  TEST_ASSERT(ms < FLUSH_MS + 20);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_burst_shares_frames);
+  TEST_RUN(test_lone_message_flushed);
+  return 0;
+}
@@ -0,0 +1,189 @@
+// Sharing the channel: devices that send as fast as they can take it over,
+// an airtime budget leaves room for the frames of others while the goodput
+// still grows with the number of devices. Devices started together spread
+// their first pair requests.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 18
+#define MAX_NODES 8
+#define FRAME_LEN 200
+#define MEASURE_MS 1000
+#define PROBES 10
+#define SPREAD_MS 50 // CONFIG_LINK_STARTUP_SPREAD_MS of the host nodes
+#define PERMILLE 100 // CONFIG_ENC_AIRTIME_PERMILLE of device_airtime
+
+static link_config_t configs[MAX_NODES];
+
+static unsigned frames;
+static uint64_t probe_at;
+static uint64_t requested_at[MAX_NODES];
+static uint8_t requested_by[MAX_NODES][6];
+static unsigned requests;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stop;
+
+// Scripted gateway: accepts every pairing, notes the first request of every
+// device and counts the frames of the flood
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0) {
+    pthread_mutex_lock(&lock);
+    bool known = false;
+    for (unsigned i = 0; i < requests; i++)
+      known |= memcmp(requested_by[i], frame->src, 6) == 0;
+    if (!known && requests < MAX_NODES) {
+      memcpy(requested_by[requests], frame->src, 6);
+      requested_at[requests++] = sim_now_us();
+    }
+    pthread_mutex_unlock(&lock);
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  } else if (frame->len == FRAME_LEN) {
+    __atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void probe_rx(sim_node_t *station, const sim_frame_t *frame,
+                     void *ctx) {
+  __atomic_store_n(&probe_at, sim_now_us(), __ATOMIC_RELEASE);
+}
+
+static void *flood(void *arg) {
+  const sim_api_t *api = sim_on(arg);
+  char payload[FRAME_LEN];
+  memset(payload, 'd', sizeof(payload));
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    api->enc_try_send_async(payload, sizeof(payload), ENC_MSG_DATA,
+                            pdMS_TO_TICKS(10), NULL, NULL);
+  return NULL;
+}
+
+// Average time a frame of a station without a budget takes to arrive, in ms
+static double probe_ms(sim_node_t *from, sim_node_t *to) {
+  double total = 0;
+  for (int i = 0; i < PROBES; i++) {
+    __atomic_store_n(&probe_at, 0, __ATOMIC_RELAXED);
+    uint64_t start = sim_now_us();
+    sim_station_send(from, sim_node_mac(to), "probe", 5);
+    TEST_ASSERT(
+        TEST_WAIT(__atomic_load_n(&probe_at, __ATOMIC_ACQUIRE) != 0, 1000));
+    total += probe_at - start;
+    sim_sleep_ms(MEASURE_MS / PROBES);
+  }
+  return total / PROBES / 1000.0;
+}
+
+// Floods the gateway from count devices and returns the frames per second
+// it received
+static double goodput(const char *variant, int count, double *probe) {
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  sim_node_t *probe_tx = sim_station_create("probe_tx", 1, NULL, NULL);
+  sim_node_t *probe_to = sim_station_create("probe_rx", 1, probe_rx, NULL);
+  sim_node_t *devices[MAX_NODES];
+  for (int i = 0; i < count; i++) {
+    test_device_config(&configs[i], TYPE);
+    devices[i] = test_device(variant, &configs[i]);
+  }
+  for (int i = 0; i < count; i++)
+    TEST_ASSERT(test_paired(devices[i], 5000));
+  sim_sleep_ms(300);
+
+  pthread_t threads[MAX_NODES];
+  stop = false;
+  for (int i = 0; i < count; i++)
+    pthread_create(&threads[i], NULL, flood, devices[i]);
+  sim_sleep_ms(200);
+
+  unsigned before = __atomic_load_n(&frames, __ATOMIC_RELAXED);
+  uint64_t start = sim_now_us();
+  *probe = probe_ms(probe_tx, probe_to);
+  double rate = (__atomic_load_n(&frames, __ATOMIC_RELAXED) - before) * 1e6 /
+                (sim_now_us() - start);
+
+  __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+  for (int i = 0; i < count; i++)
+    pthread_join(threads[i], NULL);
+  for (int i = 0; i < count; i++)
+    sim_node_stop(devices[i]);
+  sim_node_stop(gateway);
+  sim_node_stop(probe_tx);
+  sim_node_stop(probe_to);
+
+  char name[48];
+  snprintf(name, sizeof(name), "%s_%d_nodes_goodput", variant, count);
+  test_measure(name, "frames/s", rate);
+  snprintf(name, sizeof(name), "%s_%d_nodes_probe", variant, count);
+  test_measure(name, "ms", *probe);
+  return rate;
+}
+
+static void test_goodput(void) {
+  // Airtime of a flood frame on the 1 Mbps medium
+  double frame_us = 192 + (FRAME_LEN + 43) * 8;
+  double budget = PERMILLE / 1000.0 * 1e6 / frame_us;
+
+  static const int counts[] = {1, 4, MAX_NODES};
+  double limited[3], unlimited[3], probe_limited[3], probe_unlimited[3];
+  for (int i = 0; i < 3; i++) {
+    limited[i] = goodput("device_airtime", counts[i], &probe_limited[i]);
+    unlimited[i] = goodput("device_fifo", counts[i], &probe_unlimited[i]);
+  }
+
+  // Each device keeps to its share, so the total grows with the devices
+  TEST_ASSERT(limited[0] < budget * 1.2);
+  TEST_ASSERT(limited[1] > limited[0] * 4 * 0.8);
+  // while a single device without a budget already fills most of the
+  // channel. Frames of others find the channel free sooner.
+  TEST_ASSERT(unlimited[1] < unlimited[0] * 1.5);
+  TEST_ASSERT(probe_limited[1] < probe_unlimited[1]);
+  TEST_ASSERT(probe_limited[2] < probe_unlimited[2]);
+}
+
+static void test_startup_spread(void) {
+  pthread_mutex_lock(&lock);
+  requests = 0;
+  pthread_mutex_unlock(&lock);
+
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  sim_node_t *devices[MAX_NODES];
+  for (int i = 0; i < MAX_NODES; i++) {
+    test_device_config(&configs[i], TYPE);
+    devices[i] = sim_node_create("device");
+    sim_on(devices[i])->link_register(&configs[i]);
+  }
+
+  // Powered up together
+  for (int i = 0; i < MAX_NODES; i++)
+    sim_on(devices[i])->link_start(true);
+  for (int i = 0; i < MAX_NODES; i++)
+    TEST_ASSERT(test_paired(devices[i], 5000));
+
+  pthread_mutex_lock(&lock);
+  TEST_ASSERT_EQ(requests, MAX_NODES);
+  uint64_t first = requested_at[0], last = requested_at[0];
+  for (unsigned i = 1; i < requests; i++) {
+    if (requested_at[i] < first)
+      first = requested_at[i];
+    if (requested_at[i] > last)
+      last = requested_at[i];
+  }
+  pthread_mutex_unlock(&lock);
+
+  double spread = (last - first) / 1000.0;
+  test_measure("startup_spread", "ms", spread);
+  TEST_ASSERT(spread >= SPREAD_MS / 4);
+  TEST_ASSERT(spread <= SPREAD_MS + 20);
+
+  for (int i = 0; i < MAX_NODES; i++)
+    sim_node_stop(devices[i]);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_goodput);
+  TEST_RUN(test_startup_spread);
+  return 0;
+}
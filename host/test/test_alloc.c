@@ -0,0 +1,83 @@
+// Heap use of the send path. The test interposes the allocator of the whole
+// process; messages formatted into a reserved slot allocate nothing, the
+// generated messages of link_send_status_msg do.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 11
+#define MESSAGES 100
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static unsigned allocations;
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+static unsigned allocations_since(unsigned start) {
+  return __atomic_load_n(&allocations, __ATOMIC_RELAXED) - start;
+}
+
+static link_config_t config;
+
+// The gateway is a scripted station, so only the device runs firmware
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+}
+
+static void test_slot_path_allocates_nothing(void) {
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(500);
+
+  unsigned start = allocations_since(0);
+  for (int i = 0; i < MESSAGES; i++) {
+    link_msg_t *msg = api->link_msg_reserve_status();
+    TEST_ASSERT(msg != NULL);
+    TEST_ASSERT(api->link_msg_printf(msg, "{\"n\":%d,\"t\":%d}", i, 20 + i) >
+                0);
+    TEST_ASSERT(api->link_msg_send(msg));
+  }
+  unsigned slot = allocations_since(start);
+  test_measure("allocations_per_message_slot", "allocations",
+               (double)slot / MESSAGES);
+  TEST_ASSERT_EQ(slot, 0);
+
+  start = allocations_since(0);
+  for (int i = 0; i < MESSAGES; i++)
+    TEST_ASSERT(api->link_send_status_msg());
+  test_measure("allocations_per_message_generated", "allocations",
+               (double)allocations_since(start) / MESSAGES);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_slot_path_allocates_nothing);
+  return 0;
+}
@@ -0,0 +1,165 @@
+// Completion callbacks of async sends: each fires exactly once, with success
+// when the gateway heard the frame, superseded when a newer message took its
+// place and failed when the link is gone. One completion serves any number of
+// sends, also ones started from within the callback.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 23
+#define BURST 20
+#define ROUNDS 50
+
+static link_config_t config;
+
+static unsigned frames;
+
+typedef struct {
+  unsigned calls;
+  esp_now_send_status_t status;
+} completion_t;
+
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  else if (frame->len == 2 && memcmp(frame->data, "{}", 2) == 0)
+    __atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+}
+
+static void on_done(esp_now_send_status_t status, void *ctx) {
+  completion_t *done = ctx;
+  done->status = status;
+  __atomic_add_fetch(&done->calls, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned calls(completion_t *done) {
+  return __atomic_load_n(&done->calls, __ATOMIC_ACQUIRE);
+}
+
+static unsigned frame_count(void) {
+  return __atomic_load_n(&frames, __ATOMIC_RELAXED);
+}
+
+static bool all_done(completion_t *done, int count) {
+  for (int i = 0; i < count; i++)
+    if (calls(&done[i]) == 0)
+      return false;
+  return true;
+}
+
+static void start(sim_node_t **gateway, sim_node_t **device) {
+  *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  *device = test_device("device", &config);
+  TEST_ASSERT(test_paired(*device, 5000));
+  sim_sleep_ms(300);
+  __atomic_store_n(&frames, 0, __ATOMIC_RELAXED);
+}
+
+static void test_called_once(void) {
+  sim_node_t *gateway, *device;
+  start(&gateway, &device);
+  const sim_api_t *api = sim_on(device);
+
+  // Control messages all go on air
+  completion_t done[BURST] = {0};
+  for (int i = 0; i < BURST; i++)
+    TEST_ASSERT(api->enc_send_async("{}", 2, on_done, &done[i]));
+  TEST_ASSERT(TEST_WAIT(all_done(done, BURST), 2000));
+  sim_sleep_ms(200);
+  for (int i = 0; i < BURST; i++) {
+    TEST_ASSERT_EQ(calls(&done[i]), 1);
+    TEST_ASSERT_EQ(done[i].status, ESP_NOW_SEND_SUCCESS);
+  }
+  TEST_ASSERT_EQ(frame_count(), BURST);
+
+  // Data messages replace unsent ones, their callbacks still fire once
+  memset(done, 0, sizeof(done));
+  for (int i = 0; i < BURST; i++)
+    TEST_ASSERT_EQ(api->enc_try_send_async("{}", 2, ENC_MSG_DATA,
+                                           portMAX_DELAY, on_done, &done[i]),
+                   ESP_OK);
+  TEST_ASSERT(TEST_WAIT(all_done(done, BURST), 2000));
+  sim_sleep_ms(200);
+  unsigned sent = 0, superseded = 0;
+  for (int i = 0; i < BURST; i++) {
+    TEST_ASSERT_EQ(calls(&done[i]), 1);
+    if (done[i].status == ESP_NOW_SEND_SUCCESS)
+      sent++;
+    else if (done[i].status == ENC_SEND_SUPERSEDED)
+      superseded++;
+  }
+  test_measure("async_superseded", "messages", superseded);
+  TEST_ASSERT_EQ(sent + superseded, BURST);
+  TEST_ASSERT_EQ(frame_count(), BURST + sent);
+  TEST_ASSERT_EQ(done[BURST - 1].status, ESP_NOW_SEND_SUCCESS);
+
+  // Nobody hears the device
+  completion_t lost = {0};
+  sim_link_set(device, gateway, 1000, -50);
+  TEST_ASSERT(api->enc_send_async("{}", 2, on_done, &lost));
+  TEST_ASSERT(TEST_WAIT(calls(&lost) != 0, 2000));
+  sim_sleep_ms(200);
+  TEST_ASSERT_EQ(calls(&lost), 1);
+  TEST_ASSERT_EQ(lost.status, ESP_NOW_SEND_FAIL);
+  sim_link_set(device, gateway, 0, -50);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static unsigned chained;
+
+// Sends the next message with the completion that just fired
+static void on_chained(esp_now_send_status_t status, void *ctx) {
+  completion_t *done = ctx;
+  done->status = status;
+  if (__atomic_add_fetch(&chained, 1, __ATOMIC_RELAXED) < ROUNDS &&
+      status == ESP_NOW_SEND_SUCCESS)
+    sim_on(sim_current())->enc_send_async("{}", 2, on_chained, done);
+  __atomic_add_fetch(&done->calls, 1, __ATOMIC_RELEASE);
+}
+
+static void test_completion_reused(void) {
+  sim_node_t *gateway, *device;
+  start(&gateway, &device);
+  const sim_api_t *api = sim_on(device);
+
+  // One after the other
+  completion_t done;
+  for (int i = 0; i < ROUNDS; i++) {
+    done = (completion_t){0};
+    TEST_ASSERT(api->enc_send_async("{}", 2, on_done, &done));
+    TEST_ASSERT(TEST_WAIT(calls(&done) != 0, 1000));
+    TEST_ASSERT_EQ(calls(&done), 1);
+    TEST_ASSERT_EQ(done.status, ESP_NOW_SEND_SUCCESS);
+  }
+  TEST_ASSERT_EQ(frame_count(), ROUNDS);
+
+  // From within the callback, the slot of the message is free again by then
+  done = (completion_t){0};
+  uint64_t begin = sim_now_us();
+  TEST_ASSERT(api->enc_send_async("{}", 2, on_chained, &done));
+  TEST_ASSERT(TEST_WAIT(calls(&done) == ROUNDS, 2000));
+  test_measure("async_chained_send", "us",
+               (double)(sim_now_us() - begin) / ROUNDS);
+  sim_sleep_ms(200);
+  TEST_ASSERT_EQ(calls(&done), ROUNDS);
+  TEST_ASSERT_EQ(done.status, ESP_NOW_SEND_SUCCESS);
+  TEST_ASSERT_EQ(frame_count(), 2 * ROUNDS);
+
+  link_stats_t stats;
+  api->link_get_stats(&stats);
+  TEST_ASSERT(stats.send_pool_high_water < ENC_SEND_POOL_SIZE);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_called_once);
+  TEST_RUN(test_completion_reused);
+  return 0;
+}
@@ -0,0 +1,176 @@
+// Sends that give up: the error codes of try-sends, the watermarks of the
+// send queues and results that come after their sender stopped waiting.
+// Producer tasks keep their sampling deadlines while the radio is stalled.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 6
+#define PRODUCERS 3
+#define PERIOD_MS 20
+#define SAMPLES 40
+
+static link_config_t config;
+static unsigned above, below;
+
+static void on_watermark(enc_msg_kind_e kind, bool high, void *ctx) {
+  if (kind == ENC_MSG_CONTROL)
+    __atomic_add_fetch(high ? &above : &below, 1, __ATOMIC_RELAXED);
+}
+
+// Results of every frame come latency_ms after it was sent
+static void stall(uint32_t latency_ms) {
+  sim_medium_t medium;
+  sim_medium_get(&medium);
+  medium.latency_us = latency_ms * 1000;
+  sim_medium_set(&medium);
+}
+
+static void unstall(void) {
+  sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+  sim_medium_set(&medium);
+}
+
+static void test_error_codes(void) {
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT_EQ(api->link_try_send_status_msg(10), ENC_ERR_NOT_PAIRED);
+
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  TEST_ASSERT(test_paired(device, 5000));
+  api->link_set_send_watermark_cb(on_watermark, NULL);
+  sim_sleep_ms(300);
+
+  // Frames are queued without waiting until there is no room left. Control
+  // frames are not coalesced, each takes a place.
+  stall(400);
+  esp_err_t err = ESP_OK;
+  uint64_t start = sim_now_us();
+  for (int i = 0; i < 32 && err == ESP_OK; i++)
+    err = api->enc_try_send_async("{}", 2, ENC_MSG_CONTROL, 0, NULL, NULL);
+  TEST_ASSERT_EQ(err, ENC_ERR_QUEUE_FULL);
+  TEST_ASSERT(sim_now_us() - start < 50000);
+  TEST_ASSERT_EQ(__atomic_load_n(&above, __ATOMIC_RELAXED), 1);
+  TEST_ASSERT(api->enc_send_queue_congested(ENC_MSG_CONTROL));
+
+  start = sim_now_us();
+  err = api->link_try_send_status_msg(30);
+  TEST_ASSERT(err == ENC_ERR_QUEUE_FULL || err == ESP_ERR_TIMEOUT);
+  TEST_ASSERT(sim_now_us() - start < 100000);
+
+  unstall();
+  TEST_ASSERT(TEST_WAIT(__atomic_load_n(&below, __ATOMIC_RELAXED) == 1, 5000));
+  TEST_ASSERT(!api->enc_send_queue_congested(ENC_MSG_CONTROL));
+  TEST_ASSERT_EQ(api->link_try_send_status_msg(1000), ESP_OK);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_late_result(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  // The result wait is part of the timeout
+  stall(300);
+  uint64_t start = sim_now_us();
+  TEST_ASSERT_EQ(api->link_try_send_status_msg(50), ESP_ERR_TIMEOUT);
+  double ms = (sim_now_us() - start) / 1000.0;
+  test_measure("try_send_timeout_50ms", "ms", ms);
+  TEST_ASSERT(ms < 150);
+
+  // The success of that frame comes while the next one is waited for, which
+  // fails
+  sim_link_set(device, gateway, 1000, -50);
+  TEST_ASSERT(!api->link_send_status_msg());
+  sim_link_set(device, gateway, 0, -50);
+
+  // Waiters given up on are freed by their late results
+  for (int i = 0; i < 20; i++) {
+    esp_err_t err = api->link_try_send_status_msg(10);
+    TEST_ASSERT(err == ESP_ERR_TIMEOUT || err == ENC_ERR_QUEUE_FULL);
+  }
+  unstall();
+  sim_sleep_ms(1000);
+  for (int i = 0; i < 20; i++)
+    TEST_ASSERT_EQ(api->link_try_send_status_msg(1000), ESP_OK);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+typedef struct {
+  sim_node_t *device;
+  uint32_t max_late_us;
+  unsigned sent, gave_up;
+} producer_t;
+
+// Samples every PERIOD_MS and gives each sample half a period to be sent
+static void *producer(void *arg) {
+  producer_t *p = arg;
+  const sim_api_t *api = sim_on(p->device);
+  uint64_t next = sim_now_us();
+  for (int i = 0; i < SAMPLES; i++) {
+    uint64_t now = sim_now_us();
+    if (now > next && now - next > p->max_late_us)
+      p->max_late_us = now - next;
+    next += PERIOD_MS * 1000;
+
+    esp_err_t err = api->link_try_send_data_msg(PERIOD_MS / 2);
+    if (err == ESP_OK)
+      p->sent++;
+    else
+      p->gave_up++;
+    now = sim_now_us();
+    if (now < next)
+      sim_sleep_ms((next - now) / 1000);
+  }
+  return NULL;
+}
+
+static void test_producer_deadlines(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  stall(500);
+  producer_t producers[PRODUCERS];
+  pthread_t threads[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; i++) {
+    producers[i] = (producer_t){.device = device};
+    pthread_create(&threads[i], NULL, producer, &producers[i]);
+  }
+  uint32_t max_late_us = 0;
+  unsigned gave_up = 0;
+  for (int i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+    if (producers[i].max_late_us > max_late_us)
+      max_late_us = producers[i].max_late_us;
+    gave_up += producers[i].gave_up;
+  }
+  unstall();
+  test_measure("producer_max_late", "ms", max_late_us / 1000.0);
+  TEST_ASSERT(gave_up > 0);
+  TEST_ASSERT(max_late_us < PERIOD_MS * 1000);
+
+  sim_sleep_ms(1000);
+  TEST_ASSERT(sim_on(device)->link_send_data_msg());
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_error_codes);
+  TEST_RUN(test_late_result);
+  TEST_RUN(test_producer_deadlines);
+  return 0;
+}
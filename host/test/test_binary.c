@@ -0,0 +1,202 @@
+// Binary status messages: the values reach the gateway handler with the
+// schema the device announced when pairing, in a fraction of the bytes of the
+// same reading printed as JSON, and the handler decodes every field type
+// with link_msg_decode_field.
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+
+#define TYPE 13
+#define ENCODES 20000
+
+static link_config_t config;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned handled;
+static uint8_t payload[ESP_NOW_MAX_DATA_LEN];
+static size_t payload_len;
+static link_field_t schema[LINK_MAX_FIELDS];
+
+static void on_message(const link_node_t *node, link_node_msg_kind_e kind,
+                       const link_field_t *fields, const char *data,
+                       size_t len) {
+  if (kind != LINK_NODE_MSG_BINARY_STATUS || fields == NULL)
+    return;
+  pthread_mutex_lock(&lock);
+  memcpy(payload, data, len);
+  payload_len = len;
+  memcpy(schema, fields, sizeof(schema));
+  handled++;
+  pthread_mutex_unlock(&lock);
+}
+
+// Fields the handler decoded from the last binary data message
+static link_field_value_t values[LINK_MAX_FIELDS];
+static link_field_t keys[LINK_MAX_FIELDS];
+static char text[256];
+static int decoded;
+static bool truncated_rejected;
+
+static void on_data(const link_node_t *node, link_node_msg_kind_e kind,
+                    const link_field_t *fields, const char *data, size_t len) {
+  if (kind != LINK_NODE_MSG_BINARY_DATA)
+    return;
+  const sim_api_t *api = sim_on(sim_current());
+  pthread_mutex_lock(&lock);
+  size_t offset = 0;
+  decoded = 0;
+  while (decoded < LINK_MAX_FIELDS &&
+         api->link_msg_decode_field(fields, data, len, &offset,
+                                    &values[decoded])) {
+    // the schema and the payload only live as long as the call
+    keys[decoded] = *values[decoded].field;
+    if (values[decoded].field->type == LINK_FIELD_STR) {
+      memcpy(text, values[decoded].str.data, values[decoded].str.len);
+      text[values[decoded].str.len] = '\0';
+    }
+    decoded++;
+  }
+  if (offset != len)
+    decoded = -1;
+
+  // a field cut short is not decoded
+  link_field_value_t value;
+  offset = 0;
+  while (api->link_msg_decode_field(fields, data, len - 1, &offset, &value))
+    ;
+  truncated_rejected = offset < len - 1;
+  handled++;
+  pthread_mutex_unlock(&lock);
+}
+
+static unsigned handled_count(void) {
+  pthread_mutex_lock(&lock);
+  unsigned count = handled;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+static float field_f32(const uint8_t *p) {
+  uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+  float f;
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_reading_reaches_gateway(void) {
+  sim_node_t *gateway = sim_node_create("gateway");
+  TEST_ASSERT(sim_on(gateway)->link_gateway_register_handler(TYPE, on_message));
+  sim_on(gateway)->link_start(true);
+
+  test_device_config(&config, TYPE);
+  strcpy(config.status_fmt, "{\"T\":%.2f,\"H\":%.2f}");
+  config.status_schema[0] = (link_field_t){"T", LINK_FIELD_F32};
+  config.status_schema[1] = (link_field_t){"H", LINK_FIELD_F32};
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+
+  link_msg_t *msg = api->link_msg_reserve_binary_status();
+  TEST_ASSERT(msg != NULL);
+  int binary = api->link_msg_encode(msg, 21.2, 55.1);
+  TEST_ASSERT_EQ(binary, 10);
+  TEST_ASSERT(api->link_msg_send(msg));
+  TEST_ASSERT(TEST_WAIT(handled_count() == 1, 1000));
+
+  pthread_mutex_lock(&lock);
+  TEST_ASSERT_EQ(payload_len, 10);
+  TEST_ASSERT_EQ(payload[0], 0);
+  TEST_ASSERT(field_f32(payload + 1) == 21.2f);
+  TEST_ASSERT_EQ(payload[5], 1);
+  TEST_ASSERT(field_f32(payload + 6) == 55.1f);
+  TEST_ASSERT(strcmp(schema[0].key, "T") == 0);
+  TEST_ASSERT_EQ(schema[1].type, LINK_FIELD_F32);
+  pthread_mutex_unlock(&lock);
+
+  // The same reading as JSON
+  msg = api->link_msg_reserve_status();
+  int json = api->link_msg_printf(msg, NULL, 21.2, 55.1);
+  api->link_msg_discard(msg);
+  test_measure("payload_json", "bytes", json);
+  test_measure("payload_binary", "bytes", binary);
+  TEST_ASSERT(binary * 2 <= json);
+
+  uint64_t start = cpu_ns();
+  for (int i = 0; i < ENCODES; i++) {
+    msg = api->link_msg_reserve_status();
+    api->link_msg_printf(msg, NULL, 20.0 + i % 10, 50.0 + i % 7);
+    api->link_msg_discard(msg);
+  }
+  test_measure("encode_json", "ns", (double)(cpu_ns() - start) / ENCODES);
+
+  start = cpu_ns();
+  for (int i = 0; i < ENCODES; i++) {
+    msg = api->link_msg_reserve_binary_status();
+    api->link_msg_encode(msg, 20.0 + i % 10, 50.0 + i % 7);
+    api->link_msg_discard(msg);
+  }
+  test_measure("encode_binary", "ns", (double)(cpu_ns() - start) / ENCODES);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_fields_decoded(void) {
+  sim_node_t *gateway = sim_node_create("gateway");
+  TEST_ASSERT(sim_on(gateway)->link_gateway_register_handler(TYPE, on_data));
+  sim_on(gateway)->link_start(true);
+
+  test_device_config(&config, TYPE);
+  static const link_field_type_e types[] = {
+      LINK_FIELD_BOOL, LINK_FIELD_I8,  LINK_FIELD_U16, LINK_FIELD_I16,
+      LINK_FIELD_U32,  LINK_FIELD_I32, LINK_FIELD_F32, LINK_FIELD_STR};
+  for (int i = 0; i < 8; i++) {
+    snprintf(config.data_schema[i].key, LINK_FIELD_KEY_SIZE, "f%d", i);
+    config.data_schema[i].type = types[i];
+  }
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+
+  unsigned before = handled_count();
+  link_msg_t *msg = api->link_msg_reserve_binary_data();
+  TEST_ASSERT(api->link_msg_encode(msg, 1, -5, 60000, -300,
+                                   (uint32_t)4000000000u, (int32_t)-70000,
+                                   3.5, "kitchen") > 0);
+  TEST_ASSERT(api->link_msg_send(msg));
+  TEST_ASSERT(TEST_WAIT(handled_count() == before + 1, 1000));
+
+  pthread_mutex_lock(&lock);
+  TEST_ASSERT_EQ(decoded, 8);
+  TEST_ASSERT(strcmp(keys[0].key, "f0") == 0);
+  TEST_ASSERT_EQ(keys[7].type, LINK_FIELD_STR);
+  TEST_ASSERT(values[0].b);
+  TEST_ASSERT_EQ(values[1].i, -5);
+  TEST_ASSERT_EQ(values[2].u, 60000);
+  TEST_ASSERT_EQ(values[3].i, -300);
+  TEST_ASSERT_EQ(values[4].u, 4000000000u);
+  TEST_ASSERT_EQ(values[5].i, -70000);
+  TEST_ASSERT(values[6].f == 3.5f);
+  TEST_ASSERT_EQ(values[7].str.len, 7);
+  TEST_ASSERT(strcmp(text, "kitchen") == 0);
+  TEST_ASSERT(truncated_rejected);
+  pthread_mutex_unlock(&lock);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_reading_reaches_gateway);
+  TEST_RUN(test_fields_decoded);
+  return 0;
+}
@@ -0,0 +1,178 @@
+// Finding the gateway channel: a new device sweeps the channels, a paired
+// one starts on the stored channel after a single request to its gateway,
+// and pairing again asks on the stored channel first before it follows a
+// gateway that moved, also one that moved while the device was off. A
+// device nobody answers stops sweeping after LINK_PAIR_SWEEPS rounds.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 19
+#define FIRST_CHANNEL 9
+#define MOVED_CHANNEL 4
+#define CHANNELS 13 // ENC_MAX_CHANNEL of the host nodes
+#define MAX_REQUESTS 64
+
+static link_config_t config;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned requests;
+static uint64_t first_status_at;
+
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  pthread_mutex_lock(&lock);
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0) {
+    requests++;
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  } else if (strncmp((const char *)frame->data, LINK_STATUS_PREFIX, 3) == 0 &&
+             first_status_at == 0) {
+    first_status_at = sim_now_us();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void reset(void) {
+  pthread_mutex_lock(&lock);
+  requests = 0;
+  first_status_at = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+static unsigned request_count(void) {
+  pthread_mutex_lock(&lock);
+  unsigned count = requests;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+static uint64_t status_at(void) {
+  pthread_mutex_lock(&lock);
+  uint64_t at = first_status_at;
+  pthread_mutex_unlock(&lock);
+  return at;
+}
+
+// Starts the device again as after a power cycle and returns the ms until it
+// was paired
+static double restart(sim_node_t *device, bool force_pair) {
+  reset();
+  sim_node_reboot(device);
+  const sim_api_t *api = sim_on(device);
+  api->link_register(&config);
+  uint64_t start = sim_now_us();
+  api->link_start(force_pair);
+  TEST_ASSERT(test_paired(device, 10000));
+  return (sim_now_us() - start) / 1000.0;
+}
+
+static void test_channel_found_and_kept(void) {
+  sim_node_t *gateway =
+      sim_station_create("gateway", FIRST_CHANNEL, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = sim_node_create("device");
+
+  // A new device asks on every channel up to the one of the gateway
+  uint64_t start = sim_now_us();
+  double sweep = restart(device, true);
+  test_measure("pair_sweep", "ms", sweep);
+  TEST_ASSERT_EQ(sim_node_channel(device), FIRST_CHANNEL);
+  TEST_ASSERT(TEST_WAIT(status_at() != 0, 1000));
+  double unpaired_ms = (status_at() - start) / 1000.0;
+  test_measure("cold_start_first_message_unpaired", "ms", unpaired_ms);
+
+  // A paired device starts on the stored channel and only asks its gateway
+  // whether it is still there
+  start = sim_now_us();
+  restart(device, false);
+  TEST_ASSERT_EQ(sim_node_channel(device), FIRST_CHANNEL);
+  TEST_ASSERT(TEST_WAIT(status_at() != 0, 1000));
+  double paired_ms = (status_at() - start) / 1000.0;
+  test_measure("cold_start_first_message_paired", "ms", paired_ms);
+  TEST_ASSERT_EQ(request_count(), 1);
+  TEST_ASSERT(paired_ms < unpaired_ms);
+
+  // Pairing again asks on the stored channel first
+  double stored = restart(device, true);
+  test_measure("pair_stored_channel", "ms", stored);
+  TEST_ASSERT_EQ(request_count(), 1);
+  TEST_ASSERT(stored < sweep);
+
+  // The gateway moved: the sweep goes on from the stored channel and the new
+  // channel is stored in turn
+  sim_station_set_channel(gateway, MOVED_CHANNEL);
+  double moved = restart(device, true);
+  test_measure("pair_moved_gateway", "ms", moved);
+  TEST_ASSERT_EQ(sim_node_channel(device), MOVED_CHANNEL);
+  restart(device, false);
+  TEST_ASSERT_EQ(sim_node_channel(device), MOVED_CHANNEL);
+  TEST_ASSERT(TEST_WAIT(status_at() != 0, 1000));
+  TEST_ASSERT_EQ(request_count(), 1);
+
+  // The gateway moved back while the device was off: the probe on the stored
+  // channel goes unanswered and the device looks for the gateway again
+  sim_station_set_channel(gateway, FIRST_CHANNEL);
+  start = sim_now_us();
+  restart(device, false);
+  TEST_ASSERT(TEST_WAIT(status_at() != 0, 10000));
+  test_measure("boot_moved_gateway_first_message", "ms",
+               (status_at() - start) / 1000.0);
+  TEST_ASSERT_EQ(sim_node_channel(device), FIRST_CHANNEL);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static uint8_t heard[MAX_REQUESTS];
+static unsigned heard_count;
+
+static void silent_rx(sim_node_t *station, const sim_frame_t *frame,
+                      void *ctx) {
+  pthread_mutex_lock(&lock);
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0 &&
+      heard_count < MAX_REQUESTS)
+    heard[heard_count++] = (uint8_t)(uintptr_t)ctx;
+  pthread_mutex_unlock(&lock);
+}
+
+static void test_sweep_capped(void) {
+  sim_node_t *listeners[CHANNELS];
+  for (int i = 0; i < CHANNELS; i++)
+    listeners[i] = sim_station_create("listener", i + 1, silent_rx,
+                                      (void *)(uintptr_t)(i + 1));
+  test_device_config(&config, TYPE);
+  sim_node_t *device = sim_node_create("device_sweep");
+  sim_on(device)->link_register(&config);
+  sim_on(device)->link_start(true);
+
+  // One round over every channel at the shortest interval, then the backoff
+  // of 100 to 800 ms on the first channel
+  sim_sleep_ms(5000);
+  pthread_mutex_lock(&lock);
+  unsigned count = heard_count;
+  uint8_t first = heard[0];
+  uint32_t swept = 0;
+  for (unsigned i = 0; i < CHANNELS && i < count; i++)
+    swept |= 1UL << heard[i];
+  bool settled = true;
+  for (unsigned i = CHANNELS; i < count; i++)
+    settled &= heard[i] == first;
+  pthread_mutex_unlock(&lock);
+
+  test_measure("requests_after_sweep", "messages", count - CHANNELS);
+  TEST_ASSERT_EQ(swept, ((1UL << CHANNELS) - 1) << 1);
+  TEST_ASSERT(settled);
+  TEST_ASSERT(count >= CHANNELS + 3);
+
+  sim_node_stop(device);
+  for (int i = 0; i < CHANNELS; i++)
+    sim_node_stop(listeners[i]);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_channel_found_and_kept);
+  TEST_RUN(test_sweep_capped);
+  return 0;
+}
@@ -0,0 +1,192 @@
+// Coalescing of status messages: a newer message takes the place of an
+// unsent one, whose sender is told it was superseded and keeps its delta base.
+// Under a slow link this saves frames and keeps what the gateway sees fresh.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 7
+#define PERIOD_MS 10
+#define SAMPLES 100
+
+static link_config_t config;
+
+// Value the status of the calling thread reports
+static __thread unsigned value;
+
+static char *status_cb(void) {
+  return sim_on(sim_current())
+      ->link_generate_status_message("{\"a\":1,\"b\":%u,\"t\":%u}", value,
+                                     (unsigned)(sim_now_us() / 1000));
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned received, last_value;
+static double staleness_ms;
+
+static void on_message(const link_node_t *node, link_node_msg_kind_e kind,
+                       const link_field_t *schema, const char *payload,
+                       size_t len) {
+  unsigned b, t;
+  if (kind != LINK_NODE_MSG_STATUS ||
+      sscanf(payload, "{\"a\":1,\"b\":%u,\"t\":%u}", &b, &t) != 2)
+    return;
+  pthread_mutex_lock(&lock);
+  received++;
+  last_value = b;
+  staleness_ms += sim_now_us() / 1000.0 - t;
+  pthread_mutex_unlock(&lock);
+}
+
+static unsigned received_count(void) {
+  pthread_mutex_lock(&lock);
+  unsigned count = received;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+static void stall(uint32_t latency_ms) {
+  sim_medium_t medium;
+  sim_medium_get(&medium);
+  medium.latency_us = latency_ms * 1000;
+  sim_medium_set(&medium);
+}
+
+static void unstall(void) {
+  sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+  sim_medium_set(&medium);
+}
+
+typedef struct {
+  sim_node_t *device;
+  unsigned value;
+  esp_err_t err;
+} sender_t;
+
+static void *sender(void *arg) {
+  sender_t *s = arg;
+  value = s->value;
+  s->err = sim_on(s->device)->link_try_send_status_msg(2000);
+  return NULL;
+}
+
+static void pair(const char *device_variant, const char *gateway_variant,
+                 sim_node_t **device, sim_node_t **gateway) {
+  *gateway = sim_node_create(gateway_variant);
+  TEST_ASSERT(sim_on(*gateway)->link_gateway_register_handler(TYPE,
+                                                              on_message));
+  sim_on(*gateway)->link_start(true);
+  test_device_config(&config, TYPE);
+  config.user_status_msg_cb = status_cb;
+  *device = test_device(device_variant, &config);
+  TEST_ASSERT(test_paired(*device, 5000));
+  sim_sleep_ms(300);
+}
+
+// A control frame is in the air while the first status waits in the queue,
+// where the second takes its place
+static void supersede(sim_node_t *device) {
+  sender_t senders[2];
+  pthread_t threads[2];
+  unsigned before = received_count();
+  stall(200);
+  TEST_ASSERT_EQ(sim_on(device)->enc_try_send_async("{}", 2, ENC_MSG_CONTROL,
+                                                    0, NULL, NULL),
+                 ESP_OK);
+  for (int i = 0; i < 2; i++) {
+    sim_sleep_ms(30);
+    senders[i] = (sender_t){.device = device, .value = 10 + i};
+    pthread_create(&threads[i], NULL, sender, &senders[i]);
+  }
+  for (int i = 0; i < 2; i++)
+    pthread_join(threads[i], NULL);
+  unstall();
+
+  TEST_ASSERT_EQ(senders[0].err, ENC_ERR_SUPERSEDED);
+  TEST_ASSERT_EQ(senders[1].err, ESP_OK);
+  TEST_ASSERT(TEST_WAIT(received_count() == before + 1, 1000));
+  sim_sleep_ms(50);
+  TEST_ASSERT_EQ(received_count(), before + 1);
+  TEST_ASSERT_EQ(last_value, 11);
+}
+
+static void test_superseded(void) {
+  sim_node_t *device, *gateway;
+  pair("device", "gateway", &device, &gateway);
+  supersede(device);
+
+  value = 1;
+  TEST_ASSERT(sim_on(device)->link_send_status_msg());
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_superseded_keeps_delta_base(void) {
+  sim_node_t *device, *gateway;
+  pair("device_compact", "gateway_compact", &device, &gateway);
+  value = 11;
+  TEST_ASSERT(sim_on(device)->link_send_status_msg());
+  supersede(device);
+
+  // Deltas are made against the message that was sent, so the gateway can
+  // rebuild the next one without a resync
+  for (unsigned v = 10; v < 13; v++) {
+    unsigned before = received_count();
+    value = v;
+    TEST_ASSERT(sim_on(device)->link_send_status_msg());
+    TEST_ASSERT(TEST_WAIT(received_count() > before, 1000));
+    TEST_ASSERT_EQ(last_value, v);
+  }
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+// Samples every PERIOD_MS over a link that takes 4 periods per frame, without
+// waiting for the results
+static void slow_link(const char *device_variant, const char *name) {
+  sim_node_t *device, *gateway;
+  pair(device_variant, "gateway", &device, &gateway);
+  const sim_api_t *api = sim_on(device);
+  pthread_mutex_lock(&lock);
+  received = 0;
+  staleness_ms = 0;
+  pthread_mutex_unlock(&lock);
+  sim_counters_t before, after;
+  sim_node_counters(device, &before);
+
+  stall(4 * PERIOD_MS);
+  for (unsigned i = 0; i < SAMPLES; i++) {
+    value = i;
+    api->link_try_send_status_msg(0);
+    sim_sleep_ms(PERIOD_MS);
+  }
+  sim_sleep_ms(1000);
+  unstall();
+  sim_node_counters(device, &after);
+
+  pthread_mutex_lock(&lock);
+  TEST_ASSERT(received > 0);
+  char measure[48];
+  snprintf(measure, sizeof(measure), "%s_staleness", name);
+  test_measure(measure, "ms", staleness_ms / received);
+  snprintf(measure, sizeof(measure), "%s_frames", name);
+  test_measure(measure, "frames", after.frames_tx - before.frames_tx);
+  pthread_mutex_unlock(&lock);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_slow_link(void) {
+  slow_link("device", "coalesce");
+  slow_link("device_fifo", "fifo");
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_superseded);
+  TEST_RUN(test_superseded_keeps_delta_base);
+  TEST_RUN(test_slow_link);
+  return 0;
+}
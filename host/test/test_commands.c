@@ -0,0 +1,140 @@
+// Commands under a burst: with workers the receive task only hands them off,
+// commands no worker has room for are counted and reported in the telemetry,
+// and each command runs in the order it was received. Inline handlers stall
+// the receive task, so frames are dropped before they are even matched.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 8
+#define BURST 30
+#define HANDLER_MS 20
+
+static link_config_t config;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned handled;
+static unsigned last_arg[2];
+static bool out_of_order;
+static char telemetry[ESP_NOW_MAX_DATA_LEN + 1];
+
+static void on_command(int command, const link_arg_t *args) {
+  sim_sleep_ms(HANDLER_MS);
+  pthread_mutex_lock(&lock);
+  if (args[0].u <= last_arg[command] && last_arg[command] != 0)
+    out_of_order = true;
+  last_arg[command] = args[0].u;
+  handled++;
+  pthread_mutex_unlock(&lock);
+}
+
+static void on_set(const char *cmd, const link_arg_t *args, int argc) {
+  on_command(0, args);
+}
+
+static void on_led(const char *cmd, const link_arg_t *args, int argc) {
+  on_command(1, args);
+}
+
+// Scripted gateway that accepts the pairing and keeps the last telemetry
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0) {
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  } else if (strncmp((const char *)frame->data, LINK_TELEMETRY_PREFIX, 3) ==
+             0) {
+    pthread_mutex_lock(&lock);
+    memcpy(telemetry, frame->data, frame->len);
+    telemetry[frame->len] = '\0';
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static bool telemetry_has(const char *key) {
+  pthread_mutex_lock(&lock);
+  bool found = strstr(telemetry, key) != NULL;
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+static unsigned handled_count(void) {
+  pthread_mutex_lock(&lock);
+  unsigned count = handled;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+// Sends BURST commands 1 ms apart and returns the frames that were dropped.
+// Devices that send telemetry report the commands they dropped.
+static unsigned burst(const char *variant, link_stats_t *stats) {
+  memset(&config, 0, sizeof(config));
+  config.type = TYPE;
+  strcpy(config.config, "{}");
+  strcpy(config.commands[0], "SET=%u");
+  strcpy(config.commands[1], "LED=%u");
+  config.command_handlers[0] = on_set;
+  config.command_handlers[1] = on_led;
+
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  sim_node_t *device = test_device(variant, &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  pthread_mutex_lock(&lock);
+  handled = 0;
+  telemetry[0] = '\0';
+  memset(last_arg, 0, sizeof(last_arg));
+  out_of_order = false;
+  pthread_mutex_unlock(&lock);
+  sim_counters_t counters;
+  sim_node_counters(device, &counters);
+  uint32_t rx_dropped = counters.rx_dropped;
+
+  for (unsigned i = 1; i <= BURST; i++) {
+    char msg[16];
+    int len = snprintf(msg, sizeof(msg), "%s=%u", (i % 2) ? "SET" : "LED", i);
+    sim_station_send(gateway, sim_node_mac(device), msg, len);
+    sim_sleep_ms(1);
+  }
+  sim_sleep_ms(BURST * HANDLER_MS + 500);
+
+  sim_on(device)->link_get_stats(stats);
+  sim_node_counters(device, &counters);
+  unsigned dropped = counters.rx_dropped - rx_dropped +
+                     stats->receive_queue_full + stats->receive_pool_exhausted +
+                     stats->commands_dropped;
+  TEST_ASSERT_EQ(handled_count() + dropped, BURST);
+  TEST_ASSERT(!out_of_order);
+
+  if (strcmp(variant, "device_telemetry") == 0) {
+    char key[32];
+    snprintf(key, sizeof(key), "\"cmd\":%u,",
+             (unsigned)stats->commands_dropped);
+    TEST_ASSERT(TEST_WAIT(telemetry_has(key), 3000));
+  }
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  return dropped;
+}
+
+static void test_command_burst(void) {
+  link_stats_t stats;
+  unsigned inline_dropped = burst("device_inline", &stats);
+  TEST_ASSERT(inline_dropped > 0);
+  TEST_ASSERT_EQ(stats.commands_dropped, 0);
+  test_measure("command_burst_dropped_inline", "frames", inline_dropped);
+
+  // Only the workers drop commands, the radio is drained in time
+  unsigned workers_dropped = burst("device_telemetry", &stats);
+  TEST_ASSERT(stats.commands_dropped > 0);
+  TEST_ASSERT_EQ(workers_dropped, stats.commands_dropped);
+  test_measure("command_burst_dropped_workers", "frames", workers_dropped);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_command_burst);
+  return 0;
+}
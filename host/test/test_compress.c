@@ -0,0 +1,114 @@
+// Frame compression: typical frames of every kind come back unchanged from
+// the decompressor, the protocol and JSON text shrinks, and the static
+// tables stay small. Ratio and time per frame are reported for each kind.
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+
+#define TYPE 21
+#define ROUNDS 20000
+#define RAM_LIMIT 512
+
+static link_config_t config;
+
+typedef struct {
+  const char *name;
+  const char *data;
+  size_t len; // 0 for text
+} frame_t;
+
+static frame_t frames[] = {
+    {"pair", NULL, 0},
+    {"status", "!S:{\"temp\":21.4,\"hum\":55,\"bat\":3.71,\"rssi\":-61,"
+               "\"uptime\":3600}",
+     0},
+    {"data", "!D:{\"power\":12.5,\"energy\":1043.2,\"voltage\":230.1,"
+             "\"current\":0.054,\"state\":true}",
+     0},
+    {"telemetry", "!T:{\"tx\":120,\"fail\":2,\"ack\":118,\"rtx\":0,\"lost\":0,"
+                  "\"full\":{\"sq\":[0,0,0],\"res\":0,\"rq\":0,\"pool\":0,"
+                  "\"ack\":0},\"hw\":{\"sq\":[1,2,1],\"rq\":1},\"coal\":3,"
+                  "\"z\":[4100,2630],\"unk\":0,\"cmd\":0,"
+                  "\"rssi\":[-70,-58,-49]}",
+     0},
+    {"delta", "!s:3fa1{\"temp\":21.5,\"uptime\":3660}", 0},
+    {"command", "SET_BRIGHTNESS=128", 0},
+    {"binary", "#S:\x00\x9a\x99\xa9\x41\x01\xcd\xcc\x5c\x42\x02\xff\x80", 16},
+};
+
+#define FRAMES (sizeof(frames) / sizeof(frames[0]))
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_ratio_and_time(void) {
+  sim_node_t *device = sim_node_create("device_compact");
+  const sim_api_t *api = sim_on(device);
+  size_t (*compress_init)(void) = sim_node_symbol(device, "enc_compress_init");
+  TEST_ASSERT(compress_init != NULL);
+  size_t ram = compress_init();
+  test_measure("compress_ram", "bytes", ram);
+  TEST_ASSERT(ram <= RAM_LIMIT);
+
+  // The pair request of a device with schemas
+  test_device_config(&config, TYPE);
+  strcpy(config.config, "{\"room\":\"hall\"}");
+  config.status_schema[0] = (link_field_t){"temp", LINK_FIELD_F32};
+  config.status_schema[1] = (link_field_t){"hum", LINK_FIELD_U8};
+  config.data_schema[0] = (link_field_t){"power", LINK_FIELD_F32};
+  api->link_register(&config);
+  frames[0].data = api->link_get_pair_msg();
+
+  size_t total_in = 0, total_out = 0;
+  for (size_t f = 0; f < FRAMES; f++) {
+    const uint8_t *in = (const uint8_t *)frames[f].data;
+    size_t len = frames[f].len ? frames[f].len : strlen(frames[f].data);
+    uint8_t packed[2 * ESP_NOW_MAX_DATA_LEN];
+    uint8_t unpacked[2 * ESP_NOW_MAX_DATA_LEN];
+
+    int packed_len = api->enc_compress(in, len, packed, sizeof(packed));
+    TEST_ASSERT(packed_len > 0);
+    int unpacked_len =
+        api->enc_decompress(packed, packed_len, unpacked, sizeof(unpacked));
+    TEST_ASSERT_EQ(unpacked_len, len);
+    TEST_ASSERT(memcmp(unpacked, in, len) == 0);
+
+    uint64_t start = cpu_ns();
+    for (int i = 0; i < ROUNDS; i++)
+      api->enc_compress(in, len, packed, sizeof(packed));
+    double compress_ns = (double)(cpu_ns() - start) / ROUNDS;
+    start = cpu_ns();
+    for (int i = 0; i < ROUNDS; i++)
+      api->enc_decompress(packed, packed_len, unpacked, sizeof(unpacked));
+    double decompress_ns = (double)(cpu_ns() - start) / ROUNDS;
+
+    // The frame type byte goes on air as well
+    char name[48];
+    snprintf(name, sizeof(name), "compress_ratio_%s", frames[f].name);
+    test_measure(name, "ratio", (double)(packed_len + 1) / len);
+    snprintf(name, sizeof(name), "compress_time_%s", frames[f].name);
+    test_measure(name, "ns", compress_ns);
+    snprintf(name, sizeof(name), "decompress_time_%s", frames[f].name);
+    test_measure(name, "ns", decompress_ns);
+
+    // Short commands and binary frames grow and go on air as they are
+    if (frames[f].len == 0 && strcmp(frames[f].name, "command") != 0)
+      TEST_ASSERT(packed_len + 1 < (int)len);
+    total_in += len;
+    total_out += packed_len + 1;
+  }
+  test_measure("compress_ratio_all", "ratio", (double)total_out / total_in);
+  TEST_ASSERT(total_out * 4 < total_in * 3);
+
+  sim_node_stop(device);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_ratio_and_time);
+  return 0;
+}
@@ -0,0 +1,183 @@
+// Delta messages on a sensor trace: the gateway hands every reading over as
+// it was sent while far fewer bytes go on air, a full message goes out every
+// keyframe interval, and a gateway that lost its bases after a reboot gets
+// back in step after a single reading.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 20
+#define READINGS 100
+#define KEYFRAME_INTERVAL 10 // CONFIG_LINK_DELTA_KEYFRAME_INTERVAL default
+
+static link_config_t config;
+static char trace[READINGS][128];
+static int current;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned handled;
+static char last[ESP_NOW_MAX_DATA_LEN + 1];
+
+// Slowly drifting readings of a greenhouse sensor, one a minute
+static void trace_init(void) {
+  uint32_t rng = 12345;
+  int temp = 214, hum = 55, bat = 371, lux = 320;
+  for (int i = 0; i < READINGS; i++) {
+    rng = rng * 1103515245 + 12345;
+    if ((rng >> 16) % 3 == 0)
+      temp += ((rng >> 20) & 1) ? 1 : -1;
+    if ((rng >> 18) % 4 == 0)
+      hum += ((rng >> 22) & 1) ? 1 : -1;
+    if (i % 20 == 19)
+      bat--;
+    lux += (int)((rng >> 24) % 21) - 10;
+    snprintf(trace[i], sizeof(trace[i]),
+             "{\"id\":\"greenhouse-3\",\"fw\":\"2.1.0\",\"temp\":%d.%d,"
+             "\"hum\":%d,\"bat\":%d.%02d,\"lux\":%d,\"up\":%d}",
+             temp / 10, temp % 10, hum, bat / 100, bat % 100, lux,
+             3600 + i * 60);
+  }
+}
+
+static char *status_cb(void) {
+  return sim_on(sim_current())->link_generate_status_message("%s",
+                                                             trace[current]);
+}
+
+static void on_message(const link_node_t *node, link_node_msg_kind_e kind,
+                       const link_field_t *schema, const char *payload,
+                       size_t len) {
+  if (kind != LINK_NODE_MSG_STATUS)
+    return;
+  pthread_mutex_lock(&lock);
+  memcpy(last, payload, len);
+  last[len] = '\0';
+  handled++;
+  pthread_mutex_unlock(&lock);
+}
+
+static unsigned handled_count(void) {
+  pthread_mutex_lock(&lock);
+  unsigned count = handled;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+static bool last_is(const char *msg) {
+  pthread_mutex_lock(&lock);
+  bool same = strcmp(last, msg) == 0;
+  pthread_mutex_unlock(&lock);
+  return same;
+}
+
+static sim_node_t *start_gateway(sim_node_t *gateway, bool fresh) {
+  const sim_api_t *api = sim_on(gateway);
+  TEST_ASSERT(api->link_gateway_register_handler(TYPE, on_message));
+  api->link_start(fresh);
+  return gateway;
+}
+
+// Sends reading i and returns the bytes the device put on air for it
+static unsigned send_reading(sim_node_t *device, int i, bool arrives) {
+  sim_counters_t before, after;
+  sim_node_counters(device, &before);
+  unsigned count = handled_count();
+  current = i;
+  TEST_ASSERT(sim_on(device)->link_send_status_msg());
+  sim_node_counters(device, &after);
+  TEST_ASSERT_EQ(after.frames_tx - before.frames_tx, 1);
+  if (arrives) {
+    TEST_ASSERT(TEST_WAIT(handled_count() == count + 1, 1000));
+    TEST_ASSERT(last_is(trace[i]));
+  }
+  return after.bytes_tx - before.bytes_tx;
+}
+
+// Replays the trace and returns the average bytes on air of a reading
+static double replay(const char *variant, const char *name) {
+  sim_node_t *gateway =
+      start_gateway(sim_node_create("gateway_compact"), true);
+  memset(&config, 0, sizeof(config));
+  config.type = TYPE;
+  strcpy(config.config, "{}");
+  config.user_status_msg_cb = status_cb;
+  current = 0;
+  sim_node_t *device = test_device(variant, &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  unsigned bytes = 0, keyframes = 0;
+  for (int i = 0; i < READINGS; i++) {
+    unsigned len = send_reading(device, i, true);
+    bytes += len;
+    if (len == strlen(LINK_STATUS_PREFIX) + strlen(trace[i]))
+      keyframes++;
+  }
+
+  char measure[48];
+  snprintf(measure, sizeof(measure), "%s_bytes_per_reading", name);
+  test_measure(measure, "bytes", (double)bytes / READINGS);
+  if (strcmp(variant, "device_delta") == 0) {
+    test_measure("delta_keyframes", "messages", keyframes);
+    TEST_ASSERT(keyframes >= READINGS / KEYFRAME_INTERVAL);
+    TEST_ASSERT(keyframes <= READINGS / KEYFRAME_INTERVAL + 2);
+  }
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  return (double)bytes / READINGS;
+}
+
+static void test_trace_replay(void) {
+  double full = replay("device", "full");
+  double delta = replay("device_delta", "delta");
+  double compact = replay("device_compact", "compact");
+  TEST_ASSERT(delta * 1.5 < full);
+  TEST_ASSERT(compact < delta);
+}
+
+static void test_resync_after_gateway_reboot(void) {
+  sim_node_t *gateway =
+      start_gateway(sim_node_create("gateway_compact"), true);
+  memset(&config, 0, sizeof(config));
+  config.type = TYPE;
+  strcpy(config.config, "{}");
+  config.user_status_msg_cb = status_cb;
+  current = 0;
+  sim_node_t *device = test_device("device_delta", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  int i = 0;
+  for (; i < KEYFRAME_INTERVAL / 2; i++)
+    send_reading(device, i, true);
+
+  // The node is kept in storage, the bases are not. The gateway drops the
+  // delta it cannot expand and asks for a full message.
+  sim_node_reboot(gateway);
+  start_gateway(gateway, false);
+  unsigned before = handled_count();
+  int first = i;
+  send_reading(device, i++, false);
+  sim_sleep_ms(100);
+  TEST_ASSERT_EQ(handled_count(), before);
+
+  unsigned len = send_reading(device, i, true);
+  TEST_ASSERT_EQ(len, strlen(LINK_STATUS_PREFIX) + strlen(trace[i]));
+  for (i++; i < KEYFRAME_INTERVAL * 2; i++)
+    send_reading(device, i, true);
+  test_measure("resync_lost_readings", "messages",
+               i - first - (handled_count() - before));
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  trace_init();
+  TEST_RUN(test_trace_replay);
+  TEST_RUN(test_resync_after_gateway_reboot);
+  return 0;
+}
@@ -0,0 +1,180 @@
+// Messages longer than a frame: 1 KB and 4 KB messages arrive whole over a
+// lossy medium, where every lost fragment costs the whole message unless
+// frames are retransmitted, and the largest configurable message travels in
+// 32 fragments. Delivered bytes per second and the send slots and
+// reassembly buffers in use at once are reported.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 5
+// Largest ENC_MAX_MESSAGE_SIZE, the size the *_large variants are built with
+#define LARGEST 7744
+#define MESSAGES 10
+#define LOSS_PERMILLE 50
+#define MAX_RTO_MS 400 // of the reliable variants
+
+static link_config_t config;
+static char message[LARGEST + 1];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t expected_len;
+static unsigned intact, damaged;
+static uint64_t last_intact_at;
+
+// Message number n of len bytes: its number followed by a pattern that
+// differs between messages
+static void fill(char *out, size_t len, unsigned n) {
+  snprintf(out, len + 1, "%04u", n);
+  for (size_t i = 4; i < len; i++)
+    out[i] = 'a' + (i * 7 + n) % 26;
+  out[len] = '\0';
+}
+
+static void on_message(const link_node_t *node, link_node_msg_kind_e kind,
+                       const link_field_t *schema, const char *payload,
+                       size_t len) {
+  if (kind != LINK_NODE_MSG_OTHER)
+    return;
+  static char expected[LARGEST + 1];
+  pthread_mutex_lock(&lock);
+  unsigned n = 0;
+  sscanf(payload, "%4u", &n);
+  fill(expected, expected_len, n);
+  if (len == expected_len && memcmp(payload, expected, len) == 0) {
+    intact++;
+    last_intact_at = sim_now_us();
+  } else {
+    damaged++;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static unsigned intact_count(void) {
+  pthread_mutex_lock(&lock);
+  unsigned count = intact;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+static sim_node_t *start_gateway(const char *variant) {
+  sim_node_t *gateway = sim_node_create(variant);
+  TEST_ASSERT(sim_on(gateway)->link_gateway_register_handler(TYPE, on_message));
+  sim_on(gateway)->link_start(true);
+  return gateway;
+}
+
+// Sends MESSAGES messages of len bytes over the lossy medium and returns the
+// fraction that arrived whole
+static double transfer(const char *device_variant, const char *gateway_variant,
+                       size_t len, const char *name) {
+  sim_node_t *gateway = start_gateway(gateway_variant);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device(device_variant, &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  pthread_mutex_lock(&lock);
+  expected_len = len;
+  intact = damaged = 0;
+  pthread_mutex_unlock(&lock);
+  sim_medium_t medium;
+  sim_medium_get(&medium);
+  sim_medium_t lossy = medium;
+  lossy.loss_permille = LOSS_PERMILLE;
+  sim_medium_set(&lossy);
+
+  uint64_t start = sim_now_us();
+  for (unsigned n = 0; n < MESSAGES; n++) {
+    fill(message, len, n);
+    api->enc_send_with_result(message);
+  }
+  TEST_WAIT(intact_count() == MESSAGES, 2 * MAX_RTO_MS);
+  sim_medium_set(&medium);
+
+  enc_stats_t device_stats, gateway_stats;
+  api->enc_get_stats(&device_stats);
+  sim_on(gateway)->enc_get_stats(&gateway_stats);
+  size_t (*slot_size)(void) = sim_node_symbol(device, "enc_slot_size");
+  size_t (*reassembly_size)(void) =
+      sim_node_symbol(gateway, "enc_reassembly_size");
+  TEST_ASSERT(slot_size != NULL && reassembly_size != NULL);
+
+  pthread_mutex_lock(&lock);
+  unsigned whole = intact;
+  double seconds = (last_intact_at - start) / 1e6;
+  TEST_ASSERT_EQ(damaged, 0);
+  pthread_mutex_unlock(&lock);
+  TEST_ASSERT(whole > 0);
+
+  char measure[64];
+  snprintf(measure, sizeof(measure), "%s_delivered", name);
+  test_measure(measure, "fraction", (double)whole / MESSAGES);
+  snprintf(measure, sizeof(measure), "%s_goodput", name);
+  test_measure(measure, "bytes/s", whole * len / seconds);
+  snprintf(measure, sizeof(measure), "%s_peak_slots", name);
+  test_measure(measure, "bytes",
+               device_stats.send_pool_high_water * slot_size());
+  snprintf(measure, sizeof(measure), "%s_peak_reassembly", name);
+  test_measure(measure, "bytes",
+               gateway_stats.reassembly_high_water * reassembly_size());
+  TEST_ASSERT(gateway_stats.reassembly_high_water >= 1);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  return (double)whole / MESSAGES;
+}
+
+static void test_messages_under_loss(void) {
+  static const size_t sizes[] = {1024, 4096};
+  for (int i = 0; i < 2; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "fragment_%uB", (unsigned)sizes[i]);
+    double plain = transfer("device_large", "gateway_large", sizes[i], name);
+    snprintf(name, sizeof(name), "fragment_%uB_reliable", (unsigned)sizes[i]);
+    double reliable =
+        transfer("device_fragment", "gateway_fragment", sizes[i], name);
+    TEST_ASSERT_EQ(reliable, 1.0);
+    TEST_ASSERT(plain <= reliable);
+  }
+}
+
+static void test_largest_message(void) {
+  sim_node_t *gateway = start_gateway("gateway_large");
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device_large", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+
+  const sim_api_t *api = sim_on(device);
+  pthread_mutex_lock(&lock);
+  expected_len = LARGEST;
+  intact = damaged = 0;
+  pthread_mutex_unlock(&lock);
+  fill(message, LARGEST, 0);
+  uint64_t start = sim_now_us();
+  TEST_ASSERT(api->enc_send_with_result(message));
+  TEST_ASSERT(TEST_WAIT(intact_count() == 1, 2000));
+  test_measure("fragment_7744B", "ms", (sim_now_us() - start) / 1000.0);
+
+  // One byte more does not fit
+  char *longer = malloc(LARGEST + 2);
+  memset(longer, 'x', LARGEST + 1);
+  longer[LARGEST + 1] = '\0';
+  TEST_ASSERT(!api->enc_send_with_result(longer));
+  free(longer);
+
+  pthread_mutex_lock(&lock);
+  TEST_ASSERT_EQ(damaged, 0);
+  pthread_mutex_unlock(&lock);
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_messages_under_loss);
+  TEST_RUN(test_largest_message);
+  return 0;
+}
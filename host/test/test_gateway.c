@@ -0,0 +1,229 @@
+// The gateway role: its node table, the handlers and schemas of device types,
+// the options nodes agree to when pairing and what it keeps in storage across
+// a restart.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 5
+
+#define COMPACT_DEVICES 3
+
+static link_config_t config;
+static link_config_t configs[COMPACT_DEVICES];
+static unsigned handled;
+
+// What the last handler call was given, read once it returned
+static link_node_t last_node;
+static link_node_msg_kind_e last_kind;
+static link_field_t last_schema[LINK_MAX_FIELDS];
+static bool last_has_schema;
+static char last_payload[ESP_NOW_MAX_DATA_LEN + 1];
+
+static void on_message(const link_node_t *node, link_node_msg_kind_e kind,
+                       const link_field_t *schema, const char *payload,
+                       size_t len) {
+  last_node = *node;
+  last_kind = kind;
+  last_has_schema = schema != NULL;
+  if (schema != NULL)
+    memcpy(last_schema, schema, sizeof(last_schema));
+  if (len > ESP_NOW_MAX_DATA_LEN)
+    len = ESP_NOW_MAX_DATA_LEN;
+  memcpy(last_payload, payload, len);
+  last_payload[len] = '\0';
+  __atomic_add_fetch(&handled, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned handled_count(void) {
+  return __atomic_load_n(&handled, __ATOMIC_ACQUIRE);
+}
+
+static bool send_binary_status(sim_node_t *device, unsigned value) {
+  const sim_api_t *api = sim_on(device);
+  link_msg_t *msg = api->link_msg_reserve_binary_status();
+  TEST_ASSERT(msg != NULL);
+  TEST_ASSERT(api->link_msg_encode(msg, 1, value) > 0);
+  return api->link_msg_send(msg);
+}
+
+static void assert_status_schema(void) {
+  TEST_ASSERT(last_has_schema);
+  TEST_ASSERT(strcmp(last_schema[0].key, "on") == 0);
+  TEST_ASSERT_EQ(last_schema[0].type, LINK_FIELD_BOOL);
+  TEST_ASSERT(strcmp(last_schema[1].key, "temp") == 0);
+  TEST_ASSERT_EQ(last_schema[1].type, LINK_FIELD_U16);
+  TEST_ASSERT_EQ(last_schema[2].type, LINK_FIELD_NONE);
+}
+
+static void test_handler_before_start(void) {
+  // Registering comes first, before the gateway has started
+  sim_node_t *gateway = sim_node_create("gateway");
+  TEST_ASSERT(sim_on(gateway)->link_gateway_register_handler(TYPE, on_message));
+  sim_on(gateway)->link_start(true);
+
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  TEST_ASSERT(TEST_WAIT(handled_count() >= 2, 5000));
+
+  // Nodes loaded from storage get the handler registered before the start
+  sim_node_reboot(gateway);
+  const sim_api_t *api = sim_on(gateway);
+  TEST_ASSERT(api->link_gateway_register_handler(TYPE, on_message));
+  api->link_start(false);
+  TEST_ASSERT_EQ(api->link_gateway_get_node_count(), 1);
+
+  unsigned before = handled_count();
+  TEST_ASSERT(sim_on(device)->link_send_status_msg());
+  TEST_ASSERT(TEST_WAIT(handled_count() > before, 1000));
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_schema_reaches_handler(void) {
+  sim_node_t *gateway = sim_node_create("gateway");
+  TEST_ASSERT(sim_on(gateway)->link_gateway_register_handler(TYPE, on_message));
+  sim_on(gateway)->link_start(true);
+
+  // Members of the configuration look like those of the request itself
+  test_device_config(&config, TYPE);
+  strcpy(config.config, "{\"type\":9,\"schema\":1,\"z\":1}");
+  config.status_schema[0] = (link_field_t){"on", LINK_FIELD_BOOL};
+  config.status_schema[1] = (link_field_t){"temp", LINK_FIELD_U16};
+  config.data_schema[0] = (link_field_t){"rate", LINK_FIELD_F32};
+  sim_node_t *device = test_device("device", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+
+  link_node_t node;
+  enc_mac_t mac;
+  sim_node_enc_mac(device, &mac);
+  TEST_ASSERT(sim_on(gateway)->link_gateway_get_node(&mac, &node));
+  TEST_ASSERT_EQ(node.type, TYPE);
+  TEST_ASSERT(strcmp(node.config, config.config) == 0);
+
+  TEST_ASSERT(TEST_WAIT(handled_count() >= 2, 5000));
+  unsigned before = handled_count();
+  TEST_ASSERT(send_binary_status(device, 1));
+  TEST_ASSERT(TEST_WAIT(handled_count() > before, 1000));
+  TEST_ASSERT_EQ(last_kind, LINK_NODE_MSG_BINARY_STATUS);
+  assert_status_schema();
+
+  // Text messages come without a schema
+  before = handled_count();
+  TEST_ASSERT(sim_on(device)->link_send_status_msg());
+  TEST_ASSERT(TEST_WAIT(handled_count() > before, 1000));
+  TEST_ASSERT_EQ(last_kind, LINK_NODE_MSG_STATUS);
+  TEST_ASSERT(!last_has_schema);
+
+  // The schema is kept in storage with the node
+  sim_node_reboot(gateway);
+  const sim_api_t *api = sim_on(gateway);
+  api->link_start(false);
+  TEST_ASSERT(api->link_gateway_register_handler(TYPE, on_message));
+  before = handled_count();
+  TEST_ASSERT(send_binary_status(device, 0));
+  TEST_ASSERT(TEST_WAIT(handled_count() > before, 1000));
+  assert_status_schema();
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+// Sends a status message and checks the handler got it in full
+static void status_arrives(sim_node_t *device) {
+  unsigned before = handled_count();
+  TEST_ASSERT(sim_on(device)->link_send_status_msg());
+  TEST_ASSERT(TEST_WAIT(handled_count() > before, 1000));
+  TEST_ASSERT_EQ(last_kind, LINK_NODE_MSG_STATUS);
+  TEST_ASSERT(strncmp(last_payload, "{\"n\":", 5) == 0);
+}
+
+static int delta_devices(sim_node_t **devices) {
+  int count = 0;
+  for (int i = 0; i < COMPACT_DEVICES; i++) {
+    enc_mac_t gateway;
+    TEST_ASSERT(sim_on(devices[i])->enp_get_gateway_mac(&gateway));
+    count += sim_on(devices[i])->enp_gateway_deltas(&gateway);
+  }
+  return count;
+}
+
+static void test_options_and_delta_pool(void) {
+  sim_node_t *gateway = sim_node_create("gateway_compact");
+  TEST_ASSERT(sim_on(gateway)->link_gateway_register_handler(TYPE, on_message));
+  sim_on(gateway)->link_start(true);
+
+  sim_node_t *devices[COMPACT_DEVICES];
+  for (int i = 0; i < COMPACT_DEVICES; i++) {
+    test_device_config(&configs[i], TYPE);
+    devices[i] = test_device("device_compact", &configs[i]);
+    TEST_ASSERT(test_paired(devices[i], 5000));
+  }
+  sim_sleep_ms(300);
+
+  // Every device compresses, the pool has room for two delta nodes
+  TEST_ASSERT_EQ(delta_devices(devices), 2);
+  for (int i = 0; i < COMPACT_DEVICES; i++) {
+    enc_mac_t mac;
+    TEST_ASSERT(sim_on(devices[i])->enp_get_gateway_mac(&mac));
+    TEST_ASSERT(sim_on(devices[i])->enp_gateway_compresses(&mac));
+    for (int n = 0; n < 5; n++)
+      status_arrives(devices[i]);
+  }
+
+  // The options are kept in storage; the delta bases are not, so the first
+  // delta after the restart is answered with a resync
+  sim_node_reboot(gateway);
+  const sim_api_t *api = sim_on(gateway);
+  TEST_ASSERT(api->link_gateway_register_handler(TYPE, on_message));
+  api->link_start(false);
+  for (int i = 0; i < COMPACT_DEVICES; i++) {
+    enc_mac_t mac;
+    sim_node_enc_mac(devices[i], &mac);
+    TEST_ASSERT(api->eng_node_compresses(&mac));
+    sim_on(devices[i])->link_send_status_msg();
+    sim_sleep_ms(50);
+    for (int n = 0; n < 3; n++)
+      status_arrives(devices[i]);
+  }
+
+  // A removed node frees its delta entry for the next one to pair
+  int removed = -1, waiting = -1;
+  for (int i = 0; i < COMPACT_DEVICES; i++) {
+    enc_mac_t gw;
+    sim_on(devices[i])->enp_get_gateway_mac(&gw);
+    if (sim_on(devices[i])->enp_gateway_deltas(&gw))
+      removed = i;
+    else
+      waiting = i;
+  }
+  enc_mac_t mac;
+  sim_node_enc_mac(devices[removed], &mac);
+  TEST_ASSERT(api->link_gateway_remove_node(&mac));
+  sim_node_stop(devices[removed]);
+
+  sim_node_reboot(devices[waiting]);
+  sim_on(devices[waiting])->link_register(&configs[waiting]);
+  sim_on(devices[waiting])->link_start(true);
+  TEST_ASSERT(test_paired(devices[waiting], 5000));
+  enc_mac_t gw;
+  TEST_ASSERT(sim_on(devices[waiting])->enp_get_gateway_mac(&gw));
+  TEST_ASSERT(sim_on(devices[waiting])->enp_gateway_deltas(&gw));
+  sim_sleep_ms(300);
+  for (int n = 0; n < 3; n++)
+    status_arrives(devices[waiting]);
+
+  for (int i = 0; i < COMPACT_DEVICES; i++)
+    sim_node_stop(devices[i]);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_handler_before_start);
+  TEST_RUN(test_schema_reaches_handler);
+  TEST_RUN(test_options_and_delta_pool);
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Reading the gateway MAC while the pair task switches gateways: readers
+// never block and never see a MAC that is half one gateway and half the
+// other. The cost of a read is measured with and without a writer.
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+
+#define TYPE 15
+#define READERS 4
+#define IDLE_MS 300
+#define SWITCHING_MS 1500
+
+static link_config_t config;
+static sim_node_t *device;
+static sim_node_t *stations[2];
+
+static bool stop;
+static unsigned torn;
+static unsigned unpaired;
+
+typedef struct {
+  uint64_t reads;
+  uint64_t cpu_ns;
+} reader_t;
+
+static void answer(sim_node_t *station, const sim_frame_t *frame, void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+}
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int gateway_index(const enc_mac_t *mac) {
+  for (int i = 0; i < 2; i++) {
+    if (memcmp(mac->bytes, sim_node_mac(stations[i]), 6) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void *reader(void *arg) {
+  reader_t *r = arg;
+  const sim_api_t *api = sim_on(device);
+  uint64_t start = cpu_ns();
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    enc_mac_t mac;
+    if (!api->enp_get_gateway_mac(&mac))
+      __atomic_add_fetch(&unpaired, 1, __ATOMIC_RELAXED);
+    else if (gateway_index(&mac) < 0)
+      __atomic_add_fetch(&torn, 1, __ATOMIC_RELAXED);
+    r->reads++;
+  }
+  r->cpu_ns = cpu_ns() - start;
+  return NULL;
+}
+
+// Runs the readers for ms and returns the CPU time of a read in ns
+static double read_ns(unsigned ms, unsigned *switches) {
+  pthread_t threads[READERS];
+  reader_t readers[READERS] = {0};
+  stop = false;
+  for (int i = 0; i < READERS; i++)
+    pthread_create(&threads[i], NULL, reader, &readers[i]);
+
+  // Failed sends to the current gateway make the pair task switch to the
+  // other one
+  const sim_api_t *api = sim_on(device);
+  uint64_t until = sim_now_us() + (uint64_t)ms * 1000;
+  while (sim_now_us() < until) {
+    if (switches == NULL) {
+      sim_sleep_ms(10);
+      continue;
+    }
+    enc_mac_t before, after;
+    TEST_ASSERT(api->enp_get_gateway_mac(&before));
+    for (int i = 0; i < LINK_GATEWAY_FAILOVER_AFTER_FAILURES; i++)
+      api->enp_report_send_result(&before, false);
+    if (TEST_WAIT(api->enp_get_gateway_mac(&after) &&
+                      memcmp(after.bytes, before.bytes, 6) != 0,
+                  500))
+      (*switches)++;
+  }
+
+  __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+  uint64_t reads = 0, ns = 0;
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(threads[i], NULL);
+    reads += readers[i].reads;
+    ns += readers[i].cpu_ns;
+  }
+  TEST_ASSERT(reads > 0);
+  return (double)ns / reads;
+}
+
+static void test_reads_during_switches(void) {
+  test_device_config(&config, TYPE);
+  device = sim_node_create("device");
+  for (int i = 0; i < 2; i++)
+    stations[i] = sim_station_create("gateway", 1, answer, NULL);
+
+  const sim_api_t *api = sim_on(device);
+  api->link_register(&config);
+  api->link_start(true);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  double idle = read_ns(IDLE_MS, NULL);
+  unsigned switches = 0;
+  double switching = read_ns(SWITCHING_MS, &switches);
+  test_measure("gateway_mac_read_idle", "ns", idle);
+  test_measure("gateway_mac_read_switching", "ns", switching);
+  test_measure("gateway_switches", "switches", switches);
+
+  TEST_ASSERT(switches >= 10);
+  TEST_ASSERT_EQ(torn, 0);
+  TEST_ASSERT_EQ(unpaired, 0);
+
+  sim_node_stop(device);
+  for (int i = 0; i < 2; i++)
+    sim_node_stop(stations[i]);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_reads_during_switches);
+  return 0;
+}
@@ -0,0 +1,228 @@
+// The command matcher: wildcards and typed placeholders capture their values,
+// the first command of the table that matches the whole message wins and its
+// handler runs with the captures. Matching cost is measured for tables of up
+// to CONFIG_LINK_MAX_COMMANDS commands, which this test is built with.
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+
+#define TYPE 14
+#define MATCHES 20000
+
+static link_config_t config;
+
+static uint64_t cpu_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool arg_is(const link_arg_t *arg, const char *str) {
+  return arg->len == strlen(str) && strncmp(arg->str, str, arg->len) == 0;
+}
+
+static void test_captures(void) {
+  sim_node_t *device = sim_node_create("device_commands");
+  const sim_api_t *api = sim_on(device);
+
+  memset(&config, 0, sizeof(config));
+  strcpy(config.commands[0], "RGB=%u,%u,%u");
+  strcpy(config.commands[1], "OFFSET=%d");
+  strcpy(config.commands[2], "GAIN=%f");
+  strcpy(config.commands[3], "*/*/set");
+  strcpy(config.commands[4], "KV=*=*");
+  strcpy(config.commands[5], "LED_ON");
+  strcpy(config.commands[6], "LED_ON_ALL");
+  strcpy(config.commands[7], "SET=%u");
+  strcpy(config.commands[8], "*=RESET");
+  strcpy(config.commands[9], "RATE=100%%");
+  api->link_command_compile(&config);
+
+  link_arg_t args[LINK_MAX_COMMAND_ARGS];
+  int argc = -1;
+  TEST_ASSERT_EQ(api->link_command_match("RGB=1,22,333", args, &argc), 0);
+  TEST_ASSERT_EQ(argc, 3);
+  TEST_ASSERT_EQ(args[0].u, 1);
+  TEST_ASSERT_EQ(args[1].u, 22);
+  TEST_ASSERT_EQ(args[2].u, 333);
+  TEST_ASSERT(arg_is(&args[2], "333"));
+
+  TEST_ASSERT_EQ(api->link_command_match("OFFSET=-15", args, &argc), 1);
+  TEST_ASSERT_EQ(args[0].i, -15);
+  TEST_ASSERT_EQ(api->link_command_match("GAIN=0.25", args, &argc), 2);
+  TEST_ASSERT(args[0].f == 0.25f);
+
+  // Every wildcard captures up to the next literal, the last one takes the
+  // rest of the message
+  TEST_ASSERT_EQ(api->link_command_match("hall/lamp/set", args, &argc), 3);
+  TEST_ASSERT_EQ(argc, 2);
+  TEST_ASSERT(arg_is(&args[0], "hall"));
+  TEST_ASSERT(arg_is(&args[1], "lamp"));
+  TEST_ASSERT_EQ(api->link_command_match("KV=a=b=c", args, &argc), 4);
+  TEST_ASSERT(arg_is(&args[0], "a"));
+  TEST_ASSERT(arg_is(&args[1], "b=c"));
+
+  // The whole message has to match, not only a prefix
+  TEST_ASSERT_EQ(api->link_command_match("LED_ON", args, &argc), 5);
+  TEST_ASSERT_EQ(argc, 0);
+  TEST_ASSERT_EQ(api->link_command_match("LED_ON_ALL", args, &argc), 6);
+
+  // A value that is not a number falls through to a later command
+  TEST_ASSERT_EQ(api->link_command_match("SET=7", args, &argc), 7);
+  TEST_ASSERT_EQ(api->link_command_match("SET=RESET", args, &argc), 8);
+  TEST_ASSERT(arg_is(&args[0], "SET"));
+  TEST_ASSERT_EQ(api->link_command_match("RATE=100%", args, &argc), 9);
+
+  static const char *const misses[] = {"SET=", "SET=x", "SET=7x", "RGB=1,2",
+                                       "LED",  "led_on", "GAIN=", ""};
+  for (size_t i = 0; i < sizeof(misses) / sizeof(misses[0]); i++)
+    TEST_ASSERT_EQ(api->link_command_match(misses[i], args, &argc), -1);
+
+  sim_node_stop(device);
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int handled_by = -1;
+static char handled_cmd[LINK_COMMAND_MAX_SIZE];
+static long handled_args[2];
+static int handled_argc;
+
+static void record(int handler, const char *cmd, const link_arg_t *args,
+                   int argc) {
+  pthread_mutex_lock(&lock);
+  handled_by = handler;
+  snprintf(handled_cmd, sizeof(handled_cmd), "%s", cmd);
+  for (int i = 0; i < argc && i < 2; i++)
+    handled_args[i] = args[i].i;
+  handled_argc = argc;
+  pthread_mutex_unlock(&lock);
+}
+
+static void on_rgb(const char *cmd, const link_arg_t *args, int argc) {
+  record(0, cmd, args, argc);
+}
+
+static void on_offset(const char *cmd, const link_arg_t *args, int argc) {
+  record(1, cmd, args, argc);
+}
+
+static void on_other(const char *cmd) { record(2, cmd, NULL, 0); }
+
+static int handled(void) {
+  pthread_mutex_lock(&lock);
+  int handler = handled_by;
+  pthread_mutex_unlock(&lock);
+  return handler;
+}
+
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+}
+
+static void command(sim_node_t *gateway, sim_node_t *device, const char *cmd,
+                    int handler) {
+  pthread_mutex_lock(&lock);
+  handled_by = -1;
+  pthread_mutex_unlock(&lock);
+  sim_station_send(gateway, sim_node_mac(device), cmd, strlen(cmd));
+  TEST_ASSERT(TEST_WAIT(handled() == handler, 1000));
+  pthread_mutex_lock(&lock);
+  TEST_ASSERT(strcmp(handled_cmd, cmd) == 0);
+  pthread_mutex_unlock(&lock);
+}
+
+static void test_handlers(void) {
+  memset(&config, 0, sizeof(config));
+  config.type = TYPE;
+  strcpy(config.config, "{}");
+  strcpy(config.commands[0], "RGB=%u,%u,%u");
+  strcpy(config.commands[1], "OFFSET=%d");
+  strcpy(config.commands[2], "MODE=*");
+  config.command_handlers[0] = on_rgb;
+  config.command_handlers[1] = on_offset;
+  config.user_command_parser_cb = on_other;
+
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  sim_node_t *device = test_device("device_commands", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+
+  command(gateway, device, "RGB=10,20,30", 0);
+  TEST_ASSERT_EQ(handled_argc, 3);
+  TEST_ASSERT_EQ(handled_args[1], 20);
+  command(gateway, device, "OFFSET=-3", 1);
+  TEST_ASSERT_EQ(handled_argc, 1);
+  TEST_ASSERT_EQ(handled_args[0], -3);
+
+  // Commands without a handler of their own go to the parser callback
+  command(gateway, device, "MODE=eco", 2);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+// Fills the first n commands of the table. With spread first characters the
+// commands are spread over the index, otherwise they all share one chain.
+static void table(const sim_api_t *api, int n, bool spread) {
+  memset(&config, 0, sizeof(config));
+  for (int i = 0; i < n; i++) {
+    if (spread)
+      snprintf(config.commands[i], LINK_COMMAND_MAX_SIZE, "%c%03d_SET=%%u",
+               'A' + i % 26, i);
+    else
+      snprintf(config.commands[i], LINK_COMMAND_MAX_SIZE, "C%03d_SET=%%u", i);
+  }
+  api->link_command_compile(&config);
+}
+
+// Matching cost of the last command of the table, in ns
+static double match_ns(const sim_api_t *api, int n) {
+  char cmd[LINK_COMMAND_MAX_SIZE];
+  snprintf(cmd, sizeof(cmd), "%.*s42",
+           (int)strlen(config.commands[n - 1]) - 2, config.commands[n - 1]);
+
+  link_arg_t args[LINK_MAX_COMMAND_ARGS];
+  int argc;
+  TEST_ASSERT_EQ(api->link_command_match(cmd, args, &argc), n - 1);
+  TEST_ASSERT_EQ(args[0].u, 42);
+
+  uint64_t start = cpu_ns();
+  for (int i = 0; i < MATCHES; i++)
+    api->link_command_match(cmd, args, &argc);
+  return (double)(cpu_ns() - start) / MATCHES;
+}
+
+static void test_matching_cost(void) {
+  sim_node_t *device = sim_node_create("device_commands");
+  const sim_api_t *api = sim_on(device);
+
+  static const int sizes[] = {10, 64, LINK_MAX_COMMANDS};
+  double spread_ns = 0, shared_ns = 0;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char name[48];
+    table(api, sizes[i], true);
+    spread_ns = match_ns(api, sizes[i]);
+    snprintf(name, sizeof(name), "match_%d_commands", sizes[i]);
+    test_measure(name, "ns", spread_ns);
+
+    table(api, sizes[i], false);
+    shared_ns = match_ns(api, sizes[i]);
+    snprintf(name, sizeof(name), "match_%d_commands_one_chain", sizes[i]);
+    test_measure(name, "ns", shared_ns);
+  }
+  // The index skips the commands that start with another character
+  TEST_ASSERT(spread_ns < shared_ns);
+
+  sim_node_stop(device);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_captures);
+  TEST_RUN(test_handlers);
+  TEST_RUN(test_matching_cost);
+  return 0;
+}
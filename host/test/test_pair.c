@@ -0,0 +1,265 @@
+// Pairing with several gateways: the device picks the strongest of those
+// that answered, and answers arriving during or after the choice neither
+// reach a finished pair task nor disturb the results of later sends. When
+// the gateway stops answering, the pair task moves the device to the
+// strongest standby while the messages sent meanwhile are counted.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 4
+#define GATEWAYS 3
+#define CHANNEL 1
+#define STREAM 100
+#define STREAM_PERIOD_MS 20
+
+static link_config_t config;
+static unsigned requests[GATEWAYS];
+
+// Every gateway answers each request twice, the second time like a late or
+// repeated answer
+static void answer(sim_node_t *station, const sim_frame_t *frame, void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) != 0)
+    return;
+  __atomic_add_fetch(&requests[(intptr_t)ctx], 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < 2; i++)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+}
+
+static void test_pair_with_strongest_gateway(void) {
+  sim_node_t *stations[GATEWAYS];
+  test_device_config(&config, TYPE);
+  sim_node_t *device = sim_node_create("device");
+  for (intptr_t i = 0; i < GATEWAYS; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "gw%d", (int)i);
+    stations[i] = sim_station_create(name, CHANNEL, answer, (void *)i);
+    sim_link_set(stations[i], device, 0, i == 1 ? -40 : -70);
+  }
+
+  const sim_api_t *api = sim_on(device);
+  api->link_register(&config);
+  api->link_start(true);
+  TEST_ASSERT(test_paired(device, 5000));
+
+  enc_mac_t gateway;
+  TEST_ASSERT(api->enp_get_gateway_mac(&gateway));
+  TEST_ASSERT(memcmp(gateway.bytes, sim_node_mac(stations[1]), 6) == 0);
+  for (int i = 0; i < GATEWAYS; i++) {
+    enc_mac_t mac;
+    memcpy(mac.bytes, sim_node_mac(stations[i]), 6);
+    TEST_ASSERT(api->enp_is_gateway(&mac));
+  }
+
+  // The pair task is done after its reports; more answers are ignored
+  sim_sleep_ms(300);
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < GATEWAYS; i++)
+      sim_station_send(stations[i], sim_node_mac(device), PAIR_ACCEPT,
+                       strlen(PAIR_ACCEPT));
+    sim_sleep_ms(2);
+  }
+  TEST_ASSERT(api->enp_get_gateway_mac(&gateway));
+  TEST_ASSERT(memcmp(gateway.bytes, sim_node_mac(stations[1]), 6) == 0);
+
+  // Results of synchronous sends belong to their own frames
+  TEST_ASSERT(api->link_send_status_msg());
+  sim_link_set(device, stations[1], 1000, -40);
+  TEST_ASSERT(!api->link_send_status_msg());
+  sim_link_set(device, stations[1], 0, -40);
+  TEST_ASSERT(api->link_send_status_msg());
+
+  sim_node_stop(device);
+  for (int i = 0; i < GATEWAYS; i++)
+    sim_node_stop(stations[i]);
+}
+
+static void crowd(sim_node_t **stations, int count) {
+  for (int i = 0; i < count; i++) {
+    sim_station_send(stations[i], (const uint8_t *)"\xff\xff\xff\xff\xff\xff",
+                     "noise", 5);
+    sim_sleep_ms(1);
+  }
+}
+
+static void test_failover_to_strongest_standby(void) {
+  static const int rssi[GATEWAYS] = {-40, -75, -55};
+  sim_node_t *gateways[GATEWAYS];
+  for (int i = 0; i < GATEWAYS; i++)
+    gateways[i] = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = sim_node_create("device");
+  for (int i = 0; i < GATEWAYS; i++)
+    sim_link_set(gateways[i], device, 0, rssi[i]);
+
+  const sim_api_t *api = sim_on(device);
+  api->link_register(&config);
+  api->link_start(true);
+  TEST_ASSERT(test_paired(device, 5000));
+  enc_mac_t gateway;
+  TEST_ASSERT(api->enp_get_gateway_mac(&gateway));
+  TEST_ASSERT(memcmp(gateway.bytes, sim_node_mac(gateways[0]), 6) == 0);
+
+  // Frames of other senders push the gateways out of the peer statistics
+  sim_node_t *noise[8];
+  for (int i = 0; i < 8; i++)
+    noise[i] = sim_station_create("noise", CHANNEL, NULL, NULL);
+  crowd(noise, 8);
+
+  sim_sleep_ms(300);
+  unsigned commits = sim_node_nvs_commits(device, "pair_task");
+
+  // A steady stream of status messages goes on across the outage
+  unsigned status = test_received(LINK_NODE_MSG_STATUS);
+  unsigned acked = 0;
+  uint64_t start = 0;
+  double failover = 0;
+  for (int i = 0; i < STREAM; i++) {
+    if (i == STREAM / 4) {
+      sim_node_stop(gateways[0]);
+      start = sim_now_us();
+    }
+    acked += api->link_send_status_msg();
+    api->enp_get_gateway_mac(&gateway);
+    if (start != 0 && failover == 0 &&
+        memcmp(gateway.bytes, sim_node_mac(gateways[0]), 6) != 0)
+      failover = (sim_now_us() - start) / 1000.0;
+    sim_sleep_ms(STREAM_PERIOD_MS);
+  }
+  unsigned delivered = test_received(LINK_NODE_MSG_STATUS) - status;
+  test_measure("failover", "ms", failover);
+  test_measure("failover_stream_sent", "messages", STREAM);
+  test_measure("failover_stream_delivered", "messages", delivered);
+  TEST_ASSERT(failover > 0);
+  TEST_ASSERT_EQ(delivered, acked);
+  TEST_ASSERT(STREAM - delivered <= LINK_GATEWAY_FAILOVER_AFTER_FAILURES + 1);
+
+  TEST_ASSERT(memcmp(gateway.bytes, sim_node_mac(gateways[2]), 6) == 0);
+  TEST_ASSERT_EQ(sim_node_channel(device), sim_node_channel(gateways[2]));
+  TEST_ASSERT(sim_node_nvs_commits(device, "pair_task") > commits);
+  TEST_ASSERT_EQ(sim_node_nvs_commits(device, "enc_send_task"), 0);
+
+  status = test_received(LINK_NODE_MSG_STATUS);
+  TEST_ASSERT(api->link_send_status_msg());
+  TEST_ASSERT(test_received(LINK_NODE_MSG_STATUS) > status);
+
+  sim_node_stop(device);
+  for (int i = 0; i < GATEWAYS; i++)
+    sim_node_stop(gateways[i]);
+  for (int i = 0; i < 8; i++)
+    sim_node_stop(noise[i]);
+}
+
+static bool repairing(const sim_api_t *api, sim_node_t *gateway) {
+  enc_mac_t mac;
+  return !api->enp_get_gateway_mac(&mac) ||
+         memcmp(mac.bytes, sim_node_mac(gateway), 6) != 0;
+}
+
+// Sends until the sniffer hears the device ask for a gateway again. Results
+// of sends to a gateway the device just failed over from do not count, so
+// the number of sends varies.
+static void fail_until_repairing(sim_node_t *device, sim_node_t *sniffer) {
+  sim_frame_t frame;
+  while (sim_station_recv(sniffer, &frame, 0))
+    ;
+  for (int i = 0; i < 3 * LINK_REPAIR_AFTER_FAILURES; i++) {
+    TEST_ASSERT(!sim_on(device)->link_send_status_msg());
+    while (sim_station_recv(sniffer, &frame, 0)) {
+      if (memcmp(frame.src, sim_node_mac(device), 6) == 0 &&
+          strncmp((const char *)frame.data, "SHPR:{", 6) == 0)
+        return;
+    }
+  }
+  TEST_ASSERT(!"the device does not pair again");
+}
+
+static void test_repair_on_gateway_channel(void) {
+  sim_node_t *old = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_node_t *sniffer = sim_station_create("sniffer", CHANNEL, NULL, NULL);
+  sim_sleep_ms(300);
+
+  // The gateway is replaced by one with another MAC a while later. The
+  // device keeps its channel and its pairing until the new one answers.
+  sim_node_stop(old);
+  fail_until_repairing(device, sniffer);
+  uint64_t start = sim_now_us();
+  sim_node_t *replacement = NULL;
+  while (repairing(api, replacement ? replacement : old) ||
+         replacement == NULL) {
+    if (replacement == NULL && sim_now_us() - start > 300000)
+      replacement = test_gateway("gateway", TYPE);
+    TEST_ASSERT(test_paired(device, 0));
+    TEST_ASSERT_EQ(sim_node_channel(device), CHANNEL);
+    TEST_ASSERT(sim_now_us() - start < 5000000);
+    sim_sleep_ms(1);
+  }
+  test_measure("repair_same_channel", "ms", (sim_now_us() - start) / 1000.0);
+
+  // Without any gateway on its channel the device gives up the pairing and
+  // searches the others
+  sim_node_t *far = sim_station_create("far", 6, answer, (void *)0);
+  sim_node_stop(replacement);
+  fail_until_repairing(device, sniffer);
+  start = sim_now_us();
+  TEST_ASSERT(TEST_WAIT(!test_paired(device, 0), 5000));
+  uint64_t unpaired = sim_now_us() - start;
+  TEST_ASSERT(unpaired >= (uint64_t)(200 + 400 + 800) * 1000);
+  TEST_ASSERT(!api->link_send_status_msg());
+  TEST_ASSERT(test_paired(device, 5000));
+  enc_mac_t mac;
+  TEST_ASSERT(api->enp_get_gateway_mac(&mac));
+  TEST_ASSERT(memcmp(mac.bytes, sim_node_mac(far), 6) == 0);
+  TEST_ASSERT_EQ(sim_node_channel(device), 6);
+  test_measure("repair_other_channel", "ms", (sim_now_us() - start) / 1000.0);
+
+  sim_node_stop(device);
+  sim_node_stop(far);
+  sim_node_stop(sniffer);
+}
+
+// Gateway whose answers take delay_ms, polled from the test thread
+static double time_to_paired(uint32_t delay_ms) {
+  sim_node_t *gateway = sim_station_create("slow", CHANNEL, NULL, NULL);
+  test_device_config(&config, TYPE);
+  uint64_t start = sim_now_us();
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+
+  sim_frame_t frame;
+  while (!test_paired(device, 0)) {
+    TEST_ASSERT(sim_now_us() - start < 20000000);
+    if (!sim_station_recv(gateway, &frame, 1) ||
+        strncmp((const char *)frame.data, "SHPR:{", 6) != 0)
+      continue;
+    sim_sleep_ms(delay_ms);
+    sim_station_send(gateway, frame.src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  }
+  double ms = (sim_now_us() - start) / 1000.0;
+  TEST_ASSERT(api->link_send_status_msg());
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  return ms;
+}
+
+static void test_time_to_paired(void) {
+  static const uint32_t delays[] = {0, 50, 150, 300};
+  for (size_t i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "time_to_paired_%ums", delays[i]);
+    test_measure(name, "ms", time_to_paired(delays[i]));
+  }
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_pair_with_strongest_gateway);
+  TEST_RUN(test_failover_to_strongest_standby);
+  TEST_RUN(test_repair_on_gateway_channel);
+  TEST_RUN(test_time_to_paired);
+  return 0;
+}
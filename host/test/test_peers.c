@@ -0,0 +1,91 @@
+// The peer cache: the gateway is registered with ESP-NOW once and stays,
+// other destinations take the place of the least recently used one.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 9
+#define MESSAGES 50
+#define STATIONS 5
+
+static link_config_t config;
+
+static void test_gateway_registered_once(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(500);
+
+  sim_counters_t before, after;
+  link_stats_t stats_before, stats_after;
+  sim_node_counters(device, &before);
+  api->link_get_stats(&stats_before);
+  for (int i = 0; i < MESSAGES; i++)
+    TEST_ASSERT(api->link_send_status_msg());
+  sim_node_counters(device, &after);
+  api->link_get_stats(&stats_after);
+
+  unsigned ops = after.peer_adds - before.peer_adds + after.peer_dels -
+                 before.peer_dels;
+  test_measure("peer_ops_per_message", "ops", (double)ops / MESSAGES);
+  TEST_ASSERT_EQ(ops, 0);
+  TEST_ASSERT_EQ(stats_after.peer_cache_hits - stats_before.peer_cache_hits,
+                 MESSAGES);
+  TEST_ASSERT_EQ(stats_after.peer_cache_misses, stats_before.peer_cache_misses);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void send_to(sim_node_t *device, sim_node_t *station) {
+  enc_mac_t mac;
+  memcpy(mac.bytes, sim_node_mac(station), 6);
+  TEST_ASSERT(sim_on(device)->enc_send_to_with_result(&mac, "ping"));
+  TEST_ASSERT(sim_node_peer_count(device) <= ENC_PEER_CACHE_SIZE);
+}
+
+static void test_least_recently_used_evicted(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(500);
+
+  sim_node_t *stations[STATIONS];
+  for (int i = 0; i < STATIONS; i++)
+    stations[i] = sim_station_create("station", 1, NULL, NULL);
+
+  // The broadcast address of the pairing request and the gateway are in the
+  // cache. Two stations fill it, then the oldest entries make room: the
+  // broadcast address, the gateway, the second and the third station.
+  sim_counters_t before, after;
+  link_stats_t stats_before, stats_after;
+  sim_node_counters(device, &before);
+  api->link_get_stats(&stats_before);
+  static const int order[] = {0, 1, 2, 0, 3, 4, 0, 1};
+  for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+    send_to(device, stations[order[i]]);
+  sim_node_counters(device, &after);
+  api->link_get_stats(&stats_after);
+
+  TEST_ASSERT_EQ(stats_after.peer_cache_hits - stats_before.peer_cache_hits, 2);
+  TEST_ASSERT_EQ(stats_after.peer_cache_misses - stats_before.peer_cache_misses,
+                 6);
+  TEST_ASSERT_EQ(after.peer_adds - before.peer_adds, 6);
+  TEST_ASSERT_EQ(after.peer_dels - before.peer_dels, 4);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  for (int i = 0; i < STATIONS; i++)
+    sim_node_stop(stations[i]);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_gateway_registered_once);
+  TEST_RUN(test_least_recently_used_evicted);
+  return 0;
+}
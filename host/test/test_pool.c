@@ -0,0 +1,129 @@
+// Running out of buffers: frames that arrive while every receive buffer is
+// taken are dropped and counted, a producer finds no send slot and gets
+// ENC_ERR_QUEUE_FULL, and both pools are whole again once released.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 22
+#define FLOOD 10
+
+static link_config_t config;
+
+static bool hold;
+static bool holding;
+static unsigned pings;
+
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+}
+
+// Runs on the receive task and keeps its buffer until released
+static void on_hold(const char *cmd, const link_arg_t *args, int argc) {
+  __atomic_store_n(&holding, true, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&hold, __ATOMIC_ACQUIRE))
+    sim_sleep_ms(1);
+}
+
+static void on_ping(const char *cmd, const link_arg_t *args, int argc) {
+  __atomic_add_fetch(&pings, 1, __ATOMIC_RELAXED);
+}
+
+static void test_receive_pool_exhausted(void) {
+  memset(&config, 0, sizeof(config));
+  config.type = TYPE;
+  strcpy(config.config, "{}");
+  strcpy(config.commands[0], "HOLD");
+  strcpy(config.commands[1], "PING");
+  config.command_handlers[0] = on_hold;
+  config.command_handlers[1] = on_ping;
+
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  sim_node_t *device = test_device("device_inline", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  __atomic_store_n(&hold, true, __ATOMIC_RELAXED);
+  sim_station_send(gateway, sim_node_mac(device), "HOLD", 4);
+  TEST_ASSERT(TEST_WAIT(__atomic_load_n(&holding, __ATOMIC_ACQUIRE), 1000));
+
+  // One buffer is held, the rest fill up and every later frame is dropped
+  link_stats_t before, after;
+  api->link_get_stats(&before);
+  for (int i = 0; i < FLOOD; i++)
+    sim_station_send(gateway, sim_node_mac(device), "PING", 4);
+  sim_sleep_ms(100);
+  api->link_get_stats(&after);
+  unsigned dropped =
+      after.receive_pool_exhausted - before.receive_pool_exhausted;
+  test_measure("receive_pool_exhausted", "frames", dropped);
+  TEST_ASSERT_EQ(dropped, FLOOD - (ENC_RECEIVE_POOL_SIZE - 1));
+  TEST_ASSERT_EQ(after.receive_queue_full, before.receive_queue_full);
+
+  // The queued frames are handled and their buffers come back
+  __atomic_store_n(&hold, false, __ATOMIC_RELEASE);
+  TEST_ASSERT(TEST_WAIT(__atomic_load_n(&pings, __ATOMIC_RELAXED) ==
+                            ENC_RECEIVE_POOL_SIZE - 1,
+                        1000));
+  for (int i = 0; i < ENC_RECEIVE_POOL_SIZE; i++) {
+    sim_station_send(gateway, sim_node_mac(device), "PING", 4);
+    sim_sleep_ms(5);
+  }
+  TEST_ASSERT(TEST_WAIT(__atomic_load_n(&pings, __ATOMIC_RELAXED) ==
+                            2 * ENC_RECEIVE_POOL_SIZE - 1,
+                        1000));
+  api->link_get_stats(&before);
+  TEST_ASSERT_EQ(before.receive_pool_exhausted, after.receive_pool_exhausted);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_send_pool_exhausted(void) {
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  enc_send_t *slots[ENC_SEND_POOL_SIZE];
+  for (int i = 0; i < ENC_SEND_POOL_SIZE; i++) {
+    slots[i] = api->enc_slot_reserve(ENC_MSG_DATA, 0);
+    TEST_ASSERT(slots[i] != NULL);
+  }
+
+  link_stats_t before, after;
+  api->link_get_stats(&before);
+  TEST_ASSERT(api->enc_slot_reserve(ENC_MSG_DATA, 0) == NULL);
+  TEST_ASSERT_EQ(api->enc_try_send_async("{}", 2, ENC_MSG_DATA, 0, NULL, NULL),
+                 ENC_ERR_QUEUE_FULL);
+  uint64_t start = sim_now_us();
+  TEST_ASSERT_EQ(api->enc_try_send_async("{}", 2, ENC_MSG_CONTROL,
+                                         pdMS_TO_TICKS(50), NULL, NULL),
+                 ENC_ERR_QUEUE_FULL);
+  TEST_ASSERT(sim_now_us() - start >= 50000);
+  api->link_get_stats(&after);
+  TEST_ASSERT_EQ(after.send_pool_exhausted - before.send_pool_exhausted, 3);
+  TEST_ASSERT_EQ(after.send_pool_high_water, ENC_SEND_POOL_SIZE);
+
+  for (int i = 0; i < ENC_SEND_POOL_SIZE; i++)
+    api->enc_slot_release(slots[i]);
+  TEST_ASSERT_EQ(api->enc_try_send_async("{}", 2, ENC_MSG_DATA, 0, NULL, NULL),
+                 ESP_OK);
+  api->link_get_stats(&before);
+  TEST_ASSERT_EQ(before.send_pool_exhausted, after.send_pool_exhausted);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_receive_pool_exhausted);
+  TEST_RUN(test_send_pool_exhausted);
+  return 0;
+}
@@ -0,0 +1,159 @@
+// Priority classes of the send queues: a status answer to a command overtakes
+// a flood of data messages, and data messages still go out while control
+// frames keep their queue full.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 17
+#define ROUND_TRIPS 10
+#define FLOOD_LEN 200
+
+static link_config_t config;
+
+static bool stop;
+static enc_msg_kind_e answer_kind;
+static uint64_t answered_at;
+
+// Scripted gateway that accepts the pairing and notes when the answer to
+// "PING" arrived
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  else if (frame->len == 4 && memcmp(frame->data, "PONG", 4) == 0)
+    __atomic_store_n(&answered_at, sim_now_us(), __ATOMIC_RELEASE);
+}
+
+static void on_ping(const char *cmd, const link_arg_t *args, int argc) {
+  sim_on(sim_current())
+      ->enc_try_send_async("PONG", 4, answer_kind, portMAX_DELAY, NULL, NULL);
+}
+
+static void *flood(void *arg) {
+  const sim_api_t *api = sim_on(arg);
+  char payload[FLOOD_LEN];
+  memset(payload, 'd', sizeof(payload));
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    api->enc_try_send_async(payload, sizeof(payload), ENC_MSG_DATA,
+                            pdMS_TO_TICKS(10), NULL, NULL);
+  return NULL;
+}
+
+// Average time from sending "PING" to the gateway hearing "PONG", in ms
+static double round_trip_ms(sim_node_t *gateway, sim_node_t *device,
+                            enc_msg_kind_e kind) {
+  answer_kind = kind;
+  double total = 0;
+  for (int i = 0; i < ROUND_TRIPS; i++) {
+    __atomic_store_n(&answered_at, 0, __ATOMIC_RELAXED);
+    uint64_t start = sim_now_us();
+    sim_station_send(gateway, sim_node_mac(device), "PING", 4);
+    TEST_ASSERT(
+        TEST_WAIT(__atomic_load_n(&answered_at, __ATOMIC_ACQUIRE) != 0, 2000));
+    total += answered_at - start;
+    sim_sleep_ms(20);
+  }
+  return total / ROUND_TRIPS / 1000.0;
+}
+
+static void test_round_trip_under_flood(void) {
+  memset(&config, 0, sizeof(config));
+  config.type = TYPE;
+  strcpy(config.config, "{}");
+  strcpy(config.commands[0], "PING");
+  config.command_handlers[0] = on_ping;
+
+  // Data messages are not coalesced here, so the flood keeps its queue full
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  sim_node_t *device = test_device("device_fifo", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  double idle = round_trip_ms(gateway, device, ENC_MSG_STATUS);
+  stop = false;
+  pthread_t thread;
+  pthread_create(&thread, NULL, flood, device);
+  sim_sleep_ms(100);
+  double status = round_trip_ms(gateway, device, ENC_MSG_STATUS);
+  double data = round_trip_ms(gateway, device, ENC_MSG_DATA);
+  __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+  pthread_join(thread, NULL);
+
+  test_measure("round_trip_idle", "ms", idle);
+  test_measure("round_trip_flood_status", "ms", status);
+  test_measure("round_trip_flood_data", "ms", data);
+  TEST_ASSERT(status * 2 < data);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static unsigned control_sent;
+static unsigned data_passed_over;
+static bool data_sent;
+
+static void on_control(esp_now_send_status_t status, void *ctx) {
+  __atomic_add_fetch(&control_sent, 1, __ATOMIC_RELAXED);
+}
+
+static void on_data(esp_now_send_status_t status, void *ctx) {
+  data_passed_over = __atomic_load_n(&control_sent, __ATOMIC_RELAXED) -
+                     (unsigned)(uintptr_t)ctx;
+  __atomic_store_n(&data_sent, true, __ATOMIC_RELEASE);
+}
+
+static void *control_flood(void *arg) {
+  const sim_api_t *api = sim_on(arg);
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    api->enc_try_send_async("{}", 2, ENC_MSG_CONTROL, pdMS_TO_TICKS(10),
+                            on_control, NULL);
+  return NULL;
+}
+
+static void test_data_not_starved(void) {
+  // Results come late enough for the producer to keep the queue full
+  sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+  medium.latency_us = 5000;
+  sim_medium_set(&medium);
+  sim_node_t *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device_fifo", &config);
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+
+  stop = false;
+  pthread_t thread;
+  pthread_create(&thread, NULL, control_flood, device);
+  sim_sleep_ms(100);
+  link_stats_t stats;
+  api->link_get_stats(&stats);
+  TEST_ASSERT(stats.send_queue_full[ENC_MSG_CONTROL] > 0);
+
+  // Control frames sent from here on include the one already in the air
+  uintptr_t start = __atomic_load_n(&control_sent, __ATOMIC_RELAXED);
+  TEST_ASSERT_EQ(api->enc_try_send_async("d", 1, ENC_MSG_DATA, 0, on_data,
+                                         (void *)start),
+                 ESP_OK);
+  TEST_ASSERT(TEST_WAIT(__atomic_load_n(&data_sent, __ATOMIC_ACQUIRE), 2000));
+  __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+  pthread_join(thread, NULL);
+
+  test_measure("data_passed_over", "frames", data_passed_over);
+  TEST_ASSERT(data_passed_over >= ENC_SEND_STARVATION_LIMIT);
+  TEST_ASSERT(data_passed_over <= ENC_SEND_STARVATION_LIMIT + 1);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  medium = (sim_medium_t)SIM_MEDIUM_DEFAULT;
+  sim_medium_set(&medium);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_round_trip_under_flood);
+  TEST_RUN(test_data_not_starved);
+  return 0;
+}
@@ -0,0 +1,264 @@
+// Reliable delivery: frames whose ack never comes are retransmitted with a
+// timeout that doubles up to ENC_RELIABLE_MAX_RTO_MS, and the send task
+// sleeps while its window is full even if such a timeout expired. Receivers
+// drop duplicates of paired peers whatever else they hear, and take only a
+// new boot epoch for a restart. A loss sweep reports the delivered fraction
+// with and without reliable delivery.
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+
+#define TYPE 6
+// The reliable variants retransmit 8 times with a timeout of 30 to 400 ms
+#define RETRIES 8
+#define MIN_RTO_MS 30
+#define MAX_RTO_MS 400
+#define SWEEP_MESSAGES 50
+
+static link_config_t config;
+
+static void test_retransmission_timeout_capped(void) {
+  sim_node_t *gateway = test_gateway("gateway_reliable", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device_reliable", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_DATA) > 0, 5000));
+  const sim_api_t *api = sim_on(device);
+  TEST_ASSERT(api->enc_send_with_result("first"));
+
+  // Frames arrive but their acks are lost
+  sim_link_set(gateway, device, 1000, -50);
+  enc_stats_t before, after;
+  api->enc_get_stats(&before);
+  uint64_t start = sim_now_us();
+  TEST_ASSERT(!api->enc_send_with_result("lost acks"));
+  uint64_t elapsed_ms = (sim_now_us() - start) / 1000;
+  api->enc_get_stats(&after);
+  test_measure("reliable_give_up", "ms", elapsed_ms);
+
+  TEST_ASSERT_EQ(after.retransmissions - before.retransmissions, RETRIES);
+  // The last timeouts are capped; doubling without a cap would take at least
+  // MIN_RTO_MS * (2^9 - 1) ms
+  TEST_ASSERT(elapsed_ms >= 4 * MAX_RTO_MS);
+  TEST_ASSERT(elapsed_ms < (RETRIES + 1) * MAX_RTO_MS + 1000);
+  sim_link_set(gateway, device, 0, -50);
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static unsigned others(void) { return test_received(LINK_NODE_MSG_OTHER); }
+
+// Reliable frame as a node of the given boot epoch sends it
+static void send_reliable(sim_node_t *station, sim_node_t *to, uint8_t epoch,
+                          uint16_t seq, const char *msg) {
+  uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+  frame[0] = 0x1D;
+  frame[1] = epoch;
+  frame[2] = seq & 0xFF;
+  frame[3] = seq >> 8;
+  memcpy(frame + 4, msg, strlen(msg));
+  TEST_ASSERT(sim_station_send(station, sim_node_mac(to), frame,
+                               4 + strlen(msg)));
+}
+
+// Broadcasts from other senders, more than a node keeps signal statistics of
+static void crowd(sim_node_t **stations, int count) {
+  for (int i = 0; i < count; i++) {
+    sim_station_send(stations[i], (const uint8_t *)"\xff\xff\xff\xff\xff\xff",
+                     "noise", 5);
+    sim_sleep_ms(1);
+  }
+}
+
+static void test_duplicates_of_paired_node(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  uint8_t channel = sim_node_channel(gateway);
+  sim_node_t *node = sim_station_create("node", channel, NULL, NULL);
+  sim_node_t *noise[8];
+  for (int i = 0; i < 8; i++)
+    noise[i] = sim_station_create("noise", channel, NULL, NULL);
+
+  const char *request = "SHPR:{\"type\":6,\"cfg\":{}}";
+  sim_station_send(node, (const uint8_t *)"\xff\xff\xff\xff\xff\xff", request,
+                   strlen(request));
+  TEST_ASSERT(TEST_WAIT(sim_on(gateway)->link_gateway_get_node_count() == 1,
+                        1000));
+
+  unsigned base = others();
+  send_reliable(node, gateway, 1, 100, "a");
+  TEST_ASSERT(TEST_WAIT(others() == base + 1, 1000));
+  crowd(noise, 8);
+  send_reliable(node, gateway, 1, 100, "a");
+  for (uint16_t seq = 101; seq <= 140; seq++) {
+    send_reliable(node, gateway, 1, seq, "b");
+    sim_sleep_ms(1);
+  }
+  TEST_ASSERT(TEST_WAIT(others() == base + 41, 1000));
+
+  // Far behind in the same epoch is an old duplicate, not a restart
+  crowd(noise, 8);
+  send_reliable(node, gateway, 1, 120, "b");
+  send_reliable(node, gateway, 1, 100, "a");
+  sim_sleep_ms(50);
+  TEST_ASSERT_EQ(others(), base + 41);
+
+  send_reliable(node, gateway, 2, 0, "c");
+  TEST_ASSERT(TEST_WAIT(others() == base + 42, 1000));
+  send_reliable(node, gateway, 2, 0, "c");
+  sim_sleep_ms(50);
+  TEST_ASSERT_EQ(others(), base + 42);
+
+  // Acks come back for duplicates too, unless the control queue was full
+  sim_frame_t ack;
+  int acks = 0;
+  while (sim_station_recv(node, &ack, 0))
+    acks += ack.data[0] == 0x1C;
+  enc_stats_t stats;
+  sim_on(gateway)->enc_get_stats(&stats);
+  TEST_ASSERT_EQ(acks + stats.acks_dropped, 46);
+  sim_node_stop(gateway);
+}
+
+static void test_lost_acks_deliver_once(void) {
+  sim_node_t *gateway = test_gateway("gateway_reliable", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device_reliable", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_DATA) > 0, 5000));
+  sim_node_t *noise[8];
+  for (int i = 0; i < 8; i++)
+    noise[i] = sim_station_create("noise", sim_node_channel(gateway), NULL,
+                                  NULL);
+
+  // Every frame is retransmitted until its ack gets through, while other
+  // senders keep the gateway busy
+  unsigned base = others();
+  enc_stats_t before, after;
+  sim_on(gateway)->enc_get_stats(&before);
+  sim_link_set(gateway, device, 700, -50);
+  for (int i = 0; i < 20; i++) {
+    sim_on(device)->enc_send_no_result("once");
+    for (int j = 0; j < 5; j++) {
+      crowd(noise, 8);
+      sim_sleep_ms(10);
+    }
+  }
+  sim_link_set(gateway, device, 0, -50);
+  sim_sleep_ms(3 * MAX_RTO_MS);
+  sim_on(gateway)->enc_get_stats(&after);
+  TEST_ASSERT_EQ(others(), base + 20);
+  TEST_ASSERT(after.duplicates > before.duplicates);
+
+  // A rebooted device starts its sequence numbers over in a new epoch
+  sim_node_reboot(device);
+  const sim_api_t *api = sim_on(device);
+  api->link_register(&config);
+  api->link_start(false);
+  TEST_ASSERT(test_paired(device, 1000));
+  TEST_ASSERT(api->enc_send_with_result("after reboot"));
+  TEST_ASSERT(TEST_WAIT(others() == base + 21, 1000));
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static double cpu_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void test_full_window_sleeps(void) {
+  sim_node_t *gateway = test_gateway("gateway_reliable", TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device("device_reliable", &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_DATA) > 0, 5000));
+  const sim_api_t *api = sim_on(device);
+  // a fast round trip leaves the timeout at its minimum
+  TEST_ASSERT(api->enc_send_with_result("fast"));
+
+  // Acks take longer than the timeout, so it expires while every frame of
+  // the window waits for its send result
+  sim_medium_t medium;
+  sim_medium_get(&medium);
+  sim_medium_t slow = medium;
+  slow.latency_us = 150000;
+  sim_medium_set(&slow);
+
+  unsigned before = test_received(LINK_NODE_MSG_OTHER);
+  double cpu = cpu_ms();
+  uint64_t start = sim_now_us();
+  for (int i = 0; i < 8; i++)
+    api->enc_send_no_result("slow");
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_OTHER) >= before + 8,
+                        10000));
+  double wall = (sim_now_us() - start) / 1000.0;
+  cpu = cpu_ms() - cpu;
+  test_measure("full_window_cpu_share", "%", 100 * cpu / wall);
+  TEST_ASSERT(cpu < wall / 20);
+
+  sim_medium_set(&medium);
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+// Sends a steady stream over a lossy medium and returns the fraction of it
+// the gateway handed over
+static double delivered(const char *gateway_variant,
+                        const char *device_variant, int loss_permille) {
+  sim_node_t *gateway = test_gateway(gateway_variant, TYPE);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device(device_variant, &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_DATA) > 0, 5000));
+  sim_sleep_ms(100);
+
+  sim_medium_t medium;
+  sim_medium_get(&medium);
+  sim_medium_t lossy = medium;
+  lossy.loss_permille = loss_permille;
+  sim_medium_set(&lossy);
+
+  unsigned base = others(), sent = 0;
+  for (int i = 0; i < SWEEP_MESSAGES; i++) {
+    // control messages are never replaced by newer ones while queued
+    sent += sim_on(device)->enc_try_send_async("sweep", 5, ENC_MSG_CONTROL,
+                                               portMAX_DELAY, NULL,
+                                               NULL) == ESP_OK;
+    sim_sleep_ms(20);
+  }
+  sim_sleep_ms(RETRIES * MAX_RTO_MS);
+  sim_medium_set(&medium);
+  TEST_ASSERT_EQ(sent, SWEEP_MESSAGES);
+  double fraction = (double)(others() - base) / sent;
+
+  char name[48];
+  snprintf(name, sizeof(name), "%s_delivered_at_%d_permille_loss",
+           device_variant, loss_permille);
+  test_measure(name, "fraction", fraction);
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  return fraction;
+}
+
+static void test_loss_sweep(void) {
+  static const int losses[] = {100, 200, 300};
+  for (int i = 0; i < 3; i++) {
+    double plain = delivered("gateway", "device", losses[i]);
+    double reliable = delivered("gateway_reliable", "device_reliable",
+                                losses[i]);
+    TEST_ASSERT(reliable >= 0.95);
+    TEST_ASSERT(reliable > plain);
+  }
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_retransmission_timeout_capped);
+  TEST_RUN(test_full_window_sleeps);
+  TEST_RUN(test_duplicates_of_paired_node);
+  TEST_RUN(test_lost_acks_deliver_once);
+  TEST_RUN(test_loss_sweep);
+  return 0;
+}
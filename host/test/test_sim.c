@@ -0,0 +1,109 @@
+// The simulation itself: unmodified nodes pair, report and take commands over
+// the simulated medium, and keep their storage across a reboot.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 7
+
+static link_config_t configs[2];
+static unsigned commands[2];
+
+static void on_command_0(const char *cmd) { commands[0]++; }
+static void on_command_1(const char *cmd) { commands[1]++; }
+
+static bool frame_from(sim_node_t *station, const uint8_t *mac,
+                       const char *prefix, uint32_t timeout_ms) {
+  sim_frame_t frame;
+  while (sim_station_recv(station, &frame, timeout_ms)) {
+    if (memcmp(frame.src, mac, 6) == 0 &&
+        strncmp((const char *)frame.data, prefix, strlen(prefix)) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void test_pair_report_and_command(void) {
+  sim_node_t *gateway = test_gateway("gateway", TYPE);
+  sim_node_t *devices[2];
+  for (int i = 0; i < 2; i++) {
+    test_device_config(&configs[i], TYPE);
+    strcpy(configs[i].commands[0], "PING");
+    configs[i].user_command_parser_cb = i == 0 ? on_command_0 : on_command_1;
+    devices[i] = test_device("device", &configs[i]);
+  }
+  for (int i = 0; i < 2; i++)
+    TEST_ASSERT(test_paired(devices[i], 5000));
+
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_STATUS) >= 2, 5000));
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_DATA) >= 2, 5000));
+  TEST_ASSERT_EQ(sim_on(gateway)->link_gateway_get_node_count(), 2);
+
+  // Both devices found the gateway on its channel and registered it as peer
+  for (int i = 0; i < 2; i++) {
+    enc_mac_t gw;
+    TEST_ASSERT(sim_on(devices[i])->enp_get_gateway_mac(&gw));
+    TEST_ASSERT(memcmp(gw.bytes, sim_node_mac(gateway), 6) == 0);
+    TEST_ASSERT_EQ(sim_node_channel(devices[i]), sim_node_channel(gateway));
+  }
+
+  for (int i = 0; i < 2; i++) {
+    enc_mac_t mac;
+    sim_node_enc_mac(devices[i], &mac);
+    TEST_ASSERT(sim_on(gateway)->link_gateway_send_command(&mac, "PING"));
+  }
+  TEST_ASSERT(TEST_WAIT(commands[0] == 1 && commands[1] == 1, 2000));
+
+  // A rebooted device keeps its pairing and reports without asking again
+  sim_node_t *sniffer = sim_station_create("sniffer", sim_node_channel(gateway),
+                                           NULL, NULL);
+  unsigned status = test_received(LINK_NODE_MSG_STATUS);
+  sim_node_reboot(devices[0]);
+  const sim_api_t *api = sim_on(devices[0]);
+  api->link_register(&configs[0]);
+  api->link_start(false);
+  TEST_ASSERT(test_paired(devices[0], 100));
+  TEST_ASSERT(TEST_WAIT(test_received(LINK_NODE_MSG_STATUS) > status, 5000));
+  TEST_ASSERT(!frame_from(sniffer, sim_node_mac(devices[0]), "SHPR", 0));
+
+  // A stopped gateway no longer confirms frames
+  sim_node_stop(gateway);
+  TEST_ASSERT(!sim_on(devices[1])->link_send_status_msg());
+}
+
+static void test_medium_loss_and_airtime(void) {
+  sim_node_t *a = sim_station_create("a", 6, NULL, NULL);
+  sim_node_t *b = sim_station_create("b", 6, NULL, NULL);
+  sim_node_t *c = sim_station_create("c", 7, NULL, NULL);
+  uint8_t frame[200] = {0};
+
+  TEST_ASSERT(sim_station_send(a, sim_node_mac(b), frame, sizeof(frame)));
+  TEST_ASSERT(!sim_station_send(a, sim_node_mac(c), frame, sizeof(frame)));
+  sim_frame_t rx;
+  TEST_ASSERT(sim_station_recv(b, &rx, 100));
+  TEST_ASSERT_EQ(rx.len, sizeof(frame));
+  TEST_ASSERT(!sim_station_recv(c, &rx, 20));
+
+  sim_link_set(a, b, 1000, -80);
+  TEST_ASSERT(!sim_station_send(a, sim_node_mac(b), frame, sizeof(frame)));
+  sim_link_set(a, b, 0, -80);
+
+  // 100 frames of 200 bytes at 1 Mbit/s take about 200 ms of airtime
+  uint64_t start = sim_now_us();
+  for (int i = 0; i < 100; i++)
+    sim_station_send(a, sim_node_mac(b), frame, sizeof(frame));
+  for (int i = 0; i < 100; i++) {
+    TEST_ASSERT(sim_station_recv(b, &rx, 1000));
+    TEST_ASSERT_EQ(rx.rssi, -80);
+  }
+  uint64_t elapsed = sim_now_us() - start;
+  TEST_ASSERT(elapsed > 150000);
+  test_measure("sim_airtime_100x200B", "ms", elapsed / 1000.0);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_medium_loss_and_airtime);
+  TEST_RUN(test_pair_report_and_command);
+  return 0;
+}
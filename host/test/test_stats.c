@@ -0,0 +1,148 @@
+// Runtime statistics: the send, queue and receive counters follow what
+// happened on the medium, the signal of every sender is tracked and the
+// telemetry message carries the same values to the gateway.
+#include <pthread.h>
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 16
+#define SENT 10
+#define FAILED 3
+#define STRANGER_FRAMES 4
+
+static link_config_t config;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char telemetry[ESP_NOW_MAX_DATA_LEN + 1];
+
+// Scripted gateway that accepts the pairing and keeps the last telemetry
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0) {
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+  } else if (strncmp((const char *)frame->data, LINK_TELEMETRY_PREFIX, 3) ==
+             0) {
+    pthread_mutex_lock(&lock);
+    memcpy(telemetry, frame->data, frame->len);
+    telemetry[frame->len] = '\0';
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static bool telemetry_has(const char *key) {
+  pthread_mutex_lock(&lock);
+  bool found = strstr(telemetry, key) != NULL;
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+static sim_node_t *start(const char *variant, sim_node_t **gateway) {
+  *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device(variant, &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(300);
+  return device;
+}
+
+static void test_send_counters(void) {
+  sim_node_t *gateway;
+  sim_node_t *device = start("device", &gateway);
+  const sim_api_t *api = sim_on(device);
+
+  link_stats_t before, after;
+  api->link_get_stats(&before);
+  for (int i = 0; i < SENT; i++)
+    TEST_ASSERT(api->link_send_status_msg());
+  sim_link_set(device, gateway, 1000, -50);
+  for (int i = 0; i < FAILED; i++)
+    TEST_ASSERT(!api->link_send_status_msg());
+  sim_link_set(device, gateway, 0, -50);
+  api->link_get_stats(&after);
+
+  TEST_ASSERT_EQ(after.frames_sent - before.frames_sent, SENT + FAILED);
+  TEST_ASSERT_EQ(after.frames_acked - before.frames_acked, SENT);
+  TEST_ASSERT_EQ(after.frames_failed - before.frames_failed, FAILED);
+
+  // Control frames are queued without waiting while the results are late;
+  // the one that found no room is counted
+  sim_medium_t medium;
+  sim_medium_get(&medium);
+  medium.latency_us = 200000;
+  sim_medium_set(&medium);
+  esp_err_t err = ESP_OK;
+  while (err == ESP_OK)
+    err = api->enc_try_send_async("{}", 2, ENC_MSG_CONTROL, 0, NULL, NULL);
+  TEST_ASSERT_EQ(err, ENC_ERR_QUEUE_FULL);
+  api->link_get_stats(&after);
+  TEST_ASSERT_EQ(after.send_queue_full[ENC_MSG_CONTROL] -
+                     before.send_queue_full[ENC_MSG_CONTROL],
+                 1);
+  TEST_ASSERT_EQ(after.send_queue_high_water[ENC_MSG_CONTROL],
+                 ENC_SEND_QUEUE_SIZE);
+  TEST_ASSERT_EQ(after.send_queue_full[ENC_MSG_STATUS],
+                 before.send_queue_full[ENC_MSG_STATUS]);
+  medium = (sim_medium_t)SIM_MEDIUM_DEFAULT;
+  sim_medium_set(&medium);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+}
+
+static void test_receive_counters(void) {
+  sim_node_t *gateway;
+  sim_node_t *device = start("device_telemetry", &gateway);
+  const sim_api_t *api = sim_on(device);
+  sim_node_t *stranger = sim_station_create("stranger", 1, NULL, NULL);
+
+  link_stats_t before, after;
+  api->link_get_stats(&before);
+  for (int i = 0; i < STRANGER_FRAMES; i++) {
+    sim_station_send(stranger, sim_node_mac(device), "LED=1", 5);
+    sim_sleep_ms(5);
+  }
+
+  // The pairing answer came at -50 dBm
+  static const int8_t rssi[] = {-40, -70, -60};
+  for (size_t i = 0; i < sizeof(rssi) / sizeof(rssi[0]); i++) {
+    sim_link_set(gateway, device, 0, rssi[i]);
+    sim_station_send(gateway, sim_node_mac(device), "noop", 4);
+    sim_sleep_ms(5);
+  }
+  sim_sleep_ms(50);
+  api->link_get_stats(&after);
+  TEST_ASSERT_EQ(after.unknown_sender - before.unknown_sender,
+                 STRANGER_FRAMES);
+
+  link_peer_stats_t peers[ENC_PEER_CACHE_SIZE];
+  int count = api->link_get_peer_stats(peers, ENC_PEER_CACHE_SIZE);
+  link_peer_stats_t *peer = NULL;
+  for (int i = 0; i < count; i++) {
+    if (memcmp(peers[i].mac.bytes, sim_node_mac(gateway), 6) == 0)
+      peer = &peers[i];
+  }
+  TEST_ASSERT(peer != NULL);
+  TEST_ASSERT_EQ(peer->frames, 4);
+  TEST_ASSERT_EQ(peer->rssi_min, -70);
+  TEST_ASSERT_EQ(peer->rssi_max, -40);
+  TEST_ASSERT(peer->rssi_avg > -70 && peer->rssi_avg < -40);
+  test_measure("gateway_rssi_avg", "dBm", peer->rssi_avg);
+
+  char unk[32], signal[48];
+  snprintf(unk, sizeof(unk), "\"unk\":%u,", (unsigned)after.unknown_sender);
+  snprintf(signal, sizeof(signal), "\"rssi\":[%d,%d,%d]}", peer->rssi_min,
+           peer->rssi_avg, peer->rssi_max);
+  TEST_ASSERT(TEST_WAIT(telemetry_has(unk) && telemetry_has(signal), 3000));
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  sim_node_stop(stranger);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_send_counters);
+  TEST_RUN(test_receive_counters);
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+test_inbox_t test_gateway_inbox;
+static pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void test_measure(const char *name, const char *unit, double value) {
+  printf("{\"measure\":\"%s\",\"unit\":\"%s\",\"value\":%.3f}\n", name, unit,
+         value);
+  fflush(stdout);
+}
+
+unsigned test_received(link_node_msg_kind_e kind) {
+  pthread_mutex_lock(&inbox_lock);
+  unsigned count = test_gateway_inbox.count[kind];
+  pthread_mutex_unlock(&inbox_lock);
+  return count;
+}
+
+static void gateway_handler(const link_node_t *node, link_node_msg_kind_e kind,
+                            const link_field_t *schema, const char *payload,
+                            size_t len) {
+  pthread_mutex_lock(&inbox_lock);
+  test_gateway_inbox.count[kind]++;
+  test_gateway_inbox.last_len[kind] = len;
+  if (len > ESP_NOW_MAX_DATA_LEN)
+    len = ESP_NOW_MAX_DATA_LEN;
+  memcpy(test_gateway_inbox.last[kind], payload, len);
+  test_gateway_inbox.last[kind][len] = '\0';
+  test_gateway_inbox.last_mac = node->mac;
+  pthread_mutex_unlock(&inbox_lock);
+}
+
+sim_node_t *test_gateway(const char *variant, int type) {
+  sim_node_t *gateway = sim_node_create(variant);
+  const sim_api_t *api = sim_on(gateway);
+  api->link_start(true);
+  api->link_gateway_register_handler(type, gateway_handler);
+  return gateway;
+}
+
+sim_node_t *test_device(const char *variant, link_config_t *config) {
+  sim_node_t *device = sim_node_create(variant);
+  const sim_api_t *api = sim_on(device);
+  api->link_register(config);
+  api->link_start(true);
+  return device;
+}
+
+static unsigned reports;
+
+static char *status_cb(void) {
+  return sim_on(sim_current())
+      ->link_generate_status_message("{\"n\":%u}",
+                                     __atomic_add_fetch(&reports, 1,
+                                                        __ATOMIC_RELAXED));
+}
+
+static char *data_cb(void) {
+  return sim_on(sim_current())
+      ->link_generate_data_message("{\"d\":%u}",
+                                   __atomic_add_fetch(&reports, 1,
+                                                      __ATOMIC_RELAXED));
+}
+
+void test_device_config(link_config_t *config, int type) {
+  memset(config, 0, sizeof(*config));
+  config->type = type;
+  strcpy(config->config, "{}");
+  config->user_status_msg_cb = status_cb;
+  config->user_data_msg_cb = data_cb;
+}
+
+bool test_paired(sim_node_t *device, uint32_t timeout_ms) {
+  return sim_on(device)->link_wait_for_pair(timeout_ms);
+}
@@ -0,0 +1,112 @@
+// The send window: with several frames in flight the results still reach the
+// messages they belong to, and throughput over a link with latency grows with
+// the window.
+#include <string.h>
+
+#include "test.h"
+
+#define TYPE 10
+#define FRAMES 200
+#define MIXED 40
+
+static link_config_t config;
+
+static void gateway_rx(sim_node_t *station, const sim_frame_t *frame,
+                       void *ctx) {
+  if (strncmp((const char *)frame->data, "SHPR:{", 6) == 0)
+    sim_station_send(station, frame->src, PAIR_ACCEPT, strlen(PAIR_ACCEPT));
+}
+
+static unsigned completed;
+static bool out_of_order;
+static esp_now_send_status_t results[MIXED];
+
+// The radio reports the frames in the order they were sent
+static void on_sent(esp_now_send_status_t status, void *ctx) {
+  unsigned i = (uintptr_t)ctx;
+  if (i < MIXED)
+    results[i] = status;
+  if (i != completed)
+    out_of_order = true;
+  __atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned completed_count(void) {
+  return __atomic_load_n(&completed, __ATOMIC_ACQUIRE);
+}
+
+static sim_node_t *start(const char *variant, sim_node_t **gateway) {
+  *gateway = sim_station_create("gateway", 1, gateway_rx, NULL);
+  test_device_config(&config, TYPE);
+  sim_node_t *device = test_device(variant, &config);
+  TEST_ASSERT(test_paired(device, 5000));
+  sim_sleep_ms(500);
+  completed = 0;
+  out_of_order = false;
+  return device;
+}
+
+static double frames_per_second(const char *variant) {
+  sim_medium_t medium = SIM_MEDIUM_DEFAULT;
+  medium.latency_us = 2000;
+  sim_medium_set(&medium);
+  sim_node_t *gateway;
+  sim_node_t *device = start(variant, &gateway);
+  const sim_api_t *api = sim_on(device);
+  enc_mac_t mac;
+  memcpy(mac.bytes, sim_node_mac(gateway), 6);
+
+  uint64_t begin = sim_now_us();
+  for (uintptr_t i = 0; i < FRAMES; i++)
+    TEST_ASSERT(api->enc_send_to_async(&mac, "w:0123456789", 12, on_sent,
+                                       (void *)i));
+  TEST_ASSERT(TEST_WAIT(completed_count() == FRAMES, 10000));
+  double rate = FRAMES * 1e6 / (sim_now_us() - begin);
+  TEST_ASSERT(!out_of_order);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  medium = (sim_medium_t)SIM_MEDIUM_DEFAULT;
+  sim_medium_set(&medium);
+  return rate;
+}
+
+static void test_throughput(void) {
+  double window_1 = frames_per_second("device");
+  double window_4 = frames_per_second("device_window");
+  test_measure("window_1_throughput", "frames/s", window_1);
+  test_measure("window_4_throughput", "frames/s", window_4);
+  TEST_ASSERT(window_4 > 2 * window_1);
+}
+
+static void test_results_matched(void) {
+  sim_node_t *gateway;
+  sim_node_t *device = start("device_window", &gateway);
+  sim_node_t *lossy = sim_station_create("lossy", 1, NULL, NULL);
+  sim_link_set(device, lossy, 1000, -50);
+  enc_mac_t macs[2];
+  memcpy(macs[0].bytes, sim_node_mac(gateway), 6);
+  memcpy(macs[1].bytes, sim_node_mac(lossy), 6);
+
+  // Frames to both destinations are in flight together
+  const sim_api_t *api = sim_on(device);
+  for (uintptr_t i = 0; i < MIXED; i++)
+    TEST_ASSERT(api->enc_send_to_async(&macs[(i / 2) % 2], "w:x", 3, on_sent,
+                                       (void *)i));
+  TEST_ASSERT(TEST_WAIT(completed_count() == MIXED, 10000));
+  for (int i = 0; i < MIXED; i++)
+    TEST_ASSERT_EQ(results[i], ((i / 2) % 2) ? ESP_NOW_SEND_FAIL
+                                             : ESP_NOW_SEND_SUCCESS);
+  TEST_ASSERT(!out_of_order);
+
+  sim_node_stop(device);
+  sim_node_stop(gateway);
+  sim_node_stop(lossy);
+}
+
+int main(void) {
+  sim_init(NULL);
+  TEST_RUN(test_throughput);
+  TEST_RUN(test_results_matched);
+  return 0;
+}
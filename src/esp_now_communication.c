@@ -13,15 +13,69 @@
 
 #ifndef CONFIG_IDF_TARGET_ESP8266
 #include "esp_mac.h"
+#include "esp_random.h"
 #endif
 
+#include "esp_now_compress.h"
+#include "esp_now_gateway.h"
 #include "esp_now_pair.h"
 #include "link.h"
+#include "link_command.h"
 
 static const char *TAG = "Link_ENC";
 
 #define ESPNOW_MAXDELAY 100
 
+// First byte of a frame carrying several messages, each one prefixed with its
+// length byte
+#define ENC_FRAME_AGGREGATE 0x1E
+#define ENC_AGGREGATE_HEADER_LEN 1
+
+// First byte of a frame the receiver has to acknowledge, followed by the
+// boot epoch of the sender, the little endian sequence number and the actual
+// frame. Sequence numbers count per paired peer; a new epoch tells the
+// receiver that the sender restarted them.
+#define ENC_FRAME_RELIABLE 0x1D
+#define ENC_RELIABLE_HEADER_LEN 4
+#define ENC_NVS_NAME "ENC"
+#define ENC_NVS_EPOCH_KEY "epoch"
+
+// Acknowledgement of a reliable frame, followed by its sequence number
+#define ENC_FRAME_ACK 0x1C
+#define ENC_ACK_LEN 3
+#define ENC_DEDUP_WINDOW 32
+
+// First byte of a frame whose rest was compressed with the static dictionary,
+// only sent to peers that announced support for it
+#define ENC_FRAME_COMPRESSED 0x1B
+
+// The average RSSI of a peer is kept in 1/16 dBm, every frame adds 1/8 of its
+// difference
+#define ENC_RSSI_AVG_SCALE 16
+#define ENC_RSSI_AVG_WEIGHT 8
+
+// First byte of a frame carrying one part of a message longer than a frame,
+// followed by the message id, the fragment index and the fragment count.
+// Fragments always leave room for the reliability header, so nodes agree on
+// the fragment size whether they use reliable delivery or not.
+#define ENC_FRAME_FRAGMENT 0x1F
+#define ENC_FRAGMENT_HEADER_LEN 4
+#define ENC_FRAGMENT_PAYLOAD_LEN                                               \
+  (ESP_NOW_MAX_DATA_LEN - ENC_RELIABLE_HEADER_LEN - ENC_FRAGMENT_HEADER_LEN)
+#define ENC_MAX_FRAGMENTS                                                      \
+  ((ENC_MAX_MESSAGE_SIZE + ENC_FRAGMENT_PAYLOAD_LEN - 1) /                     \
+   ENC_FRAGMENT_PAYLOAD_LEN)
+
+// the reassembly keeps one bit per fragment
+_Static_assert(ENC_MAX_FRAGMENTS <= 32,
+               "ENC_MAX_MESSAGE_SIZE needs more than 32 fragments");
+
+// Airtime of a frame at the default 1 Mbps rate: the long preamble plus the
+// 802.11 action frame and vendor headers around the payload
+#define ENC_AIRTIME_PREAMBLE_US 192
+#define ENC_AIRTIME_OVERHEAD_BYTES 43
+#define ENC_AIRTIME_US_PER_BYTE 8
+
 #define IS_BROADCAST_ADDR(addr)                                                \
   (memcmp(addr, esp_now_broadcast_mac.bytes, ESP_NOW_ETH_ALEN) == 0)
 const enc_mac_t esp_now_broadcast_mac = {
@@ -39,24 +93,205 @@ static void on_esp_now_data_receive(const esp_now_recv_info_t *esp_now_info,
 static void esp_now_send_task(void *params);
 static void esp_now_receive_task(void *params);
 
-extern void link_message_parse(const char *data);
-
 typedef struct {
   uint8_t mac_addr[ESP_NOW_ETH_ALEN];
   esp_now_send_status_t status;
 } enc_event_send_cb_t;
 
-typedef struct {
-  char data[ESP_NOW_MAX_DATA_LEN];
+struct enc_send {
+  char data[ESP_NOW_MAX_DATA_LEN + 1];
+  size_t len;
   enc_mac_t dest_mac;
+  enc_msg_kind_e kind;
 
   // private
-  QueueHandle_t *_ack_queue;
-} enc_send_t;
+  enc_send_cb _cb;
+  void *_cb_ctx;
+  struct enc_send *_next; // messages sent in the same frame
+
+  // newer messages copied into this one, they report its result
+  struct enc_send *_merged;
+
+  // first fragment of the message, reports once all fragments are sent
+  struct enc_send *_fragments;
+  uint8_t _fragments_pending;
+  esp_now_send_status_t _fragments_status;
+
+  // compression was tried, retransmissions send the frame as it is
+  bool _compressed;
+
+  // reliable delivery, the slot is kept until the receiver acknowledges it
+  bool _reliable;
+  bool _acked;
+  uint16_t _seq;
+  uint8_t _retries;
+  TickType_t _sent_at;
+  TickType_t _deadline;
+};
+
+// Result of a send a task waits for. One given up on stays in use until the
+// result comes, so it cannot be confused with that of a later send.
+typedef struct {
+  TaskHandle_t task;
+  esp_now_send_status_t status;
+  bool done;
+  bool abandoned;
+  bool in_use;
+} enc_waiter_t;
+
+typedef struct {
+  enc_mac_t mac;
+  uint32_t last_used;
+  bool in_use;
+} enc_peer_t;
+
+typedef struct {
+  enc_send_t *slot;
+  uint32_t seq;
+  bool in_use;
+} enc_in_flight_t;
+
+typedef struct {
+  enc_mac_t mac;
+  uint16_t seq;
+} enc_ack_t;
+
+typedef struct {
+  enc_mac_t mac;
+  uint32_t last_used;
+  bool in_use;
+
+  uint32_t frames;
+  int32_t rssi_avg;
+  int8_t rssi_min;
+  int8_t rssi_max;
+} enc_rx_peer_t;
+
+typedef struct {
+  enc_mac_t src_mac;
+  uint8_t msg_id;
+  uint8_t count;
+  uint32_t received; // bitmap of received fragments
+  size_t len;
+  TickType_t started;
+  bool in_use;
+  char data[ENC_MAX_MESSAGE_SIZE + 1];
+} enc_reassembly_t;
 
-static QueueHandle_t send_queue;
+// one queue per message kind, the send task serves them by priority
+static QueueHandle_t send_queues[ENC_MSG_KINDS];
+static const UBaseType_t send_queue_size[ENC_MSG_KINDS] = {
+    ENC_SEND_QUEUE_SIZE, ENC_STATUS_QUEUE_SIZE, ENC_DATA_QUEUE_SIZE};
+static uint8_t send_queue_skipped[ENC_MSG_KINDS];
+static bool send_queue_congested[ENC_MSG_KINDS];
+
+#if ENC_COALESCE
+#define ENC_COALESCE_ENTRIES (ENC_STATUS_QUEUE_SIZE + ENC_DATA_QUEUE_SIZE)
+
+// status and data messages not taken by the send task yet, at most one per
+// kind and destination
+static enc_send_t *coalesce_queued[ENC_COALESCE_ENTRIES];
+#endif
+static enc_watermark_cb watermark_cb;
+static void *watermark_ctx;
 static QueueHandle_t receive_queue;
 static QueueHandle_t send_result_queue;
+static TaskHandle_t send_task_handle;
+
+static enc_send_t send_pool[ENC_SEND_POOL_SIZE];
+static QueueHandle_t send_pool_queue;
+static uint8_t fragment_msg_id;
+
+// slots are released before their callback runs, so one more than there are
+#define ENC_WAITERS (ENC_SEND_POOL_SIZE + 1)
+static enc_waiter_t waiters[ENC_WAITERS];
+
+static enc_reassembly_t reassembly[ENC_REASSEMBLY_BUFFERS];
+
+static enc_rx_peer_t rx_peers[ENC_PEER_CACHE_SIZE];
+static uint32_t rx_peers_clock;
+
+#if ENC_RELIABLE
+static QueueHandle_t ack_queue;
+static enc_send_t *awaiting_ack[ENC_SEND_POOL_SIZE];
+static uint16_t reliable_seq; // to peers that are not paired
+static uint8_t reliable_epoch;
+static int32_t srtt_ms = -1;
+static int32_t rttvar_ms;
+#endif
+
+static enc_event_receive_cb_t receive_pool[ENC_RECEIVE_POOL_SIZE];
+static QueueHandle_t receive_pool_queue;
+
+static enc_peer_t peer_cache[ENC_PEER_CACHE_SIZE];
+static uint32_t peer_cache_clock;
+static uint8_t peer_cache_channel = ENC_CHANNEL;
+
+// set by the pairing, peers follow it on their next send
+static uint8_t channel = ENC_CHANNEL;
+
+static enc_in_flight_t in_flight[ENC_SEND_WINDOW];
+static uint32_t in_flight_seq;
+static int in_flight_count;
+
+#if ENC_AIRTIME_PERMILLE > 0
+// Airtime left to spend in microseconds, refilled at ENC_AIRTIME_PERMILLE
+// microseconds per millisecond
+static int32_t airtime_tokens;
+static TickType_t airtime_refilled;
+#endif
+
+static bool backoff_active;
+static uint8_t backoff_failures;
+static TickType_t backoff_until;
+
+static enc_stats_t stats;
+
+#define ENC_STAT_INC(counter)                                                  \
+  __atomic_fetch_add(&stats.counter, 1, __ATOMIC_RELAXED)
+
+// guards rx_peers, read by enc_get_peer_stats from any task, the coalescing
+// of queued messages and the result waiters
+#ifdef CONFIG_IDF_TARGET_ESP8266
+#define ENC_ENTER_CRITICAL() taskENTER_CRITICAL()
+#define ENC_EXIT_CRITICAL() taskEXIT_CRITICAL()
+#else
+static portMUX_TYPE rx_peers_mux = portMUX_INITIALIZER_UNLOCKED;
+#define ENC_ENTER_CRITICAL() taskENTER_CRITICAL(&rx_peers_mux)
+#define ENC_EXIT_CRITICAL() taskEXIT_CRITICAL(&rx_peers_mux)
+#endif
+
+static void stat_max(uint32_t *mark, uint32_t value) {
+  uint32_t current = __atomic_load_n(mark, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(mark, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void stat_high_water(uint32_t *mark, QueueHandle_t queue) {
+  stat_max(mark, uxQueueMessagesWaiting(queue));
+}
+
+#if ENC_RELIABLE
+/**
+ * @brief Counts the boots in NVS, so receivers can tell restarted sequence
+ * numbers from duplicates.
+ */
+static void reliable_epoch_next() {
+  nvs_handle_t nvs;
+  if (nvs_open(ENC_NVS_NAME, NVS_READWRITE, &nvs) != ESP_OK) {
+    // better than the same epoch after every boot
+    reliable_epoch = esp_random();
+    return;
+  }
+  nvs_get_u8(nvs, ENC_NVS_EPOCH_KEY, &reliable_epoch);
+  reliable_epoch++;
+  nvs_set_u8(nvs, ENC_NVS_EPOCH_KEY, reliable_epoch);
+  nvs_commit(nvs);
+  nvs_close(nvs);
+}
+#endif
 
 void enc_init() {
   // init wifi module
@@ -74,12 +309,38 @@ void enc_init() {
   esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
   ESP_LOGI(TAG, "Device WiFi (ESP-NOW) MAC: " MACSTR, MAC2STR(mac));
 
+#if ENC_COMPRESSION
+  ESP_LOGI(TAG, "Frame compression uses %u bytes of RAM",
+           (unsigned)enc_compress_init());
+#endif
+
   // init queue
-  send_queue = xQueueCreate(ENC_SEND_QUEUE_SIZE, sizeof(enc_send_t));
+  for (int i = 0; i < ENC_MSG_KINDS; i++)
+    send_queues[i] = xQueueCreate(send_queue_size[i], sizeof(enc_send_t *));
+  send_pool_queue = xQueueCreate(ENC_SEND_POOL_SIZE, sizeof(enc_send_t *));
+  for (int i = 0; i < ENC_SEND_POOL_SIZE; i++) {
+    enc_send_t *slot = &send_pool[i];
+    xQueueSend(send_pool_queue, &slot, 0);
+  }
   receive_queue =
-      xQueueCreate(ENC_RECIEVE_QUEUE_SIZE, sizeof(enc_event_receive_cb_t));
+      xQueueCreate(ENC_RECIEVE_QUEUE_SIZE, sizeof(enc_event_receive_cb_t *));
+  receive_pool_queue =
+      xQueueCreate(ENC_RECEIVE_POOL_SIZE, sizeof(enc_event_receive_cb_t *));
+  for (int i = 0; i < ENC_RECEIVE_POOL_SIZE; i++) {
+    enc_event_receive_cb_t *buffer = &receive_pool[i];
+    xQueueSend(receive_pool_queue, &buffer, 0);
+  }
+#if ENC_RELIABLE
+  ack_queue = xQueueCreate(ENC_SEND_POOL_SIZE, sizeof(enc_ack_t));
+  reliable_epoch_next();
+#endif
+
+  // every frame in flight may report back before the send task wakes up
   send_result_queue =
-      xQueueCreate(ENC_RESULT_QUEUE_SIZE, sizeof(enc_event_send_cb_t));
+      xQueueCreate(ENC_RESULT_QUEUE_SIZE > ENC_SEND_WINDOW
+                       ? ENC_RESULT_QUEUE_SIZE
+                       : ENC_SEND_WINDOW,
+                   sizeof(enc_event_send_cb_t));
 
   // esp now init
   if (esp_now_init() != ESP_OK) {
@@ -91,10 +352,18 @@ void enc_init() {
   esp_now_register_recv_cb(on_esp_now_data_receive);
 
   // create send task
-  xTaskCreate(esp_now_send_task, "enc_send_task", 4096, NULL, 5, NULL);
+  xTaskCreate(esp_now_send_task, "enc_send_task", 4096, NULL, 5,
+              &send_task_handle);
   xTaskCreate(esp_now_receive_task, "enc_receive_task", 4096, NULL, 5, NULL);
 }
 
+void enc_set_channel(uint8_t new_channel) {
+  esp_wifi_set_channel(new_channel, WIFI_SECOND_CHAN_NONE);
+  __atomic_store_n(&channel, new_channel, __ATOMIC_RELAXED);
+}
+
+uint8_t enc_get_channel() { return __atomic_load_n(&channel, __ATOMIC_RELAXED); }
+
 static void on_esp_now_data_send(const uint8_t *mac_addr,
                                  esp_now_send_status_t status) {
   enc_event_send_cb_t send_cb;
@@ -102,8 +371,11 @@ static void on_esp_now_data_send(const uint8_t *mac_addr,
   send_cb.status = status;
 
   if (xQueueSend(send_result_queue, &send_cb, ESPNOW_MAXDELAY) != pdTRUE) {
+    ENC_STAT_INC(send_result_queue_full);
     ESP_LOGW(TAG, "Send queue fail");
+    return;
   }
+  xTaskNotifyGive(send_task_handle);
 }
 
 /**
@@ -118,174 +390,1652 @@ static void on_esp_now_data_receive(const esp_now_recv_info_t *esp_now_info,
 #endif
 {
 #ifdef CONFIG_IDF_TARGET_ESP8266
-  esp_now_recv_info_t _esp_now_info = {0};
-  memcpy(_esp_now_info.src_addr, mac, ESP_NOW_ETH_ALEN);
-  memcpy(_esp_now_info.des_addr, mac, ESP_NOW_ETH_ALEN);
-  esp_now_recv_info_t *esp_now_info = &_esp_now_info;
+  const uint8_t *mac_addr = mac;
+#else
+  const uint8_t *mac_addr = esp_now_info ? esp_now_info->src_addr : NULL;
 #endif
 
-  uint8_t *mac_addr = esp_now_info->src_addr;
-  // uint8_t *des_addr = esp_now_info->des_addr;
-
-  if (mac_addr == NULL || data == NULL || data_len <= 0) {
+  if (mac_addr == NULL || data == NULL || data_len <= 0 ||
+      data_len > ESP_NOW_MAX_DATA_LEN) {
     ESP_LOGE(TAG, "Receive cb arg error");
     return;
   }
 
-  enc_event_receive_cb_t cb;
-  memset(&cb, 0, sizeof(enc_event_receive_cb_t));
-  memcpy(&cb.esp_now_info, esp_now_info, sizeof(esp_now_recv_info_t));
-  memcpy(&cb.data, data, data_len);
-  cb.data_len = data_len;
+  // only a pointer to the buffer goes through receive_queue, the receive task
+  // returns it to the pool once the message is handled
+  enc_event_receive_cb_t *cb;
+  if (xQueueReceive(receive_pool_queue, &cb, 0) != pdTRUE) {
+    ENC_STAT_INC(receive_pool_exhausted);
+    return;
+  }
+
+  memcpy(cb->src_mac.bytes, mac_addr, ESP_NOW_ETH_ALEN);
+#ifdef CONFIG_IDF_TARGET_ESP8266
+  cb->rssi = 0;
+#else
+  cb->rssi = esp_now_info->rx_ctrl->rssi;
+#endif
+  memcpy(cb->data, data, data_len);
+  cb->data[data_len] = '\0';
+  cb->data_len = data_len;
 
-  if (xQueueSend(receive_queue, &cb, ESPNOW_MAXDELAY) != pdTRUE) {
+  if (xQueueSend(receive_queue, &cb, 0) != pdTRUE) {
+    ENC_STAT_INC(receive_queue_full);
     ESP_LOGW(TAG, "Send receive queue fail");
+    xQueueSend(receive_pool_queue, &cb, 0);
+    return;
   }
+  stat_high_water(&stats.receive_queue_high_water, receive_queue);
 }
 
-void esp_now_send_task(void *params) {
-  BaseType_t queue_status;
-  enc_send_t data;
-  esp_now_peer_info_t peer_info;
-  esp_err_t err = ESP_OK;
-  enc_event_send_cb_t result;
-
-  while (1) {
-    // wait for data
-    queue_status = xQueueReceive(send_queue, &data, portMAX_DELAY);
-    if (queue_status != pdPASS)
+static enc_peer_t *peer_cache_lru() {
+  enc_peer_t *lru = NULL;
+  for (int i = 0; i < ENC_PEER_CACHE_SIZE; i++) {
+    if (!peer_cache[i].in_use)
       continue;
+    if (lru == NULL || peer_cache[i].last_used < lru->last_used)
+      lru = &peer_cache[i];
+  }
+  return lru;
+}
 
-    // create peer
-    memset(&peer_info, 0, sizeof(esp_now_peer_info_t));
-    peer_info.channel = ENC_CHANNEL;
-    peer_info.encrypt = false;
-    memcpy(peer_info.peer_addr, data.dest_mac.bytes, ESP_NOW_ETH_ALEN);
-    err = esp_now_add_peer(&peer_info);
-    if (err != ESP_OK) {
-      ESP_LOGE(TAG, "Error while adding new peer!- %s", esp_err_to_name(err));
-      esp_now_del_peer(peer_info.peer_addr);
-      continue;
-    }
+static void peer_cache_remove(enc_peer_t *entry) {
+  ESP_LOGD(TAG, "Removing peer " MACSTR, MAC2STR(entry->mac.bytes));
+  esp_now_del_peer(entry->mac.bytes);
+  entry->in_use = false;
+}
 
-    // send data
-    ESP_LOGD(TAG, "Sending data to " MACSTR ", message=%s",
-             MAC2STR(peer_info.peer_addr), data.data);
+static enc_peer_t *peer_cache_get_free_entry() {
+  for (int i = 0; i < ENC_PEER_CACHE_SIZE; i++) {
+    if (!peer_cache[i].in_use)
+      return &peer_cache[i];
+  }
 
-    err = esp_now_send(peer_info.peer_addr, (uint8_t *)&(data.data),
-                       strlen(data.data));
-    if (err != ESP_OK) {
-      ESP_LOGE(TAG, "Error while sending! - %s", esp_err_to_name(err));
-      esp_now_del_peer(peer_info.peer_addr);
-      continue;
+  enc_peer_t *lru = peer_cache_lru();
+  peer_cache_remove(lru);
+  return lru;
+}
+
+/**
+ * @brief Makes sure the peer is registered with ESP-NOW, reusing the
+ * registration from previous sends whenever possible.
+ */
+static esp_err_t peer_cache_acquire(const enc_mac_t *mac) {
+  peer_cache_clock++;
+
+  uint8_t current_channel = enc_get_channel();
+  if (current_channel != peer_cache_channel) {
+    // peers are registered for a channel, so register them again
+    for (int i = 0; i < ENC_PEER_CACHE_SIZE; i++) {
+      if (peer_cache[i].in_use)
+        peer_cache_remove(&peer_cache[i]);
     }
+    peer_cache_channel = current_channel;
+  }
 
-    // wait for the data to be sent
-    queue_status = xQueueReceive(send_result_queue, &result, portMAX_DELAY);
-    if (result.status == ESP_NOW_SEND_FAIL) {
-      ESP_LOGD(TAG, "Sent data to " MACSTR ", with status %d (not received)",
-               MAC2STR(result.mac_addr), result.status);
-    } else {
-      ESP_LOGD(TAG, "Sent data to " MACSTR ", with status %d (received)",
-               MAC2STR(result.mac_addr), result.status);
+  for (int i = 0; i < ENC_PEER_CACHE_SIZE; i++) {
+    if (peer_cache[i].in_use &&
+        memcmp(peer_cache[i].mac.bytes, mac->bytes, ESP_NOW_ETH_ALEN) == 0) {
+      peer_cache[i].last_used = peer_cache_clock;
+      ENC_STAT_INC(peer_cache_hits);
+      return ESP_OK;
     }
+  }
+  ENC_STAT_INC(peer_cache_misses);
 
-    if (data._ack_queue != NULL)
-      xQueueSend(*data._ack_queue, &result.status, 0);
+  enc_peer_t *entry = peer_cache_get_free_entry();
 
-    // remove peer
-    esp_now_del_peer(peer_info.peer_addr);
+  esp_now_peer_info_t peer_info;
+  memset(&peer_info, 0, sizeof(esp_now_peer_info_t));
+  peer_info.channel = current_channel;
+  peer_info.encrypt = false;
+  memcpy(peer_info.peer_addr, mac->bytes, ESP_NOW_ETH_ALEN);
+
+  esp_err_t err = esp_now_add_peer(&peer_info);
+  if (err == ESP_ERR_ESPNOW_FULL && peer_cache_lru() != NULL) {
+    // Peers registered outside of this component use up the ESP-NOW limit,
+    // so make room by dropping the least recently used entry of our own
+    peer_cache_remove(peer_cache_lru());
+    err = esp_now_add_peer(&peer_info);
   }
+  if (err == ESP_ERR_ESPNOW_EXIST)
+    err = ESP_OK;
+  if (err != ESP_OK)
+    return err;
+
+  memcpy(entry->mac.bytes, mac->bytes, ESP_NOW_ETH_ALEN);
+  entry->last_used = peer_cache_clock;
+  entry->in_use = true;
+  return ESP_OK;
 }
 
-bool check_mac(uint8_t *mac) {
-  enc_mac_t gateway_mac;
-  bool is_paired = enp_get_gateway_mac(&gateway_mac);
-  if (!is_paired)
-    return false;
+/**
+ * @brief Reports the result to the messages replaced by a newer one: they are
+ * superseded once it was sent, and fail with it otherwise.
+ */
+static void merged_complete(enc_send_t *merged, esp_now_send_status_t result) {
+  while (merged != NULL) {
+    enc_send_t *next = merged->_merged;
+    enc_send_cb cb = merged->_cb;
+    void *cb_ctx = merged->_cb_ctx;
+
+    enc_slot_release(merged);
+    if (cb != NULL)
+      cb(result, cb_ctx);
+    merged = next;
+  }
+}
+
+/**
+ * @brief Returns the slot to the pool and reports the result to the completion
+ * callback of the message.
+ */
+static void send_complete(enc_send_t *slot, esp_now_send_status_t status) {
+  while (slot != NULL) {
+    enc_send_t *next = slot->_next;
+    esp_now_send_status_t result = status;
+
+    enc_send_t *head = slot->_fragments;
+    if (head != NULL) {
+      // the first fragment is kept until the whole message is done
+      if (status != ESP_NOW_SEND_SUCCESS)
+        head->_fragments_status = ESP_NOW_SEND_FAIL;
+      if (slot != head)
+        enc_slot_release(slot);
+      if (--head->_fragments_pending > 0) {
+        slot = next;
+        continue;
+      }
+      result = head->_fragments_status;
+      slot = head;
+    }
 
-  bool is_gateway_mac = (memcmp(gateway_mac.bytes, mac, ESP_NOW_ETH_ALEN) == 0);
+    enc_send_t *merged = slot->_merged;
+    enc_send_cb cb = slot->_cb;
+    void *cb_ctx = slot->_cb_ctx;
 
-  return (is_paired && is_gateway_mac);
+    // the slot goes back first, so the callback can reuse it right away
+    enc_slot_release(slot);
+
+    if (cb != NULL)
+      cb(result, cb_ctx);
+    merged_complete(merged, (result == ESP_NOW_SEND_SUCCESS)
+                                ? ENC_SEND_SUPERSEDED
+                                : result);
+    slot = next;
+  }
 }
 
-void esp_now_receive_task(void *params) {
-  BaseType_t queue_status;
-  enc_event_receive_cb_t data;
+static void in_flight_submit(enc_send_t *data);
+static esp_err_t enc_submit_wait(enc_send_t *slot, size_t len,
+                                 const enc_mac_t *dest_mac, enc_send_cb cb,
+                                 void *ctx, TickType_t wait);
 
-  while (1) {
-    // wait for data
-    queue_status = xQueueReceive(receive_queue, &data, portMAX_DELAY);
-    if (queue_status != pdPASS)
-      continue;
+static TickType_t ticks_until(TickType_t deadline, TickType_t now) {
+  return ((int32_t)(deadline - now) > 0) ? deadline - now : 0;
+}
 
-      // Parsing data
-#ifndef CONFIG_IDF_TARGET_ESP8266
-    ESP_LOGD(TAG, "Recieved message \"%s\" from " MACSTR " RSSI: %d", data.data,
-             MAC2STR(data.esp_now_info.src_addr),
-             data.esp_now_info.rx_ctrl->rssi);
+// what is left of a wait that began at start, portMAX_DELAY never runs out
+static TickType_t ticks_left(TickType_t start, TickType_t wait) {
+  if (wait == portMAX_DELAY)
+    return wait;
+  TickType_t elapsed = xTaskGetTickCount() - start;
+  return (elapsed < wait) ? wait - elapsed : 0;
+}
+
+#if ENC_AIRTIME_PERMILLE > 0
+static void airtime_refill(TickType_t now) {
+  uint32_t elapsed_ms = pdTICKS_TO_MS(now - airtime_refilled);
+  if (elapsed_ms == 0)
+    return;
+  airtime_refilled = now;
+
+  // a long pause refills the whole bucket, the clamp avoids an overflow
+  if (elapsed_ms > ENC_AIRTIME_BURST_MS * 1000)
+    elapsed_ms = ENC_AIRTIME_BURST_MS * 1000;
+  airtime_tokens += elapsed_ms * ENC_AIRTIME_PERMILLE;
+  if (airtime_tokens > ENC_AIRTIME_BURST_MS * 1000)
+    airtime_tokens = ENC_AIRTIME_BURST_MS * 1000;
+}
+
+/**
+ * @brief Charges the airtime of a frame to the budget. The budget may go
+ * negative, the next frame then waits until it is paid back.
+ */
+static void airtime_spend(size_t len) {
+  airtime_tokens -= ENC_AIRTIME_PREAMBLE_US +
+                    (len + ENC_AIRTIME_OVERHEAD_BYTES) * ENC_AIRTIME_US_PER_BYTE;
+}
+
+static TickType_t airtime_wait(TickType_t now) {
+  airtime_refill(now);
+  if (airtime_tokens >= 0)
+    return 0;
+
+  TickType_t wait = pdMS_TO_TICKS(
+      (-airtime_tokens + ENC_AIRTIME_PERMILLE - 1) / ENC_AIRTIME_PERMILLE);
+  return (wait > 0) ? wait : 1;
+}
+#endif
+
+/**
+ * @brief Pauses sending for a random time after a failed frame, the limit
+ * doubles with every failure in a row.
+ */
+static void backoff_update(esp_now_send_status_t status) {
+  if (ENC_BACKOFF_BASE_MS == 0)
+    return;
+  if (status == ESP_NOW_SEND_SUCCESS) {
+    backoff_failures = 0;
+    return;
+  }
+
+  if (backoff_failures < UINT8_MAX)
+    backoff_failures++;
+  uint32_t limit = ENC_BACKOFF_BASE_MS;
+  for (int i = 1; i < backoff_failures && limit < ENC_BACKOFF_MAX_MS; i++)
+    limit <<= 1;
+  if (limit > ENC_BACKOFF_MAX_MS)
+    limit = ENC_BACKOFF_MAX_MS;
+
+  backoff_until =
+      xTaskGetTickCount() + pdMS_TO_TICKS(esp_random() % (limit + 1));
+  backoff_active = true;
+  ENC_STAT_INC(backoffs);
+}
+
+/**
+ * @brief Returns the ticks until the airtime budget and the backoff allow the
+ * next frame, 0 if it may be sent right away.
+ */
+static TickType_t send_gate_wait(TickType_t now) {
+  TickType_t wait = 0;
+
+  if (backoff_active) {
+    wait = ticks_until(backoff_until, now);
+    if (wait == 0)
+      backoff_active = false;
+  }
+
+#if ENC_AIRTIME_PERMILLE > 0
+  TickType_t refill = airtime_wait(now);
+  if (refill > wait)
+    wait = refill;
+#endif
+  return wait;
+}
+
+static bool send_ready() {
+  return in_flight_count < ENC_SEND_WINDOW &&
+         send_gate_wait(xTaskGetTickCount()) == 0;
+}
+
+#if ENC_RELIABLE
+/**
+ * @brief Takes the next sequence number of a paired peer, false for others.
+ */
+static bool reliable_peer_next_seq(const enc_mac_t *mac, uint16_t *seq) {
+#if LINK_ROLE_GATEWAY
+  return eng_node_next_seq(mac, seq);
 #else
-    ESP_LOGD(TAG, "Recieved message \"%s\" from " MACSTR, data.data,
-             MAC2STR(data.esp_now_info.src_addr));
+  return enp_gateway_next_seq(mac, seq);
 #endif
+}
 
-    if (IS_BROADCAST_ADDR(data.esp_now_info.src_addr)) {
-      ESP_LOGD(TAG, "Received broadcast ESPNOW data");
-    } else {
-      enp_check_received_pairing_acceptance(&data);
-
-      if (check_mac(data.esp_now_info.src_addr)) {
-        link_message_parse(data.data);
-      } else {
-        if (enp_get_gateway_mac(NULL)) {
-          ESP_LOGW(TAG,
-                   "Received message from an unknown or unpaired device");
-        }
+static TickType_t reliable_rto() {
+  int32_t rto = ENC_RELIABLE_INITIAL_RTO_MS;
+  if (srtt_ms >= 0)
+    rto = srtt_ms + 4 * rttvar_ms;
+  if (rto < ENC_RELIABLE_MIN_RTO_MS)
+    rto = ENC_RELIABLE_MIN_RTO_MS;
+  if (rto > ENC_RELIABLE_MAX_RTO_MS)
+    rto = ENC_RELIABLE_MAX_RTO_MS;
+  return pdMS_TO_TICKS(rto);
+}
+
+static void reliable_update_rtt(TickType_t sent_at) {
+  int32_t rtt = pdTICKS_TO_MS(xTaskGetTickCount() - sent_at);
+
+  // RFC 6298 estimator
+  if (srtt_ms < 0) {
+    srtt_ms = rtt;
+    rttvar_ms = rtt / 2;
+  } else {
+    int32_t delta = srtt_ms - rtt;
+    rttvar_ms = (3 * rttvar_ms + (delta < 0 ? -delta : delta)) / 4;
+    srtt_ms = (7 * srtt_ms + rtt) / 8;
+  }
+}
+
+/**
+ * @brief Keeps a frame the radio is done with until it is acknowledged or
+ * its timeout expires. The timeout doubles with every retransmission, up to
+ * ENC_RELIABLE_MAX_RTO_MS.
+ */
+static void reliable_wait_for_ack(enc_send_t *slot) {
+  TickType_t max_rto = pdMS_TO_TICKS(ENC_RELIABLE_MAX_RTO_MS);
+  TickType_t rto = reliable_rto();
+  for (int i = 0; i < slot->_retries && rto < max_rto; i++)
+    rto *= 2;
+  if (rto > max_rto)
+    rto = max_rto;
+
+  slot->_deadline = xTaskGetTickCount() + rto;
+
+  for (int i = 0; i < ENC_SEND_POOL_SIZE; i++) {
+    if (awaiting_ack[i] == NULL) {
+      awaiting_ack[i] = slot;
+      return;
+    }
+  }
+}
+
+static void reliable_process_acks() {
+  enc_ack_t ack;
+  while (xQueueReceive(ack_queue, &ack, 0) == pdPASS) {
+    for (int i = 0; i < ENC_SEND_POOL_SIZE; i++) {
+      enc_send_t *slot = awaiting_ack[i];
+      if (slot == NULL || slot->_seq != ack.seq ||
+          memcmp(slot->dest_mac.bytes, ack.mac.bytes, ESP_NOW_ETH_ALEN) != 0)
+        continue;
+
+      // Karn's algorithm, retransmitted frames do not give a clean sample
+      if (slot->_retries == 0)
+        reliable_update_rtt(slot->_sent_at);
+      awaiting_ack[i] = NULL;
+      send_complete(slot, ESP_NOW_SEND_SUCCESS);
+      break;
+    }
+
+    // the ack may overtake the send result of the radio
+    for (int i = 0; i < ENC_SEND_WINDOW; i++) {
+      enc_send_t *slot = in_flight[i].slot;
+      if (in_flight[i].in_use && slot->_reliable && slot->_seq == ack.seq &&
+          memcmp(slot->dest_mac.bytes, ack.mac.bytes, ESP_NOW_ETH_ALEN) == 0) {
+        if (slot->_retries == 0)
+          reliable_update_rtt(slot->_sent_at);
+        slot->_acked = true;
       }
     }
   }
 }
 
-bool enc_send_with_result(const char *data) {
-  enc_send_t send_data = {0};
-  strcpy(send_data.data, data);
-  // send_data.dest_mac = enp_get_gateway_mac();
-  bool is_paired = enp_get_gateway_mac(&send_data.dest_mac);
-  if (!is_paired) {
-    ESP_LOGW(TAG, "Device is not paired! Ommiting sending message");
-    return false;
+static void reliable_retransmit() {
+  TickType_t now = xTaskGetTickCount();
+
+  for (int i = 0; i < ENC_SEND_POOL_SIZE; i++) {
+    enc_send_t *slot = awaiting_ack[i];
+    if (slot == NULL || ticks_until(slot->_deadline, now) > 0)
+      continue;
+
+    if (slot->_retries >= ENC_RELIABLE_MAX_RETRIES) {
+      ESP_LOGW(TAG, "No ack for frame %u to " MACSTR ", giving up", slot->_seq,
+               MAC2STR(slot->dest_mac.bytes));
+      ENC_STAT_INC(reliable_failures);
+      awaiting_ack[i] = NULL;
+      send_complete(slot, ESP_NOW_SEND_FAIL);
+      continue;
+    }
+
+    if (!send_ready())
+      return;
+
+    ESP_LOGD(TAG, "Retransmitting frame %u to " MACSTR, slot->_seq,
+             MAC2STR(slot->dest_mac.bytes));
+    awaiting_ack[i] = NULL;
+    slot->_retries++;
+    ENC_STAT_INC(retransmissions);
+    in_flight_submit(slot);
+  }
+}
+
+static TickType_t reliable_next_deadline(TickType_t now, TickType_t wait) {
+  for (int i = 0; i < ENC_SEND_POOL_SIZE; i++) {
+    if (awaiting_ack[i] == NULL)
+      continue;
+    TickType_t until = ticks_until(awaiting_ack[i]->_deadline, now);
+    if (until < wait)
+      wait = until;
   }
+  return wait;
+}
 
-  QueueHandle_t result = xQueueCreate(2, sizeof(esp_now_send_status_t));
-  send_data._ack_queue = &result;
-  xQueueSend(send_queue, &send_data, portMAX_DELAY);
+/**
+ * @brief Puts the reliability header in front of a unicast frame the first
+ * time it is sent.
+ */
+static void reliable_prepare(enc_send_t *slot) {
+  if (slot->_reliable || IS_BROADCAST_ADDR(slot->dest_mac.bytes) ||
+      slot->data[0] == ENC_FRAME_ACK)
+    return;
 
-  esp_now_send_status_t res;
-  xQueueReceive(result, &res, portMAX_DELAY);
-  if (res == ESP_NOW_SEND_SUCCESS)
-    return true;
-  return false;
+  memmove(slot->data + ENC_RELIABLE_HEADER_LEN, slot->data, slot->len);
+  if (!reliable_peer_next_seq(&slot->dest_mac, &slot->_seq))
+    slot->_seq = reliable_seq++;
+  slot->data[0] = ENC_FRAME_RELIABLE;
+  slot->data[1] = reliable_epoch;
+  slot->data[2] = slot->_seq & 0xFF;
+  slot->data[3] = slot->_seq >> 8;
+  slot->len += ENC_RELIABLE_HEADER_LEN;
+  slot->_reliable = true;
+  slot->_acked = false;
+  slot->_retries = 0;
 }
+#endif
 
-void enc_send_no_result(const char *data) {
-  enc_send_t send_data = {0};
-  memset(&send_data, 0, sizeof(enc_send_t));
-  strcpy(send_data.data, data);
-  // send_data.dest_mac = enp_get_gateway_mac();
-  bool is_paired = enp_get_gateway_mac(&send_data.dest_mac);
-  if (!is_paired) {
-    ESP_LOGW(TAG, "Device is not paired! Ommiting sending message");
+#if ENC_COMPRESSION
+static bool compress_peer(const enc_mac_t *mac) {
+#if LINK_ROLE_GATEWAY
+  return eng_node_compresses(mac);
+#else
+  return enp_gateway_compresses(mac);
+#endif
+}
+
+/**
+ * @brief Compresses the frame once, when the peer supports it and the frame
+ * gets shorter.
+ */
+static void compress_prepare(enc_send_t *slot) {
+  if (slot->_compressed || slot->len < 3 || slot->data[0] == ENC_FRAME_ACK ||
+      IS_BROADCAST_ADDR(slot->dest_mac.bytes))
+    return;
+  slot->_compressed = true;
+
+  if (!compress_peer(&slot->dest_mac))
+    return;
+
+  uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+  int len = enc_compress((const uint8_t *)slot->data, slot->len, buffer,
+                         slot->len - 2);
+  if (len < 0)
+    return;
+
+  __atomic_fetch_add(&stats.compress_in, slot->len, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats.compress_out, len + 1, __ATOMIC_RELAXED);
+  slot->data[0] = ENC_FRAME_COMPRESSED;
+  memcpy(slot->data + 1, buffer, len);
+  slot->len = len + 1;
+}
+#endif
+
+static void in_flight_complete(const enc_event_send_cb_t *result) {
+  // results for the same destination arrive in the order of sending, so the
+  // oldest matching frame is the one being reported
+  enc_in_flight_t *entry = NULL;
+  for (int i = 0; i < ENC_SEND_WINDOW; i++) {
+    if (!in_flight[i].in_use ||
+        memcmp(in_flight[i].slot->dest_mac.bytes, result->mac_addr,
+               ESP_NOW_ETH_ALEN) != 0)
+      continue;
+    if (entry == NULL || (int32_t)(in_flight[i].seq - entry->seq) < 0)
+      entry = &in_flight[i];
+  }
+
+  if (entry == NULL) {
+    ESP_LOGW(TAG, "Unexpected send result for " MACSTR,
+             MAC2STR(result->mac_addr));
+    return;
+  }
+
+  if (result->status == ESP_NOW_SEND_FAIL) {
+    ENC_STAT_INC(frames_failed);
+    ESP_LOGD(TAG, "Sent data to " MACSTR ", with status %d (not received)",
+             MAC2STR(result->mac_addr), result->status);
+  } else {
+    ENC_STAT_INC(frames_acked);
+    ESP_LOGD(TAG, "Sent data to " MACSTR ", with status %d (received)",
+             MAC2STR(result->mac_addr), result->status);
+  }
+  backoff_update(result->status);
+
+  enc_send_t *slot = entry->slot;
+  entry->in_use = false;
+  in_flight_count--;
+  enp_report_send_result(&slot->dest_mac,
+                         result->status == ESP_NOW_SEND_SUCCESS);
+
+#if ENC_RELIABLE
+  if (slot->_reliable && !slot->_acked) {
+    reliable_wait_for_ack(slot);
     return;
   }
-  send_data._ack_queue = NULL;
-  xQueueSend(send_queue, &send_data, portMAX_DELAY);
+  if (slot->_reliable) {
+    send_complete(slot, ESP_NOW_SEND_SUCCESS);
+    return;
+  }
+#endif
+
+  send_complete(slot, result->status);
 }
 
-void enc_send_to_broadcast(const char *data) {
-  enc_send_t send_data = {0};
-  strcpy(send_data.data, data);
-  memcpy(send_data.dest_mac.bytes, esp_now_broadcast_mac.bytes,
-         ESP_NOW_ETH_ALEN);
-  send_data._ack_queue = NULL;
-  xQueueSend(send_queue, &send_data, portMAX_DELAY);
+static void in_flight_submit(enc_send_t *data) {
+  // make sure the peer is registered
+  esp_err_t err = peer_cache_acquire(&data->dest_mac);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error while adding new peer!- %s", esp_err_to_name(err));
+    send_complete(data, ESP_NOW_SEND_FAIL);
+    return;
+  }
+
+  enc_in_flight_t *entry = NULL;
+  for (int i = 0; i < ENC_SEND_WINDOW; i++) {
+    if (!in_flight[i].in_use) {
+      entry = &in_flight[i];
+      break;
+    }
+  }
+
+#if ENC_COMPRESSION
+  compress_prepare(data);
+#endif
+#if ENC_RELIABLE
+  reliable_prepare(data);
+  data->_sent_at = xTaskGetTickCount();
+#endif
+
+  // the slot has to be taken before sending, the result may come back
+  // before esp_now_send returns
+  entry->slot = data;
+  entry->seq = in_flight_seq++;
+  entry->in_use = true;
+  in_flight_count++;
+
+  // send data
+  ESP_LOGD(TAG, "Sending data to " MACSTR ", message=%s",
+           MAC2STR(data->dest_mac.bytes), data->data);
+
+  err = esp_now_send(data->dest_mac.bytes, (uint8_t *)data->data, data->len);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Error while sending! - %s", esp_err_to_name(err));
+    ENC_STAT_INC(frames_failed);
+    entry->in_use = false;
+    in_flight_count--;
+    send_complete(data, ESP_NOW_SEND_FAIL);
+    return;
+  }
+  ENC_STAT_INC(frames_sent);
+#if ENC_AIRTIME_PERMILLE > 0
+  airtime_spend(data->len);
+#endif
+}
+
+#if ENC_AGGREGATION
+static enc_send_t *aggregate;
+static TickType_t aggregate_deadline;
+static enc_send_t *deferred;
+
+static bool aggregate_can_append(const enc_send_t *data) {
+  if (aggregate == NULL || data->_fragments != NULL ||
+      memcmp(aggregate->dest_mac.bytes, data->dest_mac.bytes,
+             ESP_NOW_ETH_ALEN) != 0)
+    return false;
+
+  size_t len = aggregate->len + 1 + data->len;
+  if (aggregate->_next == NULL)
+    len += ENC_AGGREGATE_HEADER_LEN + 1;
+  return len <= ENC_FRAME_MAX_LEN;
+}
+
+static void aggregate_append(enc_send_t *data) {
+  if (aggregate->_next == NULL) {
+    // turn the single message into the first entry of an aggregated frame
+    memmove(aggregate->data + ENC_AGGREGATE_HEADER_LEN + 1, aggregate->data,
+            aggregate->len);
+    aggregate->data[0] = ENC_FRAME_AGGREGATE;
+    aggregate->data[1] = aggregate->len;
+    aggregate->len += ENC_AGGREGATE_HEADER_LEN + 1;
+  }
+
+  aggregate->data[aggregate->len] = data->len;
+  memcpy(aggregate->data + aggregate->len + 1, data->data, data->len);
+  aggregate->len += 1 + data->len;
+
+  enc_send_t *tail = aggregate;
+  while (tail->_next != NULL)
+    tail = tail->_next;
+  tail->_next = data;
+}
+
+static void aggregate_flush() {
+  enc_send_t *frame = aggregate;
+  aggregate = NULL;
+  in_flight_submit(frame);
+}
+
+/**
+ * @brief Collects status and data messages for the same destination into one
+ * frame, other messages are sent right away.
+ */
+static void aggregate_submit(enc_send_t *data) {
+  if (aggregate_can_append(data) && data->kind != ENC_MSG_CONTROL) {
+    aggregate_append(data);
+    return;
+  }
+
+  if (aggregate != NULL)
+    aggregate_flush();
+
+  if (data->kind != ENC_MSG_CONTROL && data->_fragments == NULL &&
+      data->len + ENC_AGGREGATE_HEADER_LEN + 2 <= ENC_FRAME_MAX_LEN) {
+    aggregate = data;
+    aggregate_deadline =
+        xTaskGetTickCount() + pdMS_TO_TICKS(ENC_AGGREGATION_FLUSH_MS);
+  } else if (send_ready()) {
+    in_flight_submit(data);
+  } else {
+    deferred = data;
+  }
+}
+
+#endif
+
+#if ENC_COALESCE
+static bool coalesce_telemetry(const enc_send_t *slot) {
+  return strncmp(slot->data, LINK_TELEMETRY_PREFIX,
+                 sizeof(LINK_TELEMETRY_PREFIX) - 1) == 0;
+}
+
+/**
+ * @brief Telemetry goes out in the data class, but it only replaces earlier
+ * telemetry and is never replaced by data messages.
+ */
+static bool coalesce_match(const enc_send_t *queued, const enc_send_t *slot) {
+  return queued->kind == slot->kind &&
+         coalesce_telemetry(queued) == coalesce_telemetry(slot) &&
+         memcmp(queued->dest_mac.bytes, slot->dest_mac.bytes,
+                ESP_NOW_ETH_ALEN) == 0;
+}
+
+/**
+ * @brief Copies a status or data message into an unsent one of the same kind
+ * and destination. The unsent one takes the callback of the new message, the
+ * new slot only carries the earlier callback from then on, which is told
+ * ENC_SEND_SUPERSEDED, or is released right away if there is none. Without
+ * such a message the slot is registered for the next ones, before it is
+ * queued, so the send task always finds it in the table.
+ *
+ * @return True if the message took the place of an unsent one.
+ */
+static bool coalesce_submit(enc_send_t *slot) {
+  if (slot->kind == ENC_MSG_CONTROL || slot->_fragments != NULL)
+    return false;
+
+  enc_send_t *unsent = NULL;
+  int free_entry = -1;
+
+  ENC_ENTER_CRITICAL();
+  for (int i = 0; i < ENC_COALESCE_ENTRIES; i++) {
+    if (coalesce_queued[i] == NULL) {
+      if (free_entry < 0)
+        free_entry = i;
+    } else if (coalesce_match(coalesce_queued[i], slot)) {
+      unsent = coalesce_queued[i];
+      break;
+    }
+  }
+
+  if (unsent != NULL) {
+    // the send task takes the slot out of the table before reading it
+    memcpy(unsent->data, slot->data, slot->len + 1);
+    unsent->len = slot->len;
+    enc_send_cb cb = unsent->_cb;
+    void *cb_ctx = unsent->_cb_ctx;
+    unsent->_cb = slot->_cb;
+    unsent->_cb_ctx = slot->_cb_ctx;
+    slot->_cb = cb;
+    slot->_cb_ctx = cb_ctx;
+    if (slot->_cb != NULL) {
+      slot->_merged = unsent->_merged;
+      unsent->_merged = slot;
+    }
+  } else if (free_entry >= 0) {
+    coalesce_queued[free_entry] = slot;
+  }
+  ENC_EXIT_CRITICAL();
+
+  if (unsent == NULL)
+    return false;
+
+  ENC_STAT_INC(coalesced);
+  if (slot->_cb == NULL)
+    enc_slot_release(slot);
+  return true;
+}
+
+static void coalesce_remove(enc_send_t *slot) {
+  for (int i = 0; i < ENC_COALESCE_ENTRIES; i++) {
+    if (coalesce_queued[i] == slot) {
+      coalesce_queued[i] = NULL;
+      break;
+    }
+  }
+}
+
+static void coalesce_dequeued(enc_send_t *slot) {
+  ENC_ENTER_CRITICAL();
+  coalesce_remove(slot);
+  ENC_EXIT_CRITICAL();
+}
+
+/**
+ * @brief Takes back a slot that could not be queued in time, the messages
+ * it replaced meanwhile fail with it.
+ */
+static void coalesce_cancel(enc_send_t *slot) {
+  ENC_ENTER_CRITICAL();
+  coalesce_remove(slot);
+  enc_send_t *merged = slot->_merged;
+  slot->_merged = NULL;
+  ENC_EXIT_CRITICAL();
+
+  merged_complete(merged, ESP_NOW_SEND_FAIL);
+}
+#endif
+
+/**
+ * @brief Reports a send queue crossing its high or low watermark. Producers and
+ * the send task may race on the same crossing, the exchange lets only one of
+ * them report it.
+ */
+static void watermark_check(enc_msg_kind_e kind) {
+  enc_watermark_cb cb = watermark_cb;
+  if (cb == NULL)
+    return;
+
+  UBaseType_t waiting = uxQueueMessagesWaiting(send_queues[kind]);
+  UBaseType_t size = send_queue_size[kind];
+  bool above;
+
+  if (waiting * 100 >= size * ENC_WATERMARK_HIGH_PERCENT)
+    above = true;
+  else if (waiting * 100 <= size * ENC_WATERMARK_LOW_PERCENT)
+    above = false;
+  else
+    return;
+
+  if (__atomic_exchange_n(&send_queue_congested[kind], above,
+                          __ATOMIC_RELAXED) != above)
+    cb(kind, above, watermark_ctx);
+}
+
+/**
+ * @brief Takes the next message from the send queues. Higher priority queues
+ * go first, unless a lower priority queue was passed over
+ * ENC_SEND_STARVATION_LIMIT times in a row.
+ */
+static bool send_dequeue(enc_send_t **data) {
+  bool waiting[ENC_MSG_KINDS];
+  int kind = -1;
+
+  for (int i = 0; i < ENC_MSG_KINDS; i++) {
+    waiting[i] = uxQueueMessagesWaiting(send_queues[i]) > 0;
+    if (waiting[i] && kind < 0)
+      kind = i;
+  }
+  if (kind < 0)
+    return false;
+
+  for (int i = ENC_MSG_KINDS - 1; i > kind; i--) {
+    if (waiting[i] && send_queue_skipped[i] >= ENC_SEND_STARVATION_LIMIT) {
+      kind = i;
+      break;
+    }
+  }
+
+  if (xQueueReceive(send_queues[kind], data, 0) != pdPASS)
+    return false;
+  watermark_check(kind);
+#if ENC_COALESCE
+  coalesce_dequeued(*data);
+#endif
+
+  send_queue_skipped[kind] = 0;
+  for (int i = kind + 1; i < ENC_MSG_KINDS; i++) {
+    if (waiting[i])
+      send_queue_skipped[i]++;
+  }
+  return true;
+}
+
+static TickType_t send_task_wait() {
+  TickType_t wait = portMAX_DELAY;
+  TickType_t now = xTaskGetTickCount();
+
+  // an expired deadline cannot be served before a send result frees the
+  // window, and the result wakes the task anyway
+  if (in_flight_count == ENC_SEND_WINDOW)
+    return wait;
+
+#if ENC_AGGREGATION
+  if (aggregate != NULL)
+    wait = ticks_until(aggregate_deadline, now);
+#endif
+#if ENC_RELIABLE
+  wait = reliable_next_deadline(now, wait);
+#endif
+
+  // nothing can be sent before the budget or the backoff allows it
+  TickType_t gate = send_gate_wait(now);
+  if (gate > 0)
+    wait = gate;
+
+  return wait;
+}
+
+void esp_now_send_task(void *params) {
+  enc_send_t *data;
+  enc_event_send_cb_t result;
+
+  while (1) {
+    // woken up by new data in send_queues, by a send result or by the next
+    // deadline of an aggregated frame or a retransmission
+    ulTaskNotifyTake(pdTRUE, send_task_wait());
+
+    while (xQueueReceive(send_result_queue, &result, 0) == pdPASS)
+      in_flight_complete(&result);
+
+#if ENC_RELIABLE
+    reliable_process_acks();
+    reliable_retransmit();
+#endif
+
+#if ENC_AGGREGATION
+    if (deferred != NULL && send_ready()) {
+      in_flight_submit(deferred);
+      deferred = NULL;
+    }
+
+    while (deferred == NULL && send_ready() && send_dequeue(&data))
+      aggregate_submit(data);
+
+    // once the pool is empty no producer can add to the frame any more
+    if (aggregate != NULL && send_ready() &&
+        (ticks_until(aggregate_deadline, xTaskGetTickCount()) == 0 ||
+         uxQueueMessagesWaiting(send_pool_queue) == 0))
+      aggregate_flush();
+#else
+    while (send_ready() && send_dequeue(&data))
+      in_flight_submit(data);
+#endif
+  }
+}
+
+static bool check_mac(const enc_mac_t *mac) {
+  // any gateway the device paired with, not only the current one
+  return enp_is_gateway(mac);
+}
+
+static void receive_message(const enc_event_receive_cb_t *frame,
+                            const char *msg, size_t len) {
+#if LINK_ROLE_GATEWAY
+  if (!eng_receive_message(&frame->src_mac, msg, len)) {
+    ENC_STAT_INC(unknown_sender);
+    ESP_LOGW(TAG, "Received message from an unknown device " MACSTR,
+             MAC2STR(frame->src_mac.bytes));
+  }
+#else
+  enp_check_received_pairing_acceptance(&frame->src_mac, msg);
+
+  if (check_mac(&frame->src_mac)) {
+    link_message_parse(msg);
+  } else {
+    if (enp_get_gateway_mac(NULL)) {
+      ENC_STAT_INC(unknown_sender);
+      ESP_LOGW(TAG, "Received message from an unknown or unpaired device");
+    }
+  }
+#endif
+}
+
+/**
+ * @brief Splits an aggregated frame into messages. Every message is terminated
+ * in place by overwriting the length byte of the next one.
+ */
+static void receive_aggregate(enc_event_receive_cb_t *frame) {
+  int pos = ENC_AGGREGATE_HEADER_LEN;
+  uint8_t len = (pos < frame->data_len) ? frame->data[pos] : 0;
+
+  while (pos < frame->data_len) {
+    int start = pos + 1;
+    int end = start + len;
+    if (end > frame->data_len) {
+      ESP_LOGW(TAG, "Malformed aggregated frame from " MACSTR,
+               MAC2STR(frame->src_mac.bytes));
+      return;
+    }
+
+    uint8_t next_len = (end < frame->data_len) ? frame->data[end] : 0;
+    frame->data[end] = '\0';
+    receive_message(frame, frame->data + start, len);
+
+    pos = end;
+    len = next_len;
+  }
+}
+
+/**
+ * @brief Finds the entry of the peer, replacing the least recently heard one
+ * when the peer is new. Called with rx_peers_mux held.
+ */
+static enc_rx_peer_t *rx_peer_get(const enc_mac_t *src_mac) {
+  enc_rx_peer_t *lru = &rx_peers[0];
+  rx_peers_clock++;
+
+  for (int i = 0; i < ENC_PEER_CACHE_SIZE; i++) {
+    if (rx_peers[i].in_use &&
+        memcmp(rx_peers[i].mac.bytes, src_mac->bytes, ESP_NOW_ETH_ALEN) == 0) {
+      rx_peers[i].last_used = rx_peers_clock;
+      return &rx_peers[i];
+    }
+    if (!rx_peers[i].in_use ||
+        (lru->in_use && rx_peers[i].last_used < lru->last_used))
+      lru = &rx_peers[i];
+  }
+
+  memset(lru, 0, sizeof(enc_rx_peer_t));
+  lru->mac = *src_mac;
+  lru->last_used = rx_peers_clock;
+  lru->in_use = true;
+  return lru;
+}
+
+/**
+ * @brief Updates the signal statistics of the sender.
+ */
+static void rx_peer_update(const enc_event_receive_cb_t *frame) {
+  ENC_ENTER_CRITICAL();
+  enc_rx_peer_t *peer = rx_peer_get(&frame->src_mac);
+  if (peer->frames++ == 0) {
+    peer->rssi_min = frame->rssi;
+    peer->rssi_max = frame->rssi;
+    peer->rssi_avg = frame->rssi * ENC_RSSI_AVG_SCALE;
+  } else {
+    if (frame->rssi < peer->rssi_min)
+      peer->rssi_min = frame->rssi;
+    if (frame->rssi > peer->rssi_max)
+      peer->rssi_max = frame->rssi;
+    peer->rssi_avg +=
+        (frame->rssi * ENC_RSSI_AVG_SCALE - peer->rssi_avg) / ENC_RSSI_AVG_WEIGHT;
+  }
+  ENC_EXIT_CRITICAL();
+}
+
+bool enc_reliable_accept(enc_reliable_peer_t *peer, uint8_t epoch,
+                         uint16_t seq) {
+  if (!peer->rx_valid || peer->rx_epoch != epoch) {
+    // first frame of the peer since it was paired or since it restarted
+    peer->rx_epoch = epoch;
+    peer->rx_highest = seq;
+    peer->rx_window = 1;
+    peer->rx_valid = true;
+    return true;
+  }
+
+  int16_t diff = (int16_t)(seq - peer->rx_highest);
+  if (diff > 0) {
+    peer->rx_window =
+        (diff >= ENC_DEDUP_WINDOW) ? 1 : (peer->rx_window << diff) | 1;
+    peer->rx_highest = seq;
+    return true;
+  }
+  // too old to tell from a duplicate, the sender has long given up on it
+  if (-diff >= ENC_DEDUP_WINDOW)
+    return false;
+
+  uint32_t bit = 1UL << -diff;
+  if (peer->rx_window & bit)
+    return false;
+  peer->rx_window |= bit;
+  return true;
+}
+
+/**
+ * @brief Looks the sender up among the paired peers. Frames of other senders
+ * are passed on without duplicate detection.
+ */
+static bool reliable_peer_accept(const enc_mac_t *mac, uint8_t epoch,
+                                 uint16_t seq) {
+#if LINK_ROLE_GATEWAY
+  return eng_node_accept(mac, epoch, seq);
+#else
+  return enp_gateway_accept(mac, epoch, seq);
+#endif
+}
+
+static void send_ack(const enc_mac_t *dest_mac, uint16_t seq) {
+  // never wait for a slot, the sender retransmits if the ack is missing
+  enc_send_t *slot = enc_slot_reserve(ENC_MSG_CONTROL, 0);
+  if (slot == NULL) {
+    ENC_STAT_INC(acks_dropped);
+    return;
+  }
+
+  slot->data[0] = ENC_FRAME_ACK;
+  slot->data[1] = seq & 0xFF;
+  slot->data[2] = seq >> 8;
+  // the slot is released if the control queue is full
+  if (enc_submit_wait(slot, ENC_ACK_LEN, dest_mac, NULL, NULL, 0) != ESP_OK)
+    ENC_STAT_INC(acks_dropped);
+}
+
+/**
+ * @brief Acknowledges a reliable frame and strips its header.
+ *
+ * @return True if the inner frame should be handled, false for duplicates.
+ */
+static bool receive_reliable(enc_event_receive_cb_t *frame) {
+  if (frame->data_len <= ENC_RELIABLE_HEADER_LEN)
+    return false;
+
+  uint8_t epoch = frame->data[1];
+  uint16_t seq = (uint8_t)frame->data[2] | ((uint8_t)frame->data[3] << 8);
+
+  // acknowledge duplicates as well, the previous ack may have been lost
+  send_ack(&frame->src_mac, seq);
+  if (!reliable_peer_accept(&frame->src_mac, epoch, seq)) {
+    ENC_STAT_INC(duplicates);
+    ESP_LOGD(TAG, "Dropping duplicate frame %u from " MACSTR, seq,
+             MAC2STR(frame->src_mac.bytes));
+    return false;
+  }
+
+  frame->data_len -= ENC_RELIABLE_HEADER_LEN;
+  memmove(frame->data, frame->data + ENC_RELIABLE_HEADER_LEN,
+          frame->data_len + 1);
+  return true;
+}
+
+#if ENC_COMPRESSION
+static bool receive_compressed(enc_event_receive_cb_t *frame) {
+  uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+  int len = enc_decompress((const uint8_t *)frame->data + 1,
+                           frame->data_len - 1, buffer, sizeof(buffer));
+  if (len < 0) {
+    ESP_LOGW(TAG, "Malformed compressed frame from " MACSTR,
+             MAC2STR(frame->src_mac.bytes));
+    return false;
+  }
+
+  memcpy(frame->data, buffer, len);
+  frame->data[len] = '\0';
+  frame->data_len = len;
+  return true;
+}
+#endif
+
+static void receive_ack(const enc_event_receive_cb_t *frame) {
+#if ENC_RELIABLE
+  if (frame->data_len != ENC_ACK_LEN)
+    return;
+
+  enc_ack_t ack;
+  ack.mac = frame->src_mac;
+  ack.seq = (uint8_t)frame->data[1] | ((uint8_t)frame->data[2] << 8);
+  if (xQueueSend(ack_queue, &ack, 0) == pdTRUE)
+    xTaskNotifyGive(send_task_handle);
+  else
+    ENC_STAT_INC(ack_queue_full);
+#endif
+}
+
+static void reassembly_expire(TickType_t now) {
+  for (int i = 0; i < ENC_REASSEMBLY_BUFFERS; i++) {
+    if (reassembly[i].in_use &&
+        now - reassembly[i].started >
+            pdMS_TO_TICKS(ENC_REASSEMBLY_TIMEOUT_MS)) {
+      ESP_LOGW(TAG, "Incomplete message %u from " MACSTR " timed out",
+               reassembly[i].msg_id, MAC2STR(reassembly[i].src_mac.bytes));
+      ENC_STAT_INC(reassembly_timeouts);
+      reassembly[i].in_use = false;
+    }
+  }
+}
+
+static enc_reassembly_t *reassembly_get(const enc_mac_t *src_mac,
+                                        uint8_t msg_id, uint8_t count,
+                                        TickType_t now) {
+  enc_reassembly_t *free_entry = NULL;
+  enc_reassembly_t *oldest = NULL;
+  uint32_t used = 0;
+
+  for (int i = 0; i < ENC_REASSEMBLY_BUFFERS; i++) {
+    enc_reassembly_t *entry = &reassembly[i];
+    if (!entry->in_use) {
+      if (free_entry == NULL)
+        free_entry = entry;
+      continue;
+    }
+    used++;
+    if (entry->msg_id == msg_id && entry->count == count &&
+        memcmp(entry->src_mac.bytes, src_mac->bytes, ESP_NOW_ETH_ALEN) == 0)
+      return entry;
+    if (oldest == NULL || (int32_t)(entry->started - oldest->started) < 0)
+      oldest = entry;
+  }
+
+  enc_reassembly_t *entry = free_entry;
+  if (entry == NULL) {
+    ESP_LOGW(TAG, "No free reassembly buffer, dropping message %u from " MACSTR,
+             oldest->msg_id, MAC2STR(oldest->src_mac.bytes));
+    entry = oldest;
+  } else {
+    stat_max(&stats.reassembly_high_water, used + 1);
+  }
+
+  entry->src_mac = *src_mac;
+  entry->msg_id = msg_id;
+  entry->count = count;
+  entry->received = 0;
+  entry->len = 0;
+  entry->started = now;
+  entry->in_use = true;
+  return entry;
+}
+
+/**
+ * @brief Collects the fragments of a long message and handles the message once
+ * all of them arrived.
+ */
+static void receive_fragment(enc_event_receive_cb_t *frame) {
+  if (frame->data_len <= ENC_FRAGMENT_HEADER_LEN)
+    return;
+
+  uint8_t msg_id = frame->data[1];
+  uint8_t index = frame->data[2];
+  uint8_t count = frame->data[3];
+  size_t chunk = frame->data_len - ENC_FRAGMENT_HEADER_LEN;
+  size_t offset = (size_t)index * ENC_FRAGMENT_PAYLOAD_LEN;
+
+  // every fragment but the last one is full
+  if (count == 0 || count > ENC_MAX_FRAGMENTS || index >= count ||
+      (index + 1 < count && chunk != ENC_FRAGMENT_PAYLOAD_LEN) ||
+      offset + chunk > ENC_MAX_MESSAGE_SIZE) {
+    ESP_LOGW(TAG, "Malformed fragment from " MACSTR,
+             MAC2STR(frame->src_mac.bytes));
+    return;
+  }
+
+  TickType_t now = xTaskGetTickCount();
+  reassembly_expire(now);
+
+  enc_reassembly_t *entry =
+      reassembly_get(&frame->src_mac, msg_id, count, now);
+  memcpy(entry->data + offset, frame->data + ENC_FRAGMENT_HEADER_LEN, chunk);
+  entry->received |= 1UL << index;
+  if (index + 1 == count)
+    entry->len = offset + chunk;
+
+  uint32_t all = (count == 32) ? UINT32_MAX : (1UL << count) - 1;
+  if (entry->received != all)
+    return;
+
+  entry->data[entry->len] = '\0';
+  receive_message(frame, entry->data, entry->len);
+  entry->in_use = false;
+}
+
+void esp_now_receive_task(void *params) {
+  BaseType_t queue_status;
+  enc_event_receive_cb_t *data;
+
+  while (1) {
+    // wait for data
+    queue_status = xQueueReceive(receive_queue, &data, portMAX_DELAY);
+    if (queue_status != pdPASS)
+      continue;
+
+    // Parsing data
+    ESP_LOGD(TAG, "Recieved message \"%s\" from " MACSTR " RSSI: %d",
+             data->data, MAC2STR(data->src_mac.bytes), data->rssi);
+
+    rx_peer_update(data);
+
+    if (data->data[0] == ENC_FRAME_RELIABLE && !receive_reliable(data)) {
+      xQueueSend(receive_pool_queue, &data, 0);
+      continue;
+    }
+#if ENC_COMPRESSION
+    if (data->data[0] == ENC_FRAME_COMPRESSED && !receive_compressed(data)) {
+      xQueueSend(receive_pool_queue, &data, 0);
+      continue;
+    }
+#endif
+
+    if (IS_BROADCAST_ADDR(data->src_mac.bytes)) {
+      ESP_LOGD(TAG, "Received broadcast ESPNOW data");
+    } else if (data->data[0] == ENC_FRAME_ACK) {
+      receive_ack(data);
+    } else if (data->data[0] == ENC_FRAME_AGGREGATE) {
+      receive_aggregate(data);
+    } else if (data->data[0] == ENC_FRAME_FRAGMENT) {
+      receive_fragment(data);
+    } else {
+      receive_message(data, data->data, data->data_len);
+    }
+#if !LINK_ROLE_GATEWAY
+    // after the frame, so the answer that adds a gateway counts as well
+    enp_gateway_heard(&data->src_mac, data->rssi);
+#endif
+
+    xQueueSend(receive_pool_queue, &data, 0);
+  }
+}
+
+static bool enc_enqueue(enc_send_t *slot, TickType_t wait) {
+  QueueHandle_t queue = send_queues[slot->kind];
+  if (xQueueSend(queue, &slot, 0) != pdTRUE) {
+    ENC_STAT_INC(send_queue_full[slot->kind]);
+    if (xQueueSend(queue, &slot, wait) != pdTRUE)
+      return false;
+  }
+  stat_high_water(&stats.send_queue_high_water[slot->kind], queue);
+  watermark_check(slot->kind);
+  xTaskNotifyGive(send_task_handle);
+  return true;
+}
+
+/**
+ * @brief Takes a free waiter for the result of a send of the calling task.
+ */
+static enc_waiter_t *waiter_get(void) {
+  enc_waiter_t *waiter = NULL;
+  ENC_ENTER_CRITICAL();
+  for (int i = 0; i < ENC_WAITERS; i++) {
+    if (!waiters[i].in_use) {
+      waiter = &waiters[i];
+      waiter->in_use = true;
+      waiter->done = false;
+      waiter->abandoned = false;
+      waiter->task = xTaskGetCurrentTaskHandle();
+      break;
+    }
+  }
+  ENC_EXIT_CRITICAL();
+  return waiter;
+}
+
+static void waiter_put(enc_waiter_t *waiter) {
+  ENC_ENTER_CRITICAL();
+  waiter->in_use = false;
+  ENC_EXIT_CRITICAL();
+}
+
+// A waiter given up on is freed here, its task is not woken any more
+static void enc_notify_result(esp_now_send_status_t status, void *ctx) {
+  enc_waiter_t *waiter = ctx;
+  TaskHandle_t task = NULL;
+  ENC_ENTER_CRITICAL();
+  if (waiter->abandoned) {
+    waiter->in_use = false;
+  } else {
+    waiter->status = status;
+    waiter->done = true;
+    task = waiter->task;
+  }
+  ENC_EXIT_CRITICAL();
+  if (task != NULL)
+    xTaskNotify(task, status, eSetValueWithOverwrite);
+}
+
+/**
+ * @brief Waits at most wait ticks for the result of a send. The notification
+ * only wakes the task, a late one of an earlier send is told apart by the
+ * waiter not being done yet.
+ *
+ * @return ESP_OK, ENC_ERR_SUPERSEDED, ESP_FAIL or ESP_ERR_TIMEOUT, in which
+ * case the waiter is left to the callback to free
+ */
+static esp_err_t enc_wait_for_result(enc_waiter_t *waiter, TickType_t wait) {
+  TickType_t start = xTaskGetTickCount();
+  for (;;) {
+    ENC_ENTER_CRITICAL();
+    bool done = waiter->done;
+    if (!done && ticks_left(start, wait) == 0)
+      waiter->abandoned = true;
+    ENC_EXIT_CRITICAL();
+    if (done)
+      break;
+    if (waiter->abandoned)
+      return ESP_ERR_TIMEOUT;
+    xTaskNotifyWait(0, UINT32_MAX, NULL, ticks_left(start, wait));
+  }
+
+  esp_err_t err = ESP_FAIL;
+  if (waiter->status == ESP_NOW_SEND_SUCCESS)
+    err = ESP_OK;
+  else if (waiter->status == ENC_SEND_SUPERSEDED)
+    err = ENC_ERR_SUPERSEDED;
+  waiter_put(waiter);
+  return err;
+}
+
+// A newer message that replaced this one was sent
+static bool enc_sent(esp_err_t err) {
+  return err == ESP_OK || err == ENC_ERR_SUPERSEDED;
+}
+
+/**
+ * @brief Queues a filled slot for the given destination, or for the gateway
+ * when dest_mac is NULL, waiting at most wait ticks for room. The slot is
+ * released if it cannot be queued.
+ */
+static esp_err_t enc_submit_wait(enc_send_t *slot, size_t len,
+                                 const enc_mac_t *dest_mac, enc_send_cb cb,
+                                 void *ctx, TickType_t wait) {
+  if (len > ENC_FRAME_MAX_LEN) {
+    ESP_LOGE(TAG, "Message too long (%u bytes)! Ommiting sending message",
+             (unsigned)len);
+    enc_slot_release(slot);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  if (dest_mac != NULL) {
+    slot->dest_mac = *dest_mac;
+  } else if (!enp_get_gateway_mac(&slot->dest_mac)) {
+    ESP_LOGW(TAG, "Device is not paired! Ommiting sending message");
+    enc_slot_release(slot);
+    return ENC_ERR_NOT_PAIRED;
+  }
+
+  slot->data[len] = '\0';
+  slot->len = len;
+  slot->_cb = cb;
+  slot->_cb_ctx = ctx;
+#if ENC_COALESCE
+  if (coalesce_submit(slot))
+    return ESP_OK;
+#endif
+  if (!enc_enqueue(slot, wait)) {
+#if ENC_COALESCE
+    coalesce_cancel(slot);
+#endif
+    enc_slot_release(slot);
+    return ENC_ERR_QUEUE_FULL;
+  }
+  return ESP_OK;
+}
+
+static bool enc_submit(enc_send_t *slot, size_t len, const enc_mac_t *dest_mac,
+                       enc_send_cb cb, void *ctx) {
+  return enc_submit_wait(slot, len, dest_mac, cb, ctx, portMAX_DELAY) == ESP_OK;
+}
+
+/**
+ * @brief Reserves a send slot and copies the message into it.
+ */
+static enc_send_t *enc_slot_from_data(const void *data, size_t len,
+                                      enc_msg_kind_e kind, TickType_t wait) {
+  enc_send_t *slot = enc_slot_reserve(kind, wait);
+  if (slot == NULL)
+    return NULL;
+
+  memcpy(slot->data, data, len);
+  slot->data[len] = '\0';
+  slot->len = len;
+  return slot;
+}
+
+enc_send_t *enc_slot_reserve(enc_msg_kind_e kind, TickType_t wait) {
+  enc_send_t *slot;
+  if (xQueueReceive(send_pool_queue, &slot, wait) != pdTRUE) {
+    ENC_STAT_INC(send_pool_exhausted);
+    return NULL;
+  }
+  stat_max(&stats.send_pool_high_water,
+           ENC_SEND_POOL_SIZE - uxQueueMessagesWaiting(send_pool_queue));
+
+  slot->data[0] = '\0';
+  slot->len = 0;
+  slot->kind = kind;
+  slot->_cb = NULL;
+  slot->_cb_ctx = NULL;
+  slot->_next = NULL;
+  slot->_merged = NULL;
+  slot->_fragments = NULL;
+  slot->_compressed = false;
+  slot->_reliable = false;
+  return slot;
+}
+
+char *enc_slot_data(enc_send_t *slot) { return slot->data; }
+
+size_t enc_slot_size() { return sizeof(enc_send_t); }
+
+size_t enc_reassembly_size() { return sizeof(enc_reassembly_t); }
+
+enc_msg_kind_e enc_slot_kind(enc_send_t *slot) { return slot->kind; }
+
+size_t enc_slot_len(enc_send_t *slot) { return slot->len; }
+
+void enc_slot_set_len(enc_send_t *slot, size_t len) { slot->len = len; }
+
+void enc_slot_release(enc_send_t *slot) {
+  xQueueSend(send_pool_queue, &slot, 0);
+}
+
+/**
+ * @brief Splits a message longer than a frame into fragments. Every fragment
+ * is queued as soon as it is filled, so the send window keeps several of them
+ * in flight.
+ *
+ * Only the first fragment waits at most wait ticks. Once it is queued the
+ * message cannot be taken back, the rest waits for the send task, which frees
+ * slots and room even when every frame fails.
+ */
+static esp_err_t enc_send_fragmented(const uint8_t *data, size_t len,
+                                     const enc_mac_t *dest_mac,
+                                     enc_msg_kind_e kind, TickType_t wait,
+                                     enc_send_cb cb, void *ctx) {
+  if (len > ENC_MAX_MESSAGE_SIZE) {
+    ESP_LOGE(TAG, "Message too long (%u bytes)! Ommiting sending message",
+             (unsigned)len);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  enc_mac_t dest;
+  if (dest_mac != NULL) {
+    dest = *dest_mac;
+  } else if (!enp_get_gateway_mac(&dest)) {
+    ESP_LOGW(TAG, "Device is not paired! Ommiting sending message");
+    return ENC_ERR_NOT_PAIRED;
+  }
+
+  uint8_t count =
+      (len + ENC_FRAGMENT_PAYLOAD_LEN - 1) / ENC_FRAGMENT_PAYLOAD_LEN;
+  uint8_t msg_id = __atomic_fetch_add(&fragment_msg_id, 1, __ATOMIC_RELAXED);
+  enc_send_t *head = NULL;
+
+  for (uint8_t i = 0; i < count; i++) {
+    size_t offset = (size_t)i * ENC_FRAGMENT_PAYLOAD_LEN;
+    size_t chunk = len - offset;
+    if (chunk > ENC_FRAGMENT_PAYLOAD_LEN)
+      chunk = ENC_FRAGMENT_PAYLOAD_LEN;
+
+    TickType_t start = xTaskGetTickCount();
+    enc_send_t *slot = enc_slot_reserve(kind, (i == 0) ? wait : portMAX_DELAY);
+    if (slot == NULL)
+      return ENC_ERR_QUEUE_FULL;
+
+    slot->data[0] = ENC_FRAME_FRAGMENT;
+    slot->data[1] = msg_id;
+    slot->data[2] = i;
+    slot->data[3] = count;
+    memcpy(slot->data + ENC_FRAGMENT_HEADER_LEN, data + offset, chunk);
+
+    if (head == NULL) {
+      head = slot;
+      head->_fragments_pending = count;
+      head->_fragments_status = ESP_NOW_SEND_SUCCESS;
+    }
+    slot->_fragments = head;
+
+    esp_err_t err = enc_submit_wait(
+        slot, ENC_FRAGMENT_HEADER_LEN + chunk, &dest,
+        (slot == head) ? cb : NULL, (slot == head) ? ctx : NULL,
+        (i == 0) ? ticks_left(start, wait) : portMAX_DELAY);
+    if (err != ESP_OK)
+      return err;
+  }
+  return ESP_OK;
+}
+
+bool enc_slot_send_async(enc_send_t *slot, size_t len, enc_send_cb cb,
+                         void *ctx) {
+  return enc_submit(slot, len, NULL, cb, ctx);
+}
+
+bool enc_slot_send_with_result(enc_send_t *slot, size_t len) {
+  return enc_sent(enc_slot_try_send_with_result(slot, len, portMAX_DELAY));
+}
+
+esp_err_t enc_slot_try_send_async(enc_send_t *slot, size_t len, TickType_t wait,
+                                  enc_send_cb cb, void *ctx) {
+  return enc_submit_wait(slot, len, NULL, cb, ctx, wait);
+}
+
+esp_err_t enc_slot_try_send_with_result(enc_send_t *slot, size_t len,
+                                        TickType_t wait) {
+  TickType_t start = xTaskGetTickCount();
+  enc_waiter_t *waiter = waiter_get();
+  if (waiter == NULL) {
+    enc_slot_release(slot);
+    return ENC_ERR_QUEUE_FULL;
+  }
+  esp_err_t err =
+      enc_slot_try_send_async(slot, len, wait, enc_notify_result, waiter);
+  if (err != ESP_OK) {
+    waiter_put(waiter);
+    return err;
+  }
+  return enc_wait_for_result(waiter, ticks_left(start, wait));
+}
+
+bool enc_slot_send_to_async(enc_send_t *slot, const enc_mac_t *dest_mac,
+                            size_t len, enc_send_cb cb, void *ctx) {
+  return enc_submit(slot, len, dest_mac, cb, ctx);
+}
+
+static esp_err_t enc_send_kind_wait(const enc_mac_t *dest_mac,
+                                    const void *data, size_t len,
+                                    enc_msg_kind_e kind, TickType_t wait,
+                                    enc_send_cb cb, void *ctx) {
+  if (len > ENC_FRAME_MAX_LEN)
+    return enc_send_fragmented(data, len, dest_mac, kind, wait, cb, ctx);
+
+  TickType_t start = xTaskGetTickCount();
+  enc_send_t *slot = enc_slot_from_data(data, len, kind, wait);
+  if (slot == NULL)
+    return ENC_ERR_QUEUE_FULL;
+  return enc_submit_wait(slot, len, dest_mac, cb, ctx, ticks_left(start, wait));
+}
+
+static bool enc_send_kind_async(const enc_mac_t *dest_mac, const void *data,
+                                size_t len, enc_msg_kind_e kind,
+                                enc_send_cb cb, void *ctx) {
+  return enc_send_kind_wait(dest_mac, data, len, kind, portMAX_DELAY, cb,
+                            ctx) == ESP_OK;
+}
+
+bool enc_send_to_async(const enc_mac_t *dest_mac, const void *data, size_t len,
+                       enc_send_cb cb, void *ctx) {
+  return enc_send_kind_async(dest_mac, data, len, ENC_MSG_CONTROL, cb, ctx);
+}
+
+bool enc_send_to_with_result(const enc_mac_t *dest_mac, const char *data) {
+  enc_waiter_t *waiter = waiter_get();
+  if (waiter == NULL)
+    return false;
+  if (!enc_send_to_async(dest_mac, data, strlen(data), enc_notify_result,
+                         waiter)) {
+    waiter_put(waiter);
+    return false;
+  }
+  return enc_wait_for_result(waiter, portMAX_DELAY) == ESP_OK;
+}
+
+bool enc_send_async(const void *data, size_t len, enc_send_cb cb, void *ctx) {
+  if (!enp_get_gateway_mac(NULL)) {
+    ESP_LOGW(TAG, "Device is not paired! Ommiting sending message");
+    return false;
+  }
+
+  return enc_send_to_async(NULL, data, len, cb, ctx);
+}
+
+bool enc_send_kind_with_result(const char *data, enc_msg_kind_e kind) {
+  if (!enp_get_gateway_mac(NULL)) {
+    ESP_LOGW(TAG, "Device is not paired! Ommiting sending message");
+    return false;
+  }
+
+  return enc_sent(enc_try_send_with_result(data, kind, portMAX_DELAY));
+}
+
+bool enc_send_with_result(const char *data) {
+  return enc_send_kind_with_result(data, ENC_MSG_CONTROL);
+}
+
+esp_err_t enc_try_send_async(const void *data, size_t len, enc_msg_kind_e kind,
+                             TickType_t wait, enc_send_cb cb, void *ctx) {
+  if (!enp_get_gateway_mac(NULL))
+    return ENC_ERR_NOT_PAIRED;
+
+  return enc_send_kind_wait(NULL, data, len, kind, wait, cb, ctx);
+}
+
+esp_err_t enc_try_send_with_result(const char *data, enc_msg_kind_e kind,
+                                   TickType_t wait) {
+  TickType_t start = xTaskGetTickCount();
+  enc_waiter_t *waiter = waiter_get();
+  if (waiter == NULL)
+    return ENC_ERR_QUEUE_FULL;
+  esp_err_t err = enc_try_send_async(data, strlen(data), kind, wait,
+                                     enc_notify_result, waiter);
+  if (err != ESP_OK) {
+    waiter_put(waiter);
+    return err;
+  }
+  return enc_wait_for_result(waiter, ticks_left(start, wait));
+}
+
+void enc_set_watermark_cb(enc_watermark_cb cb, void *ctx) {
+  watermark_ctx = ctx;
+  watermark_cb = cb;
+}
+
+bool enc_send_queue_congested(enc_msg_kind_e kind) {
+  return __atomic_load_n(&send_queue_congested[kind], __ATOMIC_RELAXED);
+}
+
+void enc_send_no_result(const char *data) {
+  enc_send_async(data, strlen(data), NULL, NULL);
+}
+
+void enc_send_to_broadcast(const char *data) {
+  enc_send_to_async(&esp_now_broadcast_mac, data, strlen(data), NULL, NULL);
+}
+
+void enc_get_stats(enc_stats_t *out) {
+  // every counter is a single aligned word, so none of them can be torn
+  *out = stats;
+}
+
+int enc_get_peer_stats(enc_peer_stats_t *peers, int max_peers) {
+  int count = 0;
+
+  ENC_ENTER_CRITICAL();
+  for (int i = 0; i < ENC_PEER_CACHE_SIZE && count < max_peers; i++) {
+    if (!rx_peers[i].in_use)
+      continue;
+    enc_peer_stats_t *peer = &peers[count++];
+    peer->mac = rx_peers[i].mac;
+    peer->frames = rx_peers[i].frames;
+    peer->rssi_min = rx_peers[i].rssi_min;
+    peer->rssi_avg = rx_peers[i].rssi_avg / ENC_RSSI_AVG_SCALE;
+    peer->rssi_max = rx_peers[i].rssi_max;
+  }
+  ENC_EXIT_CRITICAL();
+
+  return count;
 }
\ No newline at end of file
@@ -5,35 +5,189 @@
 #include "freertos/FreeRTOS.h"
 
 #define ENC_CHANNEL CONFIG_ENC_CHANNEL
+#define ENC_MAX_CHANNEL CONFIG_ENC_MAX_CHANNEL
 #define ENC_SEND_QUEUE_SIZE CONFIG_ENC_SEND_QUEUE_SIZE
+#define ENC_STATUS_QUEUE_SIZE CONFIG_ENC_STATUS_QUEUE_SIZE
+#define ENC_DATA_QUEUE_SIZE CONFIG_ENC_DATA_QUEUE_SIZE
+#define ENC_SEND_STARVATION_LIMIT CONFIG_ENC_SEND_STARVATION_LIMIT
+#define ENC_WATERMARK_HIGH_PERCENT CONFIG_ENC_WATERMARK_HIGH_PERCENT
+#define ENC_WATERMARK_LOW_PERCENT CONFIG_ENC_WATERMARK_LOW_PERCENT
 #define ENC_RECIEVE_QUEUE_SIZE CONFIG_ENC_RECIEVE_QUEUE_SIZE
 #define ENC_RESULT_QUEUE_SIZE CONFIG_ENC_RESULT_QUEUE_SIZE
+#define ENC_PEER_CACHE_SIZE CONFIG_ENC_PEER_CACHE_SIZE
+#define ENC_SEND_WINDOW CONFIG_ENC_SEND_WINDOW
+#define ENC_AIRTIME_PERMILLE CONFIG_ENC_AIRTIME_PERMILLE
+#define ENC_AIRTIME_BURST_MS CONFIG_ENC_AIRTIME_BURST_MS
+#define ENC_BACKOFF_BASE_MS CONFIG_ENC_BACKOFF_BASE_MS
+#define ENC_BACKOFF_MAX_MS CONFIG_ENC_BACKOFF_MAX_MS
+#define ENC_RECEIVE_POOL_SIZE CONFIG_ENC_RECEIVE_POOL_SIZE
+#define ENC_SEND_POOL_SIZE CONFIG_ENC_SEND_POOL_SIZE
+#define ENC_MAX_MESSAGE_SIZE CONFIG_ENC_MAX_MESSAGE_SIZE
+#define ENC_REASSEMBLY_BUFFERS CONFIG_ENC_REASSEMBLY_BUFFERS
+#define ENC_REASSEMBLY_TIMEOUT_MS CONFIG_ENC_REASSEMBLY_TIMEOUT_MS
+#define ENC_RELIABLE CONFIG_ENC_RELIABLE
+#define ENC_RELIABLE_MAX_RETRIES CONFIG_ENC_RELIABLE_MAX_RETRIES
+#define ENC_RELIABLE_INITIAL_RTO_MS CONFIG_ENC_RELIABLE_INITIAL_RTO_MS
+#define ENC_RELIABLE_MIN_RTO_MS CONFIG_ENC_RELIABLE_MIN_RTO_MS
+#define ENC_RELIABLE_MAX_RTO_MS CONFIG_ENC_RELIABLE_MAX_RTO_MS
+#define ENC_COALESCE CONFIG_ENC_COALESCE
+#define ENC_AGGREGATION CONFIG_ENC_AGGREGATION
+#define ENC_AGGREGATION_FLUSH_MS CONFIG_ENC_AGGREGATION_FLUSH_MS
+#define ENC_COMPRESSION CONFIG_ENC_COMPRESSION
 
-#ifdef CONFIG_IDF_TARGET_ESP8266
-typedef struct {
-  uint8_t src_addr[ESP_NOW_ETH_ALEN]; /**< Source address of ESPNOW packet */
-  uint8_t
-      des_addr[ESP_NOW_ETH_ALEN]; /**< Destination address of ESPNOW packet */
-
-} esp_now_recv_info_t;
+// Longest frame the send path accepts, reliable frames need room for the
+// boot epoch and the sequence number
+#if ENC_RELIABLE
+#define ENC_FRAME_MAX_LEN (ESP_NOW_MAX_DATA_LEN - 4)
+#else
+#define ENC_FRAME_MAX_LEN ESP_NOW_MAX_DATA_LEN
 #endif
 
+// Errors of the try variants, above the ranges used by ESP-IDF
+#define ENC_ERR_BASE 0x12000
+#define ENC_ERR_QUEUE_FULL (ENC_ERR_BASE + 1) // no room before the timeout
+#define ENC_ERR_NOT_PAIRED (ENC_ERR_BASE + 2) // no gateway to send to
+#define ENC_ERR_SUPERSEDED (ENC_ERR_BASE + 3) // replaced before it was sent
+
+// Result of a status or data message a newer one replaced before it was sent
+#define ENC_SEND_SUPERSEDED ((esp_now_send_status_t)2)
+
 typedef union {
   uint8_t bytes[6];
   uint64_t value;
 } enc_mac_t;
 
 typedef struct {
-  esp_now_recv_info_t esp_now_info;
-  char data[ESP_NOW_MAX_DATA_LEN];
+  enc_mac_t src_mac;
+  int rssi;
+  char data[ESP_NOW_MAX_DATA_LEN + 1];
   int data_len;
 } enc_event_receive_cb_t;
 
+// Kinds of messages, also their send priority from the highest
+typedef enum {
+  ENC_MSG_CONTROL,
+  ENC_MSG_STATUS,
+  ENC_MSG_DATA,
+} enc_msg_kind_e;
+
+#define ENC_MSG_KINDS 3
+
+// Counters of the whole stack since enc_init, updated without locking
+typedef struct {
+  uint32_t frames_sent;   // accepted by esp_now_send
+  uint32_t frames_failed; // rejected by esp_now_send or not received
+  uint32_t frames_acked;  // confirmed by the receiver
+  uint32_t retransmissions;
+  uint32_t reliable_failures; // no ack after all retransmissions
+  uint32_t backoffs;          // sending paused after a failed frame
+
+  uint32_t send_queue_full[ENC_MSG_KINDS]; // producer had to wait for room
+  uint32_t send_result_queue_full; // send result dropped
+  uint32_t receive_queue_full;     // received frame dropped
+  uint32_t receive_pool_exhausted; // received frame dropped
+  uint32_t send_pool_exhausted;    // no send slot free before the timeout
+  uint32_t ack_queue_full;         // received ack dropped
+  uint32_t acks_dropped;           // ack not sent, no slot or queue room
+  uint32_t send_queue_high_water[ENC_MSG_KINDS];
+  uint32_t receive_queue_high_water;
+  uint32_t send_pool_high_water;  // slots reserved at once
+  uint32_t reassembly_high_water; // long messages collected at once
+
+  uint32_t coalesced; // queued messages replaced by a newer one
+  uint32_t compress_in;  // bytes of the compressed frames before compression
+  uint32_t compress_out; // and after it
+
+  uint32_t unknown_sender; // messages not from the gateway once paired
+  uint32_t duplicates;
+  uint32_t reassembly_timeouts;
+  uint32_t peer_cache_hits;
+  uint32_t peer_cache_misses;
+
+  // filled in by link_get_stats
+  uint32_t commands_dropped; // no command worker had room for them
+} enc_stats_t;
+
+// Signal of the frames received from one peer, the average is exponential
+typedef struct {
+  enc_mac_t mac;
+  uint32_t frames;
+  int8_t rssi_min;
+  int8_t rssi_avg;
+  int8_t rssi_max;
+} enc_peer_stats_t;
+
+// Sequence numbers of the reliable frames exchanged with one paired peer,
+// kept along with its pairing so other senders cannot evict them
+typedef struct {
+  uint16_t tx_seq;     // next sequence number sent to the peer
+  uint16_t rx_highest; // highest sequence number received from it
+  uint32_t rx_window;  // bit n set when rx_highest - n was received
+  uint8_t rx_epoch;    // boot of the peer the window belongs to
+  bool rx_valid;
+} enc_reliable_peer_t;
+
+// Preallocated send buffer, handed to the send task by reference
+typedef struct enc_send enc_send_t;
+
+// Called from the send task once the result of a message is known, must not
+// block
+typedef void (*enc_send_cb)(esp_now_send_status_t status, void *ctx);
+
+// Called once a send queue fills up to the high watermark (above is true) and
+// once it drains to the low watermark again, from the task that moved it
+// across; must not block
+typedef void (*enc_watermark_cb)(enc_msg_kind_e kind, bool above, void *ctx);
+
 extern const enc_mac_t esp_now_broadcast_mac;
 
 void enc_init();
+// Records a reliable frame of the peer, false if it was received before
+bool enc_reliable_accept(enc_reliable_peer_t *peer, uint8_t epoch,
+                         uint16_t seq);
+void enc_set_channel(uint8_t channel);
+uint8_t enc_get_channel();
+bool enc_send_async(const void *data, size_t len, enc_send_cb cb, void *ctx);
 bool enc_send_with_result(const char *data);
+bool enc_send_kind_with_result(const char *data, enc_msg_kind_e kind);
 void enc_send_no_result(const char *data);
 void enc_send_to_broadcast(const char *data);
+bool enc_send_to_async(const enc_mac_t *dest_mac, const void *data, size_t len,
+                       enc_send_cb cb, void *ctx);
+bool enc_send_to_with_result(const enc_mac_t *dest_mac, const char *data);
+
+// Give up with ENC_ERR_QUEUE_FULL when the message cannot be queued within
+// wait ticks. A fragmented message only waits for its first fragment, the rest
+// follows as the send task frees room. The variants with a result give up
+// waiting for it with ESP_ERR_TIMEOUT once wait ticks have passed in all.
+esp_err_t enc_try_send_async(const void *data, size_t len, enc_msg_kind_e kind,
+                             TickType_t wait, enc_send_cb cb, void *ctx);
+esp_err_t enc_try_send_with_result(const char *data, enc_msg_kind_e kind,
+                                   TickType_t wait);
+
+void enc_set_watermark_cb(enc_watermark_cb cb, void *ctx);
+bool enc_send_queue_congested(enc_msg_kind_e kind);
+
+enc_send_t *enc_slot_reserve(enc_msg_kind_e kind, TickType_t wait);
+char *enc_slot_data(enc_send_t *slot);
+// Bytes of one send slot and of one reassembly buffer
+size_t enc_slot_size();
+size_t enc_reassembly_size();
+enc_msg_kind_e enc_slot_kind(enc_send_t *slot);
+size_t enc_slot_len(enc_send_t *slot);
+void enc_slot_set_len(enc_send_t *slot, size_t len);
+void enc_slot_release(enc_send_t *slot);
+bool enc_slot_send_async(enc_send_t *slot, size_t len, enc_send_cb cb,
+                         void *ctx);
+bool enc_slot_send_with_result(enc_send_t *slot, size_t len);
+bool enc_slot_send_to_async(enc_send_t *slot, const enc_mac_t *dest_mac,
+                            size_t len, enc_send_cb cb, void *ctx);
+esp_err_t enc_slot_try_send_async(enc_send_t *slot, size_t len, TickType_t wait,
+                                  enc_send_cb cb, void *ctx);
+esp_err_t enc_slot_try_send_with_result(enc_send_t *slot, size_t len,
+                                        TickType_t wait);
+
+void enc_get_stats(enc_stats_t *stats);
+int enc_get_peer_stats(enc_peer_stats_t *peers, int max_peers);
 
 #endif // ESP_NOW_COMMUNICATION_H_
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "esp_now_compress.h"
+
+#if ENC_COMPRESSION
+
+#include <string.h>
+
+// Bytes below 0x80 stand for themselves, 0x80 + n for the entry n of the
+// dictionary and the escape for the byte that follows it
+#define ENC_DICT_FIRST 0x80
+#define ENC_DICT_ESCAPE 0xFF
+#define ENC_DICT_NONE 0xFF
+
+// Entries are looked up by a hash of their first two bytes
+#define ENC_DICT_BUCKETS 128
+#define ENC_DICT_HASH(a, b) ((((a) * 31u) + (b)) % ENC_DICT_BUCKETS)
+
+// Pieces of the messages this component sends, at least two bytes long. The
+// order is part of the frame format, new entries only go at the end.
+static const char *const dict[] = {
+    // protocol
+    "SHPR:{\"type\":", "SHPR:PAIRED", "\"cfg\":", ",\"schema\":{\"S\":[",
+    "],\"D\":[", ",\"z\":1}", "!S:{", "!D:{", "!T:{", "!S:", "!D:",
+    "!s:", "!d:", "!s=", "!d=", "#S:", "#D:", "!RESYNC",
+    // JSON
+    "\":\"", "\",\"", "\":{\"", "\":[", "\":", ",\"", "{\"", "\"}", "}}",
+    "\"]", "],\"", "},\"", "true", "false", "null", "\":0", "\":1", ".0",
+    "00",
+    // schema types
+    ":bool\"", ":u8\"", ":i8\"", ":u16\"", ":i16\"", ":u32\"", ":i32\"",
+    ":f32\"", ":str\"",
+    // telemetry keys
+    "\"tx\":", "\"fail\":", "\"ack\":", "\"rtx\":", "\"lost\":", "\"full\":",
+    "\"sq\":[", "\"res\":", "\"rq\":", "\"pool\":", "\"hw\":", "\"coal\":",
+    "\"z\":[", "\"unk\":", "\"rssi\":[",
+    // common keys
+    "\"temp\":", "\"temperature\":", "\"hum\":", "\"humidity\":",
+    "\"press\":", "\"pressure\":", "\"bat\":", "\"battery\":", "\"volt\":",
+    "\"voltage\":", "\"current\":", "\"power\":", "\"energy\":", "\"light\":",
+    "\"lux\":", "\"motion\":", "\"state\":", "\"status\":", "\"value\":",
+    "\"mode\":", "\"level\":", "\"on\":", "\"off\":", "\"rssi\":",
+    "\"uptime\":", "\"error\":", "\"name\":", "\"id\":", "\"version\":",
+    "\"count\":", "\"co2\":", "\"pm25\":", "\"brightness\":", "\"color\":",
+    "\"speed\":", "\"position\":", "\"door\":", "\"window\":", "\"water\":",
+    "\"gas\":", "\"alarm\":", "\"relay\":", "\"switch\":", "\"button\":",
+    "\"target\":", "\"setpoint\":", "\"heating\":", "\"sensor\":",
+    "\"data\":", "\"time\":", "\"interval\":",
+};
+
+#define ENC_DICT_SIZE (sizeof(dict) / sizeof(dict[0]))
+
+_Static_assert(ENC_DICT_SIZE <= ENC_DICT_ESCAPE - ENC_DICT_FIRST,
+               "dictionary entries would collide with the escape byte");
+
+static uint8_t dict_len[ENC_DICT_SIZE];
+static uint8_t dict_head[ENC_DICT_BUCKETS];
+static uint8_t dict_next[ENC_DICT_SIZE];
+
+/**
+ * @brief Builds the lookup chains of the dictionary.
+ *
+ * @return The RAM used by the compressor in bytes.
+ */
+size_t enc_compress_init() {
+  memset(dict_head, ENC_DICT_NONE, sizeof(dict_head));
+  for (int i = ENC_DICT_SIZE - 1; i >= 0; i--) {
+    const uint8_t *entry = (const uint8_t *)dict[i];
+    uint8_t bucket = ENC_DICT_HASH(entry[0], entry[1]);
+    dict_len[i] = strlen(dict[i]);
+    dict_next[i] = dict_head[bucket];
+    dict_head[bucket] = i;
+  }
+  return sizeof(dict_len) + sizeof(dict_head) + sizeof(dict_next);
+}
+
+/**
+ * @brief Replaces the longest dictionary entry at every position by its code.
+ *
+ * @return The compressed length, or -1 if it does not fit into size bytes.
+ */
+int enc_compress(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+  size_t written = 0;
+
+  for (size_t i = 0; i < len;) {
+    int best = -1;
+    size_t best_len = 1;
+
+    if (i + 1 < len) {
+      for (uint8_t e = dict_head[ENC_DICT_HASH(in[i], in[i + 1])];
+           e != ENC_DICT_NONE; e = dict_next[e]) {
+        size_t n = dict_len[e];
+        if (n > best_len && n <= len - i && memcmp(in + i, dict[e], n) == 0) {
+          best = e;
+          best_len = n;
+        }
+      }
+    }
+
+    if (best >= 0) {
+      if (written + 1 > size)
+        return -1;
+      out[written++] = ENC_DICT_FIRST + best;
+    } else {
+      if (written + ((in[i] >= ENC_DICT_FIRST) ? 2 : 1) > size)
+        return -1;
+      if (in[i] >= ENC_DICT_FIRST)
+        out[written++] = ENC_DICT_ESCAPE;
+      out[written++] = in[i];
+    }
+    i += best_len;
+  }
+  return written;
+}
+
+/**
+ * @return The decompressed length, or -1 if the input is malformed or does
+ * not fit into size bytes.
+ */
+int enc_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+  size_t written = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    const uint8_t *piece = &in[i];
+    size_t n = 1;
+
+    if (in[i] == ENC_DICT_ESCAPE) {
+      if (++i == len)
+        return -1;
+      piece = &in[i];
+    } else if (in[i] >= ENC_DICT_FIRST) {
+      uint8_t e = in[i] - ENC_DICT_FIRST;
+      if (e >= ENC_DICT_SIZE)
+        return -1;
+      piece = (const uint8_t *)dict[e];
+      n = dict_len[e];
+    }
+
+    if (written + n > size)
+      return -1;
+    memcpy(out + written, piece, n);
+    written += n;
+  }
+  return written;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef ESP_NOW_COMPRESS_H_
+#define ESP_NOW_COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_now_communication.h"
+
+#if ENC_COMPRESSION
+size_t enc_compress_init();
+int enc_compress(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+int enc_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+#endif
+
+#endif // ESP_NOW_COMPRESS_H_
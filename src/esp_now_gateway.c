@@ -0,0 +1,840 @@
+#include "esp_now_gateway.h"
+
+#if LINK_ROLE_GATEWAY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+#include "link_delta.h"
+
+#ifndef CONFIG_IDF_TARGET_ESP8266
+#include "esp_mac.h"
+#endif
+
+static const char *TAG = "Link_ENG";
+
+#define NVS_NAME "GATEWAY"
+#define NVS_COUNT_KEY "count"
+#define NVS_NODE_KEY_FMT "n%u"
+#define NVS_TYPES_KEY "types"
+
+#define PAIR_REQUEST_PREFIX "SHPR:{"
+
+#define ENG_SCHEMA_STATUS 0
+#define ENG_SCHEMA_DATA 1
+
+// Open addressing with linear probing, kept at most half full so probe
+// sequences stay short
+#define ENG_TABLE_SIZE (2 * LINK_GATEWAY_MAX_NODES)
+#define ENG_TABLE_EMPTY 0
+
+#define ENG_MAC_MASK 0xFFFFFFFFFFFFULL
+
+// Schemas devices of a type announced, stored in NVS together for all types
+typedef struct {
+  int type;
+  link_field_t schema[2][LINK_MAX_FIELDS]; // binary status and data fields
+} eng_schema_t;
+
+// Device types are added by registering a handler or by a pair request with
+// a schema, and never removed
+typedef struct {
+  eng_schema_t saved;
+  link_gateway_message_cb cb;
+} eng_type_t;
+
+// Options the node agreed to when pairing
+#define ENG_NODE_COMPRESS (1 << 0)
+#define ENG_NODE_DELTA (1 << 1)
+
+// Stored in NVS. Older versions stored only the node.
+typedef struct {
+  link_node_t node;
+  uint8_t flags;
+} eng_record_t;
+
+typedef struct {
+  link_node_t node;
+  uint8_t flags;
+  eng_type_t *kind; // type of the node, cached on pairing
+  enc_reliable_peer_t reliable;
+#if LINK_DELTA
+  int16_t delta; // entry in delta_pool, -1 for none
+#endif
+} eng_node_t;
+
+#if LINK_DELTA
+// Last status and data message of the nodes that send delta messages. Only
+// LINK_GATEWAY_DELTA_NODES of them get an entry when pairing.
+typedef struct {
+  char base[2][ENC_FRAME_MAX_LEN + 1];
+  bool in_use;
+} eng_delta_t;
+
+static eng_delta_t delta_pool[LINK_GATEWAY_DELTA_NODES];
+#endif
+
+// Paired nodes are kept densely, so they are stored in NVS under their index.
+// The table maps a MAC to the index + 1 of its node.
+static eng_node_t nodes[LINK_GATEWAY_MAX_NODES];
+static uint16_t node_count;
+static uint16_t table[ENG_TABLE_SIZE];
+
+static eng_type_t types[LINK_GATEWAY_MAX_TYPES];
+static int type_count;
+
+#ifdef CONFIG_IDF_TARGET_ESP8266
+#define ENG_ENTER_CRITICAL() taskENTER_CRITICAL()
+#define ENG_EXIT_CRITICAL() taskEXIT_CRITICAL()
+#else
+static portMUX_TYPE mutex_mux = portMUX_INITIALIZER_UNLOCKED;
+#define ENG_ENTER_CRITICAL() taskENTER_CRITICAL(&mutex_mux)
+#define ENG_EXIT_CRITICAL() taskEXIT_CRITICAL(&mutex_mux)
+#endif
+
+// Taken by the receive task while pairing and by users of the public API.
+// Created on first use, as handlers may be registered before eng_init.
+static StaticSemaphore_t mutex_buffer;
+static SemaphoreHandle_t xMutex;
+static nvs_handle_t nvs;
+
+static void eng_lock() {
+  if (__atomic_load_n(&xMutex, __ATOMIC_ACQUIRE) == NULL) {
+    ENG_ENTER_CRITICAL();
+    if (xMutex == NULL)
+      __atomic_store_n(&xMutex, xSemaphoreCreateMutexStatic(&mutex_buffer),
+                       __ATOMIC_RELEASE);
+    ENG_EXIT_CRITICAL();
+  }
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+}
+
+static inline void eng_unlock() { xSemaphoreGive(xMutex); }
+
+static inline uint64_t eng_key(const enc_mac_t *mac) {
+  return mac->value & ENG_MAC_MASK;
+}
+
+static inline uint32_t eng_home(uint64_t key) {
+  // Fibonacci hashing spreads MACs of the same vendor over the whole table
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) % ENG_TABLE_SIZE;
+}
+
+/**
+ * @brief Finds the table slot of the MAC, or the empty slot where it would be
+ * inserted.
+ */
+static uint32_t eng_probe(const enc_mac_t *mac) {
+  uint64_t key = eng_key(mac);
+  uint32_t slot = eng_home(key);
+
+  while (table[slot] != ENG_TABLE_EMPTY &&
+         eng_key(&nodes[table[slot] - 1].node.mac) != key)
+    slot = (slot + 1) % ENG_TABLE_SIZE;
+  return slot;
+}
+
+static eng_node_t *eng_find(const enc_mac_t *mac) {
+  uint32_t slot = eng_probe(mac);
+  if (table[slot] == ENG_TABLE_EMPTY)
+    return NULL;
+  return &nodes[table[slot] - 1];
+}
+
+/**
+ * @brief Empties the slot and moves the following entries of the probe
+ * sequence back, so lookups never need tombstones.
+ */
+static void eng_table_remove(uint32_t slot) {
+  uint32_t next = slot;
+
+  while (1) {
+    next = (next + 1) % ENG_TABLE_SIZE;
+    if (table[next] == ENG_TABLE_EMPTY)
+      break;
+
+    uint32_t home = eng_home(eng_key(&nodes[table[next] - 1].node.mac));
+    // the entry may move back unless its home lies cyclically in (slot, next]
+    bool in_between = (slot <= next) ? (slot < home && home <= next)
+                                     : (slot < home || home <= next);
+    if (!in_between) {
+      table[slot] = table[next];
+      slot = next;
+    }
+  }
+  table[slot] = ENG_TABLE_EMPTY;
+}
+
+/**
+ * @brief Returns the entry of the device type, adding it when add is set and
+ * there is room.
+ */
+static eng_type_t *eng_type_get(int type, bool add) {
+  for (int i = 0; i < type_count; i++) {
+    if (types[i].saved.type == type)
+      return &types[i];
+  }
+  if (!add || type_count == LINK_GATEWAY_MAX_TYPES)
+    return NULL;
+
+  eng_type_t *entry = &types[type_count++];
+  memset(entry, 0, sizeof(*entry));
+  entry->saved.type = type;
+  return entry;
+}
+
+static void eng_nvs_store_types() {
+  eng_schema_t saved[LINK_GATEWAY_MAX_TYPES];
+  for (int i = 0; i < type_count; i++)
+    saved[i] = types[i].saved;
+  nvs_set_blob(nvs, NVS_TYPES_KEY, saved, type_count * sizeof(eng_schema_t));
+}
+
+static void eng_nvs_load_types() {
+  eng_schema_t saved[LINK_GATEWAY_MAX_TYPES];
+  size_t size = sizeof(saved);
+  if (nvs_get_blob(nvs, NVS_TYPES_KEY, saved, &size) != ESP_OK)
+    return;
+
+  for (size_t i = 0; i < size / sizeof(eng_schema_t); i++) {
+    eng_type_t *entry = eng_type_get(saved[i].type, true);
+    if (entry != NULL)
+      memcpy(entry->saved.schema, saved[i].schema, sizeof(saved[i].schema));
+  }
+}
+
+static void eng_nvs_store(uint16_t index) {
+  char key[16];
+  snprintf(key, sizeof(key), NVS_NODE_KEY_FMT, index);
+  eng_record_t record = {nodes[index].node, nodes[index].flags};
+  nvs_set_blob(nvs, key, &record, sizeof(record));
+}
+
+#if LINK_DELTA
+/**
+ * @brief Gives the node an entry in the delta pool, if it has none yet and
+ * one is free. Called with the mutex taken.
+ */
+static bool eng_delta_attach(eng_node_t *entry) {
+  if (entry->delta < 0) {
+    for (int i = 0; i < LINK_GATEWAY_DELTA_NODES; i++) {
+      if (!delta_pool[i].in_use) {
+        delta_pool[i].in_use = true;
+        entry->delta = i;
+        break;
+      }
+    }
+  }
+  if (entry->delta < 0)
+    return false;
+
+  // a node pairing again starts over with full messages
+  delta_pool[entry->delta].base[0][0] = '\0';
+  delta_pool[entry->delta].base[1][0] = '\0';
+  return true;
+}
+
+static void eng_delta_detach(eng_node_t *entry) {
+  if (entry->delta >= 0)
+    delta_pool[entry->delta].in_use = false;
+  entry->delta = -1;
+}
+#endif
+
+static void eng_nvs_store_count() {
+  nvs_set_u16(nvs, NVS_COUNT_KEY, node_count);
+  nvs_commit(nvs);
+}
+
+static void eng_nvs_load() {
+  eng_lock();
+  eng_nvs_load_types();
+
+  uint16_t count = 0;
+  nvs_get_u16(nvs, NVS_COUNT_KEY, &count);
+  if (count > LINK_GATEWAY_MAX_NODES)
+    count = LINK_GATEWAY_MAX_NODES;
+
+  for (uint16_t i = 0; i < count; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), NVS_NODE_KEY_FMT, i);
+
+    eng_record_t record = {0};
+    size_t size = sizeof(record);
+    if (nvs_get_blob(nvs, key, &record, &size) != ESP_OK ||
+        (size != sizeof(record) && size != sizeof(link_node_t)))
+      break;
+
+    uint32_t slot = eng_probe(&record.node.mac);
+    if (table[slot] != ENG_TABLE_EMPTY)
+      continue;
+
+    eng_node_t *entry = &nodes[node_count];
+    entry->node = record.node;
+    entry->flags = record.flags;
+    entry->kind = eng_type_get(record.node.type, false);
+    memset(&entry->reliable, 0, sizeof(enc_reliable_peer_t));
+#if LINK_DELTA
+    entry->delta = -1;
+    // the pool only runs short when LINK_GATEWAY_DELTA_NODES was lowered,
+    // deltas of the node then get resyncs until it pairs again
+    if ((entry->flags & ENG_NODE_DELTA) && !eng_delta_attach(entry))
+      ESP_LOGW(TAG, "No delta entry left for " MACSTR,
+               MAC2STR(record.node.mac.bytes));
+#endif
+    table[slot] = ++node_count;
+  }
+  eng_unlock();
+
+  ESP_LOGI(TAG, "Retrieved %u paired devices from NVS", node_count);
+}
+
+/**
+ * @brief Returns the length of the JSON value at the start of the text.
+ */
+static size_t eng_json_value_len(const char *json) {
+  int depth = 0;
+  bool in_string = false;
+  size_t i;
+
+  for (i = 0; json[i] != '\0'; i++) {
+    char c = json[i];
+    if (in_string) {
+      if (c == '\\' && json[i + 1] != '\0')
+        i++;
+      else if (c == '"')
+        in_string = false;
+    } else if (c == '"') {
+      in_string = true;
+    } else if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0)
+        return i;
+      if (--depth == 0)
+        return i + 1;
+    } else if (c == ',' && depth == 0) {
+      return i;
+    }
+  }
+  return i;
+}
+
+static const char *eng_json_skip_space(const char *json) {
+  while (*json == ' ' || *json == '\t' || *json == '\r' || *json == '\n')
+    json++;
+  return json;
+}
+
+/**
+ * @brief Finds a member of the JSON object at the start of the text. Only
+ * members at the top level of the object are looked at, so none of a nested
+ * value is mistaken for it.
+ *
+ * @return The start of the value of the member, or NULL. len receives the
+ * length of the value.
+ */
+static const char *eng_json_member(const char *json, const char *key,
+                                   size_t *len) {
+  size_t key_len = strlen(key);
+  if (*json != '{')
+    return NULL;
+  json++;
+
+  while (1) {
+    json = eng_json_skip_space(json);
+    if (*json != '"')
+      return NULL;
+    const char *name = ++json;
+    while (*json != '\0' && *json != '"') {
+      if (*json == '\\' && json[1] != '\0')
+        json++;
+      json++;
+    }
+    if (*json != '"')
+      return NULL;
+    size_t name_len = json - name;
+
+    json = eng_json_skip_space(json + 1);
+    if (*json != ':')
+      return NULL;
+    json = eng_json_skip_space(json + 1);
+
+    size_t value_len = eng_json_value_len(json);
+    if (name_len == key_len && memcmp(name, key, key_len) == 0) {
+      *len = value_len;
+      return json;
+    }
+    json = eng_json_skip_space(json + value_len);
+    if (*json != ',')
+      return NULL;
+    json++;
+  }
+}
+
+/**
+ * @brief Reads a schema, a JSON array of "key:type" strings as
+ * link_get_pair_msg writes them.
+ */
+static bool eng_parse_schema(const char *json, size_t len,
+                             link_field_t *schema) {
+  if (len < 2 || json[0] != '[' || json[len - 1] != ']')
+    return false;
+  const char *end = json + len - 1;
+  const char *next = json + 1;
+
+  for (int i = 0;; i++) {
+    next = eng_json_skip_space(next);
+    if (next == end)
+      return true;
+    if (*next != '"' || i == LINK_MAX_FIELDS)
+      return false;
+
+    const char *field = next + 1;
+    const char *close = memchr(field, '"', end - field);
+    if (close == NULL)
+      return false;
+    const char *colon = close;
+    while (colon > field && *colon != ':')
+      colon--;
+    size_t key_len = colon - field;
+    if (key_len == 0 || key_len >= LINK_FIELD_KEY_SIZE)
+      return false;
+
+    const char *name = colon + 1;
+    size_t name_len = close - name;
+    link_field_type_e type = LINK_FIELD_BOOL;
+    while (type <= LINK_FIELD_STR &&
+           (strlen(link_field_type_name(type)) != name_len ||
+            memcmp(link_field_type_name(type), name, name_len) != 0))
+      type++;
+    if (type > LINK_FIELD_STR)
+      return false;
+
+    memcpy(schema[i].key, field, key_len);
+    schema[i].key[key_len] = '\0';
+    schema[i].type = type;
+
+    next = eng_json_skip_space(close + 1);
+    if (*next == ',')
+      next++;
+  }
+}
+
+/**
+ * @brief Tells whether the request has the member an option like
+ * PAIR_COMPRESS adds.
+ */
+static bool eng_json_option(const char *request, const char *key) {
+  size_t len;
+  const char *value = eng_json_member(request, key, &len);
+  return value != NULL && len == 1 && *value == '1';
+}
+
+/**
+ * @brief Reads the type, the configuration, the schemas and the options from
+ * a pair request. A schema that cannot be read is left empty.
+ */
+static bool eng_parse_pair_request(const char *msg, link_node_t *node,
+                                   eng_schema_t *schema, uint8_t *options) {
+  const char *request = msg + strlen(PAIR_REQUEST_PREFIX) - 1;
+  size_t len;
+
+  const char *type = eng_json_member(request, "type", &len);
+  if (type == NULL)
+    return false;
+  node->type = strtol(type, NULL, 10);
+
+  node->config[0] = '\0';
+  const char *config = eng_json_member(request, "cfg", &len);
+  if (config != NULL) {
+    if (len >= sizeof(node->config))
+      len = sizeof(node->config) - 1;
+    memcpy(node->config, config, len);
+    node->config[len] = '\0';
+  }
+
+  memset(schema, 0, sizeof(*schema));
+  schema->type = node->type;
+  const char *schemas = eng_json_member(request, "schema", &len);
+  if (schemas != NULL) {
+    static const char *const keys[2] = {"S", "D"};
+    for (int i = 0; i < 2; i++) {
+      const char *fields = eng_json_member(schemas, keys[i], &len);
+      if (fields == NULL || !eng_parse_schema(fields, len, schema->schema[i]))
+        memset(schema->schema[i], 0, sizeof(schema->schema[i]));
+    }
+  }
+
+  *options = 0;
+#if ENC_COMPRESSION
+  if (eng_json_option(request, "z"))
+    *options |= ENG_NODE_COMPRESS;
+#endif
+#if LINK_DELTA
+  if (eng_json_option(request, "d"))
+    *options |= ENG_NODE_DELTA;
+#endif
+  return true;
+}
+
+/**
+ * @brief Adds the node to the table, or updates it when it pairs again. The
+ * schemas it announced replace those of its type.
+ *
+ * @param flags Receives the options agreed to.
+ */
+static bool eng_pair(const enc_mac_t *mac, const char *msg, uint8_t *flags) {
+  link_node_t node = {0};
+  eng_schema_t schema;
+  if (!eng_parse_pair_request(msg, &node, &schema, flags)) {
+    ESP_LOGW(TAG, "Malformed pair request from " MACSTR, MAC2STR(mac->bytes));
+    return false;
+  }
+  memcpy(node.mac.bytes, mac->bytes, ESP_NOW_ETH_ALEN);
+  bool has_schema = schema.schema[ENG_SCHEMA_STATUS][0].type != LINK_FIELD_NONE ||
+                    schema.schema[ENG_SCHEMA_DATA][0].type != LINK_FIELD_NONE;
+
+  eng_lock();
+  uint32_t slot = eng_probe(mac);
+  uint16_t index;
+  if (table[slot] != ENG_TABLE_EMPTY) {
+    index = table[slot] - 1;
+  } else if (node_count < LINK_GATEWAY_MAX_NODES) {
+    index = node_count++;
+    table[slot] = node_count;
+    nodes[index].flags = 0;
+    memset(&nodes[index].reliable, 0, sizeof(enc_reliable_peer_t));
+#if LINK_DELTA
+    nodes[index].delta = -1;
+#endif
+  } else {
+    eng_unlock();
+    ESP_LOGW(TAG, "Node table full, rejecting " MACSTR, MAC2STR(mac->bytes));
+    return false;
+  }
+
+  eng_type_t *kind = eng_type_get(node.type, has_schema);
+  bool types_changed = false;
+  if (has_schema && kind == NULL) {
+    ESP_LOGW(TAG, "Too many device types, not keeping the schema of type %d",
+             node.type);
+  } else if (has_schema && memcmp(kind->saved.schema, schema.schema,
+                                  sizeof(schema.schema)) != 0) {
+    memcpy(kind->saved.schema, schema.schema, sizeof(schema.schema));
+    eng_nvs_store_types();
+    types_changed = true;
+  }
+
+#if LINK_DELTA
+  if (!(*flags & ENG_NODE_DELTA) || !eng_delta_attach(&nodes[index])) {
+    eng_delta_detach(&nodes[index]);
+    *flags &= ~ENG_NODE_DELTA;
+  }
+#endif
+
+  bool changed = memcmp(&nodes[index].node, &node, sizeof(link_node_t)) != 0 ||
+                 nodes[index].flags != *flags;
+  nodes[index].node = node;
+  nodes[index].flags = *flags;
+  nodes[index].kind = kind;
+  if (changed)
+    eng_nvs_store(index);
+  if (changed || types_changed)
+    eng_nvs_store_count();
+  eng_unlock();
+
+  ESP_LOGI(TAG, "Paired device " MACSTR " of type %d", MAC2STR(mac->bytes),
+           node.type);
+  return true;
+}
+
+static void eng_send_reply(const enc_mac_t *mac, const char *msg) {
+  // never wait for a slot in the receive task, the device asks again
+  enc_send_t *slot = enc_slot_reserve(ENC_MSG_CONTROL, 0);
+  if (slot == NULL)
+    return;
+
+  size_t len = strlen(msg);
+  memcpy(enc_slot_data(slot), msg, len);
+  enc_slot_send_to_async(slot, mac, len, NULL, NULL);
+}
+
+#if LINK_DELTA
+/**
+ * @brief Keeps the last status and data message of a node with an entry in
+ * the delta pool and expands delta messages against it into expanded, which
+ * then replaces the message. Called with the mutex taken.
+ *
+ * @return False if a delta message was not made against the kept message.
+ */
+static bool eng_delta_receive(eng_node_t *entry, const char **msg, size_t *len,
+                              char *expanded) {
+  static const struct {
+    const char *prefix;
+    const char *full_prefix; // NULL for full messages
+    uint8_t base;
+  } kinds[] = {
+      {LINK_STATUS_PREFIX, NULL, 0},
+      {LINK_DELTA_STATUS_PREFIX, LINK_STATUS_PREFIX, 0},
+      {LINK_UNCHANGED_STATUS_PREFIX, LINK_STATUS_PREFIX, 0},
+      {LINK_DATA_PREFIX, NULL, 1},
+      {LINK_DELTA_DATA_PREFIX, LINK_DATA_PREFIX, 1},
+      {LINK_UNCHANGED_DATA_PREFIX, LINK_DATA_PREFIX, 1},
+  };
+
+  size_t i = 0;
+  while (i < sizeof(kinds) / sizeof(kinds[0]) &&
+         (*len < 3 || memcmp(*msg, kinds[i].prefix, 3) != 0))
+    i++;
+  if (i == sizeof(kinds) / sizeof(kinds[0]))
+    return true;
+
+  // without an entry a delta has no base, full messages need none
+  if (entry->delta < 0)
+    return kinds[i].full_prefix == NULL;
+  char *base = delta_pool[entry->delta].base[kinds[i].base];
+  const char *body = *msg + 3;
+  size_t body_len = *len - 3;
+
+  if (kinds[i].full_prefix == NULL) {
+    if (body_len < ENC_FRAME_MAX_LEN + 1) {
+      memcpy(base, body, body_len);
+      base[body_len] = '\0';
+    } else {
+      base[0] = '\0';
+    }
+    return true;
+  }
+
+  int full_len = link_delta_expand(base, body, body_len, expanded + 3,
+                                   ENC_FRAME_MAX_LEN + 1);
+  if (full_len < 0)
+    return false;
+
+  memcpy(expanded, kinds[i].full_prefix, 3);
+  memcpy(base, expanded + 3, full_len + 1);
+  *msg = expanded;
+  *len = full_len + 3;
+  return true;
+}
+#endif
+
+static link_node_msg_kind_e eng_msg_kind(const char *msg, size_t len,
+                                         size_t *prefix_len) {
+  static const struct {
+    const char *prefix;
+    link_node_msg_kind_e kind;
+  } kinds[] = {
+      {LINK_STATUS_PREFIX, LINK_NODE_MSG_STATUS},
+      {LINK_DATA_PREFIX, LINK_NODE_MSG_DATA},
+      {LINK_BINARY_STATUS_PREFIX, LINK_NODE_MSG_BINARY_STATUS},
+      {LINK_BINARY_DATA_PREFIX, LINK_NODE_MSG_BINARY_DATA},
+      {LINK_TELEMETRY_PREFIX, LINK_NODE_MSG_TELEMETRY},
+  };
+
+  // every prefix is three characters long
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    if (len >= 3 && memcmp(msg, kinds[i].prefix, 3) == 0) {
+      *prefix_len = 3;
+      return kinds[i].kind;
+    }
+  }
+  *prefix_len = 0;
+  return LINK_NODE_MSG_OTHER;
+}
+
+// Public
+
+void eng_init(bool forget_nodes) {
+  nvs_open(NVS_NAME, NVS_READWRITE, &nvs);
+
+  if (forget_nodes) {
+    ESP_LOGI(TAG, "Forgetting all paired devices");
+    nvs_erase_all(nvs);
+    nvs_commit(nvs);
+  } else {
+    eng_nvs_load();
+  }
+}
+
+bool eng_receive_message(const enc_mac_t *src_mac, const char *msg,
+                         size_t len) {
+  if (strncmp(msg, PAIR_REQUEST_PREFIX, strlen(PAIR_REQUEST_PREFIX)) == 0) {
+    uint8_t flags;
+    if (eng_pair(src_mac, msg, &flags)) {
+      char reply[sizeof(PAIR_ACCEPT PAIR_ACCEPT_COMPRESS PAIR_ACCEPT_DELTA)];
+      snprintf(reply, sizeof(reply), "%s%s%s", PAIR_ACCEPT,
+               (flags & ENG_NODE_COMPRESS) ? PAIR_ACCEPT_COMPRESS : "",
+               (flags & ENG_NODE_DELTA) ? PAIR_ACCEPT_DELTA : "");
+      eng_send_reply(src_mac, reply);
+    }
+    return true;
+  }
+
+#if LINK_DELTA
+  char expanded[ENC_FRAME_MAX_LEN + 4];
+  bool resync = false;
+#endif
+
+  // the handler runs on copies, so the table can change meanwhile
+  link_node_t node;
+  link_gateway_message_cb cb = NULL;
+  link_field_t schema[LINK_MAX_FIELDS];
+  bool has_schema = false;
+  size_t prefix_len;
+  link_node_msg_kind_e kind = LINK_NODE_MSG_OTHER;
+  eng_lock();
+  eng_node_t *entry = eng_find(src_mac);
+  if (entry != NULL) {
+    node = entry->node;
+#if LINK_DELTA
+    resync = !eng_delta_receive(entry, &msg, &len, expanded);
+#endif
+    kind = eng_msg_kind(msg, len, &prefix_len);
+    if (entry->kind != NULL) {
+      cb = entry->kind->cb;
+      int index = (kind == LINK_NODE_MSG_BINARY_STATUS) ? ENG_SCHEMA_STATUS
+                  : (kind == LINK_NODE_MSG_BINARY_DATA) ? ENG_SCHEMA_DATA
+                                                         : -1;
+      if (index >= 0 &&
+          entry->kind->saved.schema[index][0].type != LINK_FIELD_NONE) {
+        memcpy(schema, entry->kind->saved.schema[index], sizeof(schema));
+        has_schema = true;
+      }
+    }
+  }
+  eng_unlock();
+
+  if (entry == NULL)
+    return false;
+
+#if LINK_DELTA
+  if (resync) {
+    ESP_LOGD(TAG, "Delta from " MACSTR " without its base, asking for a resync",
+             MAC2STR(src_mac->bytes));
+    eng_send_reply(src_mac, LINK_DELTA_RESYNC);
+    return true;
+  }
+#endif
+
+  if (cb == NULL) {
+    ESP_LOGD(TAG, "No handler for devices of type %d", node.type);
+    return true;
+  }
+
+  cb(&node, kind, has_schema ? schema : NULL, msg + prefix_len,
+     len - prefix_len);
+  return true;
+}
+
+bool eng_register_handler(int type, link_gateway_message_cb cb) {
+  eng_lock();
+
+  eng_type_t *kind = eng_type_get(type, true);
+  if (kind == NULL) {
+    eng_unlock();
+    ESP_LOGE(TAG, "Too many device types with a handler");
+    return false;
+  }
+  kind->cb = cb;
+
+  for (uint16_t n = 0; n < node_count; n++) {
+    if (nodes[n].node.type == type)
+      nodes[n].kind = kind;
+  }
+
+  eng_unlock();
+  return true;
+}
+
+bool eng_send_command(const enc_mac_t *mac, const char *cmd) {
+  if (!eng_get_node(mac, NULL)) {
+    ESP_LOGW(TAG, "Device " MACSTR " is not paired! Ommiting sending command",
+             MAC2STR(mac->bytes));
+    return false;
+  }
+  return enc_send_to_with_result(mac, cmd);
+}
+
+bool eng_node_compresses(const enc_mac_t *mac) {
+  eng_lock();
+  eng_node_t *entry = eng_find(mac);
+  bool compress = entry != NULL && (entry->flags & ENG_NODE_COMPRESS);
+  eng_unlock();
+
+  return compress;
+}
+
+bool eng_node_next_seq(const enc_mac_t *mac, uint16_t *seq) {
+  eng_lock();
+  eng_node_t *entry = eng_find(mac);
+  if (entry != NULL)
+    *seq = entry->reliable.tx_seq++;
+  eng_unlock();
+
+  return entry != NULL;
+}
+
+bool eng_node_accept(const enc_mac_t *mac, uint8_t epoch, uint16_t seq) {
+  eng_lock();
+  eng_node_t *entry = eng_find(mac);
+  bool accept =
+      entry == NULL || enc_reliable_accept(&entry->reliable, epoch, seq);
+  eng_unlock();
+
+  return accept;
+}
+
+bool eng_get_node(const enc_mac_t *mac, link_node_t *node_out) {
+  eng_lock();
+  eng_node_t *entry = eng_find(mac);
+  if (entry != NULL && node_out != NULL)
+    *node_out = entry->node;
+  eng_unlock();
+
+  return entry != NULL;
+}
+
+bool eng_remove_node(const enc_mac_t *mac) {
+  eng_lock();
+  uint32_t slot = eng_probe(mac);
+  if (table[slot] == ENG_TABLE_EMPTY) {
+    eng_unlock();
+    return false;
+  }
+
+  uint16_t index = table[slot] - 1;
+  eng_table_remove(slot);
+#if LINK_DELTA
+  eng_delta_detach(&nodes[index]);
+#endif
+
+  // keep the nodes dense by moving the last one into the gap
+  uint16_t last = --node_count;
+  if (index != last) {
+    nodes[index] = nodes[last];
+    table[eng_probe(&nodes[index].node.mac)] = index + 1;
+    eng_nvs_store(index);
+  }
+
+  char key[16];
+  snprintf(key, sizeof(key), NVS_NODE_KEY_FMT, last);
+  nvs_erase_key(nvs, key);
+  eng_nvs_store_count();
+  eng_unlock();
+
+  ESP_LOGI(TAG, "Removed device " MACSTR, MAC2STR(mac->bytes));
+  return true;
+}
+
+int eng_get_node_count() { return node_count; }
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef GATEWAY_H_
+#define GATEWAY_H_
+
+#include "esp_now_communication.h"
+#include "link.h"
+
+void eng_init(bool forget_nodes);
+bool eng_receive_message(const enc_mac_t *src_mac, const char *msg,
+                         size_t len);
+bool eng_register_handler(int type, link_gateway_message_cb cb);
+bool eng_send_command(const enc_mac_t *mac, const char *cmd);
+bool eng_node_compresses(const enc_mac_t *mac);
+// Sequence numbers of reliable frames, false for a MAC that is not paired
+bool eng_node_next_seq(const enc_mac_t *mac, uint16_t *seq);
+bool eng_node_accept(const enc_mac_t *mac, uint8_t epoch, uint16_t seq);
+bool eng_get_node(const enc_mac_t *mac, link_node_t *node_out);
+bool eng_remove_node(const enc_mac_t *mac);
+int eng_get_node_count();
+
+#endif // GATEWAY_H_
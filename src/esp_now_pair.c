@@ -8,6 +8,7 @@
 #include "esp_now.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 
@@ -22,116 +23,619 @@
 static const char *TAG = "Link_ENP";
 
 #define NVS_MAC_KEY "gw_mac"
+#define NVS_CHANNEL_KEY "gw_chan"
+#define NVS_LIST_KEY "gw_list"
 #define NVS_NAME "PAIR"
 
-static SemaphoreHandle_t xMutex;
+#ifdef CONFIG_IDF_TARGET_ESP8266
+#define ENP_ENTER_CRITICAL() taskENTER_CRITICAL()
+#define ENP_EXIT_CRITICAL() taskEXIT_CRITICAL()
+#else
+static portMUX_TYPE state_mux = portMUX_INITIALIZER_UNLOCKED;
+#define ENP_ENTER_CRITICAL() taskENTER_CRITICAL(&state_mux)
+#define ENP_EXIT_CRITICAL() taskEXIT_CRITICAL(&state_mux)
+#endif
+
+typedef struct {
+  enc_mac_t gateway;
+  bool is_paired;
+  bool is_pairing;
+} enp_state_t;
+
+// Pairing state is published under a sequence lock, so the send and receive
+// paths never block on it. The sequence is odd while a write is in progress;
+// readers retry until they see the same even value before and after copying
+// the state. Writes happen in a critical section, so a reader can never
+// preempt a half-finished write and spin on it.
+static volatile uint32_t state_seq;
+static enp_state_t state;
+
+// A gateway that accepted a pair request, the current one is among them
+typedef struct {
+  enc_mac_t mac;
+  uint8_t channel;
+  bool compress; // accepts compressed frames
+  bool in_use;
+  bool delta; // keeps the base of delta messages; last, as lists of older
+              // versions had zeroed padding here
+} enp_gateway_t;
 
-static enc_mac_t gateway;
-static bool is_paired = false;
-static bool is_pairing = false;
+// The share of messages a gateway received is kept in 1/16 percent, every
+// result moves it by 1/8 of the difference
+#define ENP_ACKED_SCALE 16
+#define ENP_ACKED_WEIGHT 8
+#define ENP_ACKED_FULL (100 * ENP_ACKED_SCALE)
+// Signal assumed for gateways nothing was received from yet
+#define ENP_RSSI_UNKNOWN -100
+// The average signal of a gateway is kept in 1/16 dBm, every frame moves it
+// by 1/8 of the difference
+#define ENP_RSSI_SCALE 16
+#define ENP_RSSI_WEIGHT 8
+#define ENP_RSSI_NONE INT32_MIN
+
+// Gateways known to the device, saved to NVS. Taken in the state critical
+// section, the pair task scores them and the receive task adds and looks
+// them up. Their signal is kept here rather than in the peer statistics of
+// the radio, which frames of other senders evict.
+static enp_gateway_t gateways[LINK_GATEWAY_LIST_SIZE];
+static int32_t gateway_acked[LINK_GATEWAY_LIST_SIZE];
+static int32_t gateway_rssi[LINK_GATEWAY_LIST_SIZE];
+static enc_reliable_peer_t gateway_reliable[LINK_GATEWAY_LIST_SIZE];
+// gateways that answered the running pair request, one bit each; answers
+// are only taken while the pair task collects them
+static uint32_t gateways_answered;
+static bool collecting;
+
+// Mirrors the pairing state for tasks waiting for it to change. The pair
+// task waits for answers on its own bit rather than on its task
+// notification, which the sends it makes wait on for their results.
+#define ENP_PAIRED_BIT (1 << 0)
+#define ENP_PAIRING_BIT (1 << 1)
+#define ENP_ANSWERED_BIT (1 << 2)
+// Work for the pair task, so the send task never switches channels or
+// writes to NVS
+#define ENP_PAIR_BIT (1 << 3)
+#define ENP_FAILOVER_BIT (1 << 4)
+#define ENP_PROBE_BIT (1 << 5)
+static EventGroupHandle_t state_events;
 
 static nvs_handle_t nvs;
-static TaskHandle_t pair_task_handle;
+// failed messages in a row to the current gateway, and to any gateway
+static uint8_t gateway_failures;
+static uint8_t failures;
 
-static inline void wait_random_time_and_send_status_and_data() {
+static void enp_state_publish(const enc_mac_t *gateway, bool is_paired,
+                              bool is_pairing) {
+  ENP_ENTER_CRITICAL();
+  __atomic_store_n(&state_seq, state_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (gateway != NULL)
+    state.gateway = *gateway;
+  state.is_paired = is_paired;
+  state.is_pairing = is_pairing;
+
+  __atomic_store_n(&state_seq, state_seq + 1, __ATOMIC_RELEASE);
+  ENP_EXIT_CRITICAL();
+
+  EventBits_t set = (is_paired ? ENP_PAIRED_BIT : 0) |
+                    (is_pairing ? ENP_PAIRING_BIT : 0);
+  xEventGroupClearBits(state_events,
+                       (ENP_PAIRED_BIT | ENP_PAIRING_BIT) & ~set);
+  xEventGroupSetBits(state_events, set);
+}
+
+static void enp_state_read(enp_state_t *out) {
+  uint32_t seq;
+  do {
+    seq = __atomic_load_n(&state_seq, __ATOMIC_ACQUIRE);
+    *out = state;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&state_seq, __ATOMIC_RELAXED));
+}
+
+static int enp_gateway_find(const enc_mac_t *mac) {
+  for (int i = 0; i < LINK_GATEWAY_LIST_SIZE; i++) {
+    if (gateways[i].in_use &&
+        memcmp(gateways[i].mac.bytes, mac->bytes, ESP_NOW_ETH_ALEN) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * @brief Scores every gateway by its average signal and the share of
+ * messages it received. A gateway receiving every message wins against one
+ * 50 dB stronger that receives none.
+ */
+static void enp_gateway_scores(int *scores) {
+  ENP_ENTER_CRITICAL();
+  for (int i = 0; i < LINK_GATEWAY_LIST_SIZE; i++) {
+    int rssi = gateway_rssi[i] == ENP_RSSI_NONE
+                   ? ENP_RSSI_UNKNOWN
+                   : gateway_rssi[i] / ENP_RSSI_SCALE;
+    scores[i] = rssi + gateway_acked[i] / ENP_ACKED_SCALE / 2;
+  }
+  ENP_EXIT_CRITICAL();
+}
+
+/**
+ * @brief Returns the best scoring gateway out of the candidates, or -1 if
+ * there is none.
+ */
+static int enp_gateway_best(uint32_t candidates) {
+  int scores[LINK_GATEWAY_LIST_SIZE];
+  enp_gateway_scores(scores);
+
+  int best = -1;
+  for (int i = 0; i < LINK_GATEWAY_LIST_SIZE; i++) {
+    if ((candidates & (1UL << i)) && gateways[i].in_use &&
+        (best < 0 || scores[i] > scores[best]))
+      best = i;
+  }
+  return best;
+}
+
+/**
+ * @brief Adds a gateway that accepted the pair request, replacing the worst
+ * scoring one when the list is full.
+ *
+ * @return False if the pair task no longer collects answers.
+ */
+static bool enp_gateway_add(const enc_mac_t *mac, bool compress, bool delta) {
+  int scores[LINK_GATEWAY_LIST_SIZE];
+  enp_gateway_scores(scores);
+
+  ENP_ENTER_CRITICAL();
+  if (!collecting) {
+    ENP_EXIT_CRITICAL();
+    return false;
+  }
+  int index = enp_gateway_find(mac);
+  for (int i = 0; index < 0 && i < LINK_GATEWAY_LIST_SIZE; i++) {
+    if (!gateways[i].in_use)
+      index = i;
+  }
+  if (index < 0) {
+    // those that answered this request stay
+    for (int i = 0; i < LINK_GATEWAY_LIST_SIZE; i++) {
+      if (!(gateways_answered & (1UL << i)) &&
+          (index < 0 || scores[i] < scores[index]))
+        index = i;
+    }
+  }
+
+  if (index >= 0) {
+    if (!gateways[index].in_use ||
+        memcmp(gateways[index].mac.bytes, mac->bytes, ESP_NOW_ETH_ALEN) != 0) {
+      memset(&gateway_reliable[index], 0, sizeof(gateway_reliable[index]));
+      gateway_rssi[index] = ENP_RSSI_NONE;
+    }
+    gateways[index].mac = *mac;
+    gateways[index].channel = enc_get_channel();
+    gateways[index].compress = compress;
+    gateways[index].delta = delta;
+    gateways[index].in_use = true;
+    // it just answered, whatever it missed before
+    gateway_acked[index] = ENP_ACKED_FULL;
+    gateways_answered |= 1UL << index;
+  }
+  ENP_EXIT_CRITICAL();
+  return index >= 0;
+}
+
+static void enp_gateway_save(const enc_mac_t *current, uint8_t channel) {
+  enp_gateway_t list[LINK_GATEWAY_LIST_SIZE];
+  ENP_ENTER_CRITICAL();
+  memcpy(list, gateways, sizeof(list));
+  ENP_EXIT_CRITICAL();
+
+  nvs_set_u64(nvs, NVS_MAC_KEY, current->value);
+  nvs_set_u8(nvs, NVS_CHANNEL_KEY, channel);
+  nvs_set_blob(nvs, NVS_LIST_KEY, list, sizeof(list));
+  nvs_commit(nvs);
+}
+
+/**
+ * @brief Restores the gateways from NVS. The current one is added when it is
+ * missing, as after an update from a version that only stored one gateway.
+ */
+static void enp_gateway_load(const enc_mac_t *current, uint8_t channel) {
+  size_t size = sizeof(gateways);
+  if (nvs_get_blob(nvs, NVS_LIST_KEY, gateways, &size) != ESP_OK ||
+      size != sizeof(gateways))
+    memset(gateways, 0, sizeof(gateways));
+
+  for (int i = 0; i < LINK_GATEWAY_LIST_SIZE; i++) {
+    gateway_acked[i] = ENP_ACKED_FULL;
+    gateway_rssi[i] = ENP_RSSI_NONE;
+  }
+  memset(gateway_reliable, 0, sizeof(gateway_reliable));
+
+  if (enp_gateway_find(current) < 0) {
+    memset(&gateways[0], 0, sizeof(gateways[0]));
+    gateways[0].mac = *current;
+    gateways[0].channel = channel;
+    gateways[0].in_use = true;
+  }
+}
+
+/**
+ * @brief Moves the traffic from the current gateway to the best scoring other
+ * one in the list. Runs in the pair task.
+ */
+static void enp_failover() {
+  enp_state_t snapshot;
+  enp_state_read(&snapshot);
+  if (!snapshot.is_paired || snapshot.is_pairing)
+    return;
+
+  const enc_mac_t *current = &snapshot.gateway;
+  uint32_t others = 0;
+  ENP_ENTER_CRITICAL();
+  for (int i = 0; i < LINK_GATEWAY_LIST_SIZE; i++) {
+    if (gateways[i].in_use &&
+        memcmp(gateways[i].mac.bytes, current->bytes, ESP_NOW_ETH_ALEN) != 0)
+      others |= 1UL << i;
+  }
+  ENP_EXIT_CRITICAL();
+
+  int best = enp_gateway_best(others);
+  if (best < 0)
+    return;
+
+  ENP_ENTER_CRITICAL();
+  enp_gateway_t next = gateways[best];
+  ENP_EXIT_CRITICAL();
+
+  ESP_LOGW(TAG, "Gateway " MACSTR " does not respond, switching to " MACSTR,
+           MAC2STR(current->bytes), MAC2STR(next.mac.bytes));
+  enc_set_channel(next.channel);
+  enp_state_publish(&next.mac, true, false);
+  enp_gateway_save(&next.mac, next.channel);
+}
+
+// Devices powered up together would otherwise all send at the same moment
+static inline void wait_random_startup_time() {
+  vTaskDelay(pdMS_TO_TICKS(esp_random() % (LINK_STARTUP_SPREAD_MS + 1)));
+}
+
+static inline void send_status_and_data() {
 #if LINK_SEND_STATUS_DATE_AFTER_INIT
-  vTaskDelay(pdMS_TO_TICKS(esp_random() % 300));
   link_send_status_msg();
   link_send_data_msg();
 #endif
 }
 
-void pair_task(void *params) {
+static inline void wait_random_time_and_send_status_and_data() {
+#if LINK_SEND_STATUS_DATE_AFTER_INIT
+  wait_random_startup_time();
+  send_status_and_data();
+#endif
+}
+
+/**
+ * @brief Returns the channel to send the next pair request on. Every channel
+ * is tried once before the sweep comes back to the first one.
+ */
+static uint8_t enp_next_channel(uint8_t channel) {
+#if LINK_PAIR_CHANNEL_SWEEP
+  return channel % ENC_MAX_CHANNEL + 1;
+#else
+  return channel;
+#endif
+}
+
+/**
+ * @brief Sends pair requests until a gateway answers and pairs with the best
+ * scoring one of those that did.
+ */
+static void enp_pair() {
+  uint32_t interval = LINK_PAIR_RETRY_MIN_MS;
+  // the channel the gateway was last found on goes first
+  uint8_t first_channel = enc_get_channel();
+  uint8_t channel = first_channel;
+  int sweeps = 0;
+
+  // a device pairing again stays on the channel of its gateway, where its
+  // traffic still goes, until the retries there reach LINK_PAIR_RETRY_MAX_MS
+  enp_state_t snapshot;
+  enp_state_read(&snapshot);
+  bool sweep = !snapshot.is_paired;
+
+  ENP_ENTER_CRITICAL();
+  gateways_answered = 0;
+  collecting = true;
+  ENP_EXIT_CRITICAL();
+  xEventGroupClearBits(state_events, ENP_ANSWERED_BIT);
+  wait_random_startup_time();
+
   while (1) {
-    ESP_LOGI(TAG, "Sending pair request");
+    ESP_LOGI(TAG, "Sending pair request on channel %u", channel);
+    enc_set_channel(channel);
     enc_send_to_broadcast(link_get_pair_msg());
 
-    // wait some time for response
-    int time = 4000 + (esp_random() % 2000);
-    if (ulTaskNotifyTake(true, pdMS_TO_TICKS(time))) {
-      ESP_LOGI(TAG, "Device " MACSTR " accepted pair", MAC2STR(gateway.bytes));
+    // gateways usually answer quickly, so retry early and back off towards
+    // LINK_PAIR_RETRY_MAX_MS; the jitter keeps devices from staying in step
+    uint32_t time = interval + esp_random() % (interval / 2 + 1);
+    bool exhausted = interval == LINK_PAIR_RETRY_MAX_MS;
+    bool swept = false;
+    if (sweep) {
+      channel = enp_next_channel(channel);
+      swept = channel == first_channel;
+    }
+    if (!sweep || swept)
+      interval = (interval * 2 < LINK_PAIR_RETRY_MAX_MS)
+                     ? interval * 2
+                     : LINK_PAIR_RETRY_MAX_MS;
+    if (xEventGroupWaitBits(state_events, ENP_ANSWERED_BIT, pdTRUE, pdTRUE,
+                            pdMS_TO_TICKS(time)) &
+        ENP_ANSWERED_BIT) {
+      // other gateways on the channel answer about as quickly
+      if (LINK_GATEWAY_LIST_SIZE > 1)
+        vTaskDelay(pdMS_TO_TICKS(LINK_PAIR_RETRY_MIN_MS));
+
+      ENP_ENTER_CRITICAL();
+      uint32_t answered = gateways_answered;
+      ENP_EXIT_CRITICAL();
+      int best = enp_gateway_best(answered);
+      if (best < 0)
+        continue;
+
+      ENP_ENTER_CRITICAL();
+      enc_mac_t gateway = gateways[best].mac;
+      gateways_answered = 0;
+      collecting = false;
+      ENP_EXIT_CRITICAL();
 
-      xSemaphoreTake(xMutex, portMAX_DELAY);
-      is_pairing = false;
-      is_paired = true;
-      xSemaphoreGive(xMutex);
+      ESP_LOGI(TAG, "Device " MACSTR " accepted pair, %d gateway(s) answered",
+               MAC2STR(gateway.bytes), __builtin_popcount(answered));
 
-      nvs_set_u64(nvs, NVS_MAC_KEY, gateway.value);
-      nvs_commit(nvs);
+      gateway_failures = 0;
+      failures = 0;
+      enp_state_publish(&gateway, true, false);
+      // a failover asked for meanwhile concerned the old gateway
+      xEventGroupClearBits(state_events, ENP_FAILOVER_BIT);
+
+      enp_gateway_save(&gateway, enc_get_channel());
       wait_random_time_and_send_status_and_data();
-      pair_task_handle = NULL;
-      vTaskDelete(NULL);
+      return;
+    }
+
+    if (!sweep && exhausted && sweeps == 0) {
+      ESP_LOGW(TAG, "No gateway answers on channel %u, searching all channels",
+               channel);
+      enp_state_publish(NULL, false, true);
+      sweep = true;
+      interval = LINK_PAIR_RETRY_MIN_MS;
+      first_channel = channel;
+      channel = enp_next_channel(channel);
     }
+#if LINK_PAIR_CHANNEL_SWEEP
+    if (swept && LINK_PAIR_SWEEPS != 0 && ++sweeps == LINK_PAIR_SWEEPS) {
+      // the gateway is more likely to come back where it was than to show up
+      // on another channel; keep asking there with the usual backoff
+      ESP_LOGW(TAG, "No gateway on any channel, asking on channel %u",
+               channel);
+      sweep = false;
+    }
+#endif
+  }
+}
+
+/**
+ * @brief Checks that the stored gateway still receives on the stored channel,
+ * and pairs again if it does not. The probe is a pair request to the gateway
+ * alone, so it also learns about a changed configuration of the device.
+ */
+static void enp_probe() {
+  enp_state_t snapshot;
+  enp_state_read(&snapshot);
+  wait_random_startup_time();
+
+  if (enc_send_to_with_result(&snapshot.gateway, link_get_pair_msg())) {
+    enp_state_publish(&snapshot.gateway, true, false);
+    send_status_and_data();
+    return;
+  }
+
+  ESP_LOGW(TAG, "Gateway " MACSTR " does not answer on channel %u",
+           MAC2STR(snapshot.gateway.bytes), enc_get_channel());
+  enp_pair();
+}
+
+static void pair_task(void *params) {
+  while (1) {
+    EventBits_t bits = xEventGroupWaitBits(
+        state_events, ENP_PAIR_BIT | ENP_FAILOVER_BIT | ENP_PROBE_BIT, pdTRUE,
+        pdFALSE, portMAX_DELAY);
+    if (bits & ENP_PROBE_BIT)
+      enp_probe();
+    else if (bits & ENP_PAIR_BIT)
+      enp_pair();
+    else if (bits & ENP_FAILOVER_BIT)
+      enp_failover();
   }
 }
 
 // Public
 
 void enp_init(bool force_pair) {
-  xMutex = xSemaphoreCreateMutex();
-
-  xSemaphoreTake(xMutex, portMAX_DELAY);
-  is_pairing = true;
-  is_paired = false;
-  xSemaphoreGive(xMutex);
+  state_events = xEventGroupCreate();
+  enp_state_publish(NULL, false, true);
+  xTaskCreate(pair_task, "pair_task", 4096, NULL, 1, NULL);
 
   nvs_open(NVS_NAME, NVS_READWRITE, &nvs);
 
+  uint8_t channel = 0;
+  nvs_get_u8(nvs, NVS_CHANNEL_KEY, &channel);
+  if (channel >= 1 && channel <= ENC_MAX_CHANNEL) {
+    ESP_LOGI(TAG, "Retrieved gateway channel from NVS: %u", channel);
+    enc_set_channel(channel);
+  }
+
   if (force_pair) {
     ESP_LOGI(TAG, "Force pairing initiated, resetting stored gateway MAC");
     nvs_set_u64(nvs, NVS_MAC_KEY, 0ULL);
+    nvs_erase_key(nvs, NVS_LIST_KEY);
     nvs_commit(nvs);
   } else {
+    enc_mac_t gateway = {0};
     nvs_get_u64(nvs, NVS_MAC_KEY, &gateway.value);
 
-    ESP_LOGI(TAG, "Retrieved gateway MAC from NVS: " MACSTR,
-             MAC2STR(gateway.bytes));
-    xSemaphoreTake(xMutex, portMAX_DELAY);
-    is_pairing = false;
-    is_paired = true;
-    xSemaphoreGive(xMutex);
+    // a zeroed MAC is what force pairing leaves behind
+    if ((gateway.value & 0xFFFFFFFFFFFFULL) != 0) {
+      ESP_LOGI(TAG, "Retrieved gateway MAC from NVS: " MACSTR,
+               MAC2STR(gateway.bytes));
+      enp_gateway_load(&gateway, enc_get_channel());
+      // messages go to it while the pair task checks it is still there
+      enp_state_publish(&gateway, true, true);
+    }
   }
 
-  xSemaphoreTake(xMutex, portMAX_DELAY);
-  bool _is_paired = is_paired;
-  xSemaphoreGive(xMutex);
-
-  if (!_is_paired) {
+  if (!enp_get_gateway_mac(NULL)) {
     ESP_LOGI(TAG, "Starting the pairing procedure");
-    xTaskCreate(pair_task, "pair_task", 4096, NULL, 1, &pair_task_handle);
+    xEventGroupSetBits(state_events, ENP_PAIR_BIT);
   } else {
-    wait_random_time_and_send_status_and_data();
+    xEventGroupSetBits(state_events, ENP_PROBE_BIT);
   }
 }
 
 bool enp_get_gateway_mac(enc_mac_t *gateway_mac_out) {
-  xSemaphoreTake(xMutex, portMAX_DELAY);
-  bool _is_paired = is_paired;
-  xSemaphoreGive(xMutex);
+  enp_state_t snapshot;
+  enp_state_read(&snapshot);
 
-  if (_is_paired) {
+  if (snapshot.is_paired) {
     if (gateway_mac_out != NULL) {
-      *gateway_mac_out = gateway;
+      *gateway_mac_out = snapshot.gateway;
     }
     return true;
   }
   return false;
 }
 
-void enp_block_until_find_pair() { 
-  while (!enp_get_gateway_mac(NULL)) {
-    vTaskDelay(10);
-  } 
+bool enp_is_gateway(const enc_mac_t *mac) {
+  if (!enp_get_gateway_mac(NULL))
+    return false;
+
+  ENP_ENTER_CRITICAL();
+  bool found = enp_gateway_find(mac) >= 0;
+  ENP_EXIT_CRITICAL();
+  return found;
+}
+
+bool enp_gateway_compresses(const enc_mac_t *mac) {
+  ENP_ENTER_CRITICAL();
+  int index = enp_gateway_find(mac);
+  bool compress = index >= 0 && gateways[index].compress;
+  ENP_EXIT_CRITICAL();
+  return compress;
+}
+
+bool enp_gateway_deltas(const enc_mac_t *mac) {
+  ENP_ENTER_CRITICAL();
+  int index = enp_gateway_find(mac);
+  bool delta = index >= 0 && gateways[index].delta;
+  ENP_EXIT_CRITICAL();
+  return delta;
+}
+
+bool enp_gateway_next_seq(const enc_mac_t *mac, uint16_t *seq) {
+  ENP_ENTER_CRITICAL();
+  int index = enp_gateway_find(mac);
+  if (index >= 0)
+    *seq = gateway_reliable[index].tx_seq++;
+  ENP_EXIT_CRITICAL();
+  return index >= 0;
 }
 
-void enp_check_received_pairing_acceptance(enc_event_receive_cb_t *data) {
-  xSemaphoreTake(xMutex, portMAX_DELAY);
-  bool _is_pairing = is_pairing;
-  xSemaphoreGive(xMutex);
+bool enp_gateway_accept(const enc_mac_t *mac, uint8_t epoch, uint16_t seq) {
+  ENP_ENTER_CRITICAL();
+  int index = enp_gateway_find(mac);
+  bool accept =
+      index < 0 || enc_reliable_accept(&gateway_reliable[index], epoch, seq);
+  ENP_EXIT_CRITICAL();
+  return accept;
+}
+
+void enp_block_until_find_pair() { enp_wait_for_pair(portMAX_DELAY); }
+
+bool enp_wait_for_pair(TickType_t wait) {
+  EventBits_t bits =
+      xEventGroupWaitBits(state_events, ENP_PAIRED_BIT, pdFALSE, pdTRUE, wait);
+  return (bits & ENP_PAIRED_BIT) != 0;
+}
+
+void enp_report_send_result(const enc_mac_t *dest_mac, bool delivered) {
+  ENP_ENTER_CRITICAL();
+  int index = enp_gateway_find(dest_mac);
+  if (index >= 0)
+    gateway_acked[index] +=
+        ((delivered ? ENP_ACKED_FULL : 0) - gateway_acked[index]) /
+        ENP_ACKED_WEIGHT;
+  ENP_EXIT_CRITICAL();
+
+  enp_state_t snapshot;
+  enp_state_read(&snapshot);
+  if (!snapshot.is_paired || snapshot.is_pairing ||
+      memcmp(dest_mac->bytes, snapshot.gateway.bytes, ESP_NOW_ETH_ALEN) != 0)
+    return;
+
+  if (delivered) {
+    gateway_failures = 0;
+    failures = 0;
+    return;
+  }
+  gateway_failures++;
+  failures++;
+
+  if (LINK_REPAIR_AFTER_FAILURES != 0 &&
+      failures >= LINK_REPAIR_AFTER_FAILURES) {
+    // keep sending to the old gateway until another one answers
+    ESP_LOGW(TAG, "No gateway responds, pairing again");
+    gateway_failures = 0;
+    failures = 0;
+    enp_state_publish(&snapshot.gateway, true, true);
+    xEventGroupSetBits(state_events, ENP_PAIR_BIT);
+    return;
+  }
+
+  if (LINK_GATEWAY_FAILOVER_AFTER_FAILURES != 0 &&
+      gateway_failures >= LINK_GATEWAY_FAILOVER_AFTER_FAILURES) {
+    gateway_failures = 0;
+    xEventGroupSetBits(state_events, ENP_FAILOVER_BIT);
+  }
+}
+
+void enp_check_received_pairing_acceptance(const enc_mac_t *src_mac,
+                                           const char *msg) {
+  size_t len = strlen(PAIR_ACCEPT);
+  if (strncmp(msg, PAIR_ACCEPT, len) != 0)
+    return;
+
+  // the options the gateway agreed to follow in the order they are asked for
+  const char *options = msg + len;
+  bool compress = strncmp(options, PAIR_ACCEPT_COMPRESS,
+                          strlen(PAIR_ACCEPT_COMPRESS)) == 0;
+  if (compress)
+    options += strlen(PAIR_ACCEPT_COMPRESS);
+  bool delta = strcmp(options, PAIR_ACCEPT_DELTA) == 0;
+  if (!delta && *options != '\0')
+    return;
+
+  if (enp_gateway_add(src_mac, compress, delta))
+    xEventGroupSetBits(state_events, ENP_ANSWERED_BIT);
+}
 
-  if (!strcmp(data->data, PAIR_ACCEPT) && pair_task_handle != NULL &&
-      _is_pairing) {
-    memcpy(gateway.bytes, data->esp_now_info.src_addr, ESP_NOW_ETH_ALEN);
-    xTaskNotifyGive(pair_task_handle);
+void enp_gateway_heard(const enc_mac_t *mac, int rssi) {
+  ENP_ENTER_CRITICAL();
+  int index = enp_gateway_find(mac);
+  if (index >= 0) {
+    int32_t sample = rssi * ENP_RSSI_SCALE;
+    if (gateway_rssi[index] == ENP_RSSI_NONE)
+      gateway_rssi[index] = sample;
+    else
+      gateway_rssi[index] += (sample - gateway_rssi[index]) / ENP_RSSI_WEIGHT;
   }
+  ENP_EXIT_CRITICAL();
 }
@@ -5,7 +5,18 @@
 
 void enp_init(bool force_pair);
 void enp_block_until_find_pair();
+bool enp_wait_for_pair(TickType_t wait);
+void enp_report_send_result(const enc_mac_t *dest_mac, bool delivered);
 bool enp_get_gateway_mac(enc_mac_t* gateway_mac_out);
-void enp_check_received_pairing_acceptance(enc_event_receive_cb_t *data);
+bool enp_is_gateway(const enc_mac_t *mac);
+bool enp_gateway_compresses(const enc_mac_t *mac);
+bool enp_gateway_deltas(const enc_mac_t *mac);
+// Sequence numbers of reliable frames, false for a MAC that is no gateway
+bool enp_gateway_next_seq(const enc_mac_t *mac, uint16_t *seq);
+bool enp_gateway_accept(const enc_mac_t *mac, uint8_t epoch, uint16_t seq);
+void enp_check_received_pairing_acceptance(const enc_mac_t *src_mac,
+                                           const char *msg);
+// Signal of a frame received from mac, kept when it is a known gateway
+void enp_gateway_heard(const enc_mac_t *mac, int rssi);
 
 #endif //PAIR_H_
\ No newline at end of file
@@ -1,89 +1,117 @@
 #include "link.h"
 
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "esp_log.h"
+#include "freertos/task.h"
 
 #include "esp_now_communication.h"
+#include "esp_now_gateway.h"
 #include "esp_now_pair.h"
+#include "link_command.h"
+#include "link_delta.h"
 
-link_config_t *link_device;
+static link_config_t *link_device;
 
-static const char *TAG = "Link";
+#if ENC_COMPRESSION
+#define PAIR_MSG_COMPRESS PAIR_COMPRESS
+#else
+#define PAIR_MSG_COMPRESS ""
+#endif
+#if LINK_DELTA && !LINK_ROLE_GATEWAY
+#define PAIR_MSG_DELTA PAIR_DELTA
+#else
+#define PAIR_MSG_DELTA ""
+#endif
+#define PAIR_MSG_OPTIONS PAIR_MSG_COMPRESS PAIR_MSG_DELTA
 
-typedef enum { LINK_MESSAGE_DATA, LINK_MESSAGE_STATUS } link_message_type_e;
+static const char *TAG = "Link";
 
 void link_register(link_config_t *device_to_register) {
   if (device_to_register != NULL) {
     link_device = device_to_register;
+    link_command_compile(link_device);
   } else {
     ESP_LOGE(TAG, "Failed to register device");
   }
 }
 
 void link_message_parse(const char *data) {
-  for (int i = 0; i < LINK_MAX_COMMANDS; i++) {
-    if (strlen(link_device->commands[i]) == 0) {
-      // Skip empty (uninitialized) commands
-      continue;
-    }
-
-    const char *command = link_device->commands[i];
-    char *wildcard_pos = strchr(command, '*');
-
-    if (wildcard_pos != NULL) {
-      // Check the part before the wildcard
-      int prefix_length = wildcard_pos - command;
-      if (strncmp(data, command, prefix_length) == 0) {
-        // If the part after the wildcard is non-empty, check that too
-        const char *suffix = wildcard_pos + 1;
-        if (strlen(suffix) == 0 ||
-            strstr(data + prefix_length, suffix) != NULL) {
-          // If the prefix and suffix match, or if the suffix is empty, trigger
-          // the callback
-          if (link_device->user_command_parser_cb != NULL) {
-            link_device->user_command_parser_cb(data);
-            return;
-          }
-        }
-      }
-    } else {
-      // If no wildcard, check the entire command
-      if (strncmp(data, command, LINK_COMMAND_MAX_SIZE) == 0) {
-        if (link_device->user_command_parser_cb != NULL) {
-          link_device->user_command_parser_cb(data);
-          return;
-        }
-      }
-    }
+  link_arg_t args[LINK_MAX_COMMAND_ARGS];
+  int argc = 0;
+
+#if LINK_DELTA
+  if (strcmp(data, LINK_DELTA_RESYNC) == 0) {
+    ESP_LOGI(TAG, "Gateway asked for full messages");
+    link_delta_resync();
+    return;
   }
+#endif
+
+  int i = link_command_match(data, args, &argc);
+  if (i < 0)
+    return;
+
+  if (!link_command_submit(i, data, args, argc))
+    link_command_run(i, data, args, argc);
 }
 
-char *link_generate_status_message(const char *status_fmt, ...) {
-  if (status_fmt == NULL)
-    status_fmt = link_device->status_fmt;
+void link_command_run(int command, const char *data, const link_arg_t *args,
+                      int argc) {
+  if (link_device->command_handlers[command] != NULL) {
+    link_device->command_handlers[command](data, args, argc);
+  } else if (link_device->user_command_parser_cb != NULL) {
+    link_device->user_command_parser_cb(data);
+  }
+}
 
-  va_list args;
-  va_start(args, status_fmt);
+/**
+ * @brief Formats the message into a stack buffer first, so messages that fit
+ * into a frame need a single vsnprintf pass.
+ */
+static char *link_vgenerate_message(const char *fmt, va_list args) {
+  char buffer[ENC_FRAME_MAX_LEN + 1];
+  va_list args_copy;
+  va_copy(args_copy, args);
 
   // Calculate the size needed for the formatted message
-  int message_size =
-      vsnprintf(NULL, 0, status_fmt, args) + 1; // +1 for the null terminator
+  int message_size = vsnprintf(buffer, sizeof(buffer), fmt, args) +
+                     1; // +1 for the null terminator
 
-  va_end(args);
+  if (message_size <= 0) {
+    va_end(args_copy);
+    return NULL;
+  }
 
   // Allocate memory for the message dynamically
-  char *status_message = (char *)malloc(message_size);
-  if (!status_message) {
+  char *message = (char *)malloc(message_size);
+  if (!message) {
     // Handle memory allocation failure
+    va_end(args_copy);
     return NULL;
   }
 
-  // Reinitialize the argument list to format the message
+  if ((size_t)message_size <= sizeof(buffer)) {
+    memcpy(message, buffer, message_size);
+  } else {
+    // Longer than a frame, format it again into the allocated memory
+    vsnprintf(message, message_size, fmt, args_copy);
+  }
+  va_end(args_copy);
+
+  return message;
+}
+
+char *link_generate_status_message(const char *status_fmt, ...) {
+  if (status_fmt == NULL)
+    status_fmt = link_device->status_fmt;
+
+  va_list args;
   va_start(args, status_fmt);
-  vsnprintf(status_message, message_size, status_fmt, args);
+  char *status_message = link_vgenerate_message(status_fmt, args);
   va_end(args);
 
   return status_message;
@@ -95,26 +123,69 @@ char *link_generate_data_message(const char *data_fmt, ...) {
 
   va_list args;
   va_start(args, data_fmt);
-
-  // Calculate the size needed for the formatted message
-  int message_size =
-      vsnprintf(NULL, 0, data_fmt, args) + 1; // +1 for the null terminator
-
+  char *data_message = link_vgenerate_message(data_fmt, args);
   va_end(args);
 
-  // Allocate memory for the message dynamically
-  char *data_message = (char *)malloc(message_size);
-  if (!data_message) {
-    // Handle memory allocation failure
-    return NULL;
+  return data_message;
+}
+
+static size_t link_field_size(link_field_type_e type) {
+  switch (type) {
+  case LINK_FIELD_BOOL:
+  case LINK_FIELD_U8:
+  case LINK_FIELD_I8:
+    return 1;
+  case LINK_FIELD_U16:
+  case LINK_FIELD_I16:
+    return 2;
+  case LINK_FIELD_U32:
+  case LINK_FIELD_I32:
+  case LINK_FIELD_F32:
+    return 4;
+  default:
+    return 0;
   }
+}
 
-  // Reinitialize the argument list to format the message
-  va_start(args, data_fmt);
-  vsnprintf(data_message, message_size, data_fmt, args);
-  va_end(args);
+const char *link_field_type_name(link_field_type_e type) {
+  switch (type) {
+  case LINK_FIELD_BOOL:
+    return "bool";
+  case LINK_FIELD_U8:
+    return "u8";
+  case LINK_FIELD_I8:
+    return "i8";
+  case LINK_FIELD_U16:
+    return "u16";
+  case LINK_FIELD_I16:
+    return "i16";
+  case LINK_FIELD_U32:
+    return "u32";
+  case LINK_FIELD_I32:
+    return "i32";
+  case LINK_FIELD_F32:
+    return "f32";
+  case LINK_FIELD_STR:
+    return "str";
+  default:
+    return "";
+  }
+}
 
-  return data_message;
+/**
+ * @brief Writes the schema as a JSON array of "key:type" strings.
+ */
+static int link_schema_to_json(char *out, size_t size,
+                               const link_field_t *schema) {
+  int len = snprintf(out, size, "[");
+  for (int i = 0; i < LINK_MAX_FIELDS && schema[i].type != LINK_FIELD_NONE;
+       i++) {
+    len += snprintf(out + len, len < (int)size ? size - len : 0,
+                    "%s\"%s:%s\"", (i > 0) ? "," : "", schema[i].key,
+                    link_field_type_name(schema[i].type));
+  }
+  len += snprintf(out + len, len < (int)size ? size - len : 0, "]");
+  return len;
 }
 
 char *link_get_pair_msg() {
@@ -125,66 +196,468 @@ char *link_get_pair_msg() {
   if (strlen(link_device->config) == 0)
     sprintf(link_device->config, "{}");
 
-  asprintf(&link_device->_pair_msg, PAIR_MSG_FMT, link_device->type,
-           link_device->config);
+  if (link_device->status_schema[0].type == LINK_FIELD_NONE &&
+      link_device->data_schema[0].type == LINK_FIELD_NONE) {
+    asprintf(&link_device->_pair_msg, PAIR_MSG_FMT, link_device->type,
+             link_device->config, PAIR_MSG_OPTIONS);
+    return link_device->_pair_msg;
+  }
+
+  // "key:type" entries, quoted and separated by commas
+  char status_schema[LINK_MAX_FIELDS * (LINK_FIELD_KEY_SIZE + 8) + 3];
+  char data_schema[LINK_MAX_FIELDS * (LINK_FIELD_KEY_SIZE + 8) + 3];
+  link_schema_to_json(status_schema, sizeof(status_schema),
+                      link_device->status_schema);
+  link_schema_to_json(data_schema, sizeof(data_schema),
+                      link_device->data_schema);
+
+  asprintf(&link_device->_pair_msg, PAIR_MSG_SCHEMA_FMT, link_device->type,
+           link_device->config, status_schema, data_schema, PAIR_MSG_OPTIONS);
 
   return link_device->_pair_msg;
 }
 
-static inline bool link_send_msg(char *(*msg_cb)(),
-                                 link_message_type_e msg_type) {
-  if (msg_cb == NULL) {
-    return false;
+static link_msg_t *link_msg_reserve_with_prefix(enc_msg_kind_e kind,
+                                                const char *prefix,
+                                                TickType_t wait) {
+  link_msg_t *msg = enc_slot_reserve(kind, wait);
+  if (msg == NULL)
+    return NULL;
+
+  strcpy(enc_slot_data(msg), prefix);
+  enc_slot_set_len(msg, strlen(prefix));
+
+  return msg;
+}
+
+static link_msg_t *link_msg_reserve(enc_msg_kind_e kind, TickType_t wait) {
+#if CONFIG_LINK_USE_PREFIX
+  return link_msg_reserve_with_prefix(
+      kind, (kind == ENC_MSG_STATUS) ? LINK_STATUS_PREFIX : LINK_DATA_PREFIX,
+      wait);
+#else
+  return link_msg_reserve_with_prefix(kind, "", wait);
+#endif
+}
+
+link_msg_t *link_msg_reserve_status() {
+  return link_msg_reserve(ENC_MSG_STATUS, portMAX_DELAY);
+}
+
+link_msg_t *link_msg_reserve_data() {
+  return link_msg_reserve(ENC_MSG_DATA, portMAX_DELAY);
+}
+
+static int link_msg_vprintf(link_msg_t *msg, const char *fmt, va_list args) {
+  if (fmt == NULL)
+    fmt = (enc_slot_kind(msg) == ENC_MSG_STATUS) ? link_device->status_fmt
+                                                 : link_device->data_fmt;
+
+  char *data = enc_slot_data(msg);
+  size_t len = enc_slot_len(msg);
+  size_t space = ENC_FRAME_MAX_LEN + 1 - len;
+
+  int written = vsnprintf(data + len, space, fmt, args);
+  if (written < 0 || (size_t)written >= space) {
+    // Keep the message as it was before the call
+    data[len] = '\0';
+    return -1;
   }
+  enc_slot_set_len(msg, len + written);
+  return written;
+}
 
-  char *msg = msg_cb();
+int link_msg_printf(link_msg_t *msg, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int written = link_msg_vprintf(msg, fmt, args);
+  va_end(args);
+  return written;
+}
 
-  if (msg == NULL) {
+link_msg_t *link_msg_reserve_binary_status() {
+  return link_msg_reserve_with_prefix(ENC_MSG_STATUS, LINK_BINARY_STATUS_PREFIX,
+                                      portMAX_DELAY);
+}
+
+link_msg_t *link_msg_reserve_binary_data() {
+  return link_msg_reserve_with_prefix(ENC_MSG_DATA, LINK_BINARY_DATA_PREFIX,
+                                      portMAX_DELAY);
+}
+
+/**
+ * @brief Appends one field as tag (index in the schema) followed by the value
+ * in little endian. Strings are prefixed with their length.
+ */
+static bool link_msg_encode_field(uint8_t *out, size_t *len, uint8_t tag,
+                                  link_field_type_e type, va_list *args) {
+  uint8_t value[4];
+  const uint8_t *src = value;
+  size_t size = link_field_size(type);
+
+  switch (type) {
+  case LINK_FIELD_BOOL:
+  case LINK_FIELD_U8:
+  case LINK_FIELD_I8:
+  case LINK_FIELD_U16:
+  case LINK_FIELD_I16: {
+    // promoted to int when passed through varargs
+    uint32_t v = (uint32_t)va_arg(*args, int);
+    for (size_t i = 0; i < size; i++)
+      value[i] = (v >> (8 * i)) & 0xFF;
+    break;
+  }
+  case LINK_FIELD_U32:
+  case LINK_FIELD_I32: {
+    uint32_t v = va_arg(*args, uint32_t);
+    for (size_t i = 0; i < size; i++)
+      value[i] = (v >> (8 * i)) & 0xFF;
+    break;
+  }
+  case LINK_FIELD_F32: {
+    float f = (float)va_arg(*args, double);
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    for (size_t i = 0; i < size; i++)
+      value[i] = (v >> (8 * i)) & 0xFF;
+    break;
+  }
+  case LINK_FIELD_STR:
+    src = (const uint8_t *)va_arg(*args, const char *);
+    size = strlen((const char *)src);
+    if (size > UINT8_MAX)
+      return false;
+    break;
+  default:
     return false;
   }
 
-#if CONFIG_LINK_USE_PREFIX
-  size_t prefix_len = (msg_type == LINK_MESSAGE_STATUS)
-                          ? strlen(LINK_STATUS_PREFIX)
-                          : strlen(LINK_DATA_PREFIX);
+  size_t needed = 1 + (type == LINK_FIELD_STR ? 1 : 0) + size;
+  if (*len + needed > ENC_FRAME_MAX_LEN)
+    return false;
 
-  size_t msg_len = strlen(msg);
-  char *prefixed_msg = (char *)malloc(prefix_len + msg_len + 1);
+  out[(*len)++] = tag;
+  if (type == LINK_FIELD_STR)
+    out[(*len)++] = size;
+  memcpy(out + *len, src, size);
+  *len += size;
+  return true;
+}
 
-  if (prefixed_msg == NULL) {
-    free(msg);
+int link_msg_encode(link_msg_t *msg, ...) {
+  const link_field_t *schema = (enc_slot_kind(msg) == ENC_MSG_STATUS)
+                                   ? link_device->status_schema
+                                   : link_device->data_schema;
+
+  uint8_t *data = (uint8_t *)enc_slot_data(msg);
+  size_t start = enc_slot_len(msg);
+  size_t len = start;
+
+  va_list args;
+  va_start(args, msg);
+  for (int i = 0; i < LINK_MAX_FIELDS && schema[i].type != LINK_FIELD_NONE;
+       i++) {
+    if (!link_msg_encode_field(data, &len, i, schema[i].type, &args)) {
+      va_end(args);
+      return -1;
+    }
+  }
+  va_end(args);
+
+  enc_slot_set_len(msg, len);
+  return len - start;
+}
+
+bool link_msg_decode_field(const link_field_t *schema, const char *payload,
+                           size_t len, size_t *offset,
+                           link_field_value_t *value) {
+  const uint8_t *data = (const uint8_t *)payload;
+  size_t pos = *offset;
+  if (schema == NULL || pos >= len)
+    return false;
+
+  // the tag is the index of the field in the schema
+  uint8_t tag = data[pos++];
+  if (tag >= LINK_MAX_FIELDS)
+    return false;
+  for (int i = 0; i <= tag; i++) {
+    if (schema[i].type == LINK_FIELD_NONE)
+      return false;
+  }
+
+  link_field_type_e type = schema[tag].type;
+  size_t size = link_field_size(type);
+  if (type == LINK_FIELD_STR) {
+    if (pos >= len)
+      return false;
+    size = data[pos++];
+  }
+  if (size > len - pos)
     return false;
+
+  uint32_t v = 0;
+  if (type != LINK_FIELD_STR) {
+    for (size_t i = 0; i < size; i++)
+      v |= (uint32_t)data[pos + i] << (8 * i);
   }
 
-  strcpy(prefixed_msg, (msg_type == LINK_MESSAGE_STATUS) ? LINK_STATUS_PREFIX
-                                                         : LINK_DATA_PREFIX);
-  strcat(prefixed_msg, msg);
+  value->field = &schema[tag];
+  switch (type) {
+  case LINK_FIELD_BOOL:
+    value->b = v != 0;
+    break;
+  case LINK_FIELD_I8:
+    value->i = (int8_t)v;
+    break;
+  case LINK_FIELD_I16:
+    value->i = (int16_t)v;
+    break;
+  case LINK_FIELD_I32:
+    value->i = (int32_t)v;
+    break;
+  case LINK_FIELD_F32:
+    memcpy(&value->f, &v, sizeof(value->f));
+    break;
+  case LINK_FIELD_STR:
+    value->str.data = payload + pos;
+    value->str.len = size;
+    break;
+  default:
+    value->u = v;
+    break;
+  }
 
-  free(msg);
-  msg = prefixed_msg;
+  *offset = pos + size;
+  return true;
+}
+
+bool link_msg_send(link_msg_t *msg) {
+  ESP_LOGD(TAG, "Sending %s message (%u bytes)",
+           (enc_slot_kind(msg) == ENC_MSG_STATUS) ? "status" : "data",
+           (unsigned)enc_slot_len(msg));
+
+  return enc_slot_send_with_result(msg, enc_slot_len(msg));
+}
+
+void link_msg_discard(link_msg_t *msg) { enc_slot_release(msg); }
+
+static esp_err_t link_send_msg(char *(*msg_cb)(), enc_msg_kind_e msg_type,
+                               TickType_t wait) {
+  if (msg_cb == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Do not build a message that has nowhere to go
+  if (!enp_get_gateway_mac(NULL)) {
+    return ENC_ERR_NOT_PAIRED;
+  }
+
+  char *msg = msg_cb();
+
+  if (msg == NULL) {
+    return ESP_FAIL;
+  }
+
+  const char *body = msg;
+  const char *prefix = NULL;
+#if LINK_DELTA
+  // only gateways that agreed to it when pairing keep the base of deltas
+  char delta[ENC_FRAME_MAX_LEN + 1];
+  enc_mac_t gateway;
+  if (enp_get_gateway_mac(&gateway) && enp_gateway_deltas(&gateway))
+    prefix = link_delta_encode(msg_type, msg, delta, sizeof(delta));
+  if (prefix != NULL)
+    body = delta;
 #endif
 
-  ESP_LOGD(TAG, "Sending %s message: \"%s\"",
-           (msg_type == LINK_MESSAGE_STATUS) ? "status" : "data", msg);
+  // Copy the message straight behind the prefix in the send buffer
+  TickType_t start = xTaskGetTickCount();
+  link_msg_t *prefixed_msg =
+      (prefix != NULL) ? link_msg_reserve_with_prefix(msg_type, prefix, wait)
+                       : link_msg_reserve(msg_type, wait);
+  if (prefixed_msg == NULL) {
+    free(msg);
+    return ENC_ERR_QUEUE_FULL;
+  }
+  if (wait != portMAX_DELAY) {
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    wait = (elapsed < wait) ? wait - elapsed : 0;
+  }
 
-  bool ret = enc_send_with_result(msg);
+  esp_err_t err;
+  if (link_msg_printf(prefixed_msg, "%s", body) >= 0) {
+    ESP_LOGD(TAG, "Sending %s message (%u bytes)",
+             (msg_type == ENC_MSG_STATUS) ? "status" : "data",
+             (unsigned)enc_slot_len(prefixed_msg));
+    err = enc_slot_try_send_with_result(prefixed_msg,
+                                        enc_slot_len(prefixed_msg), wait);
+  } else {
+    // Longer than a single frame, send it in fragments
+    char *long_msg = NULL;
+    asprintf(&long_msg, "%s%s", enc_slot_data(prefixed_msg), body);
+    link_msg_discard(prefixed_msg);
+
+    if (long_msg == NULL) {
+      free(msg);
+      return ESP_ERR_NO_MEM;
+    }
+
+    err = enc_try_send_with_result(long_msg, msg_type, wait);
+    free(long_msg);
+  }
+
+#if LINK_DELTA
+  if (err == ESP_OK)
+    link_delta_acked(msg_type, msg, prefix == NULL);
+#endif
   free(msg);
-  return ret;
+  return err;
 }
 
 bool link_send_status_msg() {
-  return link_send_msg(link_device->user_status_msg_cb, LINK_MESSAGE_STATUS);
+  esp_err_t err = link_send_msg(link_device->user_status_msg_cb, ENC_MSG_STATUS,
+                                portMAX_DELAY);
+  return err == ESP_OK || err == ENC_ERR_SUPERSEDED;
 }
 
 bool link_send_data_msg() {
-  return link_send_msg(link_device->user_data_msg_cb, LINK_MESSAGE_DATA);
+  esp_err_t err = link_send_msg(link_device->user_data_msg_cb, ENC_MSG_DATA,
+                                portMAX_DELAY);
+  return err == ESP_OK || err == ENC_ERR_SUPERSEDED;
+}
+
+esp_err_t link_try_send_status_msg(uint32_t timeout_ms) {
+  return link_send_msg(link_device->user_status_msg_cb, ENC_MSG_STATUS,
+                       pdMS_TO_TICKS(timeout_ms));
+}
+
+esp_err_t link_try_send_data_msg(uint32_t timeout_ms) {
+  return link_send_msg(link_device->user_data_msg_cb, ENC_MSG_DATA,
+                       pdMS_TO_TICKS(timeout_ms));
+}
+
+void link_set_send_watermark_cb(link_watermark_cb cb, void *ctx) {
+  enc_set_watermark_cb(cb, ctx);
+}
+
+void link_get_stats(link_stats_t *stats) {
+  enc_get_stats(stats);
+  stats->commands_dropped = link_command_dropped();
+}
+
+int link_get_peer_stats(link_peer_stats_t *peers, int max_peers) {
+  return enc_get_peer_stats(peers, max_peers);
+}
+
+#if LINK_TELEMETRY_INTERVAL > 0
+#define LINK_TELEMETRY_FMT                                                     \
+  LINK_TELEMETRY_PREFIX                                                        \
+  "{\"tx\":%" PRIu32 ",\"fail\":%" PRIu32 ",\"ack\":%" PRIu32                  \
+  ",\"rtx\":%" PRIu32 ",\"lost\":%" PRIu32 ",\"full\":{\"sq\":[%" PRIu32       \
+  ",%" PRIu32 ",%" PRIu32 "],\"res\":%" PRIu32 ",\"rq\":%" PRIu32              \
+  ",\"pool\":%" PRIu32 ",\"ack\":%" PRIu32 "},\"hw\":{\"sq\":[%" PRIu32        \
+  ",%" PRIu32 ",%" PRIu32 "],\"rq\":%" PRIu32 "},\"coal\":%" PRIu32            \
+  ",\"z\":[%" PRIu32 ",%" PRIu32 "],\"unk\":%" PRIu32 ",\"cmd\":%" PRIu32      \
+  ",\"rssi\":[%d,%d,%d]}"
+
+// 21 counters of up to 10 digits and 3 signal values of up to 4 characters
+// take the place of their conversions
+#define LINK_TELEMETRY_MAX_LEN (sizeof(LINK_TELEMETRY_FMT) + 21 * 10 + 3 * 4)
+
+/**
+ * @brief Sends the counters and the signal of the gateway, so the gateway can
+ * chart them for the whole network.
+ */
+static void link_send_telemetry() {
+  enc_mac_t gateway;
+  if (!enp_get_gateway_mac(&gateway))
+    return;
+
+  link_stats_t stats;
+  link_get_stats(&stats);
+
+  link_peer_stats_t peers[ENC_PEER_CACHE_SIZE];
+  int count = link_get_peer_stats(peers, ENC_PEER_CACHE_SIZE);
+  link_peer_stats_t *gateway_peer = NULL;
+  for (int i = 0; i < count; i++) {
+    if (memcmp(peers[i].mac.bytes, gateway.bytes, sizeof(gateway.bytes)) == 0)
+      gateway_peer = &peers[i];
+  }
+
+  char msg[LINK_TELEMETRY_MAX_LEN];
+  int len = snprintf(
+      msg, sizeof(msg), LINK_TELEMETRY_FMT,
+      stats.frames_sent, stats.frames_failed, stats.frames_acked,
+      stats.retransmissions, stats.reliable_failures,
+      stats.send_queue_full[ENC_MSG_CONTROL],
+      stats.send_queue_full[ENC_MSG_STATUS],
+      stats.send_queue_full[ENC_MSG_DATA], stats.send_result_queue_full,
+      stats.receive_queue_full, stats.receive_pool_exhausted,
+      stats.ack_queue_full, stats.send_queue_high_water[ENC_MSG_CONTROL],
+      stats.send_queue_high_water[ENC_MSG_STATUS],
+      stats.send_queue_high_water[ENC_MSG_DATA],
+      stats.receive_queue_high_water, stats.coalesced, stats.compress_in,
+      stats.compress_out, stats.unknown_sender, stats.commands_dropped,
+      gateway_peer ? gateway_peer->rssi_min : 0,
+      gateway_peer ? gateway_peer->rssi_avg : 0,
+      gateway_peer ? gateway_peer->rssi_max : 0);
+
+  if (len < 0) {
+    ESP_LOGW(TAG, "Telemetry could not be formatted");
+    return;
+  }
+  // a bulk message, it must not hold up commands and their answers
+  enc_try_send_async(msg, len, ENC_MSG_DATA, 0, NULL, NULL);
 }
 
+static void link_telemetry_task(void *params) {
+  while (1) {
+    vTaskDelay(pdMS_TO_TICKS(LINK_TELEMETRY_INTERVAL * 1000));
+    link_send_telemetry();
+  }
+}
+#endif
+
 void link_start(bool force_pair) {
+  link_command_workers_start();
   enc_init();
+#if LINK_ROLE_GATEWAY
+  eng_init(force_pair);
+#else
+#if LINK_DELTA
+  link_delta_init();
+#endif
   enp_init(force_pair);
+#endif
+#if LINK_TELEMETRY_INTERVAL > 0
+  xTaskCreate(link_telemetry_task, "link_telemetry_task", 3072, NULL, 4, NULL);
+#endif
 }
 
 void link_block_until_find_pair() {
   enp_block_until_find_pair();
-}
\ No newline at end of file
+}
+
+bool link_wait_for_pair(uint32_t timeout_ms) {
+  return enp_wait_for_pair(pdMS_TO_TICKS(timeout_ms));
+}
+
+#if LINK_ROLE_GATEWAY
+bool link_gateway_register_handler(int type, link_gateway_message_cb cb) {
+  return eng_register_handler(type, cb);
+}
+
+bool link_gateway_send_command(const enc_mac_t *mac, const char *cmd) {
+  return eng_send_command(mac, cmd);
+}
+
+bool link_gateway_get_node(const enc_mac_t *mac, link_node_t *node) {
+  return eng_get_node(mac, node);
+}
+
+bool link_gateway_remove_node(const enc_mac_t *mac) {
+  return eng_remove_node(mac);
+}
+
+int link_gateway_get_node_count() { return eng_get_node_count(); }
+#endif
\ No newline at end of file
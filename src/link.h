@@ -3,33 +3,136 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "sdkconfig.h"
 
-#define PAIR_MSG_FMT "SHPR:{\"type\":%d,\"cfg\":%s}"
+#include "esp_now_communication.h"
+
+#define PAIR_MSG_FMT "SHPR:{\"type\":%d,\"cfg\":%s%s}"
+#define PAIR_MSG_SCHEMA_FMT                                                    \
+  "SHPR:{\"type\":%d,\"cfg\":%s,\"schema\":{\"S\":%s,\"D\":%s}%s}"
 #define PAIR_ACCEPT "SHPR:PAIRED"
+// Appended to the pair request by devices that accept compressed frames or
+// send delta messages. The gateway appends the options it agrees to to
+// PAIR_ACCEPT, as in "SHPR:PAIRED,z,d".
+#define PAIR_COMPRESS ",\"z\":1"
+#define PAIR_DELTA ",\"d\":1"
+#define PAIR_ACCEPT_COMPRESS ",z"
+#define PAIR_ACCEPT_DELTA ",d"
 
 #define LINK_CONFIG_SIZE CONFIG_LINK_CONFIG_SIZE
 #define LINK_STATUS_FMT_SIZE CONFIG_LINK_STATUS_FMT_SIZE
 #define LINK_DATA_FMT_SIZE CONFIG_LINK_DATA_FMT_SIZE
 
+#define LINK_MAX_FIELDS CONFIG_LINK_MAX_FIELDS
+#define LINK_FIELD_KEY_SIZE CONFIG_LINK_FIELD_KEY_SIZE
+
 #define LINK_MAX_COMMANDS CONFIG_LINK_MAX_COMMANDS
 #define LINK_COMMAND_MAX_SIZE CONFIG_LINK_COMMAND_MAX_SIZE
+#define LINK_MAX_COMMAND_ARGS CONFIG_LINK_MAX_COMMAND_ARGS
+#define LINK_COMMAND_WORKERS CONFIG_LINK_COMMAND_WORKERS
+#define LINK_COMMAND_QUEUE_SIZE CONFIG_LINK_COMMAND_QUEUE_SIZE
 
 #define LINK_USE_PREFIX CONFIG_LINK_USE_PREFIX
 #define LINK_STATUS_PREFIX "!S:"
 #define LINK_DATA_PREFIX "!D:"
+#define LINK_BINARY_STATUS_PREFIX "#S:"
+#define LINK_BINARY_DATA_PREFIX "#D:"
 
 #define LINK_SEND_STATUS_DATE_AFTER_INIT CONFIG_LINK_SEND_STATUS_DATE_AFTER_INIT
 
+#define LINK_DELTA CONFIG_LINK_DELTA
+#define LINK_DELTA_KEYFRAME_INTERVAL CONFIG_LINK_DELTA_KEYFRAME_INTERVAL
+#define LINK_DELTA_STATUS_PREFIX "!s:"
+#define LINK_DELTA_DATA_PREFIX "!d:"
+#define LINK_UNCHANGED_STATUS_PREFIX "!s="
+#define LINK_UNCHANGED_DATA_PREFIX "!d="
+#define LINK_DELTA_RESYNC "!RESYNC"
+
+#define LINK_STARTUP_SPREAD_MS CONFIG_LINK_STARTUP_SPREAD_MS
+#define LINK_PAIR_CHANNEL_SWEEP CONFIG_LINK_PAIR_CHANNEL_SWEEP
+#define LINK_PAIR_SWEEPS CONFIG_LINK_PAIR_SWEEPS
+#define LINK_PAIR_RETRY_MIN_MS CONFIG_LINK_PAIR_RETRY_MIN_MS
+#define LINK_PAIR_RETRY_MAX_MS CONFIG_LINK_PAIR_RETRY_MAX_MS
+#define LINK_REPAIR_AFTER_FAILURES CONFIG_LINK_REPAIR_AFTER_FAILURES
+#define LINK_GATEWAY_LIST_SIZE CONFIG_LINK_GATEWAY_LIST_SIZE
+#define LINK_GATEWAY_FAILOVER_AFTER_FAILURES                                   \
+  CONFIG_LINK_GATEWAY_FAILOVER_AFTER_FAILURES
+
+#define LINK_TELEMETRY_INTERVAL CONFIG_LINK_TELEMETRY_INTERVAL
+#define LINK_TELEMETRY_PREFIX "!T:"
+
+#define LINK_ROLE_GATEWAY CONFIG_LINK_ROLE_GATEWAY
+#define LINK_GATEWAY_MAX_NODES CONFIG_LINK_GATEWAY_MAX_NODES
+#define LINK_GATEWAY_MAX_TYPES CONFIG_LINK_GATEWAY_MAX_TYPES
+#define LINK_GATEWAY_DELTA_NODES CONFIG_LINK_GATEWAY_DELTA_NODES
+
 /**
- * @brief Callback type for handling received commands.
+ * @brief Message buffer taken from the send pool. It is filled in place and
+ * handed to the send task without copying.
+ */
+typedef struct enc_send link_msg_t;
+
+/**
+ * @brief Counters of the communication stack since link_start.
+ */
+typedef enc_stats_t link_stats_t;
+
+/**
+ * @brief Signal statistics of one peer the device received frames from.
+ */
+typedef enc_peer_stats_t link_peer_stats_t;
+
+/**
+ * @brief Callback type for send queue watermarks. above is true once the queue
+ * of the given kind filled up and false once it drained again.
+ */
+typedef enc_watermark_cb link_watermark_cb;
+
+/**
+ * @brief Callback type for handling received commands. Runs on a command
+ * worker task unless LINK_COMMAND_WORKERS is 0.
  *
  * @param cmd The received command string.
  */
 typedef void (*link_command_cb)(const char *cmd);
 
+/**
+ * @brief Value captured by a wildcard or a typed placeholder of a command.
+ */
+typedef struct {
+  /**
+   * Start of the captured text within the received command. Not terminated.
+   */
+  const char *str;
+
+  /**
+   * Length of the captured text.
+   */
+  size_t len;
+
+  /**
+   * Parsed value for "%u", "%d" and "%f" placeholders.
+   */
+  union {
+    unsigned long u;
+    long i;
+    float f;
+  };
+} link_arg_t;
+
+/**
+ * @brief Callback type for handling a single command.
+ *
+ * @param cmd The received command string.
+ * @param args Values captured by the placeholders of the command, in order.
+ * @param argc Number of captured values.
+ */
+typedef void (*link_command_handler_cb)(const char *cmd, const link_arg_t *args,
+                                        int argc);
+
 /**
  * @brief Callback type for generating the status message.
  *
@@ -44,6 +147,47 @@ typedef char *(*link_status_message_cb)(void);
  */
 typedef char *(*link_data_message_cb)(void);
 
+/**
+ * @brief Value types of binary message fields.
+ */
+typedef enum {
+  LINK_FIELD_NONE = 0, /**< Marks the end of a schema */
+  LINK_FIELD_BOOL,
+  LINK_FIELD_U8,
+  LINK_FIELD_I8,
+  LINK_FIELD_U16,
+  LINK_FIELD_I16,
+  LINK_FIELD_U32,
+  LINK_FIELD_I32,
+  LINK_FIELD_F32,
+  LINK_FIELD_STR, /**< Up to 255 characters */
+} link_field_type_e;
+
+/**
+ * @brief Describes one field of a binary status or data message.
+ */
+typedef struct {
+  char key[LINK_FIELD_KEY_SIZE];
+  link_field_type_e type;
+} link_field_t;
+
+/**
+ * @brief One field of a received binary message, see link_msg_decode_field().
+ */
+typedef struct {
+  const link_field_t *field; /**< Its entry in the schema */
+  union {
+    bool b;     /**< LINK_FIELD_BOOL */
+    uint32_t u; /**< LINK_FIELD_U8, LINK_FIELD_U16 and LINK_FIELD_U32 */
+    int32_t i;  /**< LINK_FIELD_I8, LINK_FIELD_I16 and LINK_FIELD_I32 */
+    float f;    /**< LINK_FIELD_F32 */
+    struct {
+      const char *data; /**< Points into the payload, not terminated */
+      size_t len;
+    } str; /**< LINK_FIELD_STR */
+  };
+} link_field_value_t;
+
 /**
  * @brief Structure representing the device configuration.
  */
@@ -69,12 +213,34 @@ typedef struct {
    */
   char data_fmt[LINK_DATA_FMT_SIZE];
 
+  /**
+   * Fields of the binary status message, in encoding order.
+   * Sent to the gateway in the pairing message. Leave empty if not used.
+   */
+  link_field_t status_schema[LINK_MAX_FIELDS];
+
+  /**
+   * Fields of the binary data message, in encoding order.
+   * Sent to the gateway in the pairing message. Leave empty if not used.
+   */
+  link_field_t data_schema[LINK_MAX_FIELDS];
+
   /**
    * Array of commands that the device can handle.
-   * Use '*' to denote a wildcard in commands.
+   * Use '*' to denote a wildcard in commands, and "%u", "%d" or "%f" to
+   * capture a number (e.g. "SET_BRIGHTNESS=%u"). Use "%%" for a literal '%'.
+   * A command has to match the whole received message. The table is compiled
+   * in link_register, changes made afterwards are not seen.
    */
   char commands[LINK_MAX_COMMANDS][LINK_COMMAND_MAX_SIZE];
 
+  /**
+   * Optional handlers for the commands at the same index in the commands
+   * array. They receive the captured values. Commands without a handler are
+   * passed to user_command_parser_cb.
+   */
+  link_command_handler_cb command_handlers[LINK_MAX_COMMANDS];
+
   /**
    * User-defined callback function that is called when a command from
    * the commands array is received.
@@ -102,6 +268,54 @@ typedef struct {
 
 } link_config_t;
 
+/**
+ * @brief Device paired with the gateway, as announced in its pair request.
+ */
+typedef struct {
+  enc_mac_t mac;
+
+  /**
+   * Device type identifier from the pair request.
+   */
+  int type;
+
+  /**
+   * JSON formatted configuration from the pair request, truncated to the
+   * buffer size.
+   */
+  char config[LINK_CONFIG_SIZE];
+} link_node_t;
+
+/**
+ * @brief Kinds of messages a gateway receives from its devices.
+ */
+typedef enum {
+  LINK_NODE_MSG_STATUS,        /**< "!S:" */
+  LINK_NODE_MSG_DATA,          /**< "!D:" */
+  LINK_NODE_MSG_BINARY_STATUS, /**< "#S:" */
+  LINK_NODE_MSG_BINARY_DATA,   /**< "#D:" */
+  LINK_NODE_MSG_TELEMETRY,     /**< "!T:" */
+  LINK_NODE_MSG_OTHER,         /**< Anything without a known prefix */
+} link_node_msg_kind_e;
+
+/**
+ * @brief Callback type for handling messages of one device type on the
+ * gateway. Called from the receive task, must not block.
+ *
+ * @param node The device that sent the message.
+ * @param kind Kind of the message, taken from its prefix.
+ * @param schema Fields of binary status or data messages as devices of the
+ * type announced them when pairing, ended by LINK_FIELD_NONE. NULL for other
+ * kinds or when no schema was announced.
+ * @param payload The message without its prefix. Binary payloads are read
+ * field by field with link_msg_decode_field().
+ * @param len Length of the payload, binary payloads may contain zeros.
+ */
+typedef void (*link_gateway_message_cb)(const link_node_t *node,
+                                        link_node_msg_kind_e kind,
+                                        const link_field_t *schema,
+                                        const char *payload, size_t len);
+
 /**
  * @brief Registers the device configuration, making it available for the
  * library's internal use.
@@ -114,7 +328,8 @@ void link_register(link_config_t *device);
  * @brief Starts all tasks related to ESP-NOW communication, including pairing
  * and message handling.
  *
- * @param force_pair If true, forces re-pairing even if a pairing exists.
+ * @param force_pair If true, forces re-pairing even if a pairing exists. In
+ * the gateway role, forgets all paired devices instead.
  */
 void link_start(bool force_pair);
 
@@ -133,7 +348,8 @@ char *link_generate_status_message(const char *status_fmt, ...);
  * @brief Retrieves the status message generated by user_status_msg_cb and sends
  * it via ESP-NOW.
  *
- * @return True if the message was sent successfully, false otherwise.
+ * @return True if the message, or a newer one that took its place in the
+ * queue, was sent successfully, false otherwise.
  */
 bool link_send_status_msg();
 
@@ -151,10 +367,173 @@ char *link_generate_data_message(const char *data_fmt, ...);
  * @brief Retrieves the data message generated by user_data_msg_cb and sends it
  * via ESP-NOW.
  *
- * @return True if the message was sent successfully, false otherwise.
+ * @return True if the message, or a newer one that took its place in the
+ * queue, was sent successfully, false otherwise.
  */
 bool link_send_data_msg();
 
+/**
+ * @brief Like link_send_status_msg(), but gives up after timeout_ms instead of
+ * waiting for room and the result indefinitely.
+ *
+ * @param timeout_ms How long to wait in all for a free buffer, room in the
+ * queue and the result, 0 to return right away.
+ * @return ESP_OK if the message was sent successfully, ENC_ERR_NOT_PAIRED if
+ * there is no gateway yet, ENC_ERR_QUEUE_FULL if it could not be queued in
+ * time, ESP_ERR_TIMEOUT if it was queued but its result did not come in time
+ * (it may still be delivered), ENC_ERR_SUPERSEDED if a newer message took its
+ * place and was sent, ESP_FAIL if it was not received.
+ */
+esp_err_t link_try_send_status_msg(uint32_t timeout_ms);
+
+/**
+ * @brief Like link_send_data_msg(), but gives up after timeout_ms instead of
+ * waiting for room and the result indefinitely.
+ *
+ * @param timeout_ms How long to wait in all for a free buffer, room in the
+ * queue and the result, 0 to return right away.
+ * @return ESP_OK if the message was sent successfully, ENC_ERR_NOT_PAIRED if
+ * there is no gateway yet, ENC_ERR_QUEUE_FULL if it could not be queued in
+ * time, ESP_ERR_TIMEOUT if it was queued but its result did not come in time
+ * (it may still be delivered), ENC_ERR_SUPERSEDED if a newer message took its
+ * place and was sent, ESP_FAIL if it was not received.
+ */
+esp_err_t link_try_send_data_msg(uint32_t timeout_ms);
+
+/**
+ * @brief Sets the function told when a send queue reaches its high watermark
+ * (ENC_WATERMARK_HIGH_PERCENT) and when it drains to its low watermark
+ * (ENC_WATERMARK_LOW_PERCENT) again, so producers can slow down before
+ * sending blocks. It runs in the task that moved the queue across the mark
+ * and must not block. Set it before sending any messages.
+ *
+ * @param cb The callback, or NULL to stop the notifications.
+ * @param ctx Passed to the callback.
+ */
+void link_set_send_watermark_cb(link_watermark_cb cb, void *ctx);
+
+/**
+ * @brief Reserves a status message buffer from the send pool. The status
+ * prefix is already written when LINK_USE_PREFIX is enabled.
+ *
+ * Blocks until a buffer is available. The buffer must be passed to
+ * link_msg_send() or link_msg_discard().
+ *
+ * @return The reserved message buffer.
+ */
+link_msg_t *link_msg_reserve_status();
+
+/**
+ * @brief Reserves a data message buffer from the send pool. The data prefix is
+ * already written when LINK_USE_PREFIX is enabled.
+ *
+ * Blocks until a buffer is available. The buffer must be passed to
+ * link_msg_send() or link_msg_discard().
+ *
+ * @return The reserved message buffer.
+ */
+link_msg_t *link_msg_reserve_data();
+
+/**
+ * @brief Appends formatted text to a reserved message buffer without any heap
+ * allocation.
+ *
+ * @param msg The message buffer.
+ * @param fmt The format string. If NULL, the status or data format stored in
+ * link_config_t is used, depending on how the buffer was reserved.
+ * @return The number of characters appended, or -1 if the message does not fit
+ * into a single ESP-NOW frame.
+ */
+int link_msg_printf(link_msg_t *msg, const char *fmt, ...);
+
+/**
+ * @brief Returns the name of the field type as written in pair requests,
+ * e.g. "u16", or an empty string for LINK_FIELD_NONE.
+ */
+const char *link_field_type_name(link_field_type_e type);
+
+/**
+ * @brief Reserves a binary status message buffer from the send pool, with the
+ * "#S:" prefix already written. Fill it with link_msg_encode().
+ *
+ * @return The reserved message buffer.
+ */
+link_msg_t *link_msg_reserve_binary_status();
+
+/**
+ * @brief Reserves a binary data message buffer from the send pool, with the
+ * "#D:" prefix already written. Fill it with link_msg_encode().
+ *
+ * @return The reserved message buffer.
+ */
+link_msg_t *link_msg_reserve_binary_data();
+
+/**
+ * @brief Encodes the values according to the status_schema or data_schema of
+ * the device. Every field is written as its index in the schema followed by
+ * the little endian value; strings are prefixed with their length.
+ *
+ * Pass one value per schema field, in schema order: int for bool and integer
+ * types up to 16 bits, uint32_t/int32_t for 32-bit integers, double for f32 and
+ * const char * for str.
+ *
+ * @param msg The message buffer.
+ * @return The number of bytes appended, or -1 if the message does not fit
+ * into a single ESP-NOW frame.
+ */
+int link_msg_encode(link_msg_t *msg, ...);
+
+/**
+ * @brief Decodes the next field of a binary status or data message, as a
+ * link_gateway_message_cb receives it along with the schema of the device.
+ *
+ * @param schema The schema handed to the handler.
+ * @param payload The payload handed to the handler.
+ * @param len Length of the payload.
+ * @param offset Where the field starts, 0 for the first one. Moved past the
+ * field.
+ * @param value Where the field is decoded to.
+ * @return False at the end of the payload, or if the field does not match the
+ * schema.
+ */
+bool link_msg_decode_field(const link_field_t *schema, const char *payload,
+                           size_t len, size_t *offset,
+                           link_field_value_t *value);
+
+/**
+ * @brief Hands the message buffer to the send task and waits for the result.
+ * The buffer is returned to the pool afterwards.
+ *
+ * @param msg The message buffer.
+ * @return True if the message was sent successfully, false otherwise.
+ */
+bool link_msg_send(link_msg_t *msg);
+
+/**
+ * @brief Returns a reserved message buffer to the pool without sending it.
+ *
+ * @param msg The message buffer.
+ */
+void link_msg_discard(link_msg_t *msg);
+
+/**
+ * @brief Copies the counters of the communication stack. They are updated
+ * without locking, so the copy is cheap but its counters are not taken at
+ * exactly the same moment.
+ *
+ * @param stats Where the counters are written.
+ */
+void link_get_stats(link_stats_t *stats);
+
+/**
+ * @brief Copies the RSSI statistics of the most recently heard peers.
+ *
+ * @param peers Where the statistics are written.
+ * @param max_peers Number of entries peers can hold.
+ * @return The number of entries written.
+ */
+int link_get_peer_stats(link_peer_stats_t *peers, int max_peers);
+
 /**
  * @brief Returns the pairing message, generating it if necessary.
  *
@@ -165,9 +544,62 @@ char *link_get_pair_msg();
 /**
  * @brief Blocks execution until a pairing is found.
  *
- * This function continuously checks for the presence of a gateway MAC address 
- * and only returns once a pairing is established.
+ * The calling task sleeps until the pairing state changes and only returns
+ * once a pairing is established.
  */
 void link_block_until_find_pair();
 
+/**
+ * @brief Waits until a pairing is established or the timeout expires.
+ *
+ * @param timeout_ms How long to wait, in milliseconds.
+ * @return True if the device is paired.
+ */
+bool link_wait_for_pair(uint32_t timeout_ms);
+
+/**
+ * @brief Registers the handler for messages of all devices of the given type.
+ * Only available in the gateway role.
+ *
+ * @param type Device type identifier.
+ * @param cb The handler, replaces a previously registered one.
+ * @return False if LINK_GATEWAY_MAX_TYPES other device types are already
+ * known from handlers or from the schemas of pair requests.
+ */
+bool link_gateway_register_handler(int type, link_gateway_message_cb cb);
+
+/**
+ * @brief Sends a command to a paired device and waits for the result.
+ * Only available in the gateway role.
+ *
+ * @param mac The device.
+ * @param cmd The command, matched against the commands of the device.
+ * @return True if the command was sent successfully, false otherwise.
+ */
+bool link_gateway_send_command(const enc_mac_t *mac, const char *cmd);
+
+/**
+ * @brief Looks up a paired device. Only available in the gateway role.
+ *
+ * @param mac The device.
+ * @param node Where the device is copied, may be NULL.
+ * @return True if the device is paired.
+ */
+bool link_gateway_get_node(const enc_mac_t *mac, link_node_t *node);
+
+/**
+ * @brief Forgets a paired device, it has to pair again before its messages
+ * are accepted. Only available in the gateway role.
+ *
+ * @param mac The device.
+ * @return True if the device was paired.
+ */
+bool link_gateway_remove_node(const enc_mac_t *mac);
+
+/**
+ * @brief Returns the number of paired devices. Only available in the gateway
+ * role.
+ */
+int link_gateway_get_node_count();
+
 #endif // LINK_CONFIG_H_
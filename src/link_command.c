@@ -0,0 +1,334 @@
+#include "link_command.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "Link_CMD";
+
+#define LINK_COMMAND_MAX_TOKENS (2 * LINK_MAX_COMMAND_ARGS + 1)
+#define LINK_COMMAND_NONE -1
+
+typedef enum {
+  LINK_TOKEN_LITERAL,
+  LINK_TOKEN_ANY,      // '*'
+  LINK_TOKEN_UNSIGNED, // "%u"
+  LINK_TOKEN_SIGNED,   // "%d"
+  LINK_TOKEN_FLOAT,    // "%f"
+} link_token_type_e;
+
+typedef struct {
+  link_token_type_e type;
+  const char *literal;
+  uint8_t literal_len;
+} link_token_t;
+
+typedef struct {
+  link_token_t tokens[LINK_COMMAND_MAX_TOKENS];
+  uint8_t token_count;
+} link_command_t;
+
+static link_command_t commands[LINK_MAX_COMMANDS];
+
+// Commands bucketed by the first character of their pattern, each chain in
+// table order. Patterns starting with a capture are kept in a separate chain.
+static int16_t index_head[256];
+static int16_t index_next[LINK_MAX_COMMANDS];
+static int16_t capture_head;
+
+#if LINK_COMMAND_WORKERS > 0
+// A received command waiting for a worker task, with the captures pointing
+// into its own copy of the command
+typedef struct {
+  int command;
+  int argc;
+  link_arg_t args[LINK_MAX_COMMAND_ARGS];
+  char data[ESP_NOW_MAX_DATA_LEN + 1];
+} link_command_job_t;
+
+static link_command_job_t job_pool[LINK_COMMAND_QUEUE_SIZE];
+static QueueHandle_t job_pool_queue;
+static QueueHandle_t worker_queues[LINK_COMMAND_WORKERS];
+static uint32_t commands_dropped;
+#endif
+
+static void index_append(int16_t *head, int16_t command) {
+  while (*head != LINK_COMMAND_NONE)
+    head = &index_next[*head];
+  *head = command;
+}
+
+static bool link_command_compile_one(const char *pattern,
+                                     link_command_t *command) {
+  command->token_count = 0;
+  int captures = 0;
+  const char *p = pattern;
+  const char *end = pattern + strnlen(pattern, LINK_COMMAND_MAX_SIZE);
+
+  while (p < end) {
+    link_token_type_e type = LINK_TOKEN_LITERAL;
+    if (*p == '*') {
+      type = LINK_TOKEN_ANY;
+    } else if (*p == '%' && p + 1 < end) {
+      if (p[1] == 'u')
+        type = LINK_TOKEN_UNSIGNED;
+      else if (p[1] == 'd')
+        type = LINK_TOKEN_SIGNED;
+      else if (p[1] == 'f')
+        type = LINK_TOKEN_FLOAT;
+    }
+
+    if (command->token_count == LINK_COMMAND_MAX_TOKENS)
+      return false;
+    link_token_t *token = &command->tokens[command->token_count];
+
+    if (type != LINK_TOKEN_LITERAL) {
+      if (++captures > LINK_MAX_COMMAND_ARGS)
+        return false;
+      token->type = type;
+      token->literal = NULL;
+      token->literal_len = 0;
+      command->token_count++;
+      p += (type == LINK_TOKEN_ANY) ? 1 : 2;
+      continue;
+    }
+
+    // "%%" stands for a single '%'
+    if (*p == '%' && p + 1 < end && p[1] == '%')
+      p++;
+
+    // merge with the previous literal when they are adjacent in the pattern
+    link_token_t *prev = (command->token_count > 0) ? token - 1 : NULL;
+    if (prev != NULL && prev->type == LINK_TOKEN_LITERAL &&
+        prev->literal + prev->literal_len == p) {
+      prev->literal_len++;
+    } else {
+      token->type = LINK_TOKEN_LITERAL;
+      token->literal = p;
+      token->literal_len = 1;
+      command->token_count++;
+    }
+    p++;
+  }
+  return true;
+}
+
+void link_command_compile(const link_config_t *device) {
+  for (int i = 0; i < 256; i++)
+    index_head[i] = LINK_COMMAND_NONE;
+  capture_head = LINK_COMMAND_NONE;
+
+  for (int i = 0; i < LINK_MAX_COMMANDS; i++) {
+    index_next[i] = LINK_COMMAND_NONE;
+
+    if (device->commands[i][0] == '\0') {
+      // Skip empty (uninitialized) commands
+      commands[i].token_count = 0;
+      continue;
+    }
+
+    if (!link_command_compile_one(device->commands[i], &commands[i])) {
+      ESP_LOGE(TAG, "Command \"%.*s\" has too many captures, ignoring it",
+               LINK_COMMAND_MAX_SIZE, device->commands[i]);
+      commands[i].token_count = 0;
+      continue;
+    }
+
+    const link_token_t *first = &commands[i].tokens[0];
+    if (first->type == LINK_TOKEN_LITERAL)
+      index_append(&index_head[(uint8_t)first->literal[0]], i);
+    else
+      index_append(&capture_head, i);
+  }
+}
+
+static const char *link_command_capture_number(const link_token_t *token,
+                                               const char *s, link_arg_t *arg) {
+  char *end = NULL;
+
+  if (token->type == LINK_TOKEN_UNSIGNED) {
+    if (*s < '0' || *s > '9')
+      return NULL;
+    arg->u = strtoul(s, &end, 10);
+  } else if (token->type == LINK_TOKEN_SIGNED) {
+    if ((*s < '0' || *s > '9') && *s != '-' && *s != '+')
+      return NULL;
+    arg->i = strtol(s, &end, 10);
+  } else {
+    if ((*s < '0' || *s > '9') && *s != '-' && *s != '+' && *s != '.')
+      return NULL;
+    arg->f = strtof(s, &end);
+  }
+
+  if (end == s)
+    return NULL;
+  return end;
+}
+
+static bool link_command_match_tokens(const link_command_t *command, int ti,
+                                      const char *s, link_arg_t *args,
+                                      int argc) {
+  if (ti == command->token_count)
+    return *s == '\0';
+
+  const link_token_t *token = &command->tokens[ti];
+
+  switch (token->type) {
+  case LINK_TOKEN_LITERAL:
+    if (strncmp(s, token->literal, token->literal_len) != 0)
+      return false;
+    return link_command_match_tokens(command, ti + 1, s + token->literal_len,
+                                     args, argc);
+
+  case LINK_TOKEN_ANY: {
+    args[argc].str = s;
+
+    // the last token takes the rest of the message
+    if (ti + 1 == command->token_count) {
+      args[argc].len = strlen(s);
+      return true;
+    }
+
+    // try every position where the following literal occurs
+    const link_token_t *next = &command->tokens[ti + 1];
+    for (const char *p = s; *p != '\0'; p++) {
+      if (next->type == LINK_TOKEN_LITERAL && *p != next->literal[0])
+        continue;
+      args[argc].len = p - s;
+      if (link_command_match_tokens(command, ti + 1, p, args, argc + 1))
+        return true;
+    }
+    args[argc].len = strlen(s);
+    return link_command_match_tokens(command, ti + 1, s + args[argc].len, args,
+                                     argc + 1);
+  }
+
+  default: {
+    const char *end = link_command_capture_number(token, s, &args[argc]);
+    if (end == NULL)
+      return false;
+    args[argc].str = s;
+    args[argc].len = end - s;
+    return link_command_match_tokens(command, ti + 1, end, args, argc + 1);
+  }
+  }
+}
+
+static int link_command_count_captures(const link_command_t *command) {
+  int count = 0;
+  for (int i = 0; i < command->token_count; i++) {
+    if (command->tokens[i].type != LINK_TOKEN_LITERAL)
+      count++;
+  }
+  return count;
+}
+
+int link_command_match(const char *data, link_arg_t *args, int *argc) {
+  // walk both chains at once so the first matching command in table order
+  // wins, like in the commands array
+  int16_t literal = index_head[(uint8_t)data[0]];
+  int16_t capture = capture_head;
+
+  while (literal != LINK_COMMAND_NONE || capture != LINK_COMMAND_NONE) {
+    int16_t i;
+    if (capture == LINK_COMMAND_NONE ||
+        (literal != LINK_COMMAND_NONE && literal < capture)) {
+      i = literal;
+      literal = index_next[literal];
+    } else {
+      i = capture;
+      capture = index_next[capture];
+    }
+
+    if (link_command_match_tokens(&commands[i], 0, data, args, 0)) {
+      *argc = link_command_count_captures(&commands[i]);
+      return i;
+    }
+  }
+  return LINK_COMMAND_NONE;
+}
+
+#if LINK_COMMAND_WORKERS > 0
+static void link_command_worker_task(void *params) {
+  QueueHandle_t queue = (QueueHandle_t)params;
+  link_command_job_t *job;
+
+  while (1) {
+    if (xQueueReceive(queue, &job, portMAX_DELAY) != pdPASS)
+      continue;
+    link_command_run(job->command, job->data, job->args, job->argc);
+    xQueueSend(job_pool_queue, &job, 0);
+  }
+}
+#endif
+
+void link_command_workers_start() {
+#if LINK_COMMAND_WORKERS > 0
+  job_pool_queue =
+      xQueueCreate(LINK_COMMAND_QUEUE_SIZE, sizeof(link_command_job_t *));
+  for (int i = 0; i < LINK_COMMAND_QUEUE_SIZE; i++) {
+    link_command_job_t *job = &job_pool[i];
+    xQueueSend(job_pool_queue, &job, 0);
+  }
+
+  for (int i = 0; i < LINK_COMMAND_WORKERS; i++) {
+    // every job may end up on the same worker
+    worker_queues[i] =
+        xQueueCreate(LINK_COMMAND_QUEUE_SIZE, sizeof(link_command_job_t *));
+
+    char name[16];
+    snprintf(name, sizeof(name), "link_cmd_%d", i);
+    xTaskCreate(link_command_worker_task, name, 4096, worker_queues[i], 4,
+                NULL);
+  }
+#endif
+}
+
+/**
+ * @brief Hands a matched command to its worker task. The same command always
+ * goes to the same worker, so it runs in the order it was received.
+ *
+ * @return False if the command has to run in the calling task.
+ */
+bool link_command_submit(int command, const char *data, const link_arg_t *args,
+                         int argc) {
+#if LINK_COMMAND_WORKERS > 0
+  size_t len = strlen(data);
+  link_command_job_t *job;
+  if (len >= sizeof(job->data))
+    return false;
+
+  // never wait, the receive task must keep draining the radio
+  if (xQueueReceive(job_pool_queue, &job, 0) != pdTRUE) {
+    __atomic_fetch_add(&commands_dropped, 1, __ATOMIC_RELAXED);
+    ESP_LOGW(TAG, "All command workers are busy, dropping \"%s\"", data);
+    return true;
+  }
+
+  memcpy(job->data, data, len + 1);
+  job->command = command;
+  job->argc = argc;
+  for (int i = 0; i < argc; i++) {
+    job->args[i] = args[i];
+    job->args[i].str = job->data + (args[i].str - data);
+  }
+
+  xQueueSend(worker_queues[command % LINK_COMMAND_WORKERS], &job, 0);
+  return true;
+#else
+  return false;
+#endif
+}
+
+uint32_t link_command_dropped() {
+#if LINK_COMMAND_WORKERS > 0
+  return __atomic_load_n(&commands_dropped, __ATOMIC_RELAXED);
+#else
+  return 0;
+#endif
+}
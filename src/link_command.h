@@ -0,0 +1,17 @@
+#ifndef LINK_COMMAND_H_
+#define LINK_COMMAND_H_
+
+#include "link.h"
+
+void link_command_compile(const link_config_t *device);
+int link_command_match(const char *data, link_arg_t *args, int *argc);
+void link_message_parse(const char *data);
+
+void link_command_workers_start();
+bool link_command_submit(int command, const char *data, const link_arg_t *args,
+                         int argc);
+void link_command_run(int command, const char *data, const link_arg_t *args,
+                      int argc);
+uint32_t link_command_dropped();
+
+#endif // LINK_COMMAND_H_
@@ -0,0 +1,281 @@
+#include "link_delta.h"
+
+#if LINK_DELTA
+
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define LINK_DELTA_MAX_MEMBERS 16
+#define LINK_DELTA_HASH_LEN 4
+
+// A top level member of a flat JSON object, with the whitespace around it
+typedef struct {
+  const char *text;
+  size_t len;
+  const char *key; // quoted
+  size_t key_len;
+} link_delta_member_t;
+
+typedef struct {
+  char base[ENC_FRAME_MAX_LEN + 1]; // last message the gateway received
+  bool valid;
+  uint8_t since_keyframe;
+} link_delta_state_t;
+
+// status and data messages, taken by the sending tasks and on a resync
+static link_delta_state_t states[2];
+static SemaphoreHandle_t xMutex;
+
+static link_delta_state_t *link_delta_state(enc_msg_kind_e kind) {
+  return &states[kind == ENC_MSG_DATA];
+}
+
+static uint16_t link_delta_hash(const char *msg, size_t len) {
+  // FNV-1a folded to 16 bits
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)msg[i];
+    hash *= 16777619u;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+static bool link_delta_member_key(link_delta_member_t *member) {
+  const char *p = member->text;
+  const char *end = member->text + member->len;
+
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  if (p == end || *p != '"')
+    return false;
+
+  const char *q = p + 1;
+  while (q < end && *q != '"')
+    q += (*q == '\\') ? 2 : 1;
+  if (q >= end)
+    return false;
+
+  member->key = p;
+  member->key_len = q + 1 - p;
+  return true;
+}
+
+/**
+ * @brief Splits a JSON object at the commas between its top level members.
+ *
+ * @return The number of members, or -1 if the text is not an object with
+ * keys or has more than LINK_DELTA_MAX_MEMBERS members.
+ */
+static int link_delta_split(const char *json, size_t len,
+                            link_delta_member_t *members) {
+  if (len < 2 || json[0] != '{' || json[len - 1] != '}')
+    return -1;
+
+  const char *start = json + 1;
+  const char *end = json + len - 1;
+  int depth = 0;
+  bool in_string = false;
+  int count = 0;
+
+  for (const char *p = start; p <= end; p++) {
+    if (p < end) {
+      char c = *p;
+      if (in_string) {
+        if (c == '\\')
+          p++;
+        else if (c == '"')
+          in_string = false;
+        continue;
+      }
+      if (c == '"')
+        in_string = true;
+      else if (c == '{' || c == '[')
+        depth++;
+      else if (c == '}' || c == ']')
+        depth--;
+      if (c != ',' || depth != 0)
+        continue;
+    }
+
+    if (count == LINK_DELTA_MAX_MEMBERS)
+      return -1;
+    link_delta_member_t *member = &members[count++];
+    member->text = start;
+    member->len = p - start;
+    if (!link_delta_member_key(member))
+      return -1;
+    start = p + 1;
+  }
+
+  if (in_string || depth != 0)
+    return -1;
+  return count;
+}
+
+static bool link_delta_same_key(const link_delta_member_t *a,
+                                const link_delta_member_t *b) {
+  return a->key_len == b->key_len && memcmp(a->key, b->key, a->key_len) == 0;
+}
+
+/**
+ * @brief Writes the hash of the base followed by the members of the message
+ * that differ from it, as an object. Nothing follows the hash when no member
+ * changed.
+ *
+ * @return The length written, or -1 if the message has other keys than the
+ * base or the delta does not fit.
+ */
+static int link_delta_diff(const char *base, const char *msg, size_t len,
+                           char *out, size_t size) {
+  link_delta_member_t old_members[LINK_DELTA_MAX_MEMBERS];
+  link_delta_member_t new_members[LINK_DELTA_MAX_MEMBERS];
+  size_t base_len = strlen(base);
+
+  int count = link_delta_split(base, base_len, old_members);
+  if (count < 0 || link_delta_split(msg, len, new_members) != count ||
+      size <= LINK_DELTA_HASH_LEN)
+    return -1;
+
+  size_t written = snprintf(out, size, "%04x", link_delta_hash(base, base_len));
+  int changed = 0;
+
+  for (int i = 0; i < count; i++) {
+    const link_delta_member_t *old_member = &old_members[i];
+    const link_delta_member_t *new_member = &new_members[i];
+
+    if (!link_delta_same_key(old_member, new_member))
+      return -1;
+    if (old_member->len == new_member->len &&
+        memcmp(old_member->text, new_member->text, new_member->len) == 0)
+      continue;
+
+    // separator, member and the closing brace
+    if (written + new_member->len + 2 >= size)
+      return -1;
+    out[written++] = (changed++ == 0) ? '{' : ',';
+    memcpy(out + written, new_member->text, new_member->len);
+    written += new_member->len;
+  }
+
+  if (changed > 0)
+    out[written++] = '}';
+  out[written] = '\0';
+  return written;
+}
+
+void link_delta_init() { xMutex = xSemaphoreCreateMutex(); }
+
+/**
+ * @brief Encodes the message against the last one the gateway received.
+ *
+ * @return The prefix to send out with, or NULL if the full message has to be
+ * sent instead.
+ */
+const char *link_delta_encode(enc_msg_kind_e kind, const char *msg, char *out,
+                              size_t size) {
+  link_delta_state_t *state = link_delta_state(kind);
+  size_t len = strlen(msg);
+  int written = -1;
+
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+  if (state->valid && state->since_keyframe + 1 < LINK_DELTA_KEYFRAME_INTERVAL)
+    written = link_delta_diff(state->base, msg, len, out, size);
+  xSemaphoreGive(xMutex);
+
+  if (written < 0 || (size_t)written >= len)
+    return NULL;
+
+  if (written == LINK_DELTA_HASH_LEN)
+    return (kind == ENC_MSG_STATUS) ? LINK_UNCHANGED_STATUS_PREFIX
+                                    : LINK_UNCHANGED_DATA_PREFIX;
+  return (kind == ENC_MSG_STATUS) ? LINK_DELTA_STATUS_PREFIX
+                                  : LINK_DELTA_DATA_PREFIX;
+}
+
+/**
+ * @brief Makes the message the base of the following deltas, once the gateway
+ * received it.
+ */
+void link_delta_acked(enc_msg_kind_e kind, const char *msg, bool keyframe) {
+  link_delta_state_t *state = link_delta_state(kind);
+  size_t len = strlen(msg);
+
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+  state->valid = len < sizeof(state->base);
+  if (state->valid)
+    memcpy(state->base, msg, len + 1);
+  state->since_keyframe = keyframe ? 0 : state->since_keyframe + 1;
+  xSemaphoreGive(xMutex);
+}
+
+void link_delta_resync() {
+  xSemaphoreTake(xMutex, portMAX_DELAY);
+  for (int i = 0; i < 2; i++)
+    states[i].valid = false;
+  xSemaphoreGive(xMutex);
+}
+
+/**
+ * @brief Rebuilds a full message from its base and the body of a delta or
+ * unchanged message.
+ *
+ * @return The length of the full message, or -1 if the delta was not made
+ * against this base.
+ */
+int link_delta_expand(const char *base, const char *delta, size_t len,
+                      char *out, size_t size) {
+  size_t base_len = strlen(base);
+  if (base_len == 0 || base_len >= size || len < LINK_DELTA_HASH_LEN)
+    return -1;
+
+  char hash[LINK_DELTA_HASH_LEN + 1];
+  snprintf(hash, sizeof(hash), "%04x", link_delta_hash(base, base_len));
+  if (memcmp(delta, hash, LINK_DELTA_HASH_LEN) != 0)
+    return -1;
+
+  if (len == LINK_DELTA_HASH_LEN) {
+    memcpy(out, base, base_len + 1);
+    return base_len;
+  }
+
+  link_delta_member_t base_members[LINK_DELTA_MAX_MEMBERS];
+  link_delta_member_t delta_members[LINK_DELTA_MAX_MEMBERS];
+  int count = link_delta_split(base, base_len, base_members);
+  int changed = link_delta_split(delta + LINK_DELTA_HASH_LEN,
+                                 len - LINK_DELTA_HASH_LEN, delta_members);
+  if (count < 0 || changed <= 0)
+    return -1;
+
+  size_t written = 0;
+  int replaced = 0;
+  for (int i = 0; i < count; i++) {
+    const link_delta_member_t *member = &base_members[i];
+    for (int j = 0; j < changed; j++) {
+      if (link_delta_same_key(member, &delta_members[j])) {
+        member = &delta_members[j];
+        replaced++;
+        break;
+      }
+    }
+
+    // separator, member and the closing brace
+    if (written + member->len + 2 >= size)
+      return -1;
+    out[written++] = (i == 0) ? '{' : ',';
+    memcpy(out + written, member->text, member->len);
+    written += member->len;
+  }
+
+  // every member of the delta has to be in the base
+  if (replaced != changed)
+    return -1;
+
+  out[written++] = '}';
+  out[written] = '\0';
+  return written;
+}
+
+#endif
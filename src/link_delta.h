@@ -0,0 +1,16 @@
+#ifndef LINK_DELTA_H_
+#define LINK_DELTA_H_
+
+#include "link.h"
+
+#if LINK_DELTA
+void link_delta_init();
+const char *link_delta_encode(enc_msg_kind_e kind, const char *msg, char *out,
+                              size_t size);
+void link_delta_acked(enc_msg_kind_e kind, const char *msg, bool keyframe);
+void link_delta_resync();
+int link_delta_expand(const char *base, const char *delta, size_t len,
+                      char *out, size_t size);
+#endif
+
+#endif // LINK_DELTA_H_